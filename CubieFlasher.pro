@@ -4,29 +4,24 @@
 #
 #-------------------------------------------------
 
-QT       += core gui
-
-greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
+QT       += core gui widgets
 
 TARGET = CubieFlasher
 TEMPLATE = app
 VERSION = 0.1.1
 
-win32:DEFINES += __func__=__FUNCTION__
-unix:DEFINES += __func__=__PRETTY_FUNCTION__
-
-INCLUDEPATH += /usr/include/libusb-1.0
+include(flashcore.pri)
 
 SOURCES += main.cpp\
 	cubieflasher.cpp \
-    usbfel.cpp \
-    flasher.cpp \
-    about.cpp
+    about.cpp \
+    logmodel.cpp \
+    perfpanel.cpp
 
 HEADERS  += cubieflasher.h \
-    usbfel.h \
-    flasher.h \
-    about.h
+    about.h \
+    logmodel.h \
+    perfpanel.h
 
 FORMS    += cubieflasher.ui \
     about.ui
@@ -34,8 +29,6 @@ FORMS    += cubieflasher.ui \
 RESOURCES += \
     cubieflasher.qrc
 
-LIBS += -lusb-1.0
-
 OTHER_FILES += \
     data/fes_1-1.asm \
     img/cubieflasher.png
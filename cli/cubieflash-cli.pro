@@ -0,0 +1,24 @@
+#-------------------------------------------------
+#
+# Headless command line flasher (no QtGui/QtWidgets)
+#
+#-------------------------------------------------
+
+QT       = core network
+CONFIG  += console
+CONFIG  -= app_bundle
+
+TARGET = cubieflash-cli
+TEMPLATE = app
+VERSION = 0.1.1
+
+include(../flashcore.pri)
+
+SOURCES += main.cpp \
+    flashcli.cpp \
+    flashdaemon.cpp \
+    flashmetrics.cpp
+
+HEADERS += flashcli.h \
+    flashdaemon.h \
+    flashmetrics.h
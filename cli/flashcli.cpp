@@ -0,0 +1,372 @@
+/*
+ * Copyright (C) Jürgen Buchmüller <pullmoll@t-online.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include "flashcli.h"
+#include "flasher.h"
+#include "flashmetrics.h"
+#include "usbfel.h"
+#include "usbcapture.h"
+#include "payloads.h"
+
+#define PROGRESS_TICK_MSEC      1000    //!< longest time without a progress line while a session runs
+
+flashcli::flashcli(QObject* parent) :
+        QObject(parent),
+        m_flasher(0),
+        m_clock(),
+        m_percent(-1),
+        m_tick(),
+        m_trace_file(),
+        m_report_file(),
+        m_stats(false),
+        m_replay(0)
+{
+        m_clock.start();
+        m_flasher = new flasher(this);
+        connect(m_flasher, SIGNAL(URB(int)), this, SLOT(URB(int)));
+        connect(m_flasher, SIGNAL(Progress(qreal)), this, SLOT(Progress(qreal)));
+        connect(m_flasher, SIGNAL(Status(QString)), this, SLOT(Status(QString)));
+        connect(m_flasher, SIGNAL(Error(QString)), this, SLOT(Error(QString)));
+        connect(m_flasher, SIGNAL(StepFinished(int,QString,qint64,bool)),
+                this, SLOT(StepFinished(int,QString,qint64,bool)));
+        connect(m_flasher, SIGNAL(Finished(bool)), this, SLOT(Done(bool)));
+        m_tick.setInterval(PROGRESS_TICK_MSEC);
+        connect(&m_tick, SIGNAL(timeout()), this, SLOT(Tick()));
+}
+
+flashcli::~flashcli()
+{
+        m_flasher->setReplay(0);
+        delete m_replay;
+}
+
+void flashcli::setPortPath(const QString& path)
+{
+        m_flasher->setPortPath(path);
+}
+
+void flashcli::setWriteCombining(bool on)
+{
+        m_flasher->setWriteCombining(on);
+}
+
+void flashcli::setAllowSlowLink(bool allow)
+{
+        m_flasher->setAllowSlowLink(allow);
+}
+
+void flashcli::setForceBoot(bool force)
+{
+        m_flasher->setForceBoot(force);
+}
+
+/**
+ * @brief record a timeline of the session and write it to a file when done
+ * @param filename name of the file, or empty for no timeline
+ */
+void flashcli::setTraceFile(const QString& filename)
+{
+        m_trace_file = filename;
+        m_flasher->trace()->setEnabled(!filename.isEmpty());
+}
+
+/**
+ * @brief write the timing report of the session to a file when done
+ * @param filename name of the file, or empty for no report
+ */
+void flashcli::setTimingReport(const QString& filename)
+{
+        m_report_file = filename;
+}
+
+void flashcli::setRegressionThreshold(qreal threshold)
+{
+        m_flasher->setRegressionThreshold(threshold);
+}
+
+/**
+ * @brief report the USB operation statistics when done
+ * @param on true to write a stats event before done
+ */
+void flashcli::setStats(bool on)
+{
+        m_stats = on;
+}
+
+/**
+ * @brief collect Prometheus metrics of the session
+ * @param metrics pointer to the metrics
+ */
+void flashcli::setMetrics(flashmetrics* metrics)
+{
+        metrics->attach(m_flasher);
+}
+
+/**
+ * @brief flash against a replay fixture instead of a board
+ * @param fixture name of the fixture written by import_capture()
+ * @param paced true to wait the captured device latencies
+ * @param loose true to accept transfers that were not captured completely
+ * @return true if the fixture was loaded
+ */
+bool flashcli::setReplay(const QString& fixture, bool paced, bool loose)
+{
+        usbcapture* replay = new usbcapture;
+        if (!replay->load(fixture)) {
+                Error(replay->errorString());
+                delete replay;
+                return false;
+        }
+        replay->setPaced(paced);
+        replay->setLoose(loose);
+        m_flasher->setReplay(replay);
+        delete m_replay;
+        m_replay = replay;
+        return true;
+}
+
+/**
+ * @brief check the stage 2 inputs against a manifest before streaming them
+ * @param filename name of the manifest written by write_manifest()
+ * @return true if the manifest was loaded
+ */
+bool flashcli::setManifest(const QString& filename)
+{
+        flashmanifest manifest;
+        if (!manifest.load(filename)) {
+                Error(manifest.errorString());
+                return false;
+        }
+        m_flasher->setManifest(manifest);
+        return true;
+}
+
+/**
+ * @brief write one JSON line for an event to stdout
+ * Every line carries the event type and the milliseconds since start.
+ * @param type event type
+ * @param obj event specific members
+ */
+void flashcli::report(const QString& type, QJsonObject obj)
+{
+        obj.insert(QLatin1String("event"), type);
+        obj.insert(QLatin1String("t"), m_clock.nsecsElapsed() / 1000000.0);
+        if (!m_flasher->portPath().isEmpty())
+                obj.insert(QLatin1String("port"), m_flasher->portPath());
+        QByteArray line = QJsonDocument(obj).toJson(QJsonDocument::Compact);
+        line += '\n';
+        fwrite(line.constData(), line.size(), 1, stdout);
+        fflush(stdout);
+}
+
+/**
+ * @brief list the port paths of all attached FEL devices
+ * @return exit code 0 if at least one device was found, 1 otherwise
+ */
+int flashcli::list_devices()
+{
+        usb_FEL usb;
+        QStringList paths = usb.port_paths();
+        foreach(const QString& path, paths) {
+                QJsonObject obj;
+                obj.insert(QLatin1String("port"), path);
+                report(QLatin1String("device"), obj);
+        }
+        return paths.isEmpty() ? 1 : 0;
+}
+
+/**
+ * @brief measure the USB speed and bandwidth of the board
+ * @return exit code 0 on success, 1 otherwise
+ */
+int flashcli::probe_link()
+{
+        QJsonObject link = m_flasher->probe_link();
+        if (link.isEmpty())
+                return 1;
+        report(QLatin1String("link"), link);
+        return 0;
+}
+
+/**
+ * @brief write a manifest of the stage 2 inputs
+ * @param filename name of the manifest
+ * @return exit code 0 on success, 1 otherwise
+ */
+int flashcli::write_manifest(const QString& filename)
+{
+        QString error;
+        if (!flasher::write_manifest(filename, &error)) {
+                Error(error);
+                return 1;
+        }
+        QJsonObject obj;
+        obj.insert(QLatin1String("file"), filename);
+        report(QLatin1String("manifest"), obj);
+        return 0;
+}
+
+/**
+ * @brief write the payloads to a flash bundle
+ * @param filename name of the bundle
+ * @param dir directory with replacement payloads, or empty for none
+ * @return exit code 0 on success, 1 otherwise
+ */
+int flashcli::build_bundle(const QString& filename, const QString& dir)
+{
+        QString error;
+        if (!payloads::buildBundle(filename, dir, flasher::payload_addresses(), &error)) {
+                Error(error);
+                return 1;
+        }
+        QJsonObject obj;
+        obj.insert(QLatin1String("file"), filename);
+        obj.insert(QLatin1String("payloads"), payloads::names().size());
+        report(QLatin1String("bundle"), obj);
+        return 0;
+}
+
+/**
+ * @brief turn a usbmon capture into a replay fixture and a timing profile
+ * @param capture name of the usbmon text or pcap file
+ * @param fixture name of the fixture to write, or empty for none
+ * @param profile name of the timing profile to write, or empty for none
+ * @return exit code 0 on success, 1 otherwise
+ */
+int flashcli::import_capture(const QString& capture, const QString& fixture, const QString& profile)
+{
+        usbcapture cap;
+        if (!cap.import(capture)) {
+                Error(cap.errorString());
+                return 1;
+        }
+        const QJsonObject prof = cap.profile();
+        if (!fixture.isEmpty() && !cap.save(fixture)) {
+                Error(tr("Failed to write the fixture to %1.").arg(fixture));
+                return 1;
+        }
+        if (!profile.isEmpty()) {
+                QFile file(profile);
+                if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+                        Error(tr("Failed to write the profile to %1.").arg(profile));
+                        return 1;
+                }
+                file.write(QJsonDocument(prof).toJson());
+        }
+
+        QJsonObject obj;
+        obj.insert(QLatin1String("file"), capture);
+        obj.insert(QLatin1String("transfers"), prof.value(QLatin1String("transfers")));
+        obj.insert(QLatin1String("duration_usecs"), prof.value(QLatin1String("duration_usecs")));
+        obj.insert(QLatin1String("bytes_out"), prof.value(QLatin1String("bytes_out")));
+        obj.insert(QLatin1String("bytes_in"), prof.value(QLatin1String("bytes_in")));
+        report(QLatin1String("capture"), obj);
+        return 0;
+}
+
+void flashcli::flash()
+{
+        report(QLatin1String("start"));
+        m_tick.start();
+        m_flasher->start();
+}
+
+void flashcli::URB(int urb)
+{
+        QJsonObject obj;
+        obj.insert(QLatin1String("urb"), urb);
+        report(QLatin1String("urb"), obj);
+}
+
+void flashcli::Progress(qreal percentage)
+{
+        // one line per whole percent is plenty for scripts
+        int percent = static_cast<int>(percentage);
+        if (percent == m_percent)
+                return;
+        m_percent = percent;
+        report_progress();
+        m_tick.start();
+}
+
+/**
+ * @brief report the progress when no transfer did for a while
+ * Steps that wait for the board, e.g. for it to re-enumerate or to
+ * complete a command, move the ETA without moving a percentage.
+ */
+void flashcli::Tick()
+{
+        report_progress();
+}
+
+void flashcli::report_progress()
+{
+        report(QLatin1String("progress"), m_flasher->progressEvent(m_percent));
+}
+
+void flashcli::Status(QString message)
+{
+        QJsonObject obj;
+        obj.insert(QLatin1String("message"), message);
+        report(QLatin1String("status"), obj);
+}
+
+void flashcli::Error(QString message)
+{
+        QJsonObject obj;
+        obj.insert(QLatin1String("message"), message);
+        report(QLatin1String("error"), obj);
+}
+
+void flashcli::StepFinished(int step, QString name, qint64 usecs, bool success)
+{
+        QJsonObject obj;
+        obj.insert(QLatin1String("step"), step);
+        obj.insert(QLatin1String("name"), name);
+        obj.insert(QLatin1String("usecs"), static_cast<double>(usecs));
+        obj.insert(QLatin1String("bytes"), static_cast<double>(qMax<qint64>(0, m_flasher->progress()->stepBytes(step))));
+        obj.insert(QLatin1String("success"), success);
+        report(QLatin1String("step"), obj);
+}
+
+void flashcli::Done(bool success)
+{
+        m_tick.stop();
+        foreach(const QJsonObject& obj, m_flasher->sessionEvents(m_report_file, m_trace_file))
+                report(obj.value(QLatin1String("event")).toString(), obj);
+
+        if (m_stats) {
+                QJsonObject obj;
+                obj.insert(QLatin1String("ops"), m_flasher->stats().toJson());
+                report(QLatin1String("stats"), obj);
+        }
+
+        if (m_replay) {
+                QJsonObject obj;
+                obj.insert(QLatin1String("replayed"), m_replay->position());
+                obj.insert(QLatin1String("transfers"), m_replay->transfers().size());
+                report(QLatin1String("replay"), obj);
+        }
+
+        QJsonObject obj;
+        obj.insert(QLatin1String("success"), success);
+        report(QLatin1String("done"), obj);
+        emit Finished(success ? 0 : 1);
+}
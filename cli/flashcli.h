@@ -0,0 +1,66 @@
+#ifndef FLASHCLI_H
+#define FLASHCLI_H
+
+#include <QObject>
+#include <QString>
+#include <QElapsedTimer>
+#include <QTimer>
+#include <QJsonObject>
+
+class flasher;
+class flashmetrics;
+class usbcapture;
+
+class flashcli : public QObject
+{
+        Q_OBJECT
+public:
+        flashcli(QObject* parent = 0);
+        ~flashcli();
+
+        void setPortPath(const QString& path);
+        void setWriteCombining(bool on);
+        void setAllowSlowLink(bool allow);
+        void setForceBoot(bool force);
+        void setTraceFile(const QString& filename);
+        void setTimingReport(const QString& filename);
+        void setRegressionThreshold(qreal threshold);
+        void setStats(bool on);
+        void setMetrics(flashmetrics* metrics);
+        bool setReplay(const QString& fixture, bool paced, bool loose);
+        bool setManifest(const QString& filename);
+        int list_devices();
+        int probe_link();
+        int write_manifest(const QString& filename);
+        int build_bundle(const QString& filename, const QString& dir);
+        int import_capture(const QString& capture, const QString& fixture, const QString& profile);
+
+public slots:
+        void flash();
+
+signals:
+        void Finished(int exitcode);
+
+private slots:
+        void URB(int urb);
+        void Progress(qreal percentage);
+        void Tick();
+        void Status(QString message);
+        void Error(QString message);
+        void StepFinished(int step, QString name, qint64 usecs, bool success);
+        void Done(bool success);
+
+private:
+        flasher* m_flasher;
+        QElapsedTimer m_clock;
+        int m_percent;
+        QTimer m_tick;
+        QString m_trace_file;
+        QString m_report_file;
+        bool m_stats;
+        usbcapture* m_replay;
+        void report(const QString& type, QJsonObject obj = QJsonObject());
+        void report_progress();
+};
+
+#endif // FLASHCLI_H
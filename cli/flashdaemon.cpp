@@ -0,0 +1,462 @@
+/*
+ * Copyright (C) Jürgen Buchmüller <pullmoll@t-online.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QJsonDocument>
+#include <QJsonArray>
+#include <QTimer>
+#include "flashdaemon.h"
+#include "flasher.h"
+#include "flashmetrics.h"
+#include "payloads.h"
+#include "usbfel.h"
+
+/**
+ * @brief write one JSON object as a line to a client
+ * @param client pointer to the client's socket (may be 0)
+ * @param obj object to write
+ */
+static void write_line(QLocalSocket* client, const QJsonObject& obj)
+{
+        if (!client)
+                return;
+        QByteArray line = QJsonDocument(obj).toJson(QJsonDocument::Compact);
+        line += '\n';
+        client->write(line);
+}
+
+/**
+ * @brief convert a JSON number or a "0x..." string to an unsigned int
+ */
+static quint32 to_uint(const QJsonValue& value)
+{
+        if (value.isString())
+                return value.toString().toUInt(0, 0);
+        return static_cast<quint32>(value.toDouble());
+}
+
+flashboard::flashboard(const QString& port, QObject* parent) :
+        QObject(parent),
+        m_port(port),
+        m_flasher(0),
+        m_queue(),
+        m_job(),
+        m_active(false),
+        m_percent(-1),
+        m_clock()
+{
+        m_flasher = new flasher(this);
+        m_flasher->setPortPath(port);
+        connect(m_flasher, SIGNAL(URB(int)), this, SLOT(URB(int)));
+        connect(m_flasher, SIGNAL(Progress(qreal)), this, SLOT(Progress(qreal)));
+        connect(m_flasher, SIGNAL(Status(QString)), this, SLOT(Status(QString)));
+        connect(m_flasher, SIGNAL(Error(QString)), this, SLOT(Error(QString)));
+        connect(m_flasher, SIGNAL(StepFinished(int,QString,qint64,bool)),
+                this, SLOT(StepFinished(int,QString,qint64,bool)));
+        connect(m_flasher, SIGNAL(Finished(bool)), this, SLOT(Finished(bool)));
+        connect(m_flasher, SIGNAL(MemoryFinished(bool)), this, SLOT(Finished(bool)));
+        connect(m_flasher, SIGNAL(LinkProbed(QJsonObject)), this, SLOT(LinkProbed(QJsonObject)));
+}
+
+/**
+ * @brief drop the board
+ * A running job is cancelled; closing the device aborts the transfer
+ * in flight.
+ */
+flashboard::~flashboard()
+{
+        m_flasher->cancel();
+        delete m_flasher;
+}
+
+QString flashboard::port() const
+{
+        return m_port;
+}
+
+flasher* flashboard::worker() const
+{
+        return m_flasher;
+}
+
+/**
+ * @brief queue a job for this board
+ * @param job job to queue
+ * @return number of jobs ahead of this one
+ */
+int flashboard::enqueue(const flashjob_t& job)
+{
+        int ahead = m_queue.size() + (m_active ? 1 : 0);
+        m_queue.enqueue(job);
+        QTimer::singleShot(0, this, SLOT(next()));
+        return ahead;
+}
+
+/**
+ * @brief cancel a queued or running job
+ * A running flash job is cancelled at the next step boundary, a dump
+ * or verify job before its next chunk; probe jobs run to completion.
+ * @param id job id
+ * @return true if the job was found
+ */
+bool flashboard::cancel(const QString& id)
+{
+        for (int i = 0; i < m_queue.size(); i++) {
+                if (m_queue.at(i).id != id)
+                        continue;
+                flashjob_t job = m_queue.takeAt(i);
+                QJsonObject obj;
+                obj.insert(QLatin1String("id"), job.id);
+                obj.insert(QLatin1String("port"), m_port);
+                obj.insert(QLatin1String("event"), QLatin1String("cancelled"));
+                write_line(job.client, obj);
+                return true;
+        }
+        if (m_active && m_job.id == id) {
+                m_flasher->cancel();
+                return true;
+        }
+        return false;
+}
+
+void flashboard::send(const QString& type, QJsonObject obj)
+{
+        obj.insert(QLatin1String("id"), m_job.id);
+        obj.insert(QLatin1String("port"), m_port);
+        obj.insert(QLatin1String("event"), type);
+        obj.insert(QLatin1String("t"), m_clock.nsecsElapsed() / 1000000.0);
+        write_line(m_job.client, obj);
+}
+
+/**
+ * @brief start the next queued job, if any
+ */
+void flashboard::next()
+{
+        if (m_active || m_queue.isEmpty())
+                return;
+
+        m_job = m_queue.dequeue();
+        m_active = true;
+        m_percent = -1;
+        m_clock.start();
+        send(QLatin1String("started"));
+
+        const QJsonObject& args = m_job.args;
+        if (m_job.type == QLatin1String("flash")) {
+                m_flasher->setWriteCombining(args.value(QLatin1String("write_combining")).toBool());
+                m_flasher->setAllowSlowLink(args.value(QLatin1String("allow_slow_link")).toBool());
+                m_flasher->setForceBoot(args.value(QLatin1String("force_boot")).toBool());
+                m_flasher->trace()->setEnabled(!args.value(QLatin1String("trace")).toString().isEmpty());
+                m_flasher->setRegressionThreshold(args.value(QLatin1String("regression_threshold")).toDouble(50) / 100.0);
+                flashmanifest manifest;
+                const QString manifest_file = args.value(QLatin1String("manifest")).toString();
+                if (!manifest_file.isEmpty() && !manifest.load(manifest_file)) {
+                        Error(manifest.errorString());
+                        done(false);
+                        return;
+                }
+                m_flasher->setManifest(manifest);
+                QMetaObject::invokeMethod(m_flasher, "start", Qt::QueuedConnection);
+                return;
+        }
+
+        // the flasher is idle, so these only start the job; the chunks are
+        // read from the completions and the job ends with MemoryFinished()
+        if (m_job.type == QLatin1String("dump")) {
+                if (!m_flasher->startDump(to_uint(args.value(QLatin1String("offset"))),
+                                          to_uint(args.value(QLatin1String("size"))),
+                                          args.value(QLatin1String("file")).toString()))
+                        done(false);
+                return;
+        }
+        if (m_job.type == QLatin1String("verify")) {
+                if (!m_flasher->startVerify(to_uint(args.value(QLatin1String("offset"))),
+                                            args.value(QLatin1String("file")).toString()))
+                        done(false);
+                return;
+        }
+
+        if (m_job.type == QLatin1String("probe")) {
+                QMetaObject::invokeMethod(m_flasher, "probe", Qt::QueuedConnection);
+                return;
+        }
+        done(false);
+}
+
+/**
+ * @brief return the USB operation statistics of the board's last or current job
+ */
+QJsonObject flashboard::stats() const
+{
+        return m_flasher->stats().toJson();
+}
+
+void flashboard::done(bool success)
+{
+        if (m_job.type == QLatin1String("flash")) {
+                const QString timing_report = m_job.args.value(QLatin1String("timing_report")).toString();
+                const QString trace = m_job.args.value(QLatin1String("trace")).toString();
+                foreach(const QJsonObject& obj, m_flasher->sessionEvents(timing_report, trace))
+                        send(obj.value(QLatin1String("event")).toString(), obj);
+        }
+
+        QJsonObject obj;
+        obj.insert(QLatin1String("success"), success);
+        send(QLatin1String("done"), obj);
+        m_active = false;
+        m_job = flashjob_t();
+        QTimer::singleShot(0, this, SLOT(next()));
+}
+
+void flashboard::URB(int urb)
+{
+        QJsonObject obj;
+        obj.insert(QLatin1String("urb"), urb);
+        send(QLatin1String("urb"), obj);
+}
+
+void flashboard::Progress(qreal percentage)
+{
+        int percent = static_cast<int>(percentage);
+        if (percent == m_percent)
+                return;
+        m_percent = percent;
+        send(QLatin1String("progress"), m_flasher->progressEvent(percent));
+}
+
+void flashboard::Status(QString message)
+{
+        QJsonObject obj;
+        obj.insert(QLatin1String("message"), message);
+        send(QLatin1String("status"), obj);
+}
+
+void flashboard::Error(QString message)
+{
+        QJsonObject obj;
+        obj.insert(QLatin1String("message"), message);
+        send(QLatin1String("error"), obj);
+}
+
+void flashboard::StepFinished(int step, QString name, qint64 usecs, bool success)
+{
+        QJsonObject obj;
+        obj.insert(QLatin1String("step"), step);
+        obj.insert(QLatin1String("name"), name);
+        obj.insert(QLatin1String("usecs"), static_cast<double>(usecs));
+        obj.insert(QLatin1String("bytes"), static_cast<double>(qMax<qint64>(0, m_flasher->progress()->stepBytes(step))));
+        obj.insert(QLatin1String("success"), success);
+        send(QLatin1String("step"), obj);
+}
+
+void flashboard::Finished(bool success)
+{
+        if (m_active)
+                done(success);
+}
+
+void flashboard::LinkProbed(QJsonObject link)
+{
+        if (!m_active)
+                return;
+        if (!link.isEmpty())
+                send(QLatin1String("link"), link);
+        done(!link.isEmpty());
+}
+
+flashdaemon::flashdaemon(QObject* parent) :
+        QObject(parent),
+        m_server(0),
+        m_usb(0),
+        m_metrics(0),
+        m_boards(),
+        m_next_id(1)
+{
+        m_server = new QLocalServer(this);
+        m_server->setSocketOptions(QLocalServer::UserAccessOption);
+        connect(m_server, SIGNAL(newConnection()), this, SLOT(newConnection()));
+        // keeps the shared libusb context alive for the lifetime of the daemon
+        m_usb = new usb_FEL(SUNXI_FEL_DEVICE_MAJOR, SUNXI_FEL_DEVICE_MINOR, 60000, this);
+}
+
+flashdaemon::~flashdaemon()
+{
+        m_server->close();
+}
+
+/**
+ * @brief load the payloads and start listening on a local socket
+ * @param name path name of the socket
+ * @return true on success
+ */
+bool flashdaemon::listen(const QString& name)
+{
+        payloads::preload();
+        QLocalServer::removeServer(name);
+        if (!m_server->listen(name)) {
+                qWarning("%s: %s", __func__, qPrintable(m_server->errorString()));
+                return false;
+        }
+        return true;
+}
+
+/**
+ * @brief collect Prometheus metrics of the sessions of every board
+ * @param metrics pointer to the metrics
+ */
+void flashdaemon::setMetrics(flashmetrics* metrics)
+{
+        m_metrics = metrics;
+        foreach(flashboard* b, m_boards)
+                m_metrics->attach(b->worker());
+}
+
+void flashdaemon::newConnection()
+{
+        while (m_server->hasPendingConnections()) {
+                QLocalSocket* client = m_server->nextPendingConnection();
+                connect(client, SIGNAL(readyRead()), this, SLOT(readyRead()));
+                connect(client, SIGNAL(disconnected()), client, SLOT(deleteLater()));
+        }
+}
+
+void flashdaemon::readyRead()
+{
+        QLocalSocket* client = qobject_cast<QLocalSocket*>(sender());
+        if (!client)
+                return;
+        while (client->canReadLine()) {
+                QByteArray line = client->readLine().trimmed();
+                if (line.isEmpty())
+                        continue;
+                QJsonParseError error;
+                QJsonDocument doc = QJsonDocument::fromJson(line, &error);
+                if (!doc.isObject()) {
+                        QJsonObject obj;
+                        obj.insert(QLatin1String("event"), QLatin1String("error"));
+                        obj.insert(QLatin1String("message"), error.errorString());
+                        write_line(client, obj);
+                        continue;
+                }
+                handle(client, doc.object());
+        }
+}
+
+/**
+ * @brief return the board at a port, creating it on first use
+ */
+flashboard* flashdaemon::board(const QString& port)
+{
+        flashboard* b = m_boards.value(port);
+        if (!b) {
+                b = new flashboard(port, this);
+                m_boards.insert(port, b);
+                if (m_metrics)
+                        m_metrics->attach(b->worker());
+        }
+        return b;
+}
+
+/**
+ * @brief handle one client request
+ * Requests are objects with a "job" member: "list", "stats", "flash",
+ * "dump", "verify", "probe" or "cancel". Jobs for a board are run in the order queued.
+ * @param client pointer to the client's socket
+ * @param req request object
+ */
+void flashdaemon::handle(QLocalSocket* client, const QJsonObject& req)
+{
+        const QString type = req.value(QLatin1String("job")).toString();
+        QString id = req.value(QLatin1String("id")).toString();
+        if (id.isEmpty())
+                id = QString("job-%1").arg(m_next_id++);
+
+        QJsonObject obj;
+        obj.insert(QLatin1String("id"), id);
+
+        if (type == QLatin1String("list")) {
+                QJsonArray ports;
+                foreach(const QString& port, m_usb->port_paths())
+                        ports.append(port);
+                obj.insert(QLatin1String("event"), QLatin1String("devices"));
+                obj.insert(QLatin1String("ports"), ports);
+                write_line(client, obj);
+                return;
+        }
+
+        QString port = req.value(QLatin1String("port")).toString();
+        if (type == QLatin1String("stats")) {
+                // answered right away, also while the board is busy
+                obj.insert(QLatin1String("event"), QLatin1String("stats"));
+                QJsonObject boards;
+                foreach(flashboard* b, m_boards) {
+                        if (port.isEmpty() || port == b->port())
+                                boards.insert(b->port(), b->stats());
+                }
+                obj.insert(QLatin1String("boards"), boards);
+                write_line(client, obj);
+                return;
+        }
+
+        if (type == QLatin1String("cancel")) {
+                bool found = false;
+                foreach(flashboard* b, m_boards)
+                        found |= b->cancel(id);
+                if (!found) {
+                        obj.insert(QLatin1String("event"), QLatin1String("error"));
+                        obj.insert(QLatin1String("message"), tr("No such job: %1").arg(id));
+                        write_line(client, obj);
+                }
+                return;
+        }
+
+        if (type != QLatin1String("flash") &&
+            type != QLatin1String("dump") &&
+            type != QLatin1String("verify") &&
+            type != QLatin1String("probe")) {
+                obj.insert(QLatin1String("event"), QLatin1String("error"));
+                obj.insert(QLatin1String("message"), tr("Unknown job: %1").arg(type));
+                write_line(client, obj);
+                return;
+        }
+
+        if (port.isEmpty()) {
+                // without a port the job goes to the only attached board
+                QStringList ports = m_usb->port_paths();
+                if (ports.size() != 1) {
+                        obj.insert(QLatin1String("event"), QLatin1String("error"));
+                        obj.insert(QLatin1String("message"),
+                                   tr("%1 boards attached, a port is required.").arg(ports.size()));
+                        write_line(client, obj);
+                        return;
+                }
+                port = ports.first();
+        }
+
+        flashjob_t job;
+        job.id = id;
+        job.type = type;
+        job.args = req;
+        job.client = client;
+        int ahead = board(port)->enqueue(job);
+
+        obj.insert(QLatin1String("port"), port);
+        obj.insert(QLatin1String("event"), QLatin1String("queued"));
+        obj.insert(QLatin1String("ahead"), ahead);
+        write_line(client, obj);
+}
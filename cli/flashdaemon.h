@@ -0,0 +1,98 @@
+#ifndef FLASHDAEMON_H
+#define FLASHDAEMON_H
+
+#include <QObject>
+#include <QString>
+#include <QHash>
+#include <QQueue>
+#include <QPointer>
+#include <QElapsedTimer>
+#include <QJsonObject>
+
+class QLocalServer;
+class QLocalSocket;
+class flasher;
+class flashmetrics;
+class usb_FEL;
+
+typedef struct {
+        QString                 id;             //!< job id (given by the client or generated)
+        QString                 type;           //!< "flash", "dump" or "verify"
+        QJsonObject             args;           //!< the job request as sent by the client
+        QPointer<QLocalSocket>  client;         //!< client receiving the job's events
+}       flashjob_t;
+
+/**
+ * @brief one attached board with its flasher and job queue
+ * The flasher lives in the daemon's thread with all other boards: its
+ * steps start asynchronous transfers, which the single libusb event
+ * thread completes, so no board holds up the others or the clients.
+ * The board talks to the flasher through queued calls and signals, and
+ * changes its settings only while no job runs.
+ */
+class flashboard : public QObject
+{
+        Q_OBJECT
+public:
+        flashboard(const QString& port, QObject* parent = 0);
+        ~flashboard();
+
+        QString port() const;
+        flasher* worker() const;
+        int enqueue(const flashjob_t& job);
+        bool cancel(const QString& id);
+        QJsonObject stats() const;
+
+private slots:
+        void next();
+        void URB(int urb);
+        void Progress(qreal percentage);
+        void Status(QString message);
+        void Error(QString message);
+        void StepFinished(int step, QString name, qint64 usecs, bool success);
+        void Finished(bool success);
+        void LinkProbed(QJsonObject link);
+
+private:
+        QString m_port;
+        flasher* m_flasher;
+        QQueue<flashjob_t> m_queue;
+        flashjob_t m_job;
+        bool m_active;
+        int m_percent;
+        QElapsedTimer m_clock;
+        void send(const QString& type, QJsonObject obj = QJsonObject());
+        void done(bool success);
+};
+
+/**
+ * @brief long running flashing service on a local socket
+ * Clients send one JSON request per line and receive the events of
+ * their jobs as JSON lines. The libusb context, the payloads and a
+ * flasher per board are kept alive between jobs.
+ */
+class flashdaemon : public QObject
+{
+        Q_OBJECT
+public:
+        flashdaemon(QObject* parent = 0);
+        ~flashdaemon();
+
+        bool listen(const QString& name);
+        void setMetrics(flashmetrics* metrics);
+
+private slots:
+        void newConnection();
+        void readyRead();
+
+private:
+        QLocalServer* m_server;
+        usb_FEL* m_usb;
+        flashmetrics* m_metrics;
+        QHash<QString, flashboard*> m_boards;
+        int m_next_id;
+        flashboard* board(const QString& port);
+        void handle(QLocalSocket* client, const QJsonObject& req);
+};
+
+#endif // FLASHDAEMON_H
@@ -0,0 +1,436 @@
+/*
+ * Copyright (C) Jürgen Buchmüller <pullmoll@t-online.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+#include <QFile>
+#include <QSaveFile>
+#include <QLockFile>
+#include <QRegExp>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QJsonObject>
+#include "flashmetrics.h"
+#include "flasher.h"
+#include "felstats.h"
+
+#define STEP_HISTOGRAM          "cubieflash_step_duration_seconds"
+#define MAX_REQUEST_SIZE        8192    //!< larger HTTP requests are dropped
+#define METRICS_LOCK_MSEC       5000    //!< wait at most this long for another instance's save
+
+typedef struct {
+        const char*     name;           //!< name of the metric family
+        const char*     help;           //!< description for the HELP line
+}       metrics_family_t;
+
+static const metrics_family_t counter_families[] = {
+        {"cubieflash_sessions_total",           "Flash sessions by port and result."},
+        {"cubieflash_bytes_written_total",      "Bytes sent to the board by port."},
+        {"cubieflash_bytes_read_total",         "Bytes read from the board by port."},
+        {"cubieflash_retries_total",            "Writes repeated after a transfer error by port."},
+        {"cubieflash_timeouts_total",           "Transfers and completion waits that timed out by port."},
+        {"cubieflash_errors_total",             "Error messages by port."},
+        {"cubieflash_step_failures_total",      "Failed steps by step name."},
+        {"cubieflash_link_sessions_total",      "Flash sessions by port and USB link speed."},
+        {0, 0}
+};
+
+//! upper bounds of the step duration buckets in seconds
+static const double step_bounds[] = {
+        0.1, 0.25, 0.5, 1, 2.5, 5, 10, 25, 50, 100, 250, 500
+};
+static const int nstep_bounds = sizeof(step_bounds) / sizeof(step_bounds[0]);
+
+/**
+ * @brief escape a label value for the text exposition format
+ */
+static QString escape(QString value)
+{
+        value.replace(QLatin1Char('\\'), QLatin1String("\\\\"));
+        value.replace(QLatin1Char('"'), QLatin1String("\\\""));
+        value.replace(QLatin1Char('\n'), QLatin1String("\\n"));
+        return value;
+}
+
+static QString unescape(QString value)
+{
+        value.replace(QLatin1String("\\n"), QLatin1String("\n"));
+        value.replace(QLatin1String("\\\""), QLatin1String("\""));
+        value.replace(QLatin1String("\\\\"), QLatin1String("\\"));
+        return value;
+}
+
+/**
+ * @brief return a label pair name="value"
+ */
+static QString label(const char* name, const QString& value)
+{
+        return QString("%1=\"%2\"").arg(QLatin1String(name)).arg(escape(value));
+}
+
+static QString port_of(flasher* f)
+{
+        return f ? f->portPath() : QString();
+}
+
+flashmetrics::flashmetrics(QObject* parent) :
+        QObject(parent),
+        m_server(0),
+        m_textfile(),
+        m_counters(),
+        m_steps(),
+        m_saved_counters(),
+        m_saved_steps(),
+        m_seen()
+{
+}
+
+/**
+ * @brief collect the metrics of a flasher
+ * @param f pointer to the flasher
+ */
+void flashmetrics::attach(flasher* f)
+{
+        metrics_seen_t seen;
+        memset(&seen, 0, sizeof(seen));
+        m_seen.insert(f, seen);
+        connect(f, SIGNAL(Error(QString)), this, SLOT(Error(QString)));
+        connect(f, SIGNAL(StepFinished(int,QString,qint64,bool)),
+                this, SLOT(StepFinished(int,QString,qint64,bool)));
+        connect(f, SIGNAL(Finished(bool)), this, SLOT(Finished(bool)));
+}
+
+/**
+ * @brief read the counters and histograms of a textfile
+ * A missing file is not an error.
+ * @param filename name of the file
+ * @param counters map receiving the counter values by series
+ * @param steps map receiving the step duration histograms
+ * @return true on success, false if the file exists but could not be read
+ */
+static bool parse(const QString& filename, QMap<QString, double>& counters,
+                  QMap<QString, metrics_histogram_t>& steps)
+{
+        QFile file(filename);
+        if (!file.exists())
+                return true;
+        if (!file.open(QIODevice::ReadOnly | QIODevice::Text))
+                return false;
+
+        QRegExp step(QLatin1String(STEP_HISTOGRAM "_(bucket|sum|count)\\{step=\"((?:[^\"\\\\]|\\\\.)*)\"(?:,le=\"([^\"]*)\")?\\}"));
+        while (!file.atEnd()) {
+                const QString line = QString::fromUtf8(file.readLine()).trimmed();
+                if (line.isEmpty() || line.startsWith(QLatin1Char('#')))
+                        continue;
+                const int space = line.lastIndexOf(QLatin1Char(' '));
+                if (space < 0)
+                        continue;
+                const QString series = line.left(space);
+                bool ok = false;
+                const double value = line.mid(space + 1).toDouble(&ok);
+                if (!ok)
+                        continue;
+
+                if (step.exactMatch(series)) {
+                        metrics_histogram_t& h = steps[unescape(step.cap(2))];
+                        if (h.buckets.isEmpty()) {
+                                h.buckets.fill(0, nstep_bounds);
+                                h.sum = 0;
+                                h.count = 0;
+                        }
+                        if (step.cap(1) == QLatin1String("sum")) {
+                                h.sum = value;
+                        } else if (step.cap(1) == QLatin1String("count")) {
+                                h.count = static_cast<quint64>(value);
+                        } else {
+                                for (int i = 0; i < nstep_bounds; i++)
+                                        if (QString::number(step_bounds[i]) == step.cap(3))
+                                                h.buckets[i] = static_cast<quint64>(value);
+                        }
+                        continue;
+                }
+                for (int i = 0; counter_families[i].name; i++) {
+                        if (series.startsWith(QLatin1String(counter_families[i].name) + QLatin1Char('{'))) {
+                                counters.insert(series, value);
+                                break;
+                        }
+                }
+        }
+        return true;
+}
+
+/**
+ * @brief continue the counters of an earlier textfile
+ * This way the counters of one-shot command line runs add up.
+ * A missing file is not an error.
+ * @param filename name of the file
+ * @return true on success, false if the file exists but could not be read
+ */
+bool flashmetrics::load(const QString& filename)
+{
+        const bool ok = parse(filename, m_counters, m_steps);
+        m_saved_counters = m_counters;
+        m_saved_steps = m_steps;
+        return ok;
+}
+
+/**
+ * @brief write the metrics to a file after every session
+ * @param filename name of the file, or empty for none
+ */
+void flashmetrics::setTextfile(const QString& filename)
+{
+        m_textfile = filename;
+}
+
+/**
+ * @brief serve the metrics over HTTP
+ * @param port TCP port to listen on
+ * @param address address to bind to, the loopback interface by default
+ * @return true on success
+ */
+bool flashmetrics::listen(quint16 port, const QHostAddress& address)
+{
+        if (!m_server) {
+                m_server = new QTcpServer(this);
+                connect(m_server, SIGNAL(newConnection()), this, SLOT(newConnection()));
+        }
+        if (!m_server->listen(address, port)) {
+                qWarning("%s: %s", __func__, qPrintable(m_server->errorString()));
+                return false;
+        }
+        return true;
+}
+
+/**
+ * @brief add to a counter
+ * @param name name of the metric family
+ * @param labels label pairs, comma separated
+ * @param value amount to add
+ */
+void flashmetrics::add(const QString& name, const QString& labels, double value)
+{
+        m_counters[name + QLatin1Char('{') + labels + QLatin1Char('}')] += value;
+}
+
+/**
+ * @brief add what a flasher's transport counters gained since the last call
+ * The counters are reset when a session starts, so a value below the
+ * one seen before counts from zero.
+ */
+void flashmetrics::fold(flasher* f)
+{
+        if (!f || !m_seen.contains(f))
+                return;
+        const felstats& stats = f->stats();
+        metrics_seen_t now;
+        now.written = stats.totalBytes(felstats::OP_SEND);
+        now.read = stats.totalBytes(felstats::OP_RECV);
+        now.retries = stats.retries();
+        now.timeouts = stats.timeouts();
+
+        metrics_seen_t& seen = m_seen[f];
+        const QString port = label("port", port_of(f));
+        add(QLatin1String("cubieflash_bytes_written_total"), port,
+            now.written >= seen.written ? now.written - seen.written : now.written);
+        add(QLatin1String("cubieflash_bytes_read_total"), port,
+            now.read >= seen.read ? now.read - seen.read : now.read);
+        add(QLatin1String("cubieflash_retries_total"), port,
+            now.retries >= seen.retries ? now.retries - seen.retries : now.retries);
+        add(QLatin1String("cubieflash_timeouts_total"), port,
+            now.timeouts >= seen.timeouts ? now.timeouts - seen.timeouts : now.timeouts);
+        seen = now;
+}
+
+void flashmetrics::Error(QString message)
+{
+        Q_UNUSED(message);
+        flasher* f = qobject_cast<flasher*>(sender());
+        add(QLatin1String("cubieflash_errors_total"), label("port", port_of(f)), 1);
+}
+
+void flashmetrics::StepFinished(int step, QString name, qint64 usecs, bool success)
+{
+        Q_UNUSED(step);
+        fold(qobject_cast<flasher*>(sender()));
+
+        metrics_histogram_t& h = m_steps[name];
+        if (h.buckets.isEmpty()) {
+                h.buckets.fill(0, nstep_bounds);
+                h.sum = 0;
+                h.count = 0;
+        }
+        const double secs = usecs / 1e6;
+        for (int i = 0; i < nstep_bounds; i++)
+                if (secs <= step_bounds[i])
+                        h.buckets[i]++;
+        h.sum += secs;
+        h.count++;
+
+        if (!success)
+                add(QLatin1String("cubieflash_step_failures_total"), label("step", name), 1);
+}
+
+void flashmetrics::Finished(bool success)
+{
+        flasher* f = qobject_cast<flasher*>(sender());
+        fold(f);
+        if (m_seen.contains(f)) {
+                // the next session starts its counters from zero
+                memset(&m_seen[f], 0, sizeof(metrics_seen_t));
+        }
+
+        const QString port = label("port", port_of(f));
+        add(QLatin1String("cubieflash_sessions_total"),
+            port + QLatin1Char(',') + label("result", QLatin1String(success ? "success" : "failure")), 1);
+        if (f) {
+                const QString speed = f->timingReport().value(QLatin1String("link")).toObject()
+                                .value(QLatin1String("speed")).toString();
+                if (!speed.isEmpty())
+                        add(QLatin1String("cubieflash_link_sessions_total"),
+                            port + QLatin1Char(',') + label("speed", speed), 1);
+        }
+
+        if (!m_textfile.isEmpty() && !save())
+                qWarning("%s: could not write %s", __func__, qPrintable(m_textfile));
+}
+
+/**
+ * @brief render the metrics in the Prometheus text exposition format
+ */
+QByteArray flashmetrics::render() const
+{
+        QString text;
+        for (int i = 0; counter_families[i].name; i++) {
+                const QString name = QLatin1String(counter_families[i].name);
+                text += QString("# HELP %1 %2\n").arg(name).arg(QLatin1String(counter_families[i].help));
+                text += QString("# TYPE %1 counter\n").arg(name);
+                const QString prefix = name + QLatin1Char('{');
+                QMap<QString, double>::const_iterator it = m_counters.lowerBound(prefix);
+                for (; it != m_counters.constEnd() && it.key().startsWith(prefix); ++it)
+                        text += QString("%1 %2\n").arg(it.key()).arg(it.value(), 0, 'f', 0);
+        }
+
+        text += QLatin1String("# HELP " STEP_HISTOGRAM " Duration of the flasher steps.\n");
+        text += QLatin1String("# TYPE " STEP_HISTOGRAM " histogram\n");
+        for (QMap<QString, metrics_histogram_t>::const_iterator it = m_steps.constBegin(); it != m_steps.constEnd(); ++it) {
+                const QString step = label("step", it.key());
+                const metrics_histogram_t& h = it.value();
+                for (int i = 0; i < nstep_bounds; i++)
+                        text += QString(STEP_HISTOGRAM "_bucket{%1,le=\"%2\"} %3\n")
+                                        .arg(step).arg(step_bounds[i]).arg(h.buckets.at(i));
+                text += QString(STEP_HISTOGRAM "_bucket{%1,le=\"+Inf\"} %2\n").arg(step).arg(h.count);
+                text += QString(STEP_HISTOGRAM "_sum{%1} %2\n").arg(step).arg(h.sum, 0, 'g', 12);
+                text += QString(STEP_HISTOGRAM "_count{%1} %2\n").arg(step).arg(h.count);
+        }
+        return text.toUtf8();
+}
+
+/**
+ * @brief write the metrics to the textfile
+ * Several instances may share the file: under a lock file, the file is
+ * read again and what this instance added since it last loaded or saved
+ * is added to it. The file is replaced atomically, so a collector never
+ * reads half of it.
+ * @return true on success
+ */
+bool flashmetrics::save()
+{
+        QLockFile lock(m_textfile + QLatin1String(".lock"));
+        if (!lock.tryLock(METRICS_LOCK_MSEC))
+                return false;
+
+        QMap<QString, double> counters;
+        QMap<QString, metrics_histogram_t> steps;
+        if (!parse(m_textfile, counters, steps))
+                return false;
+
+        for (QMap<QString, double>::const_iterator it = m_counters.constBegin(); it != m_counters.constEnd(); ++it)
+                counters[it.key()] += it.value() - m_saved_counters.value(it.key());
+
+        for (QMap<QString, metrics_histogram_t>::const_iterator it = m_steps.constBegin(); it != m_steps.constEnd(); ++it) {
+                const metrics_histogram_t& mine = it.value();
+                const metrics_histogram_t saved = m_saved_steps.value(it.key());
+                metrics_histogram_t& h = steps[it.key()];
+                if (h.buckets.isEmpty()) {
+                        h.buckets.fill(0, nstep_bounds);
+                        h.sum = 0;
+                        h.count = 0;
+                }
+                for (int i = 0; i < nstep_bounds; i++)
+                        h.buckets[i] += mine.buckets.at(i) - (saved.buckets.isEmpty() ? 0 : saved.buckets.at(i));
+                h.sum += mine.sum - (saved.buckets.isEmpty() ? 0 : saved.sum);
+                h.count += mine.count - (saved.buckets.isEmpty() ? 0 : saved.count);
+        }
+
+        m_counters = counters;
+        m_steps = steps;
+        m_saved_counters = m_counters;
+        m_saved_steps = m_steps;
+
+        QSaveFile file(m_textfile);
+        if (!file.open(QIODevice::WriteOnly))
+                return false;
+        file.write(render());
+        return file.commit();
+}
+
+void flashmetrics::newConnection()
+{
+        while (m_server->hasPendingConnections()) {
+                QTcpSocket* client = m_server->nextPendingConnection();
+                connect(client, SIGNAL(readyRead()), this, SLOT(readyRead()));
+                connect(client, SIGNAL(disconnected()), client, SLOT(deleteLater()));
+        }
+}
+
+/**
+ * @brief answer an HTTP request once its header is complete
+ * GET /metrics (or /) returns the metrics; the connection is closed
+ * after every response.
+ */
+void flashmetrics::readyRead()
+{
+        QTcpSocket* client = qobject_cast<QTcpSocket*>(sender());
+        if (!client)
+                return;
+        const QByteArray header = client->peek(MAX_REQUEST_SIZE);
+        if (!header.contains("\r\n\r\n") && !header.contains("\n\n")) {
+                if (header.size() >= MAX_REQUEST_SIZE)
+                        client->abort();
+                return;
+        }
+        client->readAll();
+
+        const QList<QByteArray> request = header.left(header.indexOf('\n')).trimmed().split(' ');
+        const QByteArray path = request.size() > 1 ? request.at(1) : QByteArray();
+        QByteArray status("200 OK");
+        QByteArray body;
+        if (request.at(0) != "GET") {
+                status = "405 Method Not Allowed";
+        } else if (path != "/metrics" && path != "/") {
+                status = "404 Not Found";
+        } else {
+                body = render();
+        }
+
+        QByteArray response = "HTTP/1.0 " + status + "\r\n";
+        response += "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n";
+        response += "Content-Length: " + QByteArray::number(body.size()) + "\r\n";
+        response += "Connection: close\r\n\r\n";
+        response += body;
+        client->write(response);
+        client->disconnectFromHost();
+}
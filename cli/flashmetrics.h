@@ -0,0 +1,75 @@
+#ifndef FLASHMETRICS_H
+#define FLASHMETRICS_H
+
+#include <QObject>
+#include <QString>
+#include <QMap>
+#include <QHash>
+#include <QVector>
+#include <QByteArray>
+#include <QHostAddress>
+
+class QTcpServer;
+class flasher;
+
+/**
+ * @brief transport counters of a flasher seen when they were last added
+ */
+typedef struct {
+        quint64         written;        //!< bytes sent
+        quint64         read;           //!< bytes received
+        quint64         retries;        //!< retried writes
+        quint64         timeouts;       //!< timed out transfers and waits
+}       metrics_seen_t;
+
+/**
+ * @brief histogram of the durations of one step
+ */
+typedef struct {
+        QVector<quint64> buckets;       //!< counts per upper bound, cumulative when rendered
+        double          sum;            //!< summed seconds
+        quint64         count;          //!< number of observations
+}       metrics_histogram_t;
+
+/**
+ * @brief Prometheus metrics of the flashing sessions
+ * Fed from the Status/Error/StepFinished/Finished signals of the attached
+ * flashers and, at each step boundary, from their transport counters,
+ * so nothing is added to the transfers themselves. The metrics are
+ * rendered in the text exposition format on request: written to a file
+ * for the node_exporter textfile collector after every session and/or
+ * served over HTTP.
+ */
+class flashmetrics : public QObject
+{
+        Q_OBJECT
+public:
+        flashmetrics(QObject* parent = 0);
+
+        void attach(flasher* f);
+        bool load(const QString& filename);
+        void setTextfile(const QString& filename);
+        bool listen(quint16 port, const QHostAddress& address = QHostAddress::LocalHost);
+        QByteArray render() const;
+        bool save();
+
+private slots:
+        void Error(QString message);
+        void StepFinished(int step, QString name, qint64 usecs, bool success);
+        void Finished(bool success);
+        void newConnection();
+        void readyRead();
+
+private:
+        QTcpServer* m_server;
+        QString m_textfile;
+        QMap<QString, double> m_counters;               //!< counter values by series, i.e. name{labels}
+        QMap<QString, metrics_histogram_t> m_steps;     //!< step duration histograms by step name
+        QMap<QString, double> m_saved_counters;         //!< counter values as last loaded or saved
+        QMap<QString, metrics_histogram_t> m_saved_steps; //!< histograms as last loaded or saved
+        QHash<flasher*, metrics_seen_t> m_seen;
+        void add(const QString& name, const QString& labels, double value);
+        void fold(flasher* f);
+};
+
+#endif // FLASHMETRICS_H
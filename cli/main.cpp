@@ -0,0 +1,199 @@
+/*
+ * Copyright (C) Jürgen Buchmüller <pullmoll@t-online.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QTimer>
+#include "flashcli.h"
+#include "flashdaemon.h"
+#include "flashmetrics.h"
+#include "payloads.h"
+
+int main(int argc, char *argv[])
+{
+        QCoreApplication a(argc, argv);
+
+        a.setApplicationName(QLatin1String("cubieflash-cli"));
+        a.setApplicationVersion(QLatin1String("0.1.1"));
+        a.setOrganizationName(QLatin1String("pullmoll"));
+        a.setOrganizationDomain(QLatin1String("mame.myds.me"));
+
+        QCommandLineParser parser;
+        parser.setApplicationDescription(QLatin1String("Flash the NAND of a Cubietruck in FEL mode.\n"
+                                                       "Progress and timing are written to stdout as JSON lines."));
+        parser.addHelpOption();
+        parser.addVersionOption();
+
+        QCommandLineOption opt_list(QStringList() << QLatin1String("l") << QLatin1String("list"),
+                                    QLatin1String("List the port paths of attached FEL devices."));
+        parser.addOption(opt_list);
+        QCommandLineOption opt_probe(QLatin1String("probe"),
+                                     QLatin1String("Measure the USB speed and bandwidth of the board and exit."));
+        parser.addOption(opt_probe);
+        QCommandLineOption opt_port(QStringList() << QLatin1String("p") << QLatin1String("port"),
+                                    QLatin1String("Flash the board at USB port <path> (e.g. 1-1.2)."),
+                                    QLatin1String("path"));
+        parser.addOption(opt_port);
+        QCommandLineOption opt_write_combining(QLatin1String("write-combining"),
+                                               QLatin1String("Merge small adjacent writes in stage 1 into one transfer."));
+        parser.addOption(opt_write_combining);
+        QCommandLineOption opt_allow_slow_link(QLatin1String("allow-slow-link"),
+                                               QLatin1String("Send large partitions even if the board is connected below high speed."));
+        parser.addOption(opt_allow_slow_link);
+        QCommandLineOption opt_force_boot(QLatin1String("force-boot"),
+                                          QLatin1String("Install boot0 and u-boot even if they are up to date."));
+        parser.addOption(opt_force_boot);
+        QCommandLineOption opt_trace(QLatin1String("trace"),
+                                     QLatin1String("Write a timeline of the session to <file> (Chrome trace format)."),
+                                     QLatin1String("file"));
+        parser.addOption(opt_trace);
+        QCommandLineOption opt_timing_report(QLatin1String("timing-report"),
+                                             QLatin1String("Write the URB checkpoint times compared to the baseline to <file>."),
+                                             QLatin1String("file"));
+        parser.addOption(opt_timing_report);
+        QCommandLineOption opt_threshold(QLatin1String("regression-threshold"),
+                                         QLatin1String("Report URB checkpoints more than <percent> slower than the baseline (default 50)."),
+                                         QLatin1String("percent"), QLatin1String("50"));
+        parser.addOption(opt_threshold);
+        QCommandLineOption opt_stats(QLatin1String("stats"),
+                                     QLatin1String("Report counts, bytes, errors and latencies per USB operation when done."));
+        parser.addOption(opt_stats);
+        QCommandLineOption opt_bundle(QLatin1String("bundle"),
+                                      QLatin1String("Take the payloads from the flash bundle <file> instead of the built-in ones."),
+                                      QLatin1String("file"));
+        parser.addOption(opt_bundle);
+        QCommandLineOption opt_build_bundle(QLatin1String("build-bundle"),
+                                            QLatin1String("Write all payloads to the flash bundle <file> and exit."),
+                                            QLatin1String("file"));
+        parser.addOption(opt_build_bundle);
+        QCommandLineOption opt_payload_dir(QLatin1String("payload-dir"),
+                                           QLatin1String("With --build-bundle, replace or add payloads with the files in <dir>."),
+                                           QLatin1String("dir"));
+        parser.addOption(opt_payload_dir);
+        QCommandLineOption opt_manifest(QLatin1String("manifest"),
+                                        QLatin1String("Check the partition images and payloads against the manifest <file> before stage 2."),
+                                        QLatin1String("file"));
+        parser.addOption(opt_manifest);
+        QCommandLineOption opt_write_manifest(QLatin1String("write-manifest"),
+                                              QLatin1String("Write a manifest of the partition images and payloads to <file> and exit."),
+                                              QLatin1String("file"));
+        parser.addOption(opt_write_manifest);
+        QCommandLineOption opt_import(QLatin1String("import-capture"),
+                                      QLatin1String("Decode the FEL transfers of a usbmon text or pcap <capture> and exit."),
+                                      QLatin1String("capture"));
+        parser.addOption(opt_import);
+        QCommandLineOption opt_fixture(QLatin1String("fixture"),
+                                       QLatin1String("With --import-capture, write a replay fixture to <file>."),
+                                       QLatin1String("file"));
+        parser.addOption(opt_fixture);
+        QCommandLineOption opt_profile(QLatin1String("profile"),
+                                       QLatin1String("With --import-capture, write the timing profile to <file>."),
+                                       QLatin1String("file"));
+        parser.addOption(opt_profile);
+        QCommandLineOption opt_replay(QLatin1String("replay"),
+                                      QLatin1String("Flash against the replay fixture <file> instead of a board."),
+                                      QLatin1String("file"));
+        parser.addOption(opt_replay);
+        QCommandLineOption opt_replay_paced(QLatin1String("replay-paced"),
+                                            QLatin1String("With --replay, wait the captured device latencies."));
+        parser.addOption(opt_replay_paced);
+        QCommandLineOption opt_replay_loose(QLatin1String("replay-loose"),
+                                            QLatin1String("With --replay, accept transfers the capture holds only in part."));
+        parser.addOption(opt_replay_loose);
+        QCommandLineOption opt_metrics_file(QLatin1String("metrics-file"),
+                                            QLatin1String("Keep Prometheus metrics in <file> for the textfile collector."),
+                                            QLatin1String("file"));
+        parser.addOption(opt_metrics_file);
+        QCommandLineOption opt_metrics_port(QLatin1String("metrics-port"),
+                                            QLatin1String("Serve Prometheus metrics over HTTP on TCP <port>."),
+                                            QLatin1String("port"));
+        parser.addOption(opt_metrics_port);
+        QCommandLineOption opt_metrics_address(QLatin1String("metrics-address"),
+                                               QLatin1String("With --metrics-port, listen on <address> instead of 127.0.0.1."),
+                                               QLatin1String("address"), QLatin1String("127.0.0.1"));
+        parser.addOption(opt_metrics_address);
+        QCommandLineOption opt_daemon(QStringList() << QLatin1String("d") << QLatin1String("daemon"),
+                                      QLatin1String("Run as a service accepting jobs on the local socket <path>."),
+                                      QLatin1String("path"));
+        parser.addOption(opt_daemon);
+        parser.process(a);
+
+        if (parser.isSet(opt_bundle)) {
+                QString error;
+                if (!payloads::setBundle(parser.value(opt_bundle), &error)) {
+                        qWarning("%s", qPrintable(error));
+                        return 1;
+                }
+        }
+
+        flashmetrics metrics;
+        const bool use_metrics = parser.isSet(opt_metrics_file) || parser.isSet(opt_metrics_port);
+        if (parser.isSet(opt_metrics_file)) {
+                if (!metrics.load(parser.value(opt_metrics_file)))
+                        qWarning("Could not read the metrics file %s", qPrintable(parser.value(opt_metrics_file)));
+                metrics.setTextfile(parser.value(opt_metrics_file));
+        }
+        if (parser.isSet(opt_metrics_port)) {
+                const QHostAddress address(parser.value(opt_metrics_address));
+                if (address.isNull()) {
+                        qWarning("Invalid metrics address %s", qPrintable(parser.value(opt_metrics_address)));
+                        return 1;
+                }
+                if (!metrics.listen(parser.value(opt_metrics_port).toUShort(), address))
+                        return 1;
+        }
+
+        if (parser.isSet(opt_daemon)) {
+                flashdaemon server;
+                if (use_metrics)
+                        server.setMetrics(&metrics);
+                if (!server.listen(parser.value(opt_daemon)))
+                        return 1;
+                return a.exec();
+        }
+
+        flashcli cli;
+        if (parser.isSet(opt_list))
+                return cli.list_devices();
+        if (parser.isSet(opt_write_manifest))
+                return cli.write_manifest(parser.value(opt_write_manifest));
+        if (parser.isSet(opt_build_bundle))
+                return cli.build_bundle(parser.value(opt_build_bundle), parser.value(opt_payload_dir));
+        if (parser.isSet(opt_import))
+                return cli.import_capture(parser.value(opt_import), parser.value(opt_fixture), parser.value(opt_profile));
+
+        cli.setPortPath(parser.value(opt_port));
+        if (parser.isSet(opt_replay) && !cli.setReplay(parser.value(opt_replay), parser.isSet(opt_replay_paced),
+                                                      parser.isSet(opt_replay_loose)))
+                return 1;
+        if (parser.isSet(opt_probe))
+                return cli.probe_link();
+        if (parser.isSet(opt_manifest) && !cli.setManifest(parser.value(opt_manifest)))
+                return 1;
+        cli.setWriteCombining(parser.isSet(opt_write_combining));
+        cli.setAllowSlowLink(parser.isSet(opt_allow_slow_link));
+        cli.setForceBoot(parser.isSet(opt_force_boot));
+        cli.setTraceFile(parser.value(opt_trace));
+        cli.setTimingReport(parser.value(opt_timing_report));
+        cli.setRegressionThreshold(parser.value(opt_threshold).toDouble() / 100.0);
+        cli.setStats(parser.isSet(opt_stats));
+        if (use_metrics)
+                cli.setMetrics(&metrics);
+        QObject::connect(&cli, SIGNAL(Finished(int)), &a, SLOT(exit(int)));
+        QTimer::singleShot(0, &cli, SLOT(flash()));
+
+        return a.exec();
+}
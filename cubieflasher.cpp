@@ -14,33 +14,72 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+#include <QDateTime>
+#include <QFileDialog>
+#include <QScrollBar>
 #include "cubieflasher.h"
 #include "ui_cubieflasher.h"
 #include "about.h"
 #include "flasher.h"
+#include "payloads.h"
+
+/**
+ * @brief frame rate of progress, URB and message display updates
+ */
+#define FRAMES_PER_SECOND       30
 
 CubieFlasher::CubieFlasher(QWidget *parent) :
         QMainWindow(parent),
+        m_thread(0),
         m_flasher(0),
         ui(new Ui::CubieFlasher),
         m_progress(0),
+        m_overall(0),
+        m_rate(0),
         m_status(0),
         m_connected(0),
-        m_timer(-1)
+        m_perf(0),
+        m_timer(-1),
+        m_frame_timer(-1),
+        m_busy(false),
+        m_urb(-1),
+        m_log(0),
+        m_pending()
 {
         setup_ui();
 
-        m_flasher = new flasher(this);
-        connect(m_flasher, SIGNAL(URB(int)), this, SLOT(displayURB(int)));
-        connect(m_flasher, SIGNAL(Progress(qreal)), this, SLOT(displayProgress(qreal)));
+        // The transfers of a session complete in the libusb event thread, but
+        // device lookups and the link probe block, so the flasher keeps a
+        // thread of its own away from the window.
+        // Progress and URB are sampled from its aggregator in timerEvent(),
+        // status messages arrive queued and are appended once per frame.
+        m_thread = new QThread(this);
+        m_thread->setObjectName(QLatin1String("flasher"));
+        m_flasher = new flasher;
+        m_flasher->trace()->setEnabled(ui->action_Record_Trace->isChecked());
+        m_flasher->moveToThread(m_thread);
         connect(m_flasher, SIGNAL(Status(QString)), this, SLOT(displayStatus(QString)));
         connect(m_flasher, SIGNAL(Error(QString)), this, SLOT(displayError(QString)));
+        connect(m_flasher, SIGNAL(Finished(bool)), this, SLOT(flashFinished(bool)));
+        connect(m_flasher, SIGNAL(DeviceFound(bool)), this, SLOT(deviceFound(bool)));
+        m_thread->start();
+        if (!payloads::bundle().isEmpty())
+                displayStatus(tr("Using the payloads of the flash bundle %1.").arg(payloads::bundle()));
 
         m_timer = startTimer(250);
+        m_frame_timer = startTimer(1000 / FRAMES_PER_SECOND);
 }
 
 CubieFlasher::~CubieFlasher()
 {
+        // let a running session see the cancel and close the device
+        // before its thread stops
+        m_flasher->cancel();
+        connect(m_flasher, SIGNAL(Finished(bool)), m_thread, SLOT(quit()), Qt::DirectConnection);
+        if (!m_flasher->busy())
+                m_thread->quit();
+        m_thread->wait();
+        delete m_flasher;
         delete ui;
 }
 
@@ -50,20 +89,46 @@ void CubieFlasher::closeEvent(QCloseEvent *e)
         s.setValue(QLatin1String("windowState"), saveState());
         s.setValue(QLatin1String("windowGeometry"), saveGeometry());
         s.setValue(QLatin1String("showURBs"), ui->action_Show_URBs->isChecked());
+        s.setValue(QLatin1String("recordTrace"), ui->action_Record_Trace->isChecked());
         e->accept();
 }
 
 void CubieFlasher::timerEvent(QTimerEvent *e)
 {
+        if (e->timerId() == m_frame_timer) {
+                refresh();
+                return;
+        }
         if (e->timerId() != m_timer)
                 return;
-        if (m_flasher->connected()) {
+        // the flasher's thread owns the device while it is busy
+        if (m_busy)
+                return;
+        QMetaObject::invokeMethod(m_flasher, "findDevice", Qt::QueuedConnection);
+}
+
+void CubieFlasher::deviceFound(bool found)
+{
+        if (found) {
                 m_connected->setStyleSheet(QLatin1String("background-color: #00a020;"));
         } else {
                 m_connected->setStyleSheet(QLatin1String("background-color: #ff4040;"));
         }
 }
 
+/**
+ * @brief ask the idle flasher's thread whether a board is connected
+ * The flasher is idle, so the call returns as soon as libusb has listed
+ * the devices.
+ */
+bool CubieFlasher::connected()
+{
+        bool found = false;
+        QMetaObject::invokeMethod(m_flasher, "connected", Qt::BlockingQueuedConnection,
+                                  Q_RETURN_ARG(bool, found));
+        return found;
+}
+
 void CubieFlasher::quit()
 {
         close();
@@ -71,7 +136,7 @@ void CubieFlasher::quit()
 
 void CubieFlasher::flash_NAND()
 {
-        while (!m_flasher->connected()) {
+        while (!connected()) {
                 int res = QMessageBox::warning(this,
                                                tr("Waiting for Cubietruck FEL connection"),
                                                tr("Please connect the Cubietruck to your PC using the"
@@ -81,7 +146,47 @@ void CubieFlasher::flash_NAND()
                 if (QMessageBox::Cancel == res)
                         return;
         }
-        m_flasher->flash();
+        m_busy = true;
+        ui->action_Flash_NAND->setEnabled(false);
+        m_perf->clear();
+        QMetaObject::invokeMethod(m_flasher, "start", Qt::QueuedConnection);
+}
+
+void CubieFlasher::flashFinished(bool success)
+{
+        Q_UNUSED(success);
+        m_busy = false;
+        ui->action_Flash_NAND->setEnabled(true);
+        refresh();
+}
+
+void CubieFlasher::exportLog()
+{
+        QString filename = QFileDialog::getSaveFileName(this, tr("Export log"),
+                                                        QLatin1String("cubieflasher.log"),
+                                                        tr("Log files (*.log *.txt);;All files (*)"));
+        if (filename.isEmpty())
+                return;
+        if (!m_log->save(filename))
+                QMessageBox::warning(this, tr("Export log"), tr("Failed to write %1.").arg(filename));
+}
+
+void CubieFlasher::exportTrace()
+{
+        if (!m_flasher->trace()->count()) {
+                if (ui->action_Record_Trace->isChecked())
+                        QMessageBox::information(this, tr("Export trace"), tr("There is no session to export yet."));
+                else
+                        QMessageBox::information(this, tr("Export trace"), tr("Enable Preferences/Record trace before flashing to export a trace."));
+                return;
+        }
+        QString filename = QFileDialog::getSaveFileName(this, tr("Export trace"),
+                                                        QLatin1String("cubieflasher-trace.json"),
+                                                        tr("Chrome trace files (*.json);;All files (*)"));
+        if (filename.isEmpty())
+                return;
+        if (!m_flasher->trace()->save(filename))
+                QMessageBox::warning(this, tr("Export trace"), tr("Failed to write %1.").arg(filename));
 }
 
 void CubieFlasher::about_CubieFlasher()
@@ -100,37 +205,92 @@ void CubieFlasher::about_qt()
 
 void CubieFlasher::toggleURBs(bool show)
 {
-        m_flasher->showURBs(show);
+        // refresh() shows the current URB on the next frame
+        m_urb = -1;
+        if (!show)
+                m_status->setText(tr("Status"));
+}
+
+/**
+ * @brief record a timeline of the following sessions, or stop recording
+ * Off by default, like the CLI without --trace; the flag is atomic, so
+ * it may be flipped while a session runs.
+ * @param on true to record
+ */
+void CubieFlasher::toggleTrace(bool on)
+{
+        m_flasher->trace()->setEnabled(on);
 }
 
 void CubieFlasher::displayStatus(QString message)
 {
-        QEventLoop loop(this);
-        ui->textBrowser->setTextColor(qRgb(0x00,0xa0,0x20));
-        ui->textBrowser->append(message);
-        loop.processEvents();
+        append(message, logmodel::Status);
 }
 
 void CubieFlasher::displayError(QString message)
 {
-        QEventLoop loop(this);
-        ui->textBrowser->setTextColor(qRgb(0xff,0x40,0x40));
-        ui->textBrowser->append(message);
-        loop.processEvents();
+        append(message, logmodel::Error);
 }
 
-void CubieFlasher::displayURB(int urb)
+/**
+ * @brief queue a message for the next frame
+ * Messages with several lines (e.g. hex dumps) become one log line each.
+ * @param message text of the message
+ * @param severity logmodel::severity_e
+ */
+void CubieFlasher::append(const QString& message, int severity)
 {
-        QEventLoop loop(this);
-        m_status->setText(QString("URB(%1)").arg(urb, 6, 10, QChar('0')));
-        loop.processEvents();
+        log_entry_t entry;
+        entry.msecs = QDateTime::currentMSecsSinceEpoch();
+        entry.severity = severity;
+        foreach(const QString& line, message.split(QChar('\n'))) {
+                entry.text = line;
+                m_pending += entry;
+        }
 }
 
-void CubieFlasher::displayProgress(qreal percentage)
+/**
+ * @brief update progress, URB and messages, once per frame
+ */
+void CubieFlasher::refresh()
 {
-        QEventLoop loop(this);
-        m_progress->setValue(percentage);
-        loop.processEvents();
+        progress_sample_t sample = m_flasher->progress()->sample();
+        int value = static_cast<int>(sample.percentage);
+        if (m_progress->value() != value)
+                m_progress->setValue(value);
+
+        if (sample.overall >= 0) {
+                m_overall->setValue(static_cast<int>(sample.overall));
+                qint64 secs = (sample.eta_msecs + 999) / 1000;
+                m_rate->setText(tr("%1 MB/s (now %2)  ETA %3:%4")
+                                .arg(sample.mbps_avg, 0, 'f', 2)
+                                .arg(sample.mbps, 0, 'f', 2)
+                                .arg(secs / 60)
+                                .arg(secs % 60, 2, 10, QChar('0')));
+        } else if (!m_busy) {
+                m_rate->clear();
+        }
+
+        if (m_perf->isVisible()) {
+                QString step = sample.step >= 0 ? flasher::step_name(sample.step) : QString();
+                m_perf->refresh(sample, m_flasher->stats(), step);
+        }
+
+        int urb = sample.urb;
+        if (urb != m_urb && ui->action_Show_URBs->isChecked()) {
+                m_urb = urb;
+                m_status->setText(QString("URB(%1)").arg(urb, 6, 10, QChar('0')));
+        }
+
+        if (!m_pending.isEmpty()) {
+                // follow the end of the log, unless the user scrolled up
+                QScrollBar* bar = ui->logView->verticalScrollBar();
+                bool follow = bar->value() == bar->maximum();
+                m_log->append(m_pending);
+                m_pending.clear();
+                if (follow)
+                        ui->logView->scrollToBottom();
+        }
 }
 
 void CubieFlasher::setup_ui()
@@ -138,6 +298,9 @@ void CubieFlasher::setup_ui()
         ui->setupUi(this);
         connect_actions();
 
+        m_log = new logmodel(10000, this);
+        ui->logView->setModel(m_log);
+
         m_connected = new QLabel(tr("[FEL]"));
         ui->statusBar->addWidget(m_connected);
 
@@ -145,21 +308,39 @@ void CubieFlasher::setup_ui()
         m_status->setFrameStyle(QFrame::Panel);
         ui->statusBar->addWidget(m_status, 1);
 
+        m_rate = new QLabel;
+        ui->statusBar->addPermanentWidget(m_rate);
+
         m_progress = new QProgressBar;
         m_progress->setMinimumWidth(160);
+        m_progress->setToolTip(tr("Current transfer"));
         ui->statusBar->addPermanentWidget(m_progress);
 
+        m_overall = new QProgressBar;
+        m_overall->setMinimumWidth(160);
+        m_overall->setFormat(tr("%p% total"));
+        m_overall->setToolTip(tr("Whole session, weighted by the expected duration of every step"));
+        ui->statusBar->addPermanentWidget(m_overall);
+
+        m_perf = new perfpanel(this);
+        addDockWidget(Qt::BottomDockWidgetArea, m_perf);
+        ui->menu_Preferences->addAction(m_perf->toggleViewAction());
+
         QSettings s;
         restoreState(s.value(QLatin1String("windowState")).toByteArray());
         restoreGeometry(s.value(QLatin1String("windowGeometry")).toByteArray());
         ui->action_Show_URBs->setChecked(s.value(QLatin1String("showURBs")).toBool());
+        ui->action_Record_Trace->setChecked(s.value(QLatin1String("recordTrace"), false).toBool());
 }
 
 void CubieFlasher::connect_actions()
 {
         connect(ui->action_Flash_NAND, SIGNAL(triggered()), this, SLOT(flash_NAND()));
+        connect(ui->action_Export_Log, SIGNAL(triggered()), this, SLOT(exportLog()));
+        connect(ui->action_Export_Trace, SIGNAL(triggered()), this, SLOT(exportTrace()));
         connect(ui->action_Quit, SIGNAL(triggered()), this, SLOT(quit()));
         connect(ui->action_Show_URBs, SIGNAL(triggered(bool)), this, SLOT(toggleURBs(bool)));
+        connect(ui->action_Record_Trace, SIGNAL(triggered(bool)), this, SLOT(toggleTrace(bool)));
         connect(ui->action_About_CubieFlasher, SIGNAL(triggered()), this, SLOT(about_CubieFlasher()));
         connect(ui->action_About_Qt, SIGNAL(triggered()), this, SLOT(about_qt()));
 
@@ -9,6 +9,10 @@
 #include <QMessageBox>
 #include <QProgressBar>
 #include <QSettings>
+#include <QThread>
+#include <QStringList>
+#include "logmodel.h"
+#include "perfpanel.h"
 
 class flasher;
 
@@ -31,23 +35,38 @@ protected:
 private slots:
         void quit();
         void flash_NAND();
+        void exportLog();
+        void exportTrace();
         void toggleURBs(bool show);
+        void toggleTrace(bool on);
         void about_CubieFlasher();
         void about_qt();
 
         void displayStatus(QString message);
         void displayError(QString message);
-        void displayURB(int urb);
-        void displayProgress(qreal percentage);
+        void flashFinished(bool success);
+        void deviceFound(bool found);
 private:
         void setup_ui();
         void connect_actions();
+        void append(const QString& message, int severity);
+        void refresh();
+        bool connected();
+        QThread* m_thread;
         flasher* m_flasher;
         Ui::CubieFlasher* ui;
         QProgressBar* m_progress;
+        QProgressBar* m_overall;
+        QLabel* m_rate;
         QLabel* m_status;
         QLabel* m_connected;
+        perfpanel* m_perf;
         int m_timer;
+        int m_frame_timer;
+        bool m_busy;
+        int m_urb;
+        logmodel* m_log;
+        QList<log_entry_t> m_pending;
 };
 
 #endif // CUBIEFLASHER_H
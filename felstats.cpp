@@ -0,0 +1,322 @@
+/*
+ * Copyright (C) Jürgen Buchmüller <pullmoll@t-online.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <QJsonArray>
+#include <QtAlgorithms>
+#include "felstats.h"
+
+#define SUB_BUCKETS     (1 << FELSTATS_SUB_BITS)
+
+felstats::felstats() :
+        m_inflight(0),
+        m_wait_polls(-1),
+        m_retries(0),
+        m_timeouts(0)
+{
+}
+
+/**
+ * @brief return the name of an operation type
+ */
+const char* felstats::name(int op)
+{
+        switch (op) {
+        case OP_AWUC:
+                return "awuc";
+        case OP_SEND:
+                return "send";
+        case OP_RECV:
+                return "recv";
+        case OP_AWUS:
+                return "awus";
+        case OP_STATUS:
+                return "status";
+        case OP_FES_RDWR:
+                return "fes_rdwr";
+        case OP_POLL:
+                return "poll";
+        case OP_WAIT:
+                return "wait";
+        }
+        return "unknown";
+}
+
+/**
+ * @brief return the histogram bucket of a latency
+ * Values below 2^FELSTATS_SUB_BITS have a bucket each; above that every
+ * power of two is split into 2^FELSTATS_SUB_BITS buckets.
+ * @param usecs latency
+ * @return bucket index
+ */
+int felstats::bucket(qint64 usecs)
+{
+        if (usecs < SUB_BUCKETS)
+                return usecs < 0 ? 0 : static_cast<int>(usecs);
+        const quint64 value = static_cast<quint64>(usecs);
+        const int magnitude = 63 - qCountLeadingZeroBits(value);
+        const int shift = magnitude - FELSTATS_SUB_BITS;
+        const int sub = static_cast<int>(value >> shift) & (SUB_BUCKETS - 1);
+        return qMin(((shift + 1) << FELSTATS_SUB_BITS) | sub, FELSTATS_BUCKETS - 1);
+}
+
+/**
+ * @brief return the lowest latency counted in a bucket
+ * @param bucket bucket index
+ * @return usecs
+ */
+qint64 felstats::bucket_limit(int bucket)
+{
+        if (bucket < SUB_BUCKETS)
+                return bucket;
+        const int shift = (bucket >> FELSTATS_SUB_BITS) - 1;
+        const int sub = bucket & (SUB_BUCKETS - 1);
+        return static_cast<qint64>(SUB_BUCKETS + sub) << shift;
+}
+
+/**
+ * @brief record one operation
+ * @param op operation type (op_e)
+ * @param usecs time it took
+ * @param bytes number of bytes it transferred
+ * @param success false if it failed
+ */
+void felstats::record(int op, qint64 usecs, qint64 bytes, bool success)
+{
+        if (op < 0 || op >= OP_COUNT)
+                return;
+        counters_t& c = m_ops[op];
+        c.count.fetchAndAddRelaxed(1);
+        c.bytes.fetchAndAddRelaxed(static_cast<quint64>(qMax<qint64>(0, bytes)));
+        if (!success)
+                c.errors.fetchAndAddRelaxed(1);
+        c.total_usecs.fetchAndAddRelaxed(static_cast<quint64>(qMax<qint64>(0, usecs)));
+        c.buckets[bucket(usecs)].fetchAndAddRelaxed(1);
+}
+
+/**
+ * @brief note a bulk transfer being submitted
+ */
+void felstats::beginTransfer()
+{
+        m_inflight.fetchAndAddRelaxed(1);
+}
+
+/**
+ * @brief note a bulk transfer being completed
+ */
+void felstats::endTransfer()
+{
+        m_inflight.fetchAndAddRelaxed(-1);
+}
+
+/**
+ * @brief publish the polls of the running completion wait
+ * @param polls number of polls so far, -1 when the wait ended
+ */
+void felstats::setWaitPolls(int polls)
+{
+        m_wait_polls.store(polls);
+}
+
+/**
+ * @brief count a transfer that is repeated after an error
+ */
+void felstats::recordRetry()
+{
+        m_retries.fetchAndAddRelaxed(1);
+}
+
+/**
+ * @brief count a transfer or completion wait that timed out
+ */
+void felstats::recordTimeout()
+{
+        m_timeouts.fetchAndAddRelaxed(1);
+}
+
+/**
+ * @brief return the number of bulk transfers in flight
+ */
+int felstats::inFlight() const
+{
+        return m_inflight.load();
+}
+
+/**
+ * @brief return the polls of the running completion wait, -1 if none runs
+ */
+int felstats::waitPolls() const
+{
+        return m_wait_polls.load();
+}
+
+/**
+ * @brief return the summed latency of an operation type
+ * Cheaper than a snapshot(), for displays sampling at a high rate.
+ */
+quint64 felstats::totalUsecs(int op) const
+{
+        if (op < 0 || op >= OP_COUNT)
+                return 0;
+        return m_ops[op].total_usecs.load();
+}
+
+/**
+ * @brief return the summed bytes of an operation type
+ */
+quint64 felstats::totalBytes(int op) const
+{
+        if (op < 0 || op >= OP_COUNT)
+                return 0;
+        return m_ops[op].bytes.load();
+}
+
+quint64 felstats::retries() const
+{
+        return m_retries.load();
+}
+
+quint64 felstats::timeouts() const
+{
+        return m_timeouts.load();
+}
+
+/**
+ * @brief set all counters to zero
+ */
+void felstats::reset()
+{
+        m_retries.store(0);
+        m_timeouts.store(0);
+        for (int op = 0; op < OP_COUNT; op++) {
+                counters_t& c = m_ops[op];
+                c.count.store(0);
+                c.bytes.store(0);
+                c.errors.store(0);
+                c.total_usecs.store(0);
+                for (int i = 0; i < FELSTATS_BUCKETS; i++)
+                        c.buckets[i].store(0);
+        }
+}
+
+/**
+ * @brief return the middle of a bucket, as an estimate of its latencies
+ */
+static qint64 bucket_value(int bucket)
+{
+        qint64 low = felstats::bucket_limit(bucket);
+        qint64 high = felstats::bucket_limit(bucket + 1) - 1;
+        return (low + high) / 2;
+}
+
+/**
+ * @brief take a snapshot of the statistics of an operation type
+ * Minimum, maximum and percentiles are given with the resolution
+ * of the histogram buckets.
+ * @param op operation type (op_e)
+ * @return felstats_op_t with the counters and latencies
+ */
+felstats_op_t felstats::snapshot(int op) const
+{
+        felstats_op_t s;
+        s.count = 0;
+        s.bytes = 0;
+        s.errors = 0;
+        s.total_usecs = 0;
+        s.min_usecs = -1;
+        s.max_usecs = -1;
+        s.p50_usecs = -1;
+        s.p90_usecs = -1;
+        s.p99_usecs = -1;
+        if (op < 0 || op >= OP_COUNT)
+                return s;
+
+        const counters_t& c = m_ops[op];
+        s.count = c.count.load();
+        s.bytes = c.bytes.load();
+        s.errors = c.errors.load();
+        s.total_usecs = c.total_usecs.load();
+        s.buckets.resize(FELSTATS_BUCKETS);
+        quint64 total = 0;
+        for (int i = 0; i < FELSTATS_BUCKETS; i++) {
+                s.buckets[i] = c.buckets[i].load();
+                total += s.buckets[i];
+        }
+        if (!total)
+                return s;
+
+        // the buckets are read one by one while recording may go on, so
+        // the percentiles are ranked by the buckets' own total
+        const quint64 rank50 = (total * 50 + 99) / 100;
+        const quint64 rank90 = (total * 90 + 99) / 100;
+        const quint64 rank99 = (total * 99 + 99) / 100;
+        quint64 seen = 0;
+        for (int i = 0; i < FELSTATS_BUCKETS; i++) {
+                if (!s.buckets[i])
+                        continue;
+                if (s.min_usecs < 0)
+                        s.min_usecs = bucket_limit(i);
+                s.max_usecs = bucket_limit(i + 1) - 1;
+                seen += s.buckets[i];
+                if (s.p50_usecs < 0 && seen >= rank50)
+                        s.p50_usecs = bucket_value(i);
+                if (s.p90_usecs < 0 && seen >= rank90)
+                        s.p90_usecs = bucket_value(i);
+                if (s.p99_usecs < 0 && seen >= rank99)
+                        s.p99_usecs = bucket_value(i);
+        }
+        return s;
+}
+
+/**
+ * @brief return a snapshot of all operation types as JSON
+ * Each type has its counters, latencies and the non-empty buckets
+ * as [lowest usecs, count] pairs.
+ * @return QJsonObject with one member per operation type
+ */
+QJsonObject felstats::toJson() const
+{
+        QJsonObject obj;
+        for (int op = 0; op < OP_COUNT; op++) {
+                felstats_op_t s = snapshot(op);
+                QJsonObject o;
+                o.insert(QLatin1String("count"), static_cast<double>(s.count));
+                o.insert(QLatin1String("bytes"), static_cast<double>(s.bytes));
+                o.insert(QLatin1String("errors"), static_cast<double>(s.errors));
+                o.insert(QLatin1String("total_usecs"), static_cast<double>(s.total_usecs));
+                if (s.count) {
+                        o.insert(QLatin1String("min_usecs"), static_cast<double>(s.min_usecs));
+                        o.insert(QLatin1String("p50_usecs"), static_cast<double>(s.p50_usecs));
+                        o.insert(QLatin1String("p90_usecs"), static_cast<double>(s.p90_usecs));
+                        o.insert(QLatin1String("p99_usecs"), static_cast<double>(s.p99_usecs));
+                        o.insert(QLatin1String("max_usecs"), static_cast<double>(s.max_usecs));
+                }
+                QJsonArray histogram;
+                for (int i = 0; i < s.buckets.size(); i++) {
+                        if (!s.buckets.at(i))
+                                continue;
+                        QJsonArray pair;
+                        pair.append(static_cast<double>(bucket_limit(i)));
+                        pair.append(static_cast<double>(s.buckets.at(i)));
+                        histogram.append(pair);
+                }
+                o.insert(QLatin1String("histogram"), histogram);
+                obj.insert(QLatin1String(name(op)), o);
+        }
+        obj.insert(QLatin1String("retries"), static_cast<double>(retries()));
+        obj.insert(QLatin1String("timeouts"), static_cast<double>(timeouts()));
+        return obj;
+}
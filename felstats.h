@@ -0,0 +1,89 @@
+#ifndef FELSTATS_H
+#define FELSTATS_H
+
+#include <QAtomicInt>
+#include <QAtomicInteger>
+#include <QVector>
+#include <QJsonObject>
+
+#define FELSTATS_SUB_BITS       3       //!< sub-buckets per power of two: 2^3, i.e. 12.5% resolution
+#define FELSTATS_MAGNITUDES     40      //!< powers of two covered, up to 2^40 usecs
+#define FELSTATS_BUCKETS        (FELSTATS_MAGNITUDES << FELSTATS_SUB_BITS)
+
+/**
+ * @brief snapshot of the statistics of one operation type
+ */
+typedef struct {
+        quint64         count;          //!< number of operations
+        quint64         bytes;          //!< number of bytes transferred
+        quint64         errors;         //!< number of failed operations
+        quint64         total_usecs;    //!< sum of the latencies
+        qint64          min_usecs;      //!< lowest latency, -1 if none
+        qint64          max_usecs;      //!< highest latency, -1 if none
+        qint64          p50_usecs;      //!< median latency, -1 if none
+        qint64          p90_usecs;      //!< 90th percentile, -1 if none
+        qint64          p99_usecs;      //!< 99th percentile, -1 if none
+        QVector<quint64> buckets;       //!< counts per histogram bucket
+}       felstats_op_t;
+
+/**
+ * @brief always-on statistics of the USB FEL operations
+ * Per operation type it counts operations, bytes and errors and keeps a
+ * histogram of the latencies with logarithmic buckets, each power of two
+ * split into 2^FELSTATS_SUB_BITS linear ones, like an HDR histogram.
+ * Recording is a few relaxed atomic additions and never allocates, so it
+ * stays on; snapshots may be taken from any thread.
+ */
+class felstats
+{
+public:
+        enum op_e {
+                OP_AWUC,                //!< USB request (AWUC) sent
+                OP_SEND,                //!< payload bulk send
+                OP_RECV,                //!< payload bulk receive
+                OP_AWUS,                //!< USB response (AWUS) received
+                OP_STATUS,              //!< FEL status read
+                OP_FES_RDWR,            //!< FES read or write (request, data, status)
+                OP_POLL,                //!< 0203 completion poll
+                OP_WAIT,                //!< whole completion wait, polls included
+                OP_COUNT
+        };
+
+        felstats();
+
+        void record(int op, qint64 usecs, qint64 bytes, bool success);
+        void beginTransfer();
+        void endTransfer();
+        void setWaitPolls(int polls);
+        void recordRetry();
+        void recordTimeout();
+        void reset();
+        felstats_op_t snapshot(int op) const;
+        int inFlight() const;
+        int waitPolls() const;
+        quint64 totalUsecs(int op) const;
+        quint64 totalBytes(int op) const;
+        quint64 retries() const;
+        quint64 timeouts() const;
+        QJsonObject toJson() const;
+
+        static const char* name(int op);
+        static int bucket(qint64 usecs);
+        static qint64 bucket_limit(int bucket);
+
+private:
+        typedef struct {
+                QAtomicInteger<quint64> count;
+                QAtomicInteger<quint64> bytes;
+                QAtomicInteger<quint64> errors;
+                QAtomicInteger<quint64> total_usecs;
+                QAtomicInteger<quint64> buckets[FELSTATS_BUCKETS];
+        }       counters_t;
+        counters_t m_ops[OP_COUNT];
+        QAtomicInt m_inflight;          //!< bulk transfers submitted and not completed
+        QAtomicInt m_wait_polls;        //!< polls of the running completion wait, -1 if none
+        QAtomicInteger<quint64> m_retries;      //!< transfers repeated after an error
+        QAtomicInteger<quint64> m_timeouts;     //!< transfers and waits that timed out
+};
+
+#endif // FELSTATS_H
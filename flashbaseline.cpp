@@ -0,0 +1,237 @@
+/*
+ * Copyright (C) Jürgen Buchmüller <pullmoll@t-online.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QLockFile>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QtAlgorithms>
+#include "flashbaseline.h"
+
+#define BASELINE_RUNS           20      //!< number of successful runs kept per checkpoint
+#define BASELINE_MIN_RUNS       5       //!< runs needed before a checkpoint is compared
+#define BASELINE_SLACK_USECS    2000    //!< differences below this are never a regression
+#define BASELINE_LOCK_MSEC      5000    //!< time to wait for another session updating the file
+
+flashbaseline::flashbaseline() :
+        m_path(),
+        m_loaded(false),
+        m_samples(),
+        m_threshold(0.5)
+{
+}
+
+/**
+ * @brief return the default location of the baseline file
+ */
+QString flashbaseline::defaultPath()
+{
+        return QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) +
+                        QLatin1String("/baseline.json");
+}
+
+/**
+ * @brief load the baseline from a file
+ * A missing file is an empty baseline.
+ * @param filename name of the file
+ * @return true on success, false if the file exists but could not be read
+ */
+bool flashbaseline::load(const QString& filename)
+{
+        m_path = filename;
+        m_loaded = false;
+        m_samples.clear();
+
+        QFile file(filename);
+        if (!file.exists()) {
+                m_loaded = true;
+                return true;
+        }
+        if (!file.open(QIODevice::ReadOnly))
+                return false;
+        QJsonDocument doc = QJsonDocument::fromJson(file.readAll());
+        file.close();
+        if (!doc.isObject())
+                return false;
+
+        QJsonObject checkpoints = doc.object().value(QLatin1String("checkpoints")).toObject();
+        for (QJsonObject::const_iterator it = checkpoints.constBegin(); it != checkpoints.constEnd(); ++it) {
+                QList<qint64>& samples = m_samples[it.key().toInt()];
+                foreach(const QJsonValue& value, it.value().toArray())
+                        samples += static_cast<qint64>(value.toDouble());
+        }
+        m_loaded = true;
+        return true;
+}
+
+/**
+ * @brief write the baseline back to the file it was loaded from
+ * A baseline whose file could not be read is not written, so a damaged
+ * or unreadable file does not lose the runs it holds. The file is
+ * replaced atomically.
+ * @return true on success
+ */
+bool flashbaseline::save() const
+{
+        if (m_path.isEmpty() || !m_loaded)
+                return false;
+
+        QJsonObject checkpoints;
+        for (QMap<int, QList<qint64> >::const_iterator it = m_samples.constBegin(); it != m_samples.constEnd(); ++it) {
+                QJsonArray samples;
+                foreach(qint64 usecs, it.value())
+                        samples.append(static_cast<double>(usecs));
+                checkpoints.insert(QString::number(it.key()), samples);
+        }
+        QJsonObject obj;
+        obj.insert(QLatin1String("version"), 1);
+        obj.insert(QLatin1String("checkpoints"), checkpoints);
+
+        QDir().mkpath(QFileInfo(m_path).absolutePath());
+        QSaveFile file(m_path);
+        if (!file.open(QIODevice::WriteOnly))
+                return false;
+        const QByteArray json = QJsonDocument(obj).toJson();
+        if (file.write(json) != json.size()) {
+                file.cancelWriting();
+                return false;
+        }
+        return file.commit();
+}
+
+/**
+ * @brief add a successful run to the baseline file
+ * The file is read again, the run added and the file written while a
+ * lock file is held, so sessions finishing at the same time, e.g. of
+ * several CLI instances, do not drop each other's runs.
+ * @param run usecs per URB checkpoint
+ * @return true on success
+ */
+bool flashbaseline::merge(const QMap<int, qint64>& run)
+{
+        if (m_path.isEmpty())
+                return false;
+        QDir().mkpath(QFileInfo(m_path).absolutePath());
+        QLockFile lock(m_path + QLatin1String(".lock"));
+        if (!lock.tryLock(BASELINE_LOCK_MSEC))
+                return false;
+        if (!load(m_path))
+                return false;
+        add(run);
+        return save();
+}
+
+/**
+ * @brief set how much slower than the 95th percentile a checkpoint may be
+ * @param threshold fraction of the 95th percentile, e.g. 0.5 for 50%
+ */
+void flashbaseline::setThreshold(qreal threshold)
+{
+        m_threshold = threshold;
+}
+
+qreal flashbaseline::threshold() const
+{
+        return m_threshold;
+}
+
+/**
+ * @brief return a percentile of sorted samples (nearest rank)
+ */
+static qint64 percentile(const QList<qint64>& sorted, int percent)
+{
+        int rank = (percent * sorted.size() + 99) / 100;
+        return sorted.at(qBound(0, rank - 1, sorted.size() - 1));
+}
+
+/**
+ * @brief compare the checkpoint times of a run to the baseline
+ * @param run usecs per URB checkpoint
+ * @return list of checkpoint_result_t in URB order
+ */
+QList<checkpoint_result_t> flashbaseline::compare(const QMap<int, qint64>& run) const
+{
+        QList<checkpoint_result_t> results;
+        for (QMap<int, qint64>::const_iterator it = run.constBegin(); it != run.constEnd(); ++it) {
+                checkpoint_result_t res;
+                res.urb = it.key();
+                res.usecs = it.value();
+                res.median = -1;
+                res.p95 = -1;
+                res.regressed = false;
+
+                QList<qint64> sorted = m_samples.value(it.key());
+                res.samples = sorted.size();
+                if (sorted.size() >= BASELINE_MIN_RUNS) {
+                        qSort(sorted);
+                        res.median = percentile(sorted, 50);
+                        res.p95 = percentile(sorted, 95);
+                        qint64 limit = res.p95 + static_cast<qint64>(res.p95 * m_threshold);
+                        res.regressed = res.usecs > limit && res.usecs - res.median > BASELINE_SLACK_USECS;
+                }
+                results += res;
+        }
+        return results;
+}
+
+/**
+ * @brief add the checkpoint times of a successful run to the baseline
+ * @param run usecs per URB checkpoint
+ */
+void flashbaseline::add(const QMap<int, qint64>& run)
+{
+        for (QMap<int, qint64>::const_iterator it = run.constBegin(); it != run.constEnd(); ++it) {
+                QList<qint64>& samples = m_samples[it.key()];
+                samples += it.value();
+                while (samples.size() > BASELINE_RUNS)
+                        samples.removeFirst();
+        }
+}
+
+/**
+ * @brief return the results of a comparison as a JSON report
+ * @param results list of checkpoint_result_t
+ * @return QJsonObject with the checkpoints and the URBs that regressed
+ */
+QJsonObject flashbaseline::report(const QList<checkpoint_result_t>& results) const
+{
+        QJsonArray checkpoints;
+        QJsonArray regressions;
+        foreach(const checkpoint_result_t& res, results) {
+                QJsonObject obj;
+                obj.insert(QLatin1String("urb"), res.urb);
+                obj.insert(QLatin1String("usecs"), static_cast<double>(res.usecs));
+                obj.insert(QLatin1String("samples"), res.samples);
+                if (res.median >= 0) {
+                        obj.insert(QLatin1String("median"), static_cast<double>(res.median));
+                        obj.insert(QLatin1String("p95"), static_cast<double>(res.p95));
+                }
+                obj.insert(QLatin1String("regressed"), res.regressed);
+                checkpoints.append(obj);
+                if (res.regressed)
+                        regressions.append(res.urb);
+        }
+        QJsonObject obj;
+        obj.insert(QLatin1String("threshold"), m_threshold);
+        obj.insert(QLatin1String("min_runs"), BASELINE_MIN_RUNS);
+        obj.insert(QLatin1String("checkpoints"), checkpoints);
+        obj.insert(QLatin1String("regressions"), regressions);
+        return obj;
+}
@@ -0,0 +1,52 @@
+#ifndef FLASHBASELINE_H
+#define FLASHBASELINE_H
+
+#include <QString>
+#include <QList>
+#include <QMap>
+#include <QJsonObject>
+
+/**
+ * @brief timing of one URB checkpoint compared to the baseline
+ */
+typedef struct {
+        int             urb;            //!< URB number of the original capture
+        qint64          usecs;          //!< time from this checkpoint to the next one
+        qint64          median;         //!< median of the baseline, -1 if too few runs
+        qint64          p95;            //!< 95th percentile of the baseline, -1 if too few runs
+        int             samples;        //!< number of runs in the baseline
+        bool            regressed;      //!< slower than the baseline allows
+}       checkpoint_result_t;
+
+/**
+ * @brief timing baseline of the URB checkpoints
+ * Keeps, per showURB() checkpoint, the times of the last successful runs
+ * in a JSON file. A new run is compared to the median and 95th percentile
+ * of these; a checkpoint regressed if it took longer than the 95th
+ * percentile plus the threshold, so a slow cable, hub or board shows up
+ * before it makes a session fail.
+ */
+class flashbaseline
+{
+public:
+        flashbaseline();
+
+        static QString defaultPath();
+        bool load(const QString& filename = defaultPath());
+        bool save() const;
+        bool merge(const QMap<int, qint64>& run);
+        void setThreshold(qreal threshold);
+        qreal threshold() const;
+
+        QList<checkpoint_result_t> compare(const QMap<int, qint64>& run) const;
+        void add(const QMap<int, qint64>& run);
+        QJsonObject report(const QList<checkpoint_result_t>& results) const;
+
+private:
+        QString m_path;
+        bool m_loaded;                          //!< the file was read, or does not exist
+        QMap<int, QList<qint64> > m_samples;    //!< usecs of the last runs per URB, oldest first
+        qreal m_threshold;
+};
+
+#endif // FLASHBASELINE_H
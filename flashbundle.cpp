@@ -0,0 +1,285 @@
+/*
+ * Copyright (C) Jürgen Buchmüller <pullmoll@t-online.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <limits.h>
+#include <string.h>
+#include <QSaveFile>
+#include <QtEndian>
+#include <QCryptographicHash>
+#include "flashbundle.h"
+
+/* The layouts are mapped as they are, so their sizes are fixed */
+Q_STATIC_ASSERT(sizeof(flashbundle_header_t) == 64);
+Q_STATIC_ASSERT(sizeof(flashbundle_entry_t) == 96);
+
+flashbundle::flashbundle() :
+        m_file(),
+        m_map(0),
+        m_size(0),
+        m_entries(0),
+        m_index(),
+        m_error()
+{
+}
+
+flashbundle::~flashbundle()
+{
+        close();
+}
+
+/**
+ * @brief map a bundle file and index its payloads
+ * The header and the index are checked; the payload data is not read.
+ * @param filename name of the bundle
+ * @return true on success
+ */
+bool flashbundle::open(const QString& filename)
+{
+        close();
+        m_file.setFileName(filename);
+        if (!m_file.open(QIODevice::ReadOnly)) {
+                m_error = tr("Failed to open bundle: %1").arg(filename);
+                return false;
+        }
+        m_size = m_file.size();
+        if (m_size >= static_cast<qint64>(sizeof(flashbundle_header_t)))
+                m_map = m_file.map(0, m_size);
+        if (!m_map) {
+                m_error = tr("Failed to map bundle: %1").arg(filename);
+                close();
+                return false;
+        }
+
+        const flashbundle_header_t* hdr = reinterpret_cast<const flashbundle_header_t *>(m_map);
+        const quint32 version = qFromLittleEndian(hdr->version);
+        const quint32 count = qFromLittleEndian(hdr->count);
+        const quint32 index_offset = qFromLittleEndian(hdr->index_offset);
+        if (memcmp(hdr->magic, FLASHBUNDLE_MAGIC, sizeof(hdr->magic))) {
+                m_error = tr("%1 is not a flash bundle.").arg(filename);
+        } else if (version != FLASHBUNDLE_VERSION) {
+                m_error = tr("Bundle %1 has version %2, expected %3.").arg(filename).arg(version).arg(FLASHBUNDLE_VERSION);
+        } else if (qFromLittleEndian(hdr->size) != static_cast<quint64>(m_size) ||
+                   index_offset % 8 ||
+                   index_offset + static_cast<quint64>(count) * sizeof(flashbundle_entry_t) > static_cast<quint64>(m_size)) {
+                m_error = tr("Bundle %1 is truncated or damaged.").arg(filename);
+        }
+        if (!m_error.isEmpty()) {
+                close();
+                return false;
+        }
+
+        m_entries = reinterpret_cast<const flashbundle_entry_t *>(m_map + index_offset);
+        for (quint32 i = 0; i < count; i++) {
+                const flashbundle_entry_t& e = m_entries[i];
+                const quint64 offset = qFromLittleEndian(e.offset);
+                const quint64 size = qFromLittleEndian(e.size);
+                if (offset > static_cast<quint64>(m_size) || size > static_cast<quint64>(m_size) - offset) {
+                        m_error = tr("Bundle %1: payload %2 is out of range.").arg(filename).arg(i);
+                        close();
+                        return false;
+                }
+                if (size > static_cast<quint64>(INT_MAX)) {
+                        m_error = tr("Bundle %1: payload %2 has %3 bytes, more than a payload may have.")
+                                  .arg(filename).arg(i).arg(size);
+                        close();
+                        return false;
+                }
+                m_index.insert(QString::fromUtf8(e.name, qstrnlen(e.name, sizeof(e.name))), static_cast<int>(i));
+        }
+        return true;
+}
+
+void flashbundle::close()
+{
+        if (m_map)
+                m_file.unmap(const_cast<uchar *>(m_map));
+        m_file.close();
+        m_map = 0;
+        m_size = 0;
+        m_entries = 0;
+        m_index.clear();
+}
+
+bool flashbundle::isOpen() const
+{
+        return m_map != 0;
+}
+
+QString flashbundle::fileName() const
+{
+        return m_file.fileName();
+}
+
+QString flashbundle::errorString() const
+{
+        return m_error;
+}
+
+QStringList flashbundle::names() const
+{
+        return m_index.keys();
+}
+
+bool flashbundle::contains(const QString& name) const
+{
+        return m_index.contains(name);
+}
+
+const flashbundle_entry_t* flashbundle::entry(const QString& name) const
+{
+        QHash<QString, int>::const_iterator it = m_index.constFind(name);
+        if (it == m_index.constEnd())
+                return 0;
+        return &m_entries[it.value()];
+}
+
+/**
+ * @brief return a payload without copying it
+ * @param name name of the payload
+ * @return QByteArray referring to the mapped data; empty if not found
+ */
+QByteArray flashbundle::data(const QString& name) const
+{
+        const flashbundle_entry_t* e = entry(name);
+        if (!e)
+                return QByteArray();
+        // open() refused sizes that do not fit an int
+        return QByteArray::fromRawData(reinterpret_cast<const char *>(m_map + qFromLittleEndian(e->offset)),
+                                       static_cast<int>(qFromLittleEndian(e->size)));
+}
+
+/**
+ * @brief return the size of a payload
+ * @param name name of the payload
+ * @return size in bytes, -1 if not found
+ */
+qint64 flashbundle::size(const QString& name) const
+{
+        const flashbundle_entry_t* e = entry(name);
+        return e ? static_cast<qint64>(qFromLittleEndian(e->size)) : -1;
+}
+
+/**
+ * @brief return the address a payload is loaded to
+ * @param name name of the payload
+ * @return address, 0 if the payload has none or is not found
+ */
+quint32 flashbundle::address(const QString& name) const
+{
+        const flashbundle_entry_t* e = entry(name);
+        return e ? qFromLittleEndian(e->address) : 0;
+}
+
+quint32 flashbundle::flags(const QString& name) const
+{
+        const flashbundle_entry_t* e = entry(name);
+        return e ? qFromLittleEndian(e->flags) : 0;
+}
+
+/**
+ * @brief check the data of a payload against its SHA-256
+ * @param name name of the payload
+ * @return true if the payload exists and is intact
+ */
+bool flashbundle::verify(const QString& name) const
+{
+        const flashbundle_entry_t* e = entry(name);
+        if (!e)
+                return false;
+        const QByteArray digest = QCryptographicHash::hash(data(name), QCryptographicHash::Sha256);
+        return !memcmp(digest.constData(), e->sha256, sizeof(e->sha256));
+}
+
+/**
+ * @brief return the SHA-256 of a payload as stored in the index
+ * @param name name of the payload
+ * @return QByteArray with the digest; empty if not found
+ */
+QByteArray flashbundle::digest(const QString& name) const
+{
+        const flashbundle_entry_t* e = entry(name);
+        if (!e)
+                return QByteArray();
+        return QByteArray(reinterpret_cast<const char *>(e->sha256), sizeof(e->sha256));
+}
+
+/**
+ * @brief write a bundle
+ * The file is replaced atomically.
+ * @param filename name of the bundle
+ * @param items payloads to store
+ * @param error optional pointer to a QString receiving an error message
+ * @return true on success
+ */
+bool flashbundle::write(const QString& filename, const QList<flashbundle_item_t>& items, QString* error)
+{
+        const quint32 index_offset = sizeof(flashbundle_header_t);
+        quint64 offset = index_offset + items.size() * sizeof(flashbundle_entry_t);
+
+        QByteArray index;
+        foreach(const flashbundle_item_t& item, items) {
+                const QByteArray name = item.name.toUtf8();
+                if (name.size() >= FLASHBUNDLE_NAME_SIZE) {
+                        if (error)
+                                *error = tr("Payload name too long for a bundle: %1").arg(item.name);
+                        return false;
+                }
+                offset = (offset + FLASHBUNDLE_PAGE_SIZE - 1) & ~static_cast<quint64>(FLASHBUNDLE_PAGE_SIZE - 1);
+                flashbundle_entry_t e;
+                memset(&e, 0, sizeof(e));
+                memcpy(e.name, name.constData(), name.size());
+                e.offset = qToLittleEndian(offset);
+                e.size = qToLittleEndian(static_cast<quint64>(item.data.size()));
+                e.address = qToLittleEndian(item.address);
+                e.flags = qToLittleEndian(item.flags);
+                const QByteArray digest = QCryptographicHash::hash(item.data, QCryptographicHash::Sha256);
+                memcpy(e.sha256, digest.constData(), sizeof(e.sha256));
+                index.append(reinterpret_cast<const char *>(&e), sizeof(e));
+                offset += item.data.size();
+        }
+
+        flashbundle_header_t hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, FLASHBUNDLE_MAGIC, sizeof(hdr.magic));
+        hdr.version = qToLittleEndian(static_cast<quint32>(FLASHBUNDLE_VERSION));
+        hdr.count = qToLittleEndian(static_cast<quint32>(items.size()));
+        hdr.page_size = qToLittleEndian(static_cast<quint32>(FLASHBUNDLE_PAGE_SIZE));
+        hdr.index_offset = qToLittleEndian(index_offset);
+        hdr.size = qToLittleEndian(offset);
+
+        QSaveFile file(filename);
+        if (!file.open(QIODevice::WriteOnly)) {
+                if (error)
+                        *error = tr("Failed to create bundle: %1").arg(filename);
+                return false;
+        }
+        QByteArray head(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+        head += index;
+        file.write(head);
+        qint64 pos = head.size();
+        foreach(const flashbundle_item_t& item, items) {
+                const qint64 aligned = (pos + FLASHBUNDLE_PAGE_SIZE - 1) & ~static_cast<qint64>(FLASHBUNDLE_PAGE_SIZE - 1);
+                file.write(QByteArray(static_cast<int>(aligned - pos), '\0'));
+                file.write(item.data);
+                pos = aligned + item.data.size();
+        }
+        if (!file.commit()) {
+                if (error)
+                        *error = tr("Failed to write bundle: %1").arg(filename);
+                return false;
+        }
+        return true;
+}
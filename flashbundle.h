@@ -0,0 +1,98 @@
+#ifndef FLASHBUNDLE_H
+#define FLASHBUNDLE_H
+
+#include <QCoreApplication>
+#include <QString>
+#include <QStringList>
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QFile>
+
+#define FLASHBUNDLE_MAGIC       "CFBUNDLE"
+#define FLASHBUNDLE_VERSION     1
+#define FLASHBUNDLE_PAGE_SIZE   4096    //!< alignment of the payload data
+#define FLASHBUNDLE_NAME_SIZE   40      //!< bytes for a payload name, NUL included
+
+/**
+ * @brief bundle file header (64 bytes, little endian)
+ */
+typedef struct {
+        char            magic[8];       //!< FLASHBUNDLE_MAGIC
+        quint32         version;        //!< FLASHBUNDLE_VERSION
+        quint32         count;          //!< number of index entries
+        quint32         page_size;      //!< alignment of the payload data
+        quint32         index_offset;   //!< file offset of the index
+        quint64         size;           //!< size of the whole file
+        quint8          pad[32];
+}       flashbundle_header_t;
+
+/**
+ * @brief bundle index entry (96 bytes, little endian)
+ */
+typedef struct {
+        char            name[FLASHBUNDLE_NAME_SIZE];    //!< payload name, NUL padded
+        quint64         offset;         //!< file offset of the data, page aligned
+        quint64         size;           //!< size of the data
+        quint32         address;        //!< address the payload is loaded to, 0 if none
+        quint32         flags;          //!< FLASHBUNDLE_xxx flags
+        quint8          sha256[32];     //!< SHA-256 of the data
+}       flashbundle_entry_t;
+
+#define FLASHBUNDLE_HEXLOG      (1 << 0)        //!< a capture hex log, stored decoded
+
+/**
+ * @brief a payload to be written into a bundle
+ */
+typedef struct {
+        QString         name;           //!< payload name
+        QByteArray      data;           //!< contents
+        quint32         address;        //!< address the payload is loaded to, 0 if none
+        quint32         flags;          //!< FLASHBUNDLE_xxx flags
+}       flashbundle_item_t;
+
+/**
+ * @brief memory mapped bundle of named payloads
+ * A header, an index of the payloads with offsets, sizes, SHA-256 and
+ * load addresses, and the uncompressed payload data, each starting on a
+ * page boundary.
+ * Opening maps the file and hashes the names; data() then returns a
+ * QByteArray referring to the mapping, so no payload is read or copied
+ * before it is used. verify() checks a payload's digest; it only reads
+ * the mapping, so it may run in any thread. The mapping stays valid as
+ * long as the bundle is open. Payloads must fit a QByteArray.
+ */
+class flashbundle
+{
+        Q_DECLARE_TR_FUNCTIONS(flashbundle)
+public:
+        flashbundle();
+        ~flashbundle();
+
+        bool open(const QString& filename);
+        void close();
+        bool isOpen() const;
+        QString fileName() const;
+        QString errorString() const;
+        QStringList names() const;
+        bool contains(const QString& name) const;
+        QByteArray data(const QString& name) const;
+        qint64 size(const QString& name) const;
+        quint32 address(const QString& name) const;
+        quint32 flags(const QString& name) const;
+        bool verify(const QString& name) const;
+        QByteArray digest(const QString& name) const;
+
+        static bool write(const QString& filename, const QList<flashbundle_item_t>& items, QString* error = 0);
+
+private:
+        QFile m_file;
+        const uchar* m_map;
+        qint64 m_size;
+        const flashbundle_entry_t* m_entries;
+        QHash<QString, int> m_index;
+        QString m_error;
+        const flashbundle_entry_t* entry(const QString& name) const;
+};
+
+#endif // FLASHBUNDLE_H
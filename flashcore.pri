@@ -0,0 +1,54 @@
+#-------------------------------------------------
+#
+# Flashing core: USB FEL protocol, flasher and payloads.
+# Depends on QtCore and QtConcurrent only, so it can be linked into
+# the GUI as well as into headless tools.
+#
+#-------------------------------------------------
+
+# QSaveFile, QLockFile, QJsonDocument and QCommandLineParser need Qt 5.2
+lessThan(QT_MAJOR_VERSION, 5)|if(equals(QT_MAJOR_VERSION, 5):lessThan(QT_MINOR_VERSION, 2)) {
+        error("CubieFlash requires Qt 5.2 or later")
+}
+
+QT      += core concurrent
+CONFIG  += c++11
+
+win32:DEFINES += __func__=__FUNCTION__
+unix:DEFINES += __func__=__PRETTY_FUNCTION__
+
+# The FEL code traces every transfer with qDebug(); formatting those
+# messages would dominate the small control transfers in release builds.
+CONFIG(release, debug|release):DEFINES += QT_NO_DEBUG_OUTPUT
+
+INCLUDEPATH += $$PWD /usr/include/libusb-1.0
+DEPENDPATH += $$PWD
+
+SOURCES += $$PWD/usbfel.cpp \
+    $$PWD/flasher.cpp \
+    $$PWD/payloads.cpp \
+    $$PWD/flashplan.cpp \
+    $$PWD/flashprogress.cpp \
+    $$PWD/flashtrace.cpp \
+    $$PWD/flashbaseline.cpp \
+    $$PWD/felstats.cpp \
+    $$PWD/usbcapture.cpp \
+    $$PWD/flashbundle.cpp \
+    $$PWD/flashmanifest.cpp
+
+HEADERS += $$PWD/usbfel.h \
+    $$PWD/flasher.h \
+    $$PWD/payloads.h \
+    $$PWD/flashplan.h \
+    $$PWD/flashprogress.h \
+    $$PWD/flashtrace.h \
+    $$PWD/flashbaseline.h \
+    $$PWD/felstats.h \
+    $$PWD/usbcapture.h \
+    $$PWD/flashbundle.h \
+    $$PWD/flashmanifest.h
+
+RESOURCES += \
+    $$PWD/flashdata.qrc
+
+LIBS += -lusb-1.0
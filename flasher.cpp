@@ -17,43 +17,298 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+#include <QCryptographicHash>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QScopedPointer>
+#include <QtConcurrent/QtConcurrentRun>
 #include "flasher.h"
+#include "payloads.h"
+#include "flashplan.h"
 
-#define ADDR_CRC_TABLE  0x40100000      //!< address of the CRC table
-#define ADDR_FES_1      0x40200000      //!< address of fes_2-1.fex
-#define ADDR_FES_2      0x00007220
 #define ADDR_MAGIC_DE   0x40360000
 #define ADDR_FED_NAND   0x40430000
 #define ADDR_DRAM_BUFF  0x40600000
+#define ADDR_DRAM       0x40000000
+#define DRAM_WINDOW     0x40000000          //!< largest DRAM the SoC maps (1 GiB)
+#define MEMORY_CHUNK    65536               //!< bytes read per turn of the event loop by dump and verify
+#define AGAIN_USB       -2                  //!< again(): run the step again once usb_FEL::Completed(bool) arrived
+
+#define PREFETCH_HEAD   (4 * 1024 * 1024)   //!< bytes of each partition image to read ahead
+#define PREFETCH_POLL_MSEC 20            //!< interval to check for the stage 2 inputs at
+#define SLOW_LINK_LIMIT (16 * 1024 * 1024)  //!< largest partition streamed over a link slower than high speed
+
+#define PROBE_SRAM      0x00002000          //!< FEL1 probe memory, overwritten by FES_1_1 later
+#define PROBE_SRAM_MAX  (8 * 1024)          //!< largest FEL1 probe, ends well below the BROM FEL stack at 0x5c00
+#define PROBE_SRAM_BYTES (256 * 1024)       //!< bytes per size and direction in FEL mode
+#define PROBE_DRAM_BYTES (4 * 1024 * 1024)  //!< bytes per size and direction in flash mode
+
+/**
+ * @brief payloads and capture logs used in stage 2
+ */
+static const char* const stage_2_payloads[] = {
+        "FED_NAND_0000000",
+        "UBOOT_0000000000",
+        "BOOT0_0000000000",
+        "UPDATE_BOOT0_000",
+        "UPDATE_BOOT1_000",
+        "FET_RESTORE_0000",
+        "magic_de_start.fex",
+        "magic_de_end.fex",
+        "magic_cr_start.fex",
+        "magic_cr_end.fex",
+        0
+};
+
+static const char* const stage_2_logs[] = {
+        "pt2_000054",
+        "pt2_113307",
+        "pt2_113316",
+        "pt2_113541",
+        "pt2_113550",
+        0
+};
+
+/**
+ * @brief partition images written by send_partitions_and_MBR()
+ */
+static const char* const stage_2_partitions[] = {
+        "RFSFAT16_BOOTLOADER_FEX00",
+        "RFSFAT16_ROOTFS_FEX000000",
+        "1234567890___MBR",
+        0
+};
+
+#define WRITE_PARTITIONS        0                   //!< send_partitions_and_MBR() does not write yet
+#define NAND_WRITE_RATE         (4 * 1024 * 1024)   //!< bytes per second written to NAND until calibrated
+#define NAND_SECTOR_SIZE        512                 //!< bytes per sector as addressed through FED_NAND
+#define NAND_RECORD_MAX         (64 * 1024)         //!< largest partition record, as FED_NAND is known to accept
+#define AW_FES_CRC_ADDR         0x40023c00          //!< CRC FES keeps of the data written to NAND
+
+/**
+ * @brief actions of send_partitions_and_MBR()
+ */
+enum {
+        PART_RESET_CRC,         //!< clear the CRC
+        PART_IMAGE,             //!< write a partition image
+        PART_READ_CRC,          //!< read the CRC
+        PART_COMMIT             //!< tell FES the number of partitions written
+};
+
+typedef struct {
+        int             action;         //!< PART_RESET_CRC ... PART_COMMIT
+        int             image;          //!< index into stage_2_partitions, or -1
+        quint32         sector;         //!< first sector of the image, or the partition count
+}       part_action_t;
+
+static const part_action_t part_script[] = {
+        {PART_RESET_CRC,  -1, 0},
+        {PART_IMAGE,       0, 0x008000},
+        {PART_READ_CRC,    0, 0},
+        {PART_RESET_CRC,  -1, 0},
+        {PART_IMAGE,       1, 0x028000},
+        {PART_IMAGE,       2, 0x000000},
+        {PART_READ_CRC,    2, 0},
+        {PART_COMMIT,     -1, 2}
+};
+
+/**
+ * @brief NAND parameters as passed to boot0 and FED_NAND (boot_nand_para_t)
+ * The capture writes this block (pt2_113316) for UPDATE_BOOT1, and FED_NAND
+ * appears to answer with the same layout at the start of its 0x400 byte
+ * info block. All fields are little endian.
+ */
+typedef struct nand_para_s {
+        quint32         chip_cnt;
+        quint32         chip_connect_info;
+        quint32         rb_cnt;
+        quint32         rb_connect_info;
+        quint32         rb_connect_mode;
+        quint32         bank_cnt_per_chip;
+        quint32         die_cnt_per_chip;
+        quint32         plane_cnt_per_die;
+        quint32         sector_cnt_per_page;
+        quint32         page_cnt_per_phy_blk;
+        quint32         blk_cnt_per_die;
+        quint32         operation_opt;
+        quint32         frequence_par;
+        quint32         ecc_mode;
+        quint8          nand_chip_id[8];
+        quint32         valid_blk_ratio;
+        quint32         good_block_ratio;
+        quint32         read_retry_type;
+        quint32         ddr_type;
+}       nand_para_t;
+
+static bool is_pow2(quint32 value, quint32 min, quint32 max)
+{
+        return value >= min && value <= max && !(value & (value - 1));
+}
+
+#define NAND_BOOT0_SECTOR       0x00000000      //!< sector of boot0 as seen through FED_NAND (assumed)
+#define NAND_UBOOT_SECTOR       0x00000100      //!< sector of the u-boot header as seen through FED_NAND (assumed)
+
+/**
+ * @brief start of the eGON header of boot0 and u-boot images
+ */
+typedef struct egon_header_s {
+        quint32         jump;           /* ARM branch around the header */
+        char            magic[8];       /* "eGON.BT0" or "eGON.BT1" */
+        quint32         check_sum;
+        quint32         length;
+}       egon_header_t;
+
+/**
+ * @brief parse the eGON header at the start of a buffer
+ * @param data buffer with the image
+ * @param hdr pointer to a egon_header_t to fill
+ * @return true if the buffer starts with a plain eGON header
+ */
+static bool parse_egon(const QByteArray& data, egon_header_t* hdr)
+{
+        if (static_cast<size_t>(data.size()) < sizeof(*hdr))
+                return false;
+        memcpy(hdr, data.constData(), sizeof(*hdr));
+        if (memcmp(hdr->magic, "eGON.BT", 7))
+                return false;
+        hdr->check_sum = qFromLittleEndian(hdr->check_sum);
+        hdr->length = qFromLittleEndian(hdr->length);
+        return true;
+}
+
+/**
+ * @brief return the number of bytes of boot0 read from NAND
+ * That is the size of BOOT0_0000000000 in whole sectors, at most one record.
+ */
+static quint32 boot0_bytes()
+{
+        const quint32 size = payloads::get(QLatin1String("BOOT0_0000000000")).size();
+        return qMin<quint32>((size + NAND_SECTOR_SIZE - 1) / NAND_SECTOR_SIZE * NAND_SECTOR_SIZE, NAND_RECORD_MAX);
+}
+
+/**
+ * @brief return the settings key of the boot0 sectors written for BOOT0_0000000000
+ * The key holds the SHA-256 of the payload, so a new boot0 gets a new key.
+ */
+static QString boot0_key()
+{
+        const QByteArray digest = QCryptographicHash::hash(payloads::get(QLatin1String("BOOT0_0000000000")),
+                                                           QCryptographicHash::Sha256);
+        return QLatin1String("boot0/") + QString::fromLatin1(digest.toHex());
+}
 
 flasher::flasher(QObject *parent) :
         QObject(parent),
         m_rc(0),
         m_show_urbs(true),
+        m_running(0),
+        m_cancel(0),
+        m_memory(false),
+        m_success(false),
+        m_step(0),
+        m_stage(0),
+        m_again(-1),
+        m_jump(-1),
+        m_rerun(false),
+        m_continue(0),
+        m_completed(),
+        m_replaying(false),
+        m_mem_mode(MEM_DUMP),
+        m_mem_offset(0),
+        m_mem_size(0),
+        m_mem_pos(0),
+        m_mem_version(0),
+        m_mem_file(),
+        m_mem_buf(),
+        m_wait_start(0),
+        m_progress(),
+        m_trace(),
+        m_stage_ts(-1),
+        m_step_ts(0),
+        m_wait_ts(-1),
+        m_baseline(),
+        m_checkpoint(-1),
+        m_checkpoint_timer(),
+        m_checkpoints(),
+        m_timing_report(),
+        m_allow_slow_link(false),
+        m_link(),
+        m_probe(),
+        m_step_timer(),
+        m_step_usecs(),
+        m_prefetching(false),
+        m_prefetch_ts(0),
+        m_prefetch(),
+        m_prefetched(),
+        m_manifest(),
+        m_nand(),
         m_usb(0),
-        m_version(),
-        m_scratchpad(0x00007e00)
+        m_plan(0),
+        m_probe_version(),
+        m_part(),
+        m_force_boot(false),
+        m_uboot_current(false),
+        m_boot0_current(false),
+        m_boot0_installed(false),
+        m_boot_area(),
+        m_boot_read(0),
+        m_boot_then(0)
 {
+        m_nand.valid = false;
         m_usb = new usb_FEL(SUNXI_FEL_DEVICE_MAJOR, SUNXI_FEL_DEVICE_MINOR, 60000, this);
+        m_usb->setProgress(&m_progress);
+        m_usb->setTrace(&m_trace);
         connect(m_usb, SIGNAL(Progress(qreal)), this, SIGNAL(Progress(qreal)));
         connect(m_usb, SIGNAL(Status(QString)), this, SIGNAL(Status(QString)));
         connect(m_usb, SIGNAL(Error(QString)), this, SIGNAL(Error(QString)));
+        connect(m_usb, SIGNAL(Completed(bool)), this, SLOT(usb_completed(bool)));
+        m_plan = new flashplan(m_usb, this);
+        connect(m_plan, SIGNAL(URB(int)), this, SLOT(showURB(int)));
+        connect(m_plan, SIGNAL(Status(QString)), this, SIGNAL(Status(QString)));
+        connect(m_plan, SIGNAL(Error(QString)), this, SIGNAL(Error(QString)));
 }
 
 flasher::~flasher()
 {
+        end_partition();
         delete m_usb;
         m_usb = 0;
 }
 
+/**
+ * @brief return true if a FEL device is present
+ * Call this in the flasher's thread only, or use findDevice().
+ */
 bool flasher::connected()
 {
         return m_usb->find_device();
 }
 
+/**
+ * @brief look for a FEL device and emit DeviceFound(bool)
+ * This is the slot for other threads; while a session runs, the device
+ * belongs to it and nothing is emitted.
+ */
+void flasher::findDevice()
+{
+        if (m_running.loadAcquire())
+                return;
+        emit DeviceFound(m_usb->find_device());
+}
+
+/**
+ * @brief open the device and record the speed it is connected at
+ * The board enumerates anew for stage 2, so the speed may differ between
+ * the stages; degraded is set if any opening found a slow link.
+ * @return true on success
+ */
 bool flasher::open_usb()
 {
-        return m_usb->usb_open();
+        if (!m_usb->usb_open())
+                return false;
+        m_link.insert(QLatin1String("speed"), usb_FEL::speed_name(m_usb->speed()));
+        m_link.insert(QLatin1String("degraded"), m_link.value(QLatin1String("degraded")).toBool() || m_usb->degraded());
+        return true;
 }
 
 bool flasher::close_usb()
@@ -67,796 +322,1984 @@ void flasher::showURBs(bool show)
 }
 
 /**
- * @brief return a resource path name for a resource name
- * @param name name of the resource
- * @return QString with the filename
+ * @brief select the board to flash by its USB port path
+ * @param path port path as returned by usb_FEL::port_paths()
  */
-QString flasher::resource(const QString &name)
+void flasher::setPortPath(const QString& path)
 {
-        return QString(":/cubietruck/data/%1").arg(name);
+        m_usb->setPortPath(path);
+        m_completed.clear();
 }
 
 /**
- * @brief show the URB
- * @param urb URB number of the original tracing
+ * @brief return the progress aggregator of the session
+ * It can be sampled from any thread, e.g. by a user interface timer,
+ * instead of connecting to the Progress() and URB() signals.
+ * Its sample() also gives throughput and the ETA of the whole session.
  */
-void flasher::showURB(int urb)
+flashprogress* flasher::progress()
 {
-        qDebug("%s: URB (%06d)", __func__, urb);
-        if (m_show_urbs)
-                emit URB(urb);
+        return &m_progress;
+}
+
+QString flasher::portPath() const
+{
+        return m_usb->portPath();
 }
 
 /**
- * @brief read a trace log file's hex data into the QByteArray at dest
- * @param dest reference to a QByteArray to fill with data
- * @param bytes number of bytes expected (dest is zero padded to this size)
- * @param name name of the resource to load
- * @return
+ * @brief return the completion polling statistics per URB call site
  */
-bool flasher::read_log(QByteArray& dest, size_t bytes, const QString& filename)
+QMap<int, aw_poll_stats_t> flasher::pollStats() const
 {
-        QFile in(filename);
-        size_t nbyte = 0;
-        dest.clear();
-
-        if (!in.open(QIODevice::ReadOnly)) {
-                emit Error (tr("Failed to open input file: %1").arg(filename));
-                return false;
-        }
-
-        while (!in.atEnd()) {
-                QString line = in.readLine();
-                line = line.remove(QRegExp(QLatin1String("^.*:")));
-                line = line.remove(QChar(' '));
-                QByteArray data = QByteArray::fromHex(line.toLatin1());
-                nbyte += data.size();
-                dest.append(data);
-        }
-        in.close();
-        QLocale l = QLocale::system();
-        emit Status(tr("Read log file %1 (%2 bytes)")
-                    .arg(filename)
-                    .arg(l.toString(static_cast<quint64>(nbyte))));
-        if (nbyte < bytes) {
-                QByteArray pad;
-                pad.fill('\0', bytes - nbyte);
-                dest.append(pad);
-        }
-        return true;
+        return m_usb->pollStats();
 }
 
+/**
+ * @brief return the timeline of the session
+ * Recording is off until it is enabled with setEnabled(); each start()
+ * clears it, so after a session it holds just that session.
+ */
+flashtrace* flasher::trace()
+{
+        return &m_trace;
+}
 
-bool flasher::stage_1_prep()
+/**
+ * @brief set how much slower than the baseline a URB checkpoint may be
+ * @param threshold fraction of the 95th percentile, e.g. 0.5 for 50%
+ */
+void flasher::setRegressionThreshold(qreal threshold)
 {
-        qDebug("%s: ******** START ********", __func__);
+        m_baseline.setThreshold(threshold);
+}
 
-        QByteArray buf;
-        showURB(5);
-        quint32 version = m_usb->aw_fel_get_version(&m_version);
+/**
+ * @brief return the timing report of the last session
+ * It lists every URB checkpoint with its time, the median and 95th
+ * percentile of the baseline, and the URBs that regressed.
+ */
+QJsonObject flasher::timingReport() const
+{
+        return m_timing_report;
+}
 
-        // 0x1651 = Cubietruck
-        if (version != SUNXI_SOC_ID_A20) {
-                emit Error(tr("Expected ID 0x%1, got 0x%2")
-                           .arg(SUNXI_SOC_ID_A20, 4, 16, QChar('0'))
-                           .arg(version, 4, 16, QChar('0')));
-                return false;
+/**
+ * @brief return the progress of the session as a "progress" event
+ * @param percent progress of the current transfer in whole percent
+ * @return event object for the CLI and the daemon clients
+ */
+QJsonObject flasher::progressEvent(int percent)
+{
+        progress_sample_t sample = m_progress.sample();
+        QJsonObject obj;
+        obj.insert(QLatin1String("event"), QLatin1String("progress"));
+        obj.insert(QLatin1String("percent"), qMax(0, percent));
+        if (sample.overall >= 0) {
+                obj.insert(QLatin1String("overall"), qRound(sample.overall * 10) / 10.0);
+                obj.insert(QLatin1String("mbps"), qRound(sample.mbps * 100) / 100.0);
+                obj.insert(QLatin1String("mbps_avg"), qRound(sample.mbps_avg * 100) / 100.0);
+                obj.insert(QLatin1String("eta_ms"), static_cast<double>(sample.eta_msecs));
+                obj.insert(QLatin1String("step_bytes"), static_cast<double>(sample.step_bytes));
+                if (sample.step_total > 0)
+                        obj.insert(QLatin1String("step_total"), static_cast<double>(sample.step_total));
         }
-        m_scratchpad = m_version.scratchpad;
-
-        showURB(14);
-        version = m_usb->aw_fel_get_version();
-        qDebug("%s: version=0x%04x", __func__, version);
+        return obj;
+}
 
-        // URB 23 - 27
-        showURB(23);
-        buf.fill('\0', 256);
-        // get 256 0xCC
-        m_usb->aw_fel_read(m_scratchpad, buf.data(), buf.size());
+/**
+ * @brief write the reports of the session that just finished
+ * Writes the timing report and the trace to the files given, and
+ * returns what the CLI and the daemon clients are told about them:
+ * "poll", "regression" and "trace" events, and an "error" event for
+ * every file that could not be written.
+ * @param report_file file for the timing report (may be empty)
+ * @param trace_file file for the trace (may be empty)
+ * @return list of event objects, each with its type in "event"
+ */
+QList<QJsonObject> flasher::sessionEvents(const QString& report_file, const QString& trace_file)
+{
+        QList<QJsonObject> events;
+        QMap<int, aw_poll_stats_t> polls = pollStats();
+        for (QMap<int, aw_poll_stats_t>::const_iterator it = polls.constBegin(); it != polls.constEnd(); ++it) {
+                QJsonObject obj;
+                obj.insert(QLatin1String("event"), QLatin1String("poll"));
+                obj.insert(QLatin1String("urb"), it.key());
+                obj.insert(QLatin1String("calls"), static_cast<int>(it.value().calls));
+                obj.insert(QLatin1String("polls"), static_cast<int>(it.value().last_polls));
+                obj.insert(QLatin1String("usecs"), static_cast<double>(it.value().last_usecs));
+                events += obj;
+        }
 
-        for (int i = 0; i < buf.size(); i++) {
-                if (buf.at(i) == '\xCC')
-                        continue;
-                emit Error(tr("Non 0xCC at entry %1 (0x%2)")
-                           .arg(i).arg(static_cast<uchar>(buf.at(i)), 2, 16, QChar('0')));
-                return false;
+        foreach(const QJsonValue& value, m_timing_report.value(QLatin1String("checkpoints")).toArray()) {
+                QJsonObject obj = value.toObject();
+                if (obj.value(QLatin1String("regressed")).toBool()) {
+                        obj.remove(QLatin1String("regressed"));
+                        obj.insert(QLatin1String("event"), QLatin1String("regression"));
+                        events += obj;
+                }
+        }
+        if (!report_file.isEmpty()) {
+                QFile file(report_file);
+                if (file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+                        file.write(QJsonDocument(m_timing_report).toJson());
+                } else {
+                        QJsonObject obj;
+                        obj.insert(QLatin1String("event"), QLatin1String("error"));
+                        obj.insert(QLatin1String("message"), tr("Failed to write the timing report to %1.").arg(report_file));
+                        events += obj;
+                }
         }
 
-        showURB(32);
-        version = m_usb->aw_fel_get_version();
-        qDebug("%s: version=0x%04x", __func__, version);
+        if (!trace_file.isEmpty()) {
+                QJsonObject obj;
+                if (m_trace.save(trace_file)) {
+                        obj.insert(QLatin1String("event"), QLatin1String("trace"));
+                        obj.insert(QLatin1String("file"), trace_file);
+                        obj.insert(QLatin1String("events"), m_trace.count());
+                } else {
+                        obj.insert(QLatin1String("event"), QLatin1String("error"));
+                        obj.insert(QLatin1String("message"), tr("Failed to write the trace to %1.").arg(trace_file));
+                }
+                events += obj;
+        }
+        return events;
+}
 
-        showURB(41);
-        buf[0] = '\0';
-        buf[1] = '\0';
-        buf[2] = '\0';
-        buf[3] = '\0';
-        m_usb->aw_fel_write(m_scratchpad, buf.data(), buf.size());
+/**
+ * @brief return the statistics of the USB and FEL operations
+ * They are reset when a session starts, so after a session they
+ * describe just that session.
+ */
+const felstats& flasher::stats() const
+{
+        return m_usb->stats();
+}
 
-        showURB(50);
-        version = m_usb->aw_fel_get_version();
-        qDebug("%s: version=0x%04x", __func__, version);
+/**
+ * @brief stream large partitions even if the board is connected below high speed
+ * @param allow true to only warn about a slow link
+ */
+void flasher::setAllowSlowLink(bool allow)
+{
+        m_allow_slow_link = allow;
+}
 
-        return version == 0x1651;
+/**
+ * @brief install boot0 and u-boot even if NAND already holds them
+ * @param force true to skip the check of the boot area
+ */
+void flasher::setForceBoot(bool force)
+{
+        m_force_boot = force;
 }
 
+/**
+ * @brief run the session against a captured one instead of a board
+ * @param replay pointer to the loaded usbcapture, or 0 for the board
+ */
+void flasher::setReplay(usbcapture* replay)
+{
+        m_usb->setReplay(replay);
+        m_replaying = replay != 0;
+        m_completed.clear();
+}
 
-bool flasher::install_fes_1_1()
+/**
+ * @brief check the inputs against a manifest before stage 2
+ * @param manifest expected digests; an empty manifest checks nothing
+ */
+void flasher::setManifest(const flashmanifest& manifest)
 {
-        qDebug("%s: ******** START ********", __func__);
+        m_manifest = manifest;
+}
 
-        static const QByteArray DRAM0("DRAM\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", 16);
-        QEventLoop loop(this);
-        QByteArray buf1;
+/**
+ * @brief return the tree hashes of the partition images of the last session
+ * The chunk hashes can be reused to verify or rewrite single chunks.
+ */
+QHash<QString, flashtree_t> flasher::imageTrees() const
+{
+        return m_prefetched.trees;
+}
 
-        QString name = resource(QLatin1String("fes_1-1.fex"));
-        QFile in(name);
-        if (!in.open(QIODevice::ReadOnly)) {
-                emit Error(tr("Failed to open file to send: %1").arg(name));
-                return false;
-        }
-        QByteArray fes_1_1_orig = in.readAll();
-        in.close();
-        size_t fsize = fes_1_1_orig.size();
+/**
+ * @brief merge small adjacent FEL writes into one transfer
+ * @param on true to enable write combining in the USB layer
+ */
+void flasher::setWriteCombining(bool on)
+{
+        m_usb->setWriteCombining(on);
+}
 
-        showURB(63);
-        if (!read_log(buf1, 0x200, resource(QLatin1String("pt1_000063"))))
-                return false;
-        if (!m_usb->aw_fel_write(0x7010, buf1.data(), buf1.size()))
-                return false;
+/**
+ * @brief return a resource path name for a resource name
+ * @param name name of the resource
+ * @return QString with the filename
+ */
+QString flasher::resource(const QString &name)
+{
+        return payloads::path(name);
+}
 
-        showURB(72);
-        buf1.fill('\0', 16);
-        if (!m_usb->aw_fel_write(0x7210, buf1.data(), buf1.size()))
-                return false;
+/**
+ * @brief show the URB
+ * @param urb URB number of the original tracing
+ */
+void flasher::showURB(int urb)
+{
+        qDebug("%s: URB (%06d)", __func__, urb);
+        m_progress.setURB(urb);
+        checkpoint(urb);
+        if (m_trace.isEnabled()) {
+                QJsonObject args;
+                args.insert(QLatin1String("urb"), urb);
+                m_trace.instant("urb", QString("URB %1").arg(urb), args);
+        }
+        if (m_show_urbs)
+                emit URB(urb);
+}
 
-        showURB(77);
-        // Load buffer as per URB 81 (0xae0 = 2784) FES_1-1 with nulls after.
-        // We do lots of sanity checks here (relic from testing).
+/**
+ * @brief close the running URB checkpoint and open the next one
+ * A checkpoint's time runs from its showURB() to the next one or to the
+ * end of the step, so waits between steps are not accounted to it.
+ * Checkpoints passed more than once in a session add up.
+ * @param urb URB number of the checkpoint to open, or -1 to just close
+ */
+void flasher::checkpoint(int urb)
+{
+        if (!m_running.loadAcquire())
+                return;
+        if (m_checkpoint >= 0)
+                m_checkpoints[m_checkpoint] += m_checkpoint_timer.nsecsElapsed() / 1000;
+        m_checkpoint = urb;
+        if (urb >= 0)
+                m_checkpoint_timer.start();
+}
 
-        // data from log
-        if (!read_log(buf1, 0x0ae0, resource(QLatin1String("pt1_000081"))))
-                return false;
+/**
+ * @brief compare the checkpoints of the session to the timing baseline
+ * Regressions are reported as status messages and in timingReport().
+ * Only successful sessions become part of the baseline.
+ * @param success true if the session succeeded
+ */
+void flasher::compare_baseline(bool success)
+{
+        if (!m_baseline.load())
+                emit Status(tr("Could not read the timing baseline %1.").arg(flashbaseline::defaultPath()));
 
-        if (buf1.left(fsize) != fes_1_1_orig) {
-                emit Error(tr("Dump / fes_1-1 file mismatch"));
-                qDebug("%s: file buffer:\n%s", __func__, qPrintable(m_usb->hexdump(buf1.constData(), 0, buf1.size())));
-                qDebug("%s: read buffer:\n%s", __func__, qPrintable(m_usb->hexdump(fes_1_1_orig.constData(), 0, fes_1_1_orig.size())));
-                return false;
+        QList<checkpoint_result_t> results = m_baseline.compare(m_checkpoints);
+        foreach(const checkpoint_result_t& res, results) {
+                if (!res.regressed)
+                        continue;
+                emit Status(tr("URB %1 took %2 ms, the baseline is %3 ms (95%: %4 ms).")
+                            .arg(res.urb)
+                            .arg(res.usecs / 1000.0, 0, 'f', 1)
+                            .arg(res.median / 1000.0, 0, 'f', 1)
+                            .arg(res.p95 / 1000.0, 0, 'f', 1));
         }
 
-        if (!m_usb->aw_fel_send_file(0x7220, resource(QLatin1String("fes_1-1.fex")), 4000, 2784)) {
-                return false;
+        m_timing_report = m_baseline.report(results);
+        m_timing_report.insert(QLatin1String("time"), QDateTime::currentDateTime().toString(Qt::ISODate));
+        m_timing_report.insert(QLatin1String("port"), portPath());
+        m_timing_report.insert(QLatin1String("success"), success);
+        m_timing_report.insert(QLatin1String("link"), m_link);
+        if (!m_probe.isEmpty())
+                m_timing_report.insert(QLatin1String("probe"), m_probe);
+        if (!m_prefetched.digests.isEmpty() || !m_prefetched.trees.isEmpty()) {
+                // what was flashed: SHA-256 of the payloads and logs, tree hash root of the images
+                QJsonObject inputs;
+                for (QHash<QString, QByteArray>::const_iterator it = m_prefetched.digests.constBegin();
+                     it != m_prefetched.digests.constEnd(); ++it)
+                        inputs.insert(it.key(), QString::fromLatin1(it.value().toHex()));
+                for (QHash<QString, flashtree_t>::const_iterator it = m_prefetched.trees.constBegin();
+                     it != m_prefetched.trees.constEnd(); ++it)
+                        inputs.insert(it.key(), QString::fromLatin1(it.value().root.toHex()));
+                m_timing_report.insert(QLatin1String("inputs"), inputs);
         }
 
-        // sanity test
-        QByteArray buf2;
-        buf2.fill('\0', 2784);
-        m_usb->aw_fel_read(0x7220, buf2.data(), buf2.size());
-        if (buf1.left(fsize) != buf2.left(fsize)) {
-                emit Error(tr("Readback mismatch of fes_1-1"));
-                qDebug("%s: file buffer:\n%s", __func__, qPrintable(m_usb->hexdump(buf1.constData(), 0, buf1.size())));
-                qDebug("%s: read buffer:\n%s", __func__, qPrintable(m_usb->hexdump(buf2.constData(), 0, buf2.size())));
-                return false;
+        if (success && !m_checkpoints.isEmpty()) {
+                if (!m_baseline.merge(m_checkpoints))
+                        emit Status(tr("Could not write the timing baseline %1.").arg(flashbaseline::defaultPath()));
         }
+}
 
-        showURB(87);
-        if (!m_usb->aw_fel_execute(0x7220))
+/**
+ * @brief send a payload to DRAM while FES is running
+ * A bundle that gives the payload an address overrides @p offset.
+ * The payload is sent in chunks from the event thread; the step
+ * continues in @p then once it is sent.
+ * @param offset address to write to
+ * @param name name of the payload
+ * @param then member function to continue with
+ * @return true if the send was started
+ */
+bool flasher::send_payload2(quint32 offset, const QString& name, step_fn then)
+{
+        QString error;
+        QByteArray data = payloads::get(name, &error);
+        if (!error.isEmpty()) {
+                emit Error(error);
                 return false;
-
-        // need this to avoid error on next USB I/O
-        qint64 timeout = QDateTime::currentMSecsSinceEpoch() + Q_INT64_C(500);
-        while (QDateTime::currentMSecsSinceEpoch() < timeout) {
-                loop.processEvents();
         }
+        offset = payloads::address(name, offset);
+        return wait_usb(m_usb->startSend(offset, usb_FEL::AW_FEL_2_DRAM, true, data, resource(name)), then);
+}
 
-        showURB(96);
-        buf1.fill('\0', 16);
-        // expect 'DRAM' then nulls
-        if (!m_usb->aw_fel_read(0x7210, buf1.data(), buf1.size()))
-                return false;
 
-        if (buf1 != DRAM0) {
-                emit Error(tr("Compare to DRAM0 lit failed"));
+/**
+ * @brief wait for the operation started on the device, then continue
+ * The step returns to the event loop; usb_completed() runs it again
+ * with @p then when the operation completed, which finds the result in
+ * usb_FEL::lastResult().
+ * @param started result of usb_FEL::start() or usb_FEL::startSend()
+ * @param then member function to continue with
+ * @return true if the operation was started
+ */
+bool flasher::wait_usb(bool started, step_fn then)
+{
+        if (!started)
                 return false;
-        }
-
+        m_continue = then;
+        again(AGAIN_USB);
         return true;
 }
 
 
-bool flasher::install_fes_1_2()
+/**
+ * @brief continue the step waiting for the device
+ * @param success result of the operation
+ */
+void flasher::usb_completed(bool success)
 {
-        qDebug("%s: ******** START ********", __func__);
-
-        static const QByteArray DRAM1("DRAM\1\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", 16);
-        QByteArray buf1;
-
-        showURB(105);
-        buf1.fill('\0', 16);
-        if (!m_usb->aw_fel_write(0x7210, buf1.data(), buf1.size()))
-                return false;
-
-        showURB(114);
-        if (!m_usb->aw_fel_send_file(0x2000, resource(QLatin1String("fes_1-2.fex"))))
-                return false;
-
-        showURB(120);
-        if (!m_usb->aw_fel_execute(0x2000))
-                return false;
-
-        showURB(129);
-        // expect 'DRAM', 0x01 then nulls
-        buf1.fill('\0', 16);
-        if (!m_usb->aw_fel_read(0x7210, buf1.data(), buf1.size()))
-                return false;
-
-        if (buf1 != DRAM1) {
-                emit Error(tr("Compare to DRAM1 lit failed"));
-                return false;
+        if (m_memory) {
+                memory_completed(success);
+                return;
         }
+        if (m_again == AGAIN_USB)
+                resume();
+}
 
-        showURB(138);
-        // expect as per URB 138
-        buf1.fill('\0', 0x200);
-        if (!m_usb->aw_fel_read(0x7010, buf1.data(), buf1.size()))
-                return false;
-
-        QByteArray buf2;
-        if (!read_log(buf2, 0x0200, resource(QLatin1String("pt1_000138"))))
-                return false;
 
-        if (buf1 != buf2) {
-                emit Error(tr("Compare to pt1_000138 failed"));
-                return false;
+/**
+ * @brief run a step of the flash plan
+ * Operations on the device return to the event loop until they
+ * completed, delays and polls until they are over; the step is run
+ * again then and the plan continues where it stopped.
+ * @param step name of the step
+ * @param then member function to run once the plan step is done (may be 0)
+ * @return true on success
+ */
+bool flasher::run_plan(const char* step, step_fn then)
+{
+        if (!m_rerun)
+                qDebug("%s: ******** %s ********", __func__, step);
+        int msec = 0;
+        switch (m_plan->run(QLatin1String(step), &msec)) {
+        case flashplan::RUN_AGAIN:
+                again(msec);
+                return true;
+        case flashplan::RUN_WAIT:
+                // the rerun goes to the step function, which calls this again
+                m_continue = 0;
+                again(AGAIN_USB);
+                return true;
+        case flashplan::RUN_DONE:
+                return then ? (this->*then)() : true;
         }
-        return true;
+        return false;
 }
 
 
-bool flasher::send_crc_table()
+bool flasher::stage_1_prep()
 {
-        qDebug("%s: ******** START ********", __func__);
-
-        QByteArray buf1;
-
-        showURB(147);
-        if (!read_log(buf1, 0x2000, resource(QLatin1String("pt1_000147"))))
-                return false;
-
-        if (!m_usb->aw_fel_write(ADDR_CRC_TABLE, buf1.data(), buf1.size()))
-                return false;
-
-        showURB(153);
-        // read it back to make sure it's correct
-        QByteArray buf2;
-        buf2.fill('\0', buf1.size());
-        if (!m_usb->aw_fel_read(ADDR_CRC_TABLE, buf2.data(), buf2.size()))
-                return false;
-        if (buf1 != buf2) {
-                emit Error(tr("Compare to pt1_000147 failed"));
-                return false;
-        }
-        return true;
+        return run_plan("stage_1_prep");
 }
 
 
-bool flasher::install_fes_2()
+bool flasher::install_fes_1_1()
 {
-        qDebug("%s: ******** START ********", __func__);
+        return run_plan("install_fes_1_1");
+}
 
-        QByteArray buf;
 
-        showURB(165);
-        buf.fill('\0', 16);
-        if (!m_usb->aw_fel_write(0x7210, buf.data(), buf.size()))
-                return false;
+bool flasher::install_fes_1_2()
+{
+        return run_plan("install_fes_1_2");
+}
 
-        showURB(174);
-        if (!m_usb->aw_fel_send_file(ADDR_FES_1, resource(QLatin1String("fes.fex"))))
-                return false;
 
-        showURB(192);
-        if (!m_usb->aw_fel_send_file(ADDR_FES_2, resource(QLatin1String("fes_2.fex"))))
-                return false;
+bool flasher::send_crc_table()
+{
+        return run_plan("send_crc_table");
+}
 
-        showURB(198);
-        if (!m_usb->aw_fel_execute(0x7220))
-                return false;
 
-        return true;
+bool flasher::install_fes_2()
+{
+        return run_plan("install_fes_2");
 }
 
 
 bool flasher::stage_2_prep()
 {
-        qDebug("%s: ******** START ********", __func__);
-
-        QByteArray buf;
-        quint32 version;
-
-        showURB(5);
-        version = m_usb->aw_fel_get_version();
-        // 0x1651 = Cubietruck
-        if (version != SUNXI_SOC_ID_FLASHMODE) {
-                emit Error(tr("Expected ID 0x%1, got 0x%2")
-                           .arg(SUNXI_SOC_ID_FLASHMODE, 4, 16, QChar('0'))
-                           .arg(version, 4, 16, QChar('0')));
+        switch (prefetch_ready()) {
+        case PREFETCH_PENDING:
+                again(PREFETCH_POLL_MSEC);
+                return true;
+        case PREFETCH_FAILED:
                 return false;
         }
+        return run_plan("stage_2_prep");
+}
 
-        showURB(14);
-        version = m_usb->aw_fel_get_version();
-        qDebug("%s: version=0x%04x", __func__, version);
 
-        showURB(24);
-        buf.fill('\0', 256);
-        if (!m_usb->aw_fel2_read(m_scratchpad, buf.data(), buf.size(), usb_FEL::AW_FEL_2_DRAM))
-                return false;
+bool flasher::install_fed_nand()
+{
+        return run_plan("install_fed_nand", &flasher::read_nand_info);
+}
 
-        for (int i = 0; i < 256; i++) {
-                if (buf[i] != static_cast<char>((i < 4) ? '\0' : '\xCC')) {
-                        emit Error(tr("Scratchpad incorrect:\n%1")
-                                   .arg(m_usb->hexdump(buf.constData(), 0, buf.size())));
-                        return false;
-                }
+/**
+ * @brief decode the NAND info block FED_NAND answered with once it started
+ * The plan reads the block with "capture".
+ * @return true
+ */
+bool flasher::read_nand_info()
+{
+        const QByteArray buf = m_plan->captured();
+        qDebug("%s: NAND info:\n %s", __func__,
+               qPrintable(m_usb->hexdump(buf.constData(), 0, buf.size())));
+        if (decode_nand_geometry(buf, &m_nand)) {
+                m_nand.source = tr("board");
+                show_nand_geometry();
+        } else {
+                m_nand.valid = false;
+                nand_geometry();
         }
 
-        showURB(32);
-        version = m_usb->aw_fel_get_version();
-        qDebug("%s: version=0x%04x", __func__, version);
-
-        showURB(42);
-        if (!m_usb->aw_fel2_write(m_scratchpad, buf.data(), buf.size(), usb_FEL::AW_FEL_2_DRAM))
-                return false;
-
         return true;
 }
 
-
-bool flasher::install_fed_nand()
+/**
+ * @brief decode the NAND parameter block
+ * The block is accepted only if the geometry is plausible, since the
+ * layout of the FED_NAND answer is inferred from the capture.
+ * @param para buffer starting with a nand_para_t
+ * @param geo pointer to a nand_geometry_t to fill
+ * @return true if the block describes a plausible geometry
+ */
+bool flasher::decode_nand_geometry(const QByteArray& para, nand_geometry_t* geo)
 {
-        qDebug("%s: ***************************", __func__);
-        QByteArray buf;
+        nand_para_t np;
+        if (static_cast<size_t>(para.size()) < sizeof(np))
+                return false;
+        memcpy(&np, para.constData(), sizeof(np));
+
+        nand_geometry_t g;
+        g.valid = false;
+        g.chips = qFromLittleEndian(np.chip_cnt);
+        g.dies = qFromLittleEndian(np.die_cnt_per_chip);
+        g.planes = qFromLittleEndian(np.plane_cnt_per_die);
+        g.page_size = qFromLittleEndian(np.sector_cnt_per_page) * NAND_SECTOR_SIZE;
+        g.pages_per_block = qFromLittleEndian(np.page_cnt_per_phy_blk);
+        g.blocks = qFromLittleEndian(np.blk_cnt_per_die);
+        g.reserve_ratio = qFromLittleEndian(np.valid_blk_ratio);
+        g.chip_id = QByteArray(reinterpret_cast<const char *>(np.nand_chip_id), sizeof(np.nand_chip_id));
+        if (g.chips < 1 || g.chips > 8 ||
+            g.dies < 1 || g.dies > 4 ||
+            !is_pow2(g.planes, 1, 4) ||
+            !is_pow2(g.page_size, NAND_SECTOR_SIZE, 32768) ||
+            !is_pow2(g.pages_per_block, 16, 1024) ||
+            g.blocks < 1 || g.blocks > 65536)
+                return false;
+        g.valid = true;
+        *geo = g;
+        return true;
+}
 
-        showURB(51);
+/**
+ * @brief return the NAND geometry partition records are checked against
+ * Falls back to the parameters of the captured board (pt2_113316) if the
+ * board did not report a usable geometry, and to 64 KiB blocks of
+ * 512 byte pages, the layout assumed before, if even that fails.
+ * @return reference to the geometry
+ */
+const flasher::nand_geometry_t& flasher::nand_geometry()
+{
+        if (!m_nand.valid) {
+                if (decode_nand_geometry(payloads::hexlog(QLatin1String("pt2_113316")), &m_nand)) {
+                        m_nand.source = tr("capture");
+                } else {
+                        m_nand.valid = true;
+                        m_nand.source = tr("default");
+                        m_nand.chips = 1;
+                        m_nand.dies = 1;
+                        m_nand.planes = 1;
+                        m_nand.page_size = NAND_SECTOR_SIZE;
+                        m_nand.pages_per_block = NAND_RECORD_MAX / NAND_SECTOR_SIZE;
+                        m_nand.blocks = 0;
+                        m_nand.reserve_ratio = 0;
+                        m_nand.chip_id.clear();
+                }
+                show_nand_geometry();
+        }
+        return m_nand;
+}
 
-        if (!read_log(buf, 0x2760, resource(QLatin1String("pt2_000054"))))
-                return false;
+void flasher::show_nand_geometry()
+{
+        QString reserve;
+        if (m_nand.reserve_ratio)
+                reserve = tr(", block reserve ratio %1").arg(m_nand.reserve_ratio);
+        emit Status(tr("NAND geometry (%1): %2 chip(s) of %3 die(s), %4 plane(s), %5 byte pages, %6 pages per block, %7 blocks per die%8.")
+                    .arg(m_nand.source)
+                    .arg(m_nand.chips)
+                    .arg(m_nand.dies)
+                    .arg(m_nand.planes)
+                    .arg(m_nand.page_size)
+                    .arg(m_nand.pages_per_block)
+                    .arg(m_nand.blocks)
+                    .arg(reserve));
+        qDebug("%s: chip id %s", __func__, m_nand.chip_id.toHex().constData());
+}
 
-        if (!m_usb->aw_fel2_write(0x40a00000, buf.data(), buf.size(), usb_FEL::AW_FEL_2_DRAM))
-                return false;
 
-        showURB(60);
-        if (!m_usb->aw_fel2_send_file(ADDR_MAGIC_DE, usb_FEL::AW_FEL_2_DRAM, resource(QLatin1String("magic_de_start.fex"))))
-                return false;
+/**
+ * @brief check that the partition images can be sent over the link
+ * On a link slower than high speed, images larger than SLOW_LINK_LIMIT
+ * are refused unless a slow link is allowed. All images are checked
+ * before the first one is sent, so a refusal leaves the NAND untouched.
+ * @param names names of the partition images
+ * @return true if the images may be sent
+ */
+bool flasher::check_link(const QStringList& names)
+{
+        if (!m_usb->degraded())
+                return true;
+        foreach(const QString& name, names) {
+                QScopedPointer<QIODevice> fin(payloads::open(resource(name)));
+                if (!fin || fin->size() <= SLOW_LINK_LIMIT)
+                        continue;
+                if (!m_allow_slow_link) {
+                        emit Error(tr("Refusing to send %1 at %2; use a high speed port or allow a slow link.")
+                                   .arg(name).arg(usb_FEL::speed_name(m_usb->speed())));
+                        return false;
+                }
+                emit Status(tr("Sending %1 at %2 will take a long time.")
+                            .arg(name).arg(usb_FEL::speed_name(m_usb->speed())));
+        }
+        return true;
+}
 
-        showURB(69);
-        if (!m_usb->aw_fel2_send_file(ADDR_FED_NAND, usb_FEL::AW_FEL_2_DRAM, resource(QLatin1String("FED_NAND_0000000"))))
-                return false;
 
-        showURB(123);
-        if (!m_usb->aw_fel2_send_file(ADDR_MAGIC_DE, usb_FEL::AW_FEL_2_DRAM, resource(QLatin1String("magic_de_end.fex"))))
-                return false;
+/**
+ * @brief start sending a partition image to NAND
+ * The image is framed by magic_cr_start.fex and magic_cr_end.fex and
+ * written in records by partition_record(), each one started from the
+ * completion of the one before; partition_done() continues the script
+ * of send_partitions_and_MBR().
+ * @param filename name of the partition image
+ * @param sector first sector of the partition
+ * @param sectors minimum number of sectors
+ * @return true if the send was started
+ */
+bool flasher::send_partition(const QString& filename, quint32 sector, quint32 sectors)
+{
+        qDebug("%s: ***************************", __func__);
 
-        showURB(132);
-        if (!m_usb->aw_fel2_exec(ADDR_FED_NAND, 0x31))
+        partition_t& p = m_part;
+        const uint nand_sec_size = NAND_SECTOR_SIZE;
+        const uint usb_rec_secs = NAND_RECORD_MAX / nand_sec_size;
+
+        end_partition();
+        p.fin = payloads::open(filename);
+        if (!p.fin->isOpen()) {
+                emit Error(tr("Failed to open file to send: %1").arg(filename));
+                end_partition();
                 return false;
+        }
 
-        showURB(135);
-        if (!m_usb->aw_fel2_send_4uints(0x40a00000, 0x40a01000, 0, 0))
+        // Multi-plane pages are powers of two, so a record holds whole
+        // pages unless a page is larger than a record. A partition that
+        // does not start on a page boundary gets a short first record,
+        // which puts all following records on page boundaries.
+        const nand_geometry_t& geo = nand_geometry();
+        const uint page_secs = qMax(1u, geo.page_size * geo.planes / nand_sec_size);
+        const qint64 file_size = p.fin->size();        // allow for file > 2GB, all untested !!!
+        const uint file_sectors = (file_size + nand_sec_size - 1) / nand_sec_size;
+
+        p.filename = filename;
+        p.sector = sector;
+        p.sector_key = sector;
+        if (sectors < file_sectors)
+                sectors = file_sectors;
+        p.sector_limit = sector + sectors;
+        p.read_secs = 0;
+        p.percent = 0;
+        if (page_secs > usb_rec_secs)
+                emit Status(tr("NAND pages of %1 bytes are larger than the %2 byte records; FED_NAND has to merge them.")
+                            .arg(page_secs * nand_sec_size).arg(NAND_RECORD_MAX));
+        p.first_secs = usb_rec_secs;
+        if (page_secs <= usb_rec_secs && sector % page_secs) {
+                p.first_secs = page_secs - sector % page_secs;
+                emit Status(tr("%1 starts at sector %2, which is not on a NAND page boundary; the first record is %3 sectors.")
+                            .arg(filename).arg(sector).arg(p.first_secs));
+        }
+
+        // the first chunks were read ahead while waiting for the device
+        p.head = m_prefetched.heads.value(filename);
+        p.head_pos = 0;
+        if (!p.fin->seek(p.head.size())) {
+                emit Error(tr("Failed to seek in file to send: %1").arg(filename));
+                end_partition();
                 return false;
+        }
+        p.data = m_usb->buffer_get(NAND_RECORD_MAX);
 
-        showURB(140);
-        if (!m_usb->aw_fel2_0203_until_ok())
+        if (!send_payload2(ADDR_MAGIC_DE, QLatin1String("magic_cr_start.fex"), &flasher::partition_record)) {
+                end_partition();
                 return false;
+        }
+        return true;
+}
 
-        showURB(150);
-        if (!m_usb->aw_fel2_0204(0x0400))
+/**
+ * @brief account the record written and start writing the next one
+ * @return true while records are written
+ */
+bool flasher::partition_record()
+{
+        partition_t& p = m_part;
+        const uint nand_sec_size = NAND_SECTOR_SIZE;
+        const uint sectors = p.sector_limit - p.sector;
+
+        if (!m_usb->lastResult()) {
+                if (p.read_secs)
+                        emit Error(trUtf8("Error writing sector(s) %1…%2 of %3 (file offset %4)")
+                                   .arg(p.sector_key)
+                                   .arg(p.sector_key + p.read_secs - 1)
+                                   .arg(p.sector_limit)
+                                   .arg(static_cast<qint64>(p.sector_key - p.sector) * nand_sec_size));
+                end_partition();
                 return false;
+        }
+
+        if (p.read_secs) {
+                p.sector_key += p.read_secs;
+                m_progress.advance(p.read_secs * nand_sec_size);
+                if (100 * static_cast<qint64>(p.sector_key - p.sector) / sectors != p.percent) {
+                        p.percent = 100 * static_cast<qint64>(p.sector_key - p.sector) / sectors;
+                        emit Progress(p.percent);
+                }
+        } else {
+                // magic_cr_start.fex is sent
+                QLocale l = QLocale::system();
+                emit Status(tr("Sending %1 (%2 bytes)...")
+                            .arg(p.filename)
+                            .arg(l.toString(p.fin->size())));
+                m_progress.begin(static_cast<qint64>(sectors) * nand_sec_size);
+                emit Progress(0);
+        }
 
-        showURB(153);
+        if (p.sector_key >= p.sector_limit) {
+                end_partition();
+                return send_payload2(ADDR_MAGIC_DE, QLatin1String("magic_cr_end.fex"), &flasher::partition_done);
+        }
 
-        // what info is here ?
-        buf.fill('\0', 0x0400);
-        if (!m_usb->aw_pad_read(buf.data(), buf.size()))
+        // the end clamp keeps the last record inside the partition
+        const uint usb_rec_secs = NAND_RECORD_MAX / nand_sec_size;
+        uint read_secs = qMin(p.sector_key == p.sector ? p.first_secs : usb_rec_secs,
+                              p.sector_limit - p.sector_key);
+        uint read_size = read_secs * nand_sec_size;
+        uint bytes_read = 0;
+        if (p.head_pos < p.head.size()) {
+                bytes_read = qMin(read_size, static_cast<uint>(p.head.size() - p.head_pos));
+                memcpy(p.data, p.head.constData() + p.head_pos, bytes_read);
+                p.head_pos += bytes_read;
+        }
+        if (bytes_read < read_size) {
+                qint64 got = p.fin->read(reinterpret_cast<char *>(p.data) + bytes_read, read_size - bytes_read);
+                if (got > 0)
+                        bytes_read += static_cast<uint>(got);
+        }
+        if (bytes_read < read_size)
+                memset(p.data + bytes_read, 0, read_size - bytes_read);
+
+        aw_op_t op = aw_op_t();
+        op.type = usb_FEL::AW_OP_FES_WRITE;
+        op.addr = p.sector_key;
+        op.length = read_size;
+        op.specs = usb_FEL::AW_FEL_2_NAND | usb_FEL::AW_FEL_2_WR;
+        if (p.sector_key == p.sector)
+                op.specs |= usb_FEL::AW_FEL_2_FIRST;
+        if (p.sector_key + read_secs == p.sector_limit)
+                op.specs |= usb_FEL::AW_FEL_2_LAST;
+        op.wdata = p.data;
+        op.retry = true;
+        p.read_secs = read_secs;
+        if (!wait_usb(m_usb->start(op), &flasher::partition_record)) {
+                end_partition();
                 return false;
+        }
+        return true;
+}
 
-        qDebug("%s: unknown buffer:\n %s", __func__,
-               qPrintable(m_usb->hexdump(buf.constData(), 0, buf.size())));
+/**
+ * @brief close the partition image and return its transfer buffer
+ * Safe to call when no partition is being sent.
+ */
+void flasher::end_partition()
+{
+        delete m_part.fin;
+        m_part.fin = 0;
+        m_part.head = QByteArray();
+        m_usb->buffer_put(m_part.data);
+        m_part.data = 0;
+}
 
-        return true;
+/**
+ * @brief continue the script after magic_cr_end.fex was sent
+ */
+bool flasher::partition_done()
+{
+        if (!m_usb->lastResult())
+                return false;
+        emit Status(tr("Sending %1 done.").arg(m_part.filename));
+        return part_next();
 }
 
 
-bool flasher::send_partition(const QString& filename, quint32 sector, quint32 sectors)
+/**
+ * @brief write the partition images and the MBR
+ * Runs the actions of part_script one after the other.
+ * @return true on success
+ */
+bool flasher::send_partitions_and_MBR()
 {
-        qDebug("%s: ***************************", __func__);
+        qDebug("%s: ******** START ********", __func__);
 
-        QByteArray buf;
-        QFile fin(filename);
-        qint64 file_size;			// allow for file > 2GB, all untested !!!
-        uint file_sectors;
-        const uint nand_sec_size = 512;
-        uint usb_rec_size;
-        uint usb_rec_secs;
-        uint sector_key;
-        uint sector_limit;
-        uint usb_flags;
-
-        usb_rec_size = 65536;
-        usb_rec_secs = usb_rec_size / nand_sec_size;
-        usb_rec_size = usb_rec_secs * nand_sec_size;
-
-        if (fin.open(QIODevice::ReadOnly)) {
-                emit Error(tr("Failed to open file to send: %1").arg(filename));
+        if (!WRITE_PARTITIONS)
+                return true;    // for now
+
+        QStringList names;
+        for (const char* const* name = stage_2_partitions; *name; name++)
+                names += QLatin1String(*name);
+        if (!check_link(names))
                 return false;
+
+        m_part.action = -1;
+        return part_next();
+}
+
+/**
+ * @brief start the next action of send_partitions_and_MBR()
+ * @return true while actions run, or if all of them succeeded
+ */
+bool flasher::part_next()
+{
+        const int count = static_cast<int>(sizeof(part_script) / sizeof(part_script[0]));
+        if (++m_part.action >= count)
+                return true;
+
+        const part_action_t& act = part_script[m_part.action];
+        aw_op_t op = aw_op_t();
+        op.addr = AW_FES_CRC_ADDR;
+        op.specs = usb_FEL::AW_FEL_2_DRAM;
+        switch (act.action) {
+        case PART_RESET_CRC:
+                m_part.crc.fill('\0', 12);
+                op.type = usb_FEL::AW_OP_FES_WRITE;
+                op.length = m_part.crc.size();
+                op.wdata = m_part.crc.constData();
+                break;
+        case PART_IMAGE:
+                return send_partition(resource(QLatin1String(stage_2_partitions[act.image])), act.sector);
+        case PART_READ_CRC:
+                m_part.crc.fill('\0', 12);
+                op.type = usb_FEL::AW_OP_FES_READ;
+                op.length = m_part.crc.size();
+                op.rdata = m_part.crc.data();
+                break;
+        case PART_COMMIT:
+                // 2 partitions ?
+                op.type = usb_FEL::AW_OP_FES_0205;
+                op.param1 = act.sector;
+                break;
         }
+        return wait_usb(m_usb->start(op), &flasher::part_action_done);
+}
 
-        if (!m_usb->aw_fel2_send_file(ADDR_MAGIC_DE, usb_FEL::AW_FEL_2_DRAM, resource(QLatin1String("magic_cr_start.fex"))))
+/**
+ * @brief continue the script after an action on the device
+ */
+bool flasher::part_action_done()
+{
+        if (!m_usb->lastResult())
                 return false;
+        if (part_script[m_part.action].action == PART_READ_CRC)
+                qDebug("%s: CRC for %s:\n%s", __func__,
+                       stage_2_partitions[part_script[m_part.action].image],
+                       qPrintable(m_usb->hexdump(m_part.crc.constData(), 0, m_part.crc.size())));
+        return part_next();
+}
 
-        file_size = fin.size();
-        emit Status(tr("Sending %1 (%2 bytes)...").arg(filename));
 
-        file_sectors = (file_size + nand_sec_size - 1) / nand_sec_size;
+/**
+ * @brief start reading the boot area of the NAND
+ * Like a partition image, the reads are framed by magic_cr_start.fex and
+ * magic_cr_end.fex. The raw sectors of boot0 end up at the start of
+ * m_boot_area, the sector with the u-boot header after them.
+ * @param then member function to continue with once magic_cr_end.fex is sent
+ * @return true if the read was started
+ */
+bool flasher::read_boot_area(step_fn then)
+{
+        m_boot_area.fill('\0', boot0_bytes() + NAND_SECTOR_SIZE);
+        m_boot_read = 0;
+        m_boot_then = then;
+        return send_payload2(ADDR_MAGIC_DE, QLatin1String("magic_cr_start.fex"), &flasher::boot_area_record);
+}
 
-        sector_key = sector;
-        if (sectors < file_sectors)
-                sectors = file_sectors;
-        sector_limit = sector_key + sectors;
-
-        while (sector_key < sector_limit) {
-                uint read_secs = qMin(usb_rec_secs, sector_limit - sector_key);
-                uint read_size = read_secs * nand_sec_size;
-                QByteArray data = fin.read(read_size);
-                uint bytes_read = data.size();
-                if (bytes_read < read_size) {
-                        QByteArray pad;
-                        pad.fill('\0', read_size - bytes_read);
-                        data.append(pad);
-                }
+/**
+ * @brief start the next read of the boot area
+ * @return true while reads run
+ */
+bool flasher::boot_area_record()
+{
+        if (!m_usb->lastResult()) {
+                emit Error(tr("Failed to read the boot area of the NAND."));
+                return false;
+        }
 
-                usb_flags = usb_FEL::AW_FEL_2_NAND | usb_FEL::AW_FEL_2_WR;
-                if (sector_key == sector)
-                        usb_flags |= usb_FEL::AW_FEL_2_FIRST;
-                if (sector_key + read_secs == sector_limit)
-                        usb_flags |= usb_FEL::AW_FEL_2_LAST;
-                if (!m_usb->aw_fel2_write(sector_key, buf.constData(), buf.size(), usb_flags)) {
-                        emit Error(trUtf8("Error writing sector(s) %1…%2 of %3")
-                                   .arg(sector_key)
-                                   .arg(sector_key + read_secs - 1)
-                                   .arg(sector_limit));
-                        break;
-                }
-                sector_key += read_secs;
+        const quint32 boot0_size = m_boot_area.size() - NAND_SECTOR_SIZE;
+        aw_op_t op = aw_op_t();
+        op.type = usb_FEL::AW_OP_FES_READ;
+        op.specs = usb_FEL::AW_FEL_2_NAND;
+        switch (m_boot_read++) {
+        case 0:
+                op.addr = NAND_BOOT0_SECTOR;
+                op.length = boot0_size;
+                op.rdata = m_boot_area.data();
+                op.specs |= usb_FEL::AW_FEL_2_FIRST;
+                break;
+        case 1:
+                op.addr = NAND_UBOOT_SECTOR;
+                op.length = NAND_SECTOR_SIZE;
+                op.rdata = m_boot_area.data() + boot0_size;
+                op.specs |= usb_FEL::AW_FEL_2_LAST;
+                break;
+        default:
+                return send_payload2(ADDR_MAGIC_DE, QLatin1String("magic_cr_end.fex"), m_boot_then);
         }
-        fin.close();
+        return wait_usb(m_usb->start(op), &flasher::boot_area_record);
+}
 
-        if (!m_usb->aw_fel2_send_file(ADDR_MAGIC_DE, usb_FEL::AW_FEL_2_DRAM, resource(QLatin1String("magic_cr_end.fex"))))
-                return false;
+/**
+ * @brief find out which boot loaders need to be installed
+ * u-boot is up to date if the header in NAND has the checksum and length
+ * of the header of UBOOT_0000000000. BOOT0_0000000000 is encrypted, so
+ * boot0 is up to date if the digest of its raw sectors is one that was
+ * read back after this payload was installed (see record_boot0()).
+ * @return true on success
+ */
+bool flasher::check_boot()
+{
+        qDebug("%s: ******** START ********", __func__);
 
-        emit Status(tr("Sending %1 done.").arg(filename));
+        m_uboot_current = false;
+        m_boot0_current = false;
+        m_boot0_installed = false;
+        if (m_force_boot) {
+                emit Status(tr("Forced installation of boot0 and u-boot."));
+                return true;
+        }
+        if (m_replaying)
+                return true;    // the capture has no read of the boot area
+        return read_boot_area(&flasher::check_boot_done);
+}
+
+/**
+ * @brief compare the boot area read with the payloads
+ * @return true on success
+ */
+bool flasher::check_boot_done()
+{
+        if (!m_usb->lastResult())
+                return false;
+
+        const quint32 boot0_size = m_boot_area.size() - NAND_SECTOR_SIZE;
+        egon_header_t want;
+        egon_header_t have;
+        if (parse_egon(payloads::get(QLatin1String("UBOOT_0000000000")), &want) &&
+            parse_egon(m_boot_area.mid(boot0_size), &have)) {
+                qDebug("%s: u-boot installed %.8s sum=%08x len=%u, payload %.8s sum=%08x len=%u", __func__,
+                       have.magic, have.check_sum, have.length,
+                       want.magic, want.check_sum, want.length);
+                m_uboot_current = !memcmp(have.magic, want.magic, sizeof(want.magic)) &&
+                        have.check_sum == want.check_sum &&
+                        have.length == want.length;
+        }
+
+        QSettings s;
+        const QByteArray digest = QCryptographicHash::hash(m_boot_area.left(boot0_size), QCryptographicHash::Sha256);
+        m_boot0_current = s.value(boot0_key()).toStringList().contains(QString::fromLatin1(digest.toHex()));
+        m_boot_area = QByteArray();
+
+        if (m_uboot_current)
+                emit Status(tr("u-boot is up to date."));
+        if (m_boot0_current)
+                emit Status(tr("boot0 is up to date."));
         return true;
 }
 
 
-bool flasher::send_partitions_and_MBR()
+bool flasher::install_uboot()
 {
-        qDebug("%s: ******** START ********", __func__);
+        if (m_uboot_current) {
+                emit Status(tr("u-boot is up to date, skipping installation."));
+                return true;
+        }
+        return run_plan("install_uboot");
+}
 
-        return true;    // for now
 
-        static const QLatin1String part1("RFSFAT16_BOOTLOADER_FEX00");
-        static const QLatin1String part2("RFSFAT16_ROOTFS_FEX000000");
-        static const QLatin1String mbr("1234567890___MBR");
-        QByteArray buf;
+bool flasher::install_boot0()
+{
+        if (m_boot0_current) {
+                emit Status(tr("boot0 is up to date, skipping installation."));
+                return true;
+        }
+        return run_plan("install_boot0", &flasher::install_boot0_done);
+}
 
-        buf.fill('\0', 12);
-        // reset CRC
-        if (!m_usb->aw_fel2_write(0x40023c00, buf.constData(), buf.size(), usb_FEL::AW_FEL_2_DRAM))
-                return false;
-        if (!send_partition(resource(part1), 0x008000))
-                return false;
-        // read CRC
-        if (!m_usb->aw_fel2_read(0x40023c00, buf.data(), buf.size(), usb_FEL::AW_FEL_2_DRAM))
-                return false;
-        qDebug("%s: CRC for %s:\n%s", __func__,
-               qPrintable(part1), qPrintable(m_usb->hexdump(buf.constData(), 0, buf.size())));
+bool flasher::install_boot0_done()
+{
+        m_boot0_installed = true;
+        return true;
+}
 
-        buf.fill('\0', 12);
-        // reset CRC
-        if (!m_usb->aw_fel2_write(0x40023c00, buf.constData(), buf.size(), usb_FEL::AW_FEL_2_DRAM))
-                return false;
-        if (!send_partition(resource(part2), 0x028000))
-                return false;
-#if     0
-        aw_fel2_read (0x40023c00, buf, 0x0c, usb_fel::AW_FEL_2_DRAM);	// read CRC
+/**
+ * @brief read back the boot0 sectors just written and remember their digest
+ * UPDATE_BOOT0 overwrote FED_NAND, so it is installed again for the read.
+ * This is only done in sessions that installed boot0.
+ * @return true on success
+ */
+bool flasher::record_boot0()
+{
+        if (!m_boot0_installed || m_replaying)
+                return true;
+        return run_plan("install_fed_nand", &flasher::record_boot0_read);
+}
 
-        buf.fill('\0', 12);
-        aw_fel2_write(0x40023c00, buf, 0x0c, usb_fel::AW_FEL_2_DRAM);	// reset CRC
-#endif
-        if (!send_partition(resource(mbr), 0x000000))
-                return false;
-        // read CRC
-        if (!m_usb->aw_fel2_read(0x40023c00, buf.data(), buf.size(), usb_FEL::AW_FEL_2_DRAM))
-                return false;
+bool flasher::record_boot0_read()
+{
+        return read_boot_area(&flasher::record_boot0_done);
+}
 
-        // 2 partitions ?
-        if (!m_usb->aw_fel2_0205(0x02))
+bool flasher::record_boot0_done()
+{
+        if (!m_usb->lastResult())
                 return false;
 
+        QSettings s;
+        const QString key = boot0_key();
+        const QByteArray digest = QCryptographicHash::hash(m_boot_area.left(m_boot_area.size() - NAND_SECTOR_SIZE),
+                                                           QCryptographicHash::Sha256);
+        QStringList digests = s.value(key).toStringList();
+        if (!digests.contains(QString::fromLatin1(digest.toHex()))) {
+                digests += QString::fromLatin1(digest.toHex());
+                s.setValue(key, digests);
+        }
+        m_boot_area = QByteArray();
+        m_boot0_installed = false;
         return true;
 }
 
 
-bool flasher::install_uboot()
+bool flasher::restore_system()
 {
-        qDebug("%s: ******** START ********", __func__);
-        static const QByteArray reply("updateBootxOk000");
-        QByteArray buf;
+        // still in flash mode even though the restore is done
+        return run_plan("restore_system");
+}
 
-        showURB(113241);
-        if (!m_usb->aw_fel2_send_file(ADDR_DRAM_BUFF, usb_FEL::AW_FEL_2_DRAM, resource(QLatin1String("UBOOT_0000000000"))))
-                return false;
+/**
+ * @brief load and hash the stage 2 inputs
+ * Runs on the global thread pool from the start of stage 1 until the
+ * board has re-enumerated. The payloads and capture logs end up in the
+ * payloads cache and the first chunks of the partition images in the
+ * result, so stage 2 does no file I/O until it streams the rest of the
+ * partitions. Every partition image is tree hashed on all cores, and
+ * images and payloads are checked against the manifest, so a damaged
+ * image is found before it is streamed to NAND.
+ * This is static and works on its arguments only, because the flasher
+ * may be gone before it finishes.
+ * @param partitions payload names of the partition images
+ * @param manifest expected digests
+ * @return prefetch_t with digests, partition heads, tree hashes and errors
+ */
+flasher::prefetch_t flasher::prefetch(const QStringList& partitions, const flashmanifest& manifest)
+{
+        QElapsedTimer timer;
+        prefetch_t result;
+        result.bytes = 0;
+        timer.start();
+
+        for (const char* const* name = stage_2_payloads; *name; name++) {
+                QString error;
+                QByteArray data = payloads::get(QLatin1String(*name), &error);
+                if (!error.isEmpty()) {
+                        result.errors += error;
+                        continue;
+                }
+                result.digests.insert(QLatin1String(*name), QCryptographicHash::hash(data, QCryptographicHash::Sha256));
+                result.bytes += data.size();
+                error = manifest.check(QLatin1String(*name), result.digests.value(QLatin1String(*name)));
+                if (!error.isEmpty())
+                        result.errors += error;
+        }
 
-        showURB(113303);
-        // pt2_113307 == pt2_000054
-        if (!read_log(buf, 0x2760, resource(QLatin1String("pt2_113307"))))
-                return false;
-        if (!m_usb->aw_fel2_write(0x40400000, buf.constData(), buf.size(), usb_FEL::AW_FEL_2_DRAM))
-                return false;
+        for (const char* const* name = stage_2_logs; *name; name++) {
+                QString error;
+                QByteArray data = payloads::hexlog(QLatin1String(*name), &error);
+                if (!error.isEmpty()) {
+                        result.errors += error;
+                        continue;
+                }
+                result.digests.insert(QLatin1String(*name), QCryptographicHash::hash(data, QCryptographicHash::Sha256));
+                result.bytes += data.size();
+                error = manifest.check(QLatin1String(*name), result.digests.value(QLatin1String(*name)));
+                if (!error.isEmpty())
+                        result.errors += error;
+        }
 
-        showURB(113547);
-        if (!read_log(buf, 0x00ac, resource(QLatin1String("pt2_113316"))))
-                return false;
-        if (!m_usb->aw_fel2_write(0x40410000, buf.constData(), buf.size(), usb_FEL::AW_FEL_2_DRAM))
-                return false;
+        const QStringList listed = manifest.images();
+        foreach(const QString& name, partitions) {
+                const QString filename = payloads::path(name);
+                QByteArray head;
+                if (filename.startsWith(QLatin1String("bundle:"))) {
+                        // checked by the tree hash below, not by a pass of its own
+                        head = payloads::mapped(name).left(PREFETCH_HEAD);
+                } else if (!QFile::exists(filename)) {
+                        if (listed.contains(name))
+                                result.errors += tr("Image %1 is in the manifest, but %2 is missing.").arg(name).arg(filename);
+                        continue;
+                } else {
+                        QScopedPointer<QIODevice> file(payloads::open(filename));
+                        if (!file->isOpen()) {
+                                result.errors += tr("Failed to open file to send: %1").arg(filename);
+                                continue;
+                        }
+                        head = file->read(PREFETCH_HEAD);
+                }
+                result.bytes += head.size();
+                result.heads.insert(filename, head);
+        }
 
-        showURB(113322);
-        if (!m_usb->aw_fel2_send_file(ADDR_MAGIC_DE, usb_FEL::AW_FEL_2_DRAM, resource(QLatin1String("magic_de_start.fex"))))
-                return false;
+        // hash the images after reading their heads, which stage 2 needs first
+        foreach(const QString& name, partitions) {
+                const QString filename = payloads::path(name);
+                if (!result.heads.contains(filename))
+                        continue;
+                QString error;
+                const flashtree_t tree = flashmanifest::hash(filename, &error);
+                if (tree.root.isEmpty()) {
+                        result.errors += error;
+                        continue;
+                }
+                result.trees.insert(name, tree);
+                result.bytes += tree.size;
+                error = manifest.check(name, tree);
+                if (!error.isEmpty())
+                        result.errors += error;
+        }
 
-        showURB(113331);
-        if (!m_usb->aw_fel2_send_file(ADDR_FED_NAND, usb_FEL::AW_FEL_2_DRAM, resource(QLatin1String("UPDATE_BOOT1_000"))))
-                return false;
+        result.usecs = timer.nsecsElapsed() / 1000;
+        return result;
+}
 
-        showURB(113384);
-        if (!m_usb->aw_fel2_send_file(ADDR_MAGIC_DE, usb_FEL::AW_FEL_2_DRAM, resource(QLatin1String("magic_de_end.fex"))))
-                return false;
+/**
+ * @brief start preparing the stage 2 inputs on the thread pool
+ */
+void flasher::start_prefetch()
+{
+        if (m_prefetching)
+                return;
+
+        QStringList partitions;
+        for (const char* const* name = stage_2_partitions; *name; name++)
+                partitions += QLatin1String(*name);
+        m_prefetch = QtConcurrent::run(&flasher::prefetch, partitions, m_manifest);
+        m_prefetching = true;
+        m_prefetch_ts = m_trace.now();
+}
 
-        showURB(113394);
-        if (!m_usb->aw_fel2_exec(ADDR_FED_NAND, 0x11))
-                return false;
+/**
+ * @brief check whether the stage 2 inputs are ready
+ * Never waits: while the thread pool is still busy, PREFETCH_PENDING is
+ * returned and the caller runs again later, so the event loop keeps
+ * running and a cancel() is noticed meanwhile.
+ * @return PREFETCH_PENDING, PREFETCH_READY or PREFETCH_FAILED
+ */
+int flasher::prefetch_ready()
+{
+        if (!m_prefetching)
+                return m_prefetched.errors.isEmpty() ? PREFETCH_READY : PREFETCH_FAILED;
+        if (!m_prefetch.isFinished())
+                return PREFETCH_PENDING;
+
+        m_prefetching = false;
+        m_prefetched = m_prefetch.result();
+        if (m_trace.isEnabled()) {
+                // the thread pool has no trace of its own; show the work on a track of its own
+                QJsonObject args;
+                args.insert(QLatin1String("bytes"), static_cast<double>(m_prefetched.bytes));
+                args.insert(QLatin1String("inputs"), m_prefetched.digests.size() + m_prefetched.heads.size());
+                args.insert(QLatin1String("images"), m_prefetched.trees.size());
+                m_trace.complete("host", QLatin1String("prefetch"), m_prefetch_ts, m_prefetched.usecs, args, "prefetch");
+        }
+        foreach(const QString& error, m_prefetched.errors)
+                emit Error(error);
+        if (!m_prefetched.errors.isEmpty())
+                return PREFETCH_FAILED;
 
-        showURB(113397);
-        if (!m_usb->aw_fel2_send_4uints(ADDR_DRAM_BUFF, 0x40400000, 0x40410000, 0))
-                return false;
+        QLocale l = QLocale::system();
+        emit Status(tr("Prepared %1 stage 2 inputs (%2 bytes) in %3 ms.")
+                    .arg(m_prefetched.digests.size() + m_prefetched.heads.size())
+                    .arg(l.toString(m_prefetched.bytes))
+                    .arg(m_prefetched.usecs / 1000.0, 0, 'f', 1));
+        return PREFETCH_READY;
+}
 
-        showURB(113402);
-        if (!m_usb->aw_fel2_0203_until_ok())
-                return false;
+/**
+ * @brief wait for the board to re-enumerate after stage 1
+ * The step re-schedules itself until the device shows up again or
+ * the timeout expired, so the event loop keeps running meanwhile.
+ * @return true (a missing device is detected by the following open_usb)
+ */
+bool flasher::wait_device()
+{
+        const qint64 msec = 20000;
+        qint64 now = QDateTime::currentMSecsSinceEpoch();
+
+        if (!m_rerun) {
+                m_wait_start = now;
+                emit Status(tr("Waiting up to %1 seconds").arg(.001 * msec, 0, 'g', 2));
+        }
+
+        qint64 elapsed = now - m_wait_start;
+        m_progress.setPercentage(100.0 * elapsed / msec);
+        emit Progress(100.0 * elapsed / msec);
+        // claim the device only when the stage 2 inputs are ready, too
+        if (elapsed < msec && (elapsed < 1000 || !m_prefetch.isFinished() || !m_usb->find_device())) {
+                again(50);
+                return true;
+        }
+        m_progress.setPercentage(100.0);
+        emit Progress(100.0);
+        return true;
+}
 
-        showURB(113502);
-        if (!m_usb->aw_fel2_0204(0x0400))
+/**
+ * @brief open the device and find out where to start
+ * A board that reports flash mode already runs FES from an earlier
+ * (failed) session, so the session continues with stage 2 right away
+ * and skips the resumable steps that session completed.
+ * Otherwise a new session starts and earlier progress is forgotten.
+ * @return true on success
+ */
+bool flasher::probe_device()
+{
+        // resolve the plan and its payloads before the device is involved
+        if (!m_plan->isLoaded() && !m_plan->load())
                 return false;
 
-        showURB(113505);
-        buf.fill('\0', 0x0400);
-        if (!m_usb->aw_pad_read(buf.data(), buf.size()))
+        if (!open_usb())
                 return false;
 
-        bool success = buf.mid(24, reply.size()) == reply;
-        qDebug("install_uboot result (%s)", success ? "SUCCESS" : "FAILURE");
-        if (!success) {
-                qDebug("%s", qPrintable(m_usb->hexdump(buf.constData(), 0, buf.size())));
+        aw_op_t op = aw_op_t();
+        op.type = usb_FEL::AW_OP_VERSION;
+        op.rdata = &m_probe_version;
+        return wait_usb(m_usb->start(op), &flasher::probe_device_done);
+}
+
+/**
+ * @brief continue the session depending on the version the board reported
+ */
+bool flasher::probe_device_done()
+{
+        if (!m_usb->lastResult())
+                return false;
+        if (m_usb->soc_id(m_probe_version) == SUNXI_SOC_ID_FLASHMODE) {
+                emit Status(tr("Board is in flash mode already, resuming at stage %1.").arg(2));
+                load_completed();
+                jump("stage_2_prep");
+                return true;
         }
+        m_completed.clear();
+        save_completed();
+        m_nand.valid = false;
+        return true;
+}
 
-        return success;
+/**
+ * @brief continue the session at a different step
+ * @param name name of the step to run next
+ */
+void flasher::jump(const char* name)
+{
+        for (int i = 0; i < step_count(); i++) {
+                if (qstrcmp(m_steps[i].name, name))
+                        continue;
+                m_jump = i;
+                return;
+        }
+        Q_ASSERT(false);
 }
 
+/**
+ * @brief return the settings key of the completed steps of the board
+ * The key is per port path, so boards flashed side by side do not share it.
+ */
+QString flasher::completed_key() const
+{
+        const QString port = m_usb->portPath();
+        return QString("completed/%1").arg(port.isEmpty() ? QString("any") : QString(port).replace(QChar('/'), QChar('_')));
+}
 
-bool flasher::install_boot0()
+/**
+ * @brief load the steps completed by an earlier run on the board
+ * The steps are kept in the settings, so a CLI run started after a failed
+ * one skips them, too. Replays neither load nor save them.
+ */
+void flasher::load_completed()
 {
-        qDebug("%s: ******** START ********", __func__);
-        static const QByteArray reply("updateBootxOk000");
-        QByteArray buf;
+        if (m_replaying)
+                return;
+        QSettings s;
+        m_completed = s.value(completed_key()).toStringList().toSet();
+}
 
-        showURB(113514);
-        if (!m_usb->aw_fel2_send_file(ADDR_MAGIC_DE, usb_FEL::AW_FEL_2_DRAM, resource(QLatin1String("magic_de_start.fex"))))
-                return false;
+/**
+ * @brief save the steps completed on the board, or forget them if there are none
+ */
+void flasher::save_completed()
+{
+        if (m_replaying)
+                return;
+        QSettings s;
+        if (m_completed.isEmpty())
+                s.remove(completed_key());
+        else
+                s.setValue(completed_key(), QStringList(m_completed.toList()));
+}
 
-        showURB(113523);
-        if (!m_usb->aw_fel2_send_file(ADDR_DRAM_BUFF, usb_FEL::AW_FEL_2_DRAM, resource(QLatin1String("BOOT0_0000000000"))))
-                return false;
+/**
+ * @brief table of the steps of a flash session
+ * The steps are run one at a time by resume(). Between two steps control
+ * returns to the event loop, and timing or cancelling a session happens at
+ * step boundaries. A step starts its transfers with usb_FEL::start() and
+ * returns; the single libusb event thread completes them, and the step
+ * continues from usb_completed(). Boards flashed side by side therefore
+ * share the thread of their owner and the one event thread.
+ */
+const flasher::step_t flasher::m_steps[] = {
+        {1, "probe_device",             &flasher::probe_device,            false,    100},
+        {1, "stage_1_prep",             &flasher::stage_1_prep,            false,     50},
+        {1, "install_fes_1_1",          &flasher::install_fes_1_1,         false,    700},
+        {1, "install_fes_1_2",          &flasher::install_fes_1_2,         false,    300},
+        {1, "send_crc_table",           &flasher::send_crc_table,          false,    100},
+        {1, "install_fes_2",            &flasher::install_fes_2,           false,    500},
+        {1, "close_usb",                &flasher::close_usb,               false,     50},
+        {2, "wait_device",              &flasher::wait_device,             false,   5000},
+        {2, "open_usb",                 &flasher::open_usb,                false,    100},
+        {2, "stage_2_prep",             &flasher::stage_2_prep,            false,    100},
+        {2, "install_fed_nand",         &flasher::install_fed_nand,        false,   3000},      // later payloads overwrite it
+        {2, "send_partitions_and_MBR",  &flasher::send_partitions_and_MBR, true,       0},      // from the image sizes
+        {2, "check_boot",               &flasher::check_boot,              false,    200},
+        {2, "install_uboot",            &flasher::install_uboot,           true,   10000},
+        {2, "install_boot0",            &flasher::install_boot0,           true,   10000},
+        {2, "record_boot0",             &flasher::record_boot0,            false,   3000},      // only after boot0 was installed
+        {2, "restore_system",           &flasher::restore_system,          false,   2000},
+        {2, "close_usb",                &flasher::close_usb,               false,     50}
+};
 
-        showURB(113532);
-        if (!m_usb->aw_fel2_send_file(ADDR_MAGIC_DE, usb_FEL::AW_FEL_2_DRAM, resource(QLatin1String("magic_de_end.fex"))))
+/**
+ * @brief write a manifest of the stage 2 inputs as they are now
+ * The manifest has the tree hashes of the partition images and the
+ * digests of the payloads and capture logs; a later session given this
+ * manifest refuses to start stage 2 with inputs that differ from it.
+ * @param filename name of the manifest
+ * @param error optional pointer to a QString receiving an error message
+ * @return true on success
+ */
+bool flasher::write_manifest(const QString& filename, QString* error)
+{
+        QStringList partitions;
+        for (const char* const* name = stage_2_partitions; *name; name++)
+                partitions += QLatin1String(*name);
+        const prefetch_t result = prefetch(partitions, flashmanifest());
+        if (!result.errors.isEmpty()) {
+                if (error)
+                        *error = result.errors.join(QLatin1String("\n"));
                 return false;
+        }
 
-        showURB(113541);
-        // pt2_113541 == pt2_000054
-        if (!read_log(buf, 0x2760, resource(QLatin1String("pt2_113541"))))
-                return false;
-        if (!m_usb->aw_fel2_write(0x40400000, buf.constData(), buf.size(), usb_FEL::AW_FEL_2_DRAM))
+        flashmanifest manifest;
+        for (QHash<QString, QByteArray>::const_iterator it = result.digests.constBegin(); it != result.digests.constEnd(); ++it)
+                manifest.insertPayload(it.key(), it.value());
+        for (QHash<QString, flashtree_t>::const_iterator it = result.trees.constBegin(); it != result.trees.constEnd(); ++it)
+                manifest.insertImage(it.key(), it.value());
+        if (!manifest.save(filename)) {
+                if (error)
+                        *error = tr("Failed to write manifest: %1").arg(filename);
                 return false;
+        }
+        return true;
+}
 
-        showURB(113547);
-        buf.clear();
-        if (!read_log(buf, 0x00ac, resource(QLatin1String("pt2_113550"))))
-                return false;
-        if (!m_usb->aw_fel2_write(0x40410000, buf.constData(), buf.size(), usb_FEL::AW_FEL_2_DRAM))
-                return false;
+/**
+ * @brief return the address every payload is loaded to
+ * The addresses come from the send operations of the plans; the magic
+ * framing of the partition images is sent by send_partition(). They are
+ * stored in bundles, where they can be changed along with the firmware.
+ * @return QHash with the address per payload name
+ */
+QHash<QString, quint32> flasher::payload_addresses()
+{
+        QHash<QString, quint32> addresses;
+        addresses.insert(QLatin1String("magic_cr_start.fex"), ADDR_MAGIC_DE);
+        addresses.insert(QLatin1String("magic_cr_end.fex"), ADDR_MAGIC_DE);
 
-        showURB(113559);
-        if (!m_usb->aw_fel2_send_file(ADDR_MAGIC_DE, usb_FEL::AW_FEL_2_DRAM, resource(QLatin1String("magic_de_start.fex"))))
-                return false;
+        foreach(const QString& filename, flashplan::paths()) {
+                QFile file(filename);
+                if (!file.open(QIODevice::ReadOnly))
+                        continue;
+                const QJsonObject plan = QJsonDocument::fromJson(file.readAll()).object();
+                foreach(const QJsonValue& step, plan.value(QLatin1String("steps")).toArray()) {
+                        foreach(const QJsonValue& value, step.toObject().value(QLatin1String("ops")).toArray()) {
+                                const QJsonObject op = value.toObject();
+                                const QString name = op.value(QLatin1String("op")).toString();
+                                if (name != QLatin1String("send") && name != QLatin1String("fes_send"))
+                                        continue;
+                                bool ok = false;
+                                quint32 addr = op.value(QLatin1String("addr")).toString().toUInt(&ok, 0);
+                                if (ok)
+                                        addresses.insert(op.value(QLatin1String("payload")).toString(), addr);
+                        }
+                }
+        }
+        return addresses;
+}
 
-        showURB(113565);
-        if (!m_usb->aw_fel2_send_file(ADDR_FED_NAND, usb_FEL::AW_FEL_2_DRAM, resource(QLatin1String("UPDATE_BOOT0_000"))))
-                return false;
+int flasher::step_count()
+{
+        return static_cast<int>(sizeof(m_steps) / sizeof(m_steps[0]));
+}
 
-        showURB(113610);
-        if (!m_usb->aw_fel2_send_file(ADDR_MAGIC_DE, usb_FEL::AW_FEL_2_DRAM, resource(QLatin1String("magic_de_end.fex"))))
-                return false;
+QString flasher::step_name(int step)
+{
+        if (step < 0 || step >= step_count())
+                return QString();
+        return QLatin1String(m_steps[step].name);
+}
 
-        showURB(113619);
-        if (!m_usb->aw_fel2_exec(ADDR_FED_NAND, 0x11))
-                return false;
+bool flasher::busy() const
+{
+        return m_running.loadAcquire() != 0;
+}
 
-        showURB(113622);
-        if (!m_usb->aw_fel2_send_4uints(ADDR_DRAM_BUFF, 0x40400000, 0x40410000, 0))
-                return false;
+/**
+ * @brief return the QSettings key of the calibrated duration of a step
+ */
+static QString calibration_key(int step, const char* name)
+{
+        return QString("calibration/%1-%2").arg(step, 2, 10, QChar('0')).arg(QLatin1String(name));
+}
 
-        showURB(113628);
-        if (!m_usb->aw_fel2_0203_until_ok())
-                return false;
+static QString rate_key(int step, const char* name)
+{
+        return calibration_key(step, name) + QLatin1String("-rate");
+}
 
-        showURB(113655);
-        if (!m_usb->aw_fel2_0204(0x0400))
-                return false;
+static QString bytes_key(int step, const char* name)
+{
+        return calibration_key(step, name) + QLatin1String("-bytes");
+}
 
-        showURB(113658);
-        buf.fill('\0', 0x0400);
-        if (!m_usb->aw_pad_read(buf.data(), buf.size()))
-                return false;
+/**
+ * @brief return the bytes of the partition images send_partitions_and_MBR() writes
+ * @return number of bytes, 0 while partition writing is not enabled
+ */
+qint64 flasher::partition_bytes() const
+{
+        qint64 bytes = 0;
+        if (!WRITE_PARTITIONS)
+                return bytes;
+        for (const char* const* name = stage_2_partitions; *name; name++) {
+                QScopedPointer<QIODevice> fin(payloads::open(payloads::path(QLatin1String(*name))));
+                if (fin)
+                        bytes += fin->size();
+        }
+        return bytes;
+}
 
-        bool success = buf.mid(24, reply.size()) == reply;
-        qDebug("install_boot0 result (%s)",
-               success ? "SUCCESS" : "FAILURE");
-        if (!success) {
-                qDebug("%s", qPrintable(m_usb->hexdump(buf.constData(), 0, buf.size())));
+/**
+ * @brief return the expected duration of every step
+ * The durations are calibrated by previous runs; steps that never ran
+ * use the default of the step table. Writing the partitions takes as long
+ * as their images at the NAND write rate calibrated by previous runs.
+ * @return QVector with the expected usecs per step
+ */
+QVector<qint64> flasher::expected_usecs() const
+{
+        QSettings s;
+        QVector<qint64> expected(step_count());
+        for (int i = 0; i < step_count(); i++)
+                expected[i] = s.value(calibration_key(i, m_steps[i].name),
+                                      static_cast<qint64>(m_steps[i].msec) * 1000).toLongLong();
+        for (int i = 0; i < step_count(); i++) {
+                if (m_steps[i].fn != &flasher::send_partitions_and_MBR)
+                        continue;
+                const qint64 rate = s.value(rate_key(i, m_steps[i].name), NAND_WRITE_RATE).toLongLong();
+                const qint64 bytes = partition_bytes();
+                if (bytes > 0 && rate > 0)
+                        expected[i] = bytes * 1000000 / rate;
         }
-        return success;
+        return expected;
 }
 
+/**
+ * @brief return the expected bytes of every step
+ * Writing the partitions sends their images; the other steps send what
+ * they sent in the previous run.
+ * @return QVector with the expected bytes per step, 0 if unknown
+ */
+QVector<qint64> flasher::expected_bytes() const
+{
+        QSettings s;
+        QVector<qint64> expected(step_count());
+        for (int i = 0; i < step_count(); i++) {
+                if (m_steps[i].fn == &flasher::send_partitions_and_MBR)
+                        expected[i] = partition_bytes();
+                else
+                        expected[i] = s.value(bytes_key(i, m_steps[i].name), 0).toLongLong();
+        }
+        return expected;
+}
 
-bool flasher::restore_system()
+/**
+ * @brief update the expected durations with the steps that succeeded
+ * Called once at the end of a session. Each value moves a quarter of the
+ * way towards the measured time, so a single odd run does not spoil the
+ * estimate; byte totals are taken as they are.
+ */
+void flasher::calibrate()
 {
-        qDebug("%s: ******** START ********", __func__);
+        QSettings s;
+        for (int i = 0; i < m_step_usecs.size(); i++) {
+                const qint64 usecs = m_step_usecs.at(i);
+                if (usecs < 0)
+                        continue;
+                const QString key = calibration_key(i, m_steps[i].name);
+                const qint64 expected = s.value(key, static_cast<qint64>(m_steps[i].msec) * 1000).toLongLong();
+                s.setValue(key, expected + (usecs - expected) / 4);
 
-        QByteArray buf;
-        quint32 version;
+                const qint64 bytes = m_progress.stepBytes(i);
+                if (bytes < 0)
+                        continue;
+                s.setValue(bytes_key(i, m_steps[i].name), bytes);
+                if (m_steps[i].fn == &flasher::send_partitions_and_MBR && bytes > 0 && usecs > 0) {
+                        const qint64 rate = s.value(rate_key(i, m_steps[i].name), NAND_WRITE_RATE).toLongLong();
+                        s.setValue(rate_key(i, m_steps[i].name), rate + (bytes * 1000000 / usecs - rate) / 4);
+                }
+        }
+}
 
-        showURB(113664);
-        version = m_usb->aw_fel_get_version();
-        qDebug("%s: version=0x%04x", __func__, version);
+/**
+ * @brief request the current step to be run again after some time
+ * @param msec number of milliseconds to return to the event loop, or
+ * AGAIN_USB to run it again once the operation on the device completed
+ */
+void flasher::again(int msec)
+{
+        m_again = msec;
+}
 
-        showURB(113673);
-        if (!m_usb->aw_fel2_write(m_scratchpad + 4, "\xcd\xa5\x34\x12", 0x04, usb_FEL::AW_FEL_2_DRAM))
-                return false;
+/**
+ * @brief record the span of the current stage, if one is open
+ */
+void flasher::end_stage()
+{
+        if (m_stage_ts < 0)
+                return;
+        m_trace.complete("stage", tr("stage %1").arg(m_stage), m_stage_ts, m_trace.now() - m_stage_ts);
+        m_stage_ts = -1;
+}
 
-        showURB(113682);
-        if (!m_usb->aw_fel2_send_file(ADDR_MAGIC_DE, usb_FEL::AW_FEL_2_DRAM, resource(QLatin1String("magic_de_start.fex"))))
-                return false;
+void flasher::finish(bool success)
+{
+        end_partition();
+        end_stage();
+        checkpoint(-1);
+        compare_baseline(success);
+        calibrate();
+        m_progress.endSession();
+        m_running.storeRelease(0);
+        m_success = success;
+        emit Finished(success);
+}
 
-        showURB(113691);
-        if (!m_usb->aw_fel2_send_file(ADDR_FED_NAND, usb_FEL::AW_FEL_2_DRAM, resource(QLatin1String("FET_RESTORE_0000"))))
-                return false;
+/**
+ * @brief start a flash session and return immediately
+ * The session is driven by the event loop of the thread the flasher
+ * lives in; Finished(bool) is emitted when it is done.
+ */
+void flasher::start()
+{
+        if (m_running.loadAcquire())
+                return;
+        m_running.storeRelease(1);
+        m_cancel.storeRelease(0);
+        m_success = false;
+        m_step = 0;
+        m_stage = 0;
+        m_again = -1;
+        m_jump = -1;
+        m_rerun = false;
+        m_continue = 0;
+        m_plan->reset();
+        m_progress.beginSession(expected_usecs(), expected_bytes());
+        m_step_usecs.fill(-1, step_count());
+        m_trace.clear();
+        m_stage_ts = -1;
+        m_wait_ts = -1;
+        m_checkpoint = -1;
+        m_checkpoints.clear();
+        m_timing_report = QJsonObject();
+        m_prefetched = prefetch_t();
+        m_prefetched.bytes = 0;
+        m_prefetched.usecs = 0;
+        m_link = QJsonObject();
+        m_usb->resetStats();
+        // prepare and check the stage 2 inputs while the device is probed and stage 1 runs
+        start_prefetch();
+        QTimer::singleShot(0, this, SLOT(resume()));
+}
 
-        showURB(113703);
-        if (!m_usb->aw_fel2_send_file(ADDR_MAGIC_DE, usb_FEL::AW_FEL_2_DRAM, resource(QLatin1String("magic_de_end.fex"))))
-                return false;
+/**
+ * @brief cancel a running session at the next step boundary
+ * The flag is atomic, so this may be called directly from any thread.
+ */
+void flasher::cancel()
+{
+        if (m_running.loadAcquire())
+                m_cancel.storeRelease(1);
+}
 
-        showURB(113709);
-        if (!m_usb->aw_fel2_exec(ADDR_FED_NAND, 0x11))
-                return false;
+/**
+ * @brief run the current step and schedule the next one
+ */
+void flasher::resume()
+{
+        if (!m_running.loadAcquire())
+                return;
+
+        const step_t& step = m_steps[m_step];
+        const QString name = QLatin1String(step.name);
+
+        if (m_cancel.loadAcquire()) {
+                emit Error(tr("Stage %1 cancelled at %2.").arg(step.stage).arg(name));
+                if (m_usb->is_open())
+                        m_usb->usb_close();
+                finish(false);
+                return;
+        }
 
-        showURB(113712);
-        buf.fill('\0', 16);
-        if (!m_usb->aw_pad_write(buf.constData(), buf.size()))
-                return false;
+        if (step.resumable && m_completed.contains(name)) {
+                emit Status(tr("Skipping %1, it was completed before the board was left in flash mode.").arg(name));
+        } else {
+                if (!m_rerun) {
+                        if (m_stage != step.stage) {
+                                emit Status(tr("Start of stage %1").arg(step.stage));
+                                end_stage();
+                                m_stage_ts = m_trace.now();
+                        }
+                        m_stage = step.stage;
+                        emit StepStarted(m_step, name);
+                        m_progress.stepStarted(m_step);
+                        m_step_timer.start();
+                        m_step_ts = m_trace.now();
+                } else if (m_wait_ts >= 0) {
+                        m_trace.complete("wait", QLatin1String("again"), m_wait_ts, m_trace.now() - m_wait_ts);
+                }
+                m_wait_ts = -1;
+
+                if (!m_rerun)
+                        m_continue = 0;
+                const step_fn fn = m_rerun && m_continue ? m_continue : step.fn;
+                m_again = -1;
+                m_jump = -1;
+                bool success = (this->*fn)();
+                checkpoint(-1);
+                if (success && m_again != -1) {
+                        // usb_completed() resumes the step waiting for the device
+                        m_rerun = true;
+                        if (m_again >= 0) {
+                                m_wait_ts = m_trace.now();
+                                QTimer::singleShot(m_again, this, SLOT(resume()));
+                        }
+                        return;
+                }
+                m_rerun = false;
+                m_again = -1;
+                m_continue = 0;
+
+                qint64 usecs = m_step_timer.nsecsElapsed() / 1000;
+                if (m_trace.isEnabled()) {
+                        QJsonObject args;
+                        args.insert(QLatin1String("step"), m_step);
+                        args.insert(QLatin1String("success"), success);
+                        m_trace.complete("step", name, m_step_ts, m_trace.now() - m_step_ts, args);
+                }
+                if (success) {
+                        m_progress.stepFinished(m_step, usecs);
+                        m_step_usecs[m_step] = usecs;
+                }
+                emit StepFinished(m_step, name, usecs, success);
+                if (!success) {
+                        emit Error(tr("Stage %1 failed - aborting.").arg(step.stage));
+                        if (m_usb->is_open())
+                                m_usb->usb_close();
+                        finish(false);
+                        return;
+                }
+                if (step.resumable) {
+                        m_completed.insert(name);
+                        save_completed();
+                }
+        }
 
-        // added by me, still in flash mode
-        // even though restore done.
-//	aw_fel_get_version (handle);
+        int next = m_step + 1;
+        if (m_jump >= 0) {
+                next = m_jump;
+                m_jump = -1;
+        } else if (next == step_count() || m_steps[next].stage != step.stage) {
+                emit Status(tr("End of stage %1").arg(step.stage));
+        }
 
-        return true;
+        m_step = next;
+        if (m_step == step_count()) {
+                // the session is complete; a new one starts from scratch
+                m_completed.clear();
+                save_completed();
+                emit Status(tr("All done!"));
+                finish(true);
+                return;
+        }
+        QTimer::singleShot(0, this, SLOT(resume()));
 }
 
+/**
+ * @brief check the size of a dump or verify job
+ * Nothing larger than the DRAM window can be read, and the range must
+ * not wrap around the end of the address space.
+ * @param offset address to start at
+ * @param size number of bytes
+ * @return true if the range can be read
+ */
+bool flasher::memory_range(quint32 offset, qint64 size)
+{
+        if (size > 0 && size <= DRAM_WINDOW && offset + size <= Q_INT64_C(0x100000000))
+                return true;
+        emit Error(tr("Refusing to read %1 bytes at 0x%2; at most %3 MiB can be read.")
+                   .arg(size)
+                   .arg(offset, 8, 16, QChar('0'))
+                   .arg(DRAM_WINDOW / 1024 / 1024));
+        return false;
+}
 
-bool flasher::stage_1()
+/**
+ * @brief start a dump or verify job
+ * The memory is read in chunks, each one started from the completion of
+ * the one before, so other boards and clients are served meanwhile;
+ * MemoryFinished(bool) is emitted when the job is done.
+ * @param mode MEM_DUMP or MEM_VERIFY
+ * @param offset address to start at
+ * @param size number of bytes, checked by memory_range()
+ */
+void flasher::start_memory(int mode, quint32 offset, quint32 size)
 {
-        emit Status(tr("Start of stage %1").arg(1));
-        if (!stage_1_prep())
-                return false;
-        if (!install_fes_1_1())
-                return false;
-        if (!install_fes_1_2())
+        m_running.storeRelease(1);
+        m_cancel.storeRelease(0);
+        m_success = false;
+        m_mem_mode = mode;
+        m_mem_offset = offset;
+        m_mem_size = size;
+        m_mem_pos = 0;
+        m_mem_version = 0;
+        m_memory = true;
+        m_progress.begin(size);
+        QTimer::singleShot(0, this, SLOT(read_chunk()));
+}
+
+/**
+ * @brief start dumping device memory to a file
+ * @param offset address to start at
+ * @param size number of bytes to dump
+ * @param filename name of the output file
+ * @return true if the job was started
+ */
+bool flasher::startDump(quint32 offset, quint32 size, const QString& filename)
+{
+        if (busy()) {
+                emit Error(tr("Device is busy flashing."));
                 return false;
-        if (!send_crc_table())
+        }
+        if (!memory_range(offset, size))
                 return false;
-        if (!install_fes_2())
+        m_mem_file.setFileName(filename);
+        if (!m_mem_file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+                emit Error(tr("Failed to open output file: %1").arg(filename));
                 return false;
-        emit Status(tr("End of stage %1").arg(1));
+        }
+        start_memory(MEM_DUMP, offset, size);
         return true;
 }
 
-
-bool flasher::stage_2()
+/**
+ * @brief start comparing device memory to the contents of a file
+ * @param offset address to start at
+ * @param filename name of the file to compare with
+ * @return true if the job was started
+ */
+bool flasher::startVerify(quint32 offset, const QString& filename)
 {
-        emit Status(tr("Start of stage %1").arg(2));
-        if (!stage_2_prep())
-                return false;
-        if (!install_fed_nand())
-                return false;
-        if (!send_partitions_and_MBR())				// not done yet !!!
+        if (busy()) {
+                emit Error(tr("Device is busy flashing."));
                 return false;
-        if (!install_uboot())
-                return false;
-        if (!install_boot0())
+        }
+        m_mem_file.setFileName(filename);
+        if (!m_mem_file.open(QIODevice::ReadOnly)) {
+                emit Error(tr("Failed to open input file: %1").arg(filename));
                 return false;
-        if (!restore_system())
+        }
+        const qint64 size = m_mem_file.size();
+        if (!memory_range(offset, size)) {
+                m_mem_file.close();
                 return false;
-        emit Status(tr("End of stage %1").arg(2));
+        }
+        start_memory(MEM_VERIFY, offset, static_cast<quint32>(size));
         return true;
 }
 
-
-bool flasher::flash()
+/**
+ * @brief start reading the next chunk of a dump or verify job
+ * Memory is read with FEL1 requests in FEL mode or, while FES is running,
+ * with FES2 requests from DRAM. The first turn asks for the version to
+ * find out which; memory_completed() continues with the reply.
+ */
+void flasher::read_chunk()
 {
-        QEventLoop loop(this);
-        const qint64 msec = 20000;
-        bool success;
+        if (!m_running.loadAcquire())
+                return;
+        if (m_cancel.loadAcquire()) {
+                emit Error(tr("Reading 0x%1 cancelled.").arg(m_mem_offset + m_mem_pos, 8, 16, QChar('0')));
+                end_memory(false);
+                return;
+        }
+
+        aw_op_t op = aw_op_t();
+        if (!m_mem_version) {
+                if (!open_usb()) {
+                        end_memory(false);
+                        return;
+                }
+                op.type = usb_FEL::AW_OP_VERSION;
+                op.rdata = &m_probe_version;
+        } else {
+                const int len = static_cast<int>(qMin<quint32>(MEMORY_CHUNK, m_mem_size - m_mem_pos));
+                m_mem_buf.resize(len);
+                op.addr = m_mem_offset + m_mem_pos;
+                op.length = len;
+                op.rdata = m_mem_buf.data();
+                if (m_mem_version == SUNXI_SOC_ID_FLASHMODE) {
+                        op.type = usb_FEL::AW_OP_FES_READ;
+                        op.specs = usb_FEL::AW_FEL_2_DRAM;
+                } else {
+                        op.type = usb_FEL::AW_OP_FEL_READ;
+                }
+        }
+        if (!m_usb->start(op))
+                end_memory(false);
+}
 
-        success = m_usb->usb_open();
-        if (success)
-                success &= stage_1();
-        if (success)
-                success &= m_usb->usb_close();
+/**
+ * @brief continue a dump or verify job with the operation that completed
+ * @param success result of the operation
+ */
+void flasher::memory_completed(bool success)
+{
         if (!success) {
-                emit Error(tr("Stage %1 failed - aborting.").arg(1));
-                return false;
+                end_memory(false);
+                return;
         }
 
-        emit Status(tr("Waiting up to %1 seconds").arg(.001 * msec, 0, 'g', 2));
-        qint64 timeout = QDateTime::currentMSecsSinceEpoch() + 1000;
-        qint64 now;
-        while ((now = QDateTime::currentMSecsSinceEpoch()) < timeout) {
-                emit Progress(100.0 - (timeout - now) * 100.0 / msec);
-                loop.processEvents();
+        if (!m_mem_version) {
+                m_mem_version = usb_FEL::soc_id(m_probe_version);
+                if (m_mem_version == SUNXI_SOC_ID_FLASHMODE &&
+                    (m_mem_offset < ADDR_DRAM || m_mem_offset - ADDR_DRAM + static_cast<quint64>(m_mem_size) > DRAM_WINDOW)) {
+                        emit Error(tr("In flash mode only DRAM at 0x%1 to 0x%2 can be read.")
+                                   .arg(ADDR_DRAM, 8, 16, QChar('0'))
+                                   .arg(static_cast<quint64>(ADDR_DRAM) + DRAM_WINDOW - 1, 8, 16, QChar('0')));
+                        end_memory(false);
+                        return;
+                }
+                read_chunk();
+                return;
         }
-        timeout += msec - 1000;
-        while ((now = QDateTime::currentMSecsSinceEpoch()) < timeout) {
-                emit Progress(100.0 - (timeout - now) * 100.0 / msec);
-                loop.processEvents();
-                if (m_usb->find_device())
-                        break;
+
+        const quint32 addr = m_mem_offset + m_mem_pos;
+        const int len = m_mem_buf.size();
+        if (m_mem_mode == MEM_DUMP) {
+                if (m_mem_file.write(m_mem_buf) != len) {
+                        emit Error(tr("Failed to write output file: %1").arg(m_mem_file.fileName()));
+                        end_memory(false);
+                        return;
+                }
+        } else {
+                const QByteArray data = m_mem_file.read(len);
+                for (int i = 0; i < len; i++) {
+                        if (i < data.size() && m_mem_buf.at(i) == data.at(i))
+                                continue;
+                        emit Error(tr("Verify of %1 failed at 0x%2.")
+                                   .arg(m_mem_file.fileName())
+                                   .arg(addr + i, 8, 16, QChar('0')));
+                        end_memory(false);
+                        return;
+                }
         }
-        emit Progress(100.0);
-        if (success)
-                success &= m_usb->usb_open();
-        if (success)
-                success &= stage_2();
-        if (success)
-                success &= m_usb->usb_close();
-        if (!success) {
-                emit Error(tr("Stage %1 failed - aborting.").arg(2));
-                return false;
+
+        m_mem_pos += len;
+        m_progress.advance(len);
+        emit Progress(100.0 * m_mem_pos / m_mem_size);
+        if (m_mem_pos < m_mem_size) {
+                read_chunk();
+                return;
         }
 
-        emit Status(tr("All done!"));
+        if (m_mem_mode == MEM_DUMP)
+                emit Status(tr("Dumped %1 bytes at 0x%2 to %3.")
+                            .arg(m_mem_size)
+                            .arg(m_mem_offset, 8, 16, QChar('0'))
+                            .arg(m_mem_file.fileName()));
+        else
+                emit Status(tr("Verified %1 bytes at 0x%2 against %3.")
+                            .arg(m_mem_size)
+                            .arg(m_mem_offset, 8, 16, QChar('0'))
+                            .arg(m_mem_file.fileName()));
+        end_memory(true);
+}
+
+/**
+ * @brief end a dump or verify job
+ * A failed dump does not leave a partial output file behind.
+ * @param success true if the job succeeded
+ */
+void flasher::end_memory(bool success)
+{
+        if (m_mem_mode == MEM_DUMP && !success)
+                m_mem_file.remove();
+        m_mem_file.close();
+        m_mem_buf.clear();
+        if (m_usb->is_open())
+                close_usb();
+        m_memory = false;
+        m_running.storeRelease(0);
+        m_success = success;
+        emit MemoryFinished(success);
+}
+
+/**
+ * @brief measure the link to the board
+ * Reports the USB speed and the write and read bandwidth at several
+ * transfer sizes: FEL1 to SRAM in FEL mode, FES2 to DRAM in flash mode.
+ * Only memory that a session overwrites later is used. Unlike the steps
+ * of a session this blocks the caller in usb_FEL::run() until the
+ * probe is done; it is only run on an idle board.
+ * @return QJsonObject with the speed and the results, empty on error
+ */
+QJsonObject flasher::probe_link()
+{
+        if (busy()) {
+                emit Error(tr("Device is busy flashing."));
+                return QJsonObject();
+        }
+        m_link = QJsonObject();
+        if (!open_usb())
+                return QJsonObject();
+
+        quint32 version = m_usb->aw_fel_get_version();
+        const bool fes = version == SUNXI_SOC_ID_FLASHMODE;
+        QList<quint32> sizes;
+        if (fes)
+                sizes << 4096 << 65536 << 262144 << 1048576;
+        else
+                sizes << 256 << 1024 << 4096 << PROBE_SRAM_MAX;
+        QList<aw_bandwidth_t> results;
+        if (version != 0)
+                results = fes ? m_usb->probe_bandwidth(true, ADDR_DRAM_BUFF, sizes, PROBE_DRAM_BYTES)
+                              : m_usb->probe_bandwidth(false, PROBE_SRAM, sizes, PROBE_SRAM_BYTES);
+        close_usb();
+        if (results.isEmpty()) {
+                emit Error(tr("Bandwidth probe failed."));
+                return QJsonObject();
+        }
 
-        return 0;
+        QJsonArray list;
+        foreach(const aw_bandwidth_t& bw, results) {
+                emit Status(tr("%1 %2 bytes: write %3 MB/s, read %4 MB/s%5")
+                            .arg(fes ? QLatin1String("FES2 DRAM") : QLatin1String("FEL1 SRAM"))
+                            .arg(bw.size)
+                            .arg(bw.write_mbps, 0, 'f', 2)
+                            .arg(bw.read_mbps, 0, 'f', 2)
+                            .arg(bw.verified ? QString() : tr(" (data mismatch)")));
+                QJsonObject obj;
+                obj.insert(QLatin1String("size"), static_cast<double>(bw.size));
+                obj.insert(QLatin1String("count"), static_cast<double>(bw.count));
+                obj.insert(QLatin1String("write_mbps"), qRound(bw.write_mbps * 100) / 100.0);
+                obj.insert(QLatin1String("read_mbps"), qRound(bw.read_mbps * 100) / 100.0);
+                obj.insert(QLatin1String("verified"), bw.verified);
+                list.append(obj);
+        }
+        QJsonObject link = m_link;
+        link.insert(QLatin1String("mode"), fes ? QLatin1String("fes2_dram") : QLatin1String("fel1_sram"));
+        link.insert(QLatin1String("results"), list);
+        link.insert(QLatin1String("time"), QDateTime::currentDateTime().toString(Qt::ISODate));
+        m_probe = link;
+        return link;
+}
+
+/**
+ * @brief measure the link in the flasher's thread
+ * LinkProbed(QJsonObject) is emitted with the result of probe_link().
+ */
+void flasher::probe()
+{
+        emit LinkProbed(probe_link());
 }
 
+/**
+ * @brief run a complete flash session
+ * Starts the session and spins a local event loop until it is finished.
+ * @return true on success
+ */
+bool flasher::flash()
+{
+        QEventLoop loop(this);
+        connect(this, SIGNAL(Finished(bool)), &loop, SLOT(quit()));
+        start();
+        if (m_running.loadAcquire())
+                loop.exec();
+        return m_success;
+}
@@ -8,7 +8,21 @@
 #include <QFile>
 #include <QDateTime>
 #include <QEventLoop>
+#include <QElapsedTimer>
+#include <QTimer>
+#include <QSet>
+#include <QHash>
+#include <QStringList>
+#include <QFuture>
+#include <QVector>
+#include <QSettings>
+#include <QAtomicInt>
 #include "usbfel.h"
+#include "flashbaseline.h"
+#include "flashmanifest.h"
+
+class flashplan;
+class usbcapture;
 
 class flasher : public QObject
 {
@@ -17,27 +31,182 @@ public:
         flasher(QObject* parent = 0);
         ~flasher();
 
-        bool connected();
+        typedef bool (flasher::*step_fn)();
+
+        typedef struct {
+                int             stage;          //!< stage number (1 or 2)
+                const char*     name;           //!< name of the step function
+                step_fn         fn;             //!< pointer to the step function
+                bool            resumable;      //!< skipped if it completed before the board was left in flash mode
+                int             msec;           //!< expected duration until calibrated by a previous run
+        }       step_t;
+
+        typedef struct {
+                QHash<QString, QByteArray> digests;     //!< SHA-256 of the stage 2 payloads and logs
+                QHash<QString, QByteArray> heads;       //!< first chunks of the partition images
+                QHash<QString, flashtree_t> trees;      //!< tree hashes of the partition images
+                QStringList     errors;                 //!< inputs that could not be loaded
+                qint64          bytes;                  //!< number of bytes prepared
+                qint64          usecs;                  //!< time taken
+        }       prefetch_t;
+
+        typedef struct {
+                bool            valid;                  //!< decoded from the board or a capture
+                QString         source;                 //!< where the geometry came from
+                quint32         chips;                  //!< number of chips
+                quint32         dies;                   //!< dies per chip
+                quint32         planes;                 //!< planes per die, programmed together
+                quint32         page_size;              //!< bytes per page
+                quint32         pages_per_block;        //!< pages per physical block
+                quint32         blocks;                 //!< blocks per die
+                quint32         reserve_ratio;          //!< valid_blk_ratio as reported, the block reserve of the NFTL; 0 if unknown
+                QByteArray      chip_id;                //!< NAND chip ID bytes
+        }       nand_geometry_t;
+
+        Q_INVOKABLE bool connected();
         bool flash();
+        bool busy() const;
+        bool startDump(quint32 offset, quint32 size, const QString& filename);
+        bool startVerify(quint32 offset, const QString& filename);
+        QJsonObject probe_link();
         void showURBs(bool show);
+        void setPortPath(const QString& path);
+        QString portPath() const;
+        flashprogress* progress();
+        flashtrace* trace();
+        void setRegressionThreshold(qreal threshold);
+        QJsonObject timingReport() const;
+        QJsonObject progressEvent(int percent);
+        QList<QJsonObject> sessionEvents(const QString& report_file, const QString& trace_file);
+        const felstats& stats() const;
+        void setWriteCombining(bool on);
+        void setAllowSlowLink(bool allow);
+        void setForceBoot(bool force);
+        void setReplay(usbcapture* replay);
+        void setManifest(const flashmanifest& manifest);
+        QHash<QString, flashtree_t> imageTrees() const;
+        QMap<int, aw_poll_stats_t> pollStats() const;
+
+        static int step_count();
+        static QHash<QString, quint32> payload_addresses();
+        static bool decode_nand_geometry(const QByteArray& para, nand_geometry_t* geo);
+        static bool write_manifest(const QString& filename, QString* error = 0);
+        static QString step_name(int step);
+
+public slots:
+        void start();
+        void cancel();
+        void probe();
+        void findDevice();
 
 signals:
         void URB(int urb);
         void Progress(qreal percentage);
         void Status(QString message);
         void Error(QString message);
+        void StepStarted(int step, QString name);
+        void StepFinished(int step, QString name, qint64 usecs, bool success);
+        void Finished(bool success);
+        void MemoryFinished(bool success);
+        void LinkProbed(QJsonObject link);
+        void DeviceFound(bool found);
+
+private slots:
+        void resume();
+        void read_chunk();
+        void usb_completed(bool success);
+        void showURB(int urb);
 
 private:
+        enum {
+                MEM_DUMP,
+                MEM_VERIFY
+        };
+        enum {
+                PREFETCH_PENDING,
+                PREFETCH_READY,
+                PREFETCH_FAILED
+        };
+        typedef struct {
+                int             action;         //!< index of the action of send_partitions_and_MBR() running
+                QIODevice*      fin;            //!< partition image being sent
+                QString         filename;       //!< name of the partition image
+                QByteArray      head;           //!< first chunks of the image, read ahead
+                int             head_pos;       //!< bytes of head sent
+                quint32         sector;         //!< first sector of the partition
+                quint32         sector_key;     //!< sector of the next record
+                quint32         sector_limit;   //!< first sector after the partition
+                quint32         first_secs;     //!< sectors of the first record
+                quint32         read_secs;      //!< sectors of the record in flight, 0 before the first
+                uchar*          data;           //!< pooled transfer buffer of the records
+                int             percent;        //!< progress last reported
+                QByteArray      crc;            //!< CRC buffer of the reset and read actions
+        }       partition_t;
+        static const step_t m_steps[];
         int m_rc;
         bool m_show_urbs;
+        QAtomicInt m_running;                   //!< read by busy() from other threads
+        QAtomicInt m_cancel;                    //!< set by cancel() from any thread
+        bool m_memory;                          //!< a dump or verify job is running
+        bool m_success;
+        int m_step;
+        int m_stage;
+        int m_again;
+        int m_jump;
+        bool m_rerun;
+        step_fn m_continue;
+        QSet<QString> m_completed;
+        bool m_replaying;
+        int m_mem_mode;
+        quint32 m_mem_offset;
+        quint32 m_mem_size;
+        quint32 m_mem_pos;
+        quint32 m_mem_version;
+        QFile m_mem_file;
+        QByteArray m_mem_buf;
+        qint64 m_wait_start;
+        flashprogress m_progress;
+        flashtrace m_trace;
+        qint64 m_stage_ts;
+        qint64 m_step_ts;
+        qint64 m_wait_ts;
+        flashbaseline m_baseline;
+        int m_checkpoint;
+        QElapsedTimer m_checkpoint_timer;
+        QMap<int, qint64> m_checkpoints;
+        QJsonObject m_timing_report;
+        bool m_allow_slow_link;
+        QJsonObject m_link;
+        QJsonObject m_probe;
+        QElapsedTimer m_step_timer;
+        QVector<qint64> m_step_usecs;           //!< measured usecs of the steps that succeeded, -1 otherwise
+        bool m_prefetching;
+        qint64 m_prefetch_ts;
+        QFuture<prefetch_t> m_prefetch;
+        prefetch_t m_prefetched;
+        flashmanifest m_manifest;
+        nand_geometry_t m_nand;
         usb_FEL* m_usb;
-        aw_fel_version_t m_version;
-        quint32 m_scratchpad;
+        flashplan* m_plan;
+        aw_fel_version_t m_probe_version;       //!< version reply of probe_device() and the memory jobs
+        partition_t m_part;
+        bool m_force_boot;
+        bool m_uboot_current;                   //!< the u-boot header in NAND is the one of the payload
+        bool m_boot0_current;                   //!< the boot0 sectors in NAND were written from the payload
+        bool m_boot0_installed;                 //!< boot0 was installed, record_boot0() reads it back
+        QByteArray m_boot_area;                 //!< boot0 sectors and the u-boot header sector read from NAND
+        int m_boot_read;                        //!< index of the next read of the boot area
+        step_fn m_boot_then;                    //!< continuation once the boot area is read
         QString resource(const QString& name);
         bool open_usb();
         bool close_usb();
-        void showURB(int urb);
-        bool read_log(QByteArray &dest, size_t bytes, const QString &filename);
+        bool memory_range(quint32 offset, qint64 size);
+        void start_memory(int mode, quint32 offset, quint32 size);
+        void end_memory(bool success);
+        void memory_completed(bool success);
+        bool wait_usb(bool started, step_fn then);
+        bool send_payload2(quint32 offset, const QString& name, step_fn then);
+        bool run_plan(const char* step, step_fn then = 0);
         bool stage_1_prep();
         bool install_fes_1_1();
         bool install_fes_1_2();
@@ -45,13 +214,47 @@ private:
         bool install_fes_2();
         bool stage_2_prep();
         bool install_fed_nand();
+        bool read_nand_info();
+        const nand_geometry_t& nand_geometry();
+        void show_nand_geometry();
+        bool check_link(const QStringList& names);
         bool send_partition(const QString &filename, quint32 sector = 0, quint32 sectors = 0);
+        bool partition_record();
+        bool partition_done();
+        void end_partition();
         bool send_partitions_and_MBR();
+        bool part_next();
+        bool part_action_done();
+        bool read_boot_area(step_fn then);
+        bool boot_area_record();
+        bool check_boot();
+        bool check_boot_done();
         bool install_uboot();
         bool install_boot0();
+        bool install_boot0_done();
+        bool record_boot0();
+        bool record_boot0_read();
+        bool record_boot0_done();
         bool restore_system();
-        bool stage_1();
-        bool stage_2();
+        bool probe_device();
+        bool probe_device_done();
+        static prefetch_t prefetch(const QStringList& partitions, const flashmanifest& manifest);
+        void start_prefetch();
+        int prefetch_ready();
+        bool wait_device();
+        qint64 partition_bytes() const;
+        QVector<qint64> expected_usecs() const;
+        QVector<qint64> expected_bytes() const;
+        void calibrate();
+        void again(int msec);
+        void jump(const char* name);
+        QString completed_key() const;
+        void load_completed();
+        void save_completed();
+        void end_stage();
+        void checkpoint(int urb);
+        void compare_baseline(bool success);
+        void finish(bool success);
 };
 
 #endif // TRANSFER_H
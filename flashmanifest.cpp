@@ -0,0 +1,308 @@
+/*
+ * Copyright (C) Jürgen Buchmüller <pullmoll@t-online.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <QFile>
+#include <QSaveFile>
+#include <QThread>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QCryptographicHash>
+#include <QtConcurrent/QtConcurrentMap>
+#include "flashmanifest.h"
+#include "payloads.h"
+
+flashmanifest::flashmanifest() :
+        m_images(),
+        m_payloads(),
+        m_error()
+{
+}
+
+/**
+ * @brief hash one chunk as a leaf of the tree
+ * Leaves and inner nodes get different prefixes, so a chunk can never
+ * pass for a pair of hashes.
+ */
+static QByteArray leaf(const QByteArray& chunk)
+{
+        QCryptographicHash sha(QCryptographicHash::Sha256);
+        sha.addData("\x00", 1);
+        sha.addData(chunk);
+        return sha.result();
+}
+
+/**
+ * @brief combine the chunk hashes of an image to its root
+ * Pairs are hashed level by level; an odd hash at the end of a level
+ * moves up unchanged.
+ * @param chunks leaf hashes
+ * @return QByteArray with the root hash
+ */
+QByteArray flashmanifest::root(const QVector<QByteArray>& chunks)
+{
+        if (chunks.isEmpty())
+                return leaf(QByteArray());
+        QVector<QByteArray> level = chunks;
+        while (level.size() > 1) {
+                QVector<QByteArray> next;
+                next.reserve((level.size() + 1) / 2);
+                for (int i = 0; i + 1 < level.size(); i += 2) {
+                        QCryptographicHash sha(QCryptographicHash::Sha256);
+                        sha.addData("\x01", 1);
+                        sha.addData(level[i]);
+                        sha.addData(level[i + 1]);
+                        next += sha.result();
+                }
+                if (level.size() & 1)
+                        next += level.last();
+                level = next;
+        }
+        return level.first();
+}
+
+/**
+ * @brief compute the tree hash of an image on all cores
+ * The image is mapped if possible and otherwise read; the chunks are
+ * hashed in batches of a few per thread, so at most one batch has to be
+ * in memory when the file cannot be mapped. An image in the bundle is
+ * checked against the bundle's SHA-256 in the same pass, instead of a
+ * pass of its own when it is first used.
+ * @param path path name of the image, as returned by payloads::path()
+ * @param error optional pointer to a QString receiving an error message
+ * @param chunk_size bytes per chunk
+ * @return flashtree_t with the chunk hashes and root; no root on error
+ */
+flashtree_t flashmanifest::hash(const QString& path, QString* error, int chunk_size)
+{
+        flashtree_t tree;
+        tree.size = 0;
+        tree.chunk_size = chunk_size;
+
+        QFile file;
+        QByteArray data;
+        const uchar* map = 0;
+        QByteArray bundled;
+        QCryptographicHash sha(QCryptographicHash::Sha256);
+        if (path.startsWith(QLatin1String("bundle:"))) {
+                // bundled payloads are mapped already
+                data = payloads::mapped(path.mid(7), &bundled);
+                if (data.isEmpty()) {
+                        if (error)
+                                *error = tr("Failed to open input file: %1").arg(path);
+                        return tree;
+                }
+                tree.size = data.size();
+                map = reinterpret_cast<const uchar *>(data.constData());
+        } else {
+                file.setFileName(path);
+                if (!file.open(QIODevice::ReadOnly)) {
+                        if (error)
+                                *error = tr("Failed to open input file: %1").arg(path);
+                        return tree;
+                }
+                tree.size = file.size();
+                if (tree.size > 0)
+                        map = file.map(0, tree.size);
+        }
+
+        const qint64 count = (tree.size + chunk_size - 1) / chunk_size;
+        const int batch = 4 * qMax(1, QThread::idealThreadCount());
+        tree.chunks.reserve(static_cast<int>(count));
+        for (qint64 first = 0; first < count; first += batch) {
+                QList<QByteArray> chunks;
+                for (qint64 i = first; i < qMin(count, first + batch); i++) {
+                        const qint64 offset = i * chunk_size;
+                        const int size = static_cast<int>(qMin(static_cast<qint64>(chunk_size), tree.size - offset));
+                        if (map) {
+                                chunks += QByteArray::fromRawData(reinterpret_cast<const char *>(map + offset), size);
+                        } else {
+                                QByteArray chunk = file.read(size);
+                                if (chunk.size() != size) {
+                                        if (error)
+                                                *error = tr("Failed to read input file: %1").arg(path);
+                                        return tree;
+                                }
+                                chunks += chunk;
+                        }
+                        if (!bundled.isEmpty())
+                                sha.addData(chunks.last());
+                }
+                foreach(const QByteArray& digest, QtConcurrent::blockingMapped(chunks, leaf))
+                        tree.chunks += digest;
+        }
+        if (map && file.isOpen())
+                file.unmap(const_cast<uchar *>(map));
+        if (!bundled.isEmpty()) {
+                if (sha.result() != bundled) {
+                        if (error)
+                                *error = tr("Payload %1 in bundle %2 is damaged.").arg(path.mid(7)).arg(payloads::bundle());
+                        return tree;
+                }
+                payloads::verified(path.mid(7), data);
+        }
+        tree.root = root(tree.chunks);
+        return tree;
+}
+
+/**
+ * @brief load a manifest
+ * @param filename name of the JSON file
+ * @return true on success
+ */
+bool flashmanifest::load(const QString& filename)
+{
+        m_images.clear();
+        m_payloads.clear();
+        QFile file(filename);
+        if (!file.open(QIODevice::ReadOnly)) {
+                m_error = tr("Failed to open manifest: %1").arg(filename);
+                return false;
+        }
+        QJsonParseError pe;
+        const QJsonDocument doc = QJsonDocument::fromJson(file.readAll(), &pe);
+        if (!doc.isObject()) {
+                m_error = tr("Manifest %1: %2").arg(filename).arg(pe.errorString());
+                return false;
+        }
+
+        const QJsonObject images = doc.object().value(QLatin1String("images")).toObject();
+        for (QJsonObject::const_iterator it = images.constBegin(); it != images.constEnd(); ++it) {
+                const QJsonObject obj = it.value().toObject();
+                flashtree_t tree;
+                tree.size = static_cast<qint64>(obj.value(QLatin1String("size")).toDouble());
+                tree.chunk_size = obj.value(QLatin1String("chunk_size")).toInt(FLASHMANIFEST_CHUNK);
+                tree.root = QByteArray::fromHex(obj.value(QLatin1String("root")).toString().toLatin1());
+                foreach(const QJsonValue& chunk, obj.value(QLatin1String("chunks")).toArray())
+                        tree.chunks += QByteArray::fromHex(chunk.toString().toLatin1());
+                if (tree.root.size() != 32 || tree.chunk_size <= 0) {
+                        m_error = tr("Manifest %1: image %2 has no valid root.").arg(filename).arg(it.key());
+                        return false;
+                }
+                m_images.insert(it.key(), tree);
+        }
+
+        const QJsonObject digests = doc.object().value(QLatin1String("payloads")).toObject();
+        for (QJsonObject::const_iterator it = digests.constBegin(); it != digests.constEnd(); ++it)
+                m_payloads.insert(it.key(), QByteArray::fromHex(it.value().toString().toLatin1()));
+        return true;
+}
+
+/**
+ * @brief save the manifest
+ * @param filename name of the JSON file
+ * @return true on success
+ */
+bool flashmanifest::save(const QString& filename) const
+{
+        QJsonObject images;
+        for (QHash<QString, flashtree_t>::const_iterator it = m_images.constBegin(); it != m_images.constEnd(); ++it) {
+                const flashtree_t& tree = it.value();
+                QJsonObject obj;
+                obj.insert(QLatin1String("size"), static_cast<double>(tree.size));
+                obj.insert(QLatin1String("chunk_size"), tree.chunk_size);
+                obj.insert(QLatin1String("root"), QString::fromLatin1(tree.root.toHex()));
+                QJsonArray chunks;
+                foreach(const QByteArray& chunk, tree.chunks)
+                        chunks.append(QString::fromLatin1(chunk.toHex()));
+                obj.insert(QLatin1String("chunks"), chunks);
+                images.insert(it.key(), obj);
+        }
+        QJsonObject digests;
+        for (QHash<QString, QByteArray>::const_iterator it = m_payloads.constBegin(); it != m_payloads.constEnd(); ++it)
+                digests.insert(it.key(), QString::fromLatin1(it.value().toHex()));
+
+        QJsonObject doc;
+        doc.insert(QLatin1String("images"), images);
+        doc.insert(QLatin1String("payloads"), digests);
+        QSaveFile file(filename);
+        if (!file.open(QIODevice::WriteOnly))
+                return false;
+        file.write(QJsonDocument(doc).toJson());
+        return file.commit();
+}
+
+bool flashmanifest::isEmpty() const
+{
+        return m_images.isEmpty() && m_payloads.isEmpty();
+}
+
+QString flashmanifest::errorString() const
+{
+        return m_error;
+}
+
+void flashmanifest::insertImage(const QString& name, const flashtree_t& tree)
+{
+        m_images.insert(name, tree);
+}
+
+void flashmanifest::insertPayload(const QString& name, const QByteArray& sha256)
+{
+        m_payloads.insert(name, sha256);
+}
+
+QStringList flashmanifest::images() const
+{
+        return m_images.keys();
+}
+
+/**
+ * @brief check the tree hash of an image against the manifest
+ * An empty manifest checks nothing; otherwise an image it does not list
+ * fails. When the roots differ, the first differing chunk is reported if
+ * the manifest has chunk hashes.
+ * @param name payload name of the image
+ * @param tree tree hash computed by hash()
+ * @return QString with an error message, empty if the image is intact
+ */
+QString flashmanifest::check(const QString& name, const flashtree_t& tree) const
+{
+        QHash<QString, flashtree_t>::const_iterator it = m_images.constFind(name);
+        if (it == m_images.constEnd())
+                return isEmpty() ? QString() : tr("Image %1 is not in the manifest.").arg(name);
+        const flashtree_t& expected = it.value();
+        if (expected.chunk_size != tree.chunk_size)
+                return tr("Image %1: the manifest uses %2 byte chunks, not %3.")
+                        .arg(name).arg(expected.chunk_size).arg(tree.chunk_size);
+        if (expected.size != tree.size)
+                return tr("Image %1 has %2 bytes, the manifest expects %3.")
+                        .arg(name).arg(tree.size).arg(expected.size);
+        if (expected.root == tree.root)
+                return QString();
+        for (int i = 0; i < qMin(expected.chunks.size(), tree.chunks.size()); i++)
+                if (expected.chunks[i] != tree.chunks[i])
+                        return tr("Image %1 differs from the manifest at offset %2.")
+                                .arg(name).arg(static_cast<qint64>(i) * tree.chunk_size);
+        return tr("Image %1 does not match the manifest.").arg(name);
+}
+
+/**
+ * @brief check the SHA-256 of a payload against the manifest
+ * An empty manifest checks nothing; otherwise a payload it does not list
+ * fails.
+ * @param name name of the payload
+ * @param sha256 digest of the payload
+ * @return QString with an error message, empty if the payload is intact
+ */
+QString flashmanifest::check(const QString& name, const QByteArray& sha256) const
+{
+        QHash<QString, QByteArray>::const_iterator it = m_payloads.constFind(name);
+        if (it == m_payloads.constEnd())
+                return isEmpty() ? QString() : tr("Payload %1 is not in the manifest.").arg(name);
+        if (it.value() == sha256)
+                return QString();
+        return tr("Payload %1 does not match the manifest.").arg(name);
+}
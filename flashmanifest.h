@@ -0,0 +1,61 @@
+#ifndef FLASHMANIFEST_H
+#define FLASHMANIFEST_H
+
+#include <QCoreApplication>
+#include <QString>
+#include <QStringList>
+#include <QByteArray>
+#include <QVector>
+#include <QHash>
+#include <QJsonObject>
+
+#define FLASHMANIFEST_CHUNK     (1024 * 1024)   //!< bytes per leaf of the tree hash
+
+/**
+ * @brief chunked SHA-256 tree hash of an image
+ */
+typedef struct {
+        qint64          size;           //!< size of the image
+        int             chunk_size;     //!< bytes per chunk
+        QVector<QByteArray> chunks;     //!< SHA-256 of every chunk (leaf hashes)
+        QByteArray      root;           //!< Merkle root over the chunk hashes
+}       flashtree_t;
+
+/**
+ * @brief expected digests of the images and payloads of a session
+ * Partition images are described by a Merkle tree: the image is cut into
+ * chunks of FLASHMANIFEST_CHUNK bytes, every chunk is hashed on its own,
+ * which hash() does on all cores, and the chunk hashes are combined
+ * pairwise up to the root. The chunk hashes are kept, so verifying or
+ * rewriting only the chunks that differ needs no second pass over the
+ * image. Payloads are described by their plain SHA-256.
+ * A manifest is a JSON file with the root, size and chunk hashes of every
+ * image and the digest of every payload; check() compares against it.
+ */
+class flashmanifest
+{
+        Q_DECLARE_TR_FUNCTIONS(flashmanifest)
+public:
+        flashmanifest();
+
+        bool load(const QString& filename);
+        bool save(const QString& filename) const;
+        bool isEmpty() const;
+        QString errorString() const;
+
+        void insertImage(const QString& name, const flashtree_t& tree);
+        void insertPayload(const QString& name, const QByteArray& sha256);
+        QString check(const QString& name, const flashtree_t& tree) const;
+        QString check(const QString& name, const QByteArray& sha256) const;
+        QStringList images() const;
+
+        static flashtree_t hash(const QString& path, QString* error = 0, int chunk_size = FLASHMANIFEST_CHUNK);
+        static QByteArray root(const QVector<QByteArray>& chunks);
+
+private:
+        QHash<QString, flashtree_t> m_images;
+        QHash<QString, QByteArray> m_payloads;
+        QString m_error;
+};
+
+#endif // FLASHMANIFEST_H
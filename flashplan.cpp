@@ -0,0 +1,799 @@
+/*
+ * Copyright (C) Jürgen Buchmüller <pullmoll@t-online.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <QFile>
+#include <QMap>
+#include <QJsonDocument>
+#include <QJsonArray>
+#include <QCryptographicHash>
+#include "flashplan.h"
+#include "payloads.h"
+
+static const struct {
+        const char*     name;
+        int             op;
+        bool            fes;
+}       op_names[] = {
+        {"urb",         flashplan::OP_URB,       false},
+        {"version",     flashplan::OP_VERSION,   false},
+        {"read",        flashplan::OP_READ,      false},
+        {"write",       flashplan::OP_WRITE,     false},
+        {"send",        flashplan::OP_SEND,      false},
+        {"exec",        flashplan::OP_EXEC,      false},
+        {"delay",       flashplan::OP_DELAY,     false},
+        {"poll",        flashplan::OP_POLL,      true},
+        {"match",       flashplan::OP_MATCH,     false},
+        {"fes_read",    flashplan::OP_READ,      true},
+        {"fes_write",   flashplan::OP_WRITE,     true},
+        {"fes_send",    flashplan::OP_SEND,      true},
+        {"fes_exec",    flashplan::OP_EXEC,      true},
+        {"params",      flashplan::OP_PARAMS,    true},
+        {"fes_0204",    flashplan::OP_0204,      true},
+        {"pad_read",    flashplan::OP_PAD_READ,  false},
+        {"pad_write",   flashplan::OP_PAD_WRITE, false}
+};
+
+/**
+ * @brief convert a JSON number or a string like "0x7e00" to an unsigned
+ */
+static quint32 to_uint(const QJsonValue& value)
+{
+        if (value.isString())
+                return value.toString().toUInt(0, 0);
+        return static_cast<quint32>(value.toDouble());
+}
+
+/**
+ * @brief return the key of an operation's address in the memory model of effects()
+ */
+static quint64 address_key(const plan_op_t& op, quint32 offset = 0)
+{
+        return (static_cast<quint64>(op.scratch) << 32) | (op.addr + offset);
+}
+
+/**
+ * @brief return a digest of the memory model of effects()
+ */
+static QByteArray memory_digest(const QMap<quint64, char>& memory)
+{
+        QCryptographicHash hash(QCryptographicHash::Sha1);
+        for (QMap<quint64, char>::const_iterator it = memory.constBegin(); it != memory.constEnd(); ++it) {
+                hash.addData(reinterpret_cast<const char *>(&it.key()), sizeof(quint64));
+                hash.addData(&it.value(), 1);
+        }
+        return hash.result().toHex();
+}
+
+/**
+ * @brief return true if an operation leaves the device as it was
+ * Version requests and FEL or FES reads only answer; whatever runs
+ * between two of them, the device answers the same.
+ */
+static bool is_pure(const plan_op_t& op)
+{
+        switch (op.op) {
+        case flashplan::OP_URB:
+        case flashplan::OP_VERSION:
+        case flashplan::OP_READ:
+        case flashplan::OP_MATCH:
+                return true;
+        }
+        return false;
+}
+
+/**
+ * @brief return the record of the SoC ID checks between two device changes
+ * @param ids expected SoC IDs, sorted; 0 if any ID is accepted
+ * @param capture true if the reply is kept
+ */
+static QByteArray version_record(const QList<quint32>& ids, bool capture)
+{
+        QByteArray rec("version");
+        foreach(quint32 id, ids)
+                rec += ' ' + (id ? QByteArray::number(id, 16) : QByteArray("any"));
+        if (capture)
+                rec += " capture";
+        return rec;
+}
+
+flashplan::flashplan(usb_FEL* usb, QObject* parent) :
+        QObject(parent),
+        m_usb(usb),
+        m_name(),
+        m_order(),
+        m_steps(),
+        m_version(),
+        m_scratchpad(0x00007e00),
+        m_run_step(),
+        m_run_pos(0),
+        m_polling(false),
+        m_waiting(false),
+        m_reply(),
+        m_buf(),
+        m_captured()
+{
+}
+
+flashplan::~flashplan()
+{
+}
+
+/**
+ * @brief return the resource path name of a plan
+ * @param name name of the plan
+ * @return QString with the filename
+ */
+QString flashplan::path(const QString& name)
+{
+        return QString(":/cubietruck/plans/%1.json").arg(name);
+}
+
+/**
+ * @brief return the resource path names of the plans of a session
+ * Stage 1 runs in FEL mode, stage 2 once FES runs.
+ */
+QStringList flashplan::paths()
+{
+        return QStringList() << path(QLatin1String("stage1")) << path(QLatin1String("stage2"));
+}
+
+/**
+ * @brief load, resolve and optimize flash plans
+ * Payloads and log data are resolved here, and host side matches are
+ * checked here, so none of it happens while the device is waiting.
+ * An optimized step is only used if effects() finds it equivalent to
+ * the step as written.
+ * @param filenames names of the JSON files, their steps are merged
+ * @param optimize true to run the planner on every step
+ * @return true on success
+ */
+bool flashplan::load(const QStringList& filenames, bool optimize)
+{
+        m_name.clear();
+        m_order.clear();
+        m_steps.clear();
+        int written = 0;
+        int planned = 0;
+        foreach(const QString& filename, filenames) {
+                if (!load_plan(filename, optimize, &written, &planned)) {
+                        m_order.clear();
+                        m_steps.clear();
+                        return false;
+                }
+        }
+        emit Status(tr("Flash plan %1: %2 operations, %3 after optimization.")
+                    .arg(m_name).arg(written).arg(planned));
+        return true;
+}
+
+/**
+ * @brief load the steps of one plan
+ * @param filename name of the JSON file
+ * @param optimize true to run the planner on every step
+ * @param written pointer to the count of operations as written
+ * @param planned pointer to the count of operations to run
+ * @return true on success
+ */
+bool flashplan::load_plan(const QString& filename, bool optimize, int* written, int* planned)
+{
+        QFile file(filename);
+        if (!file.open(QIODevice::ReadOnly)) {
+                emit Error(tr("Failed to open flash plan: %1").arg(filename));
+                return false;
+        }
+
+        QJsonParseError perr;
+        QJsonDocument doc = QJsonDocument::fromJson(file.readAll(), &perr);
+        if (doc.isNull()) {
+                emit Error(tr("Flash plan %1: %2 at offset %3.")
+                           .arg(filename).arg(perr.errorString()).arg(perr.offset));
+                return false;
+        }
+
+        QJsonObject root = doc.object();
+        foreach(const QJsonValue& value, root.value(QLatin1String("steps")).toArray()) {
+                QJsonObject obj = value.toObject();
+                QString step = obj.value(QLatin1String("step")).toString();
+                QList<plan_op_t> ops;
+                foreach(const QJsonValue& opval, obj.value(QLatin1String("ops")).toArray()) {
+                        plan_op_t op;
+                        QString error;
+                        if (!parse_op(opval.toObject(), op, &error)) {
+                                emit Error(tr("Flash plan %1, step %2: %3").arg(filename).arg(step).arg(error));
+                                return false;
+                        }
+                        if (op.op == OP_MATCH && !check(op, op.data))
+                                return false;
+                        ops += op;
+                }
+                *written += ops.size();
+
+                if (optimize) {
+                        QList<plan_op_t> opt = flashplan::optimize(ops);
+                        if (effects(opt) == effects(ops)) {
+                                ops = opt;
+                        } else {
+                                emit Status(tr("Optimized step %1 differs from the plan, running it as written.").arg(step));
+                        }
+                }
+                *planned += ops.size();
+                m_order += step;
+                m_steps.insert(step, ops);
+        }
+
+        if (!m_name.isEmpty())
+                m_name += QLatin1String(", ");
+        m_name += root.value(QLatin1String("name")).toString();
+        return true;
+}
+
+bool flashplan::isLoaded() const
+{
+        return !m_order.isEmpty();
+}
+
+bool flashplan::contains(const QString& step) const
+{
+        return m_steps.contains(step);
+}
+
+QStringList flashplan::steps() const
+{
+        return m_order;
+}
+
+QList<plan_op_t> flashplan::ops(const QString& step) const
+{
+        return m_steps.value(step);
+}
+
+/**
+ * @brief return the FEL version reply captured by the plan
+ */
+aw_fel_version_t flashplan::version() const
+{
+        return m_version;
+}
+
+/**
+ * @brief return the scratchpad address captured by the plan
+ */
+quint32 flashplan::scratchpad() const
+{
+        return m_scratchpad;
+}
+
+/**
+ * @brief return the data of the last read with "capture"
+ */
+QByteArray flashplan::captured() const
+{
+        return m_captured;
+}
+
+/**
+ * @brief resolve a data source of a plan
+ * Sources are {"hex":"4452414d"}, {"fill":"0xcc"}, {"log":"pt1_000063"}
+ * and {"payload":"fes.fex"}. The data is padded up to length with the
+ * byte in "pad", if pad is true or a "pad" is given.
+ * @param spec JSON object describing the source
+ * @param length length of the data
+ * @param pad true to always pad the data to length
+ * @param error pointer to a QString receiving an error message
+ * @return QByteArray with the data
+ */
+QByteArray flashplan::data_spec(const QJsonValue& spec, quint32 length, bool pad, QString* error)
+{
+        QJsonObject obj = spec.toObject();
+        QByteArray data;
+
+        if (obj.contains(QLatin1String("hex"))) {
+                data = QByteArray::fromHex(obj.value(QLatin1String("hex")).toString().toLatin1());
+        } else if (obj.contains(QLatin1String("fill"))) {
+                data.fill(static_cast<char>(to_uint(obj.value(QLatin1String("fill")))), length);
+        } else if (obj.contains(QLatin1String("log"))) {
+                data = payloads::hexlog(obj.value(QLatin1String("log")).toString(), error);
+        } else if (obj.contains(QLatin1String("payload"))) {
+                data = payloads::get(obj.value(QLatin1String("payload")).toString(), error);
+        } else {
+                *error = tr("missing or unknown data source");
+                return QByteArray();
+        }
+
+        if ((pad || obj.contains(QLatin1String("pad"))) && static_cast<quint32>(data.size()) < length)
+                data.append(QByteArray(length - data.size(), static_cast<char>(to_uint(obj.value(QLatin1String("pad"))))));
+        return data;
+}
+
+/**
+ * @brief parse one operation of a plan
+ * @param obj JSON object of the operation
+ * @param op reference to a plan_op_t to fill
+ * @param error pointer to a QString receiving an error message
+ * @return true on success
+ */
+bool flashplan::parse_op(const QJsonObject& obj, plan_op_t& op, QString* error)
+{
+        QString name = obj.value(QLatin1String("op")).toString();
+
+        op = plan_op_t();
+        op.op = -1;
+        for (size_t i = 0; i < sizeof(op_names) / sizeof(op_names[0]); i++) {
+                if (name == QLatin1String(op_names[i].name)) {
+                        op.op = op_names[i].op;
+                        op.fes = op_names[i].fes;
+                }
+        }
+        if (op.op < 0) {
+                *error = tr("unknown operation \"%1\"").arg(name);
+                return false;
+        }
+
+        QJsonValue addr = obj.value(QLatin1String("addr"));
+        QString symbol = addr.toString();
+        if (symbol.startsWith(QLatin1String("scratchpad"))) {
+                op.scratch = true;
+                symbol.remove(0, qstrlen("scratchpad"));
+                op.addr = symbol.remove(QChar('+')).toUInt(0, 0);
+        } else {
+                op.addr = to_uint(addr);
+        }
+        op.length = to_uint(obj.value(QLatin1String("length")));
+        op.error = obj.value(QLatin1String("error")).toString();
+
+        switch (op.op) {
+        case OP_URB:
+                op.value = to_uint(obj.value(QLatin1String("urb")));
+                break;
+        case OP_VERSION:
+                op.value = to_uint(obj.value(QLatin1String("expect")));
+                op.capture = obj.value(QLatin1String("capture")).toBool();
+                break;
+        case OP_READ:
+        case OP_PAD_READ:
+                if (0 == op.length) {
+                        *error = tr("read without length");
+                        return false;
+                }
+                op.at = to_uint(obj.value(QLatin1String("at")));
+                op.capture = obj.value(QLatin1String("capture")).toBool();
+                if (obj.contains(QLatin1String("expect")))
+                        op.expect = data_spec(obj.value(QLatin1String("expect")), op.length - qMin(op.at, op.length), false, error);
+                if (static_cast<quint64>(op.at) + op.expect.size() > op.length)
+                        *error = tr("expected data is longer than the read");
+                break;
+        case OP_0204:
+                if (0 == op.length) {
+                        *error = tr("0204 request without length");
+                        return false;
+                }
+                break;
+        case OP_WRITE:
+        case OP_PAD_WRITE:
+                op.data = data_spec(obj.value(QLatin1String("data")), op.length, true, error);
+                op.length = op.data.size();
+                break;
+        case OP_SEND:
+                op.name = obj.value(QLatin1String("payload")).toString();
+                op.data = payloads::get(op.name, error);
+                if (!op.scratch)
+                        op.addr = payloads::address(op.name, op.addr);
+                op.chunk = obj.contains(QLatin1String("chunk")) ? to_uint(obj.value(QLatin1String("chunk"))) : 65536;
+                op.min = to_uint(obj.value(QLatin1String("min")));
+                break;
+        case OP_EXEC:
+                op.param1 = to_uint(obj.value(QLatin1String("param1")));
+                op.param2 = to_uint(obj.value(QLatin1String("param2")));
+                break;
+        case OP_PARAMS:
+                op.param1 = to_uint(obj.value(QLatin1String("param1")));
+                op.param2 = to_uint(obj.value(QLatin1String("param2")));
+                op.param3 = to_uint(obj.value(QLatin1String("param3")));
+                op.param4 = to_uint(obj.value(QLatin1String("param4")));
+                break;
+        case OP_DELAY:
+                op.value = to_uint(obj.value(QLatin1String("msec")));
+                break;
+        case OP_POLL:
+                op.value = to_uint(obj.value(QLatin1String("site")));
+                break;
+        case OP_MATCH:
+                op.data = data_spec(obj.value(QLatin1String("data")), 0, false, error);
+                if (error->isEmpty())
+                        op.expect = data_spec(obj.value(QLatin1String("expect")), 0, false, error);
+                break;
+        }
+        return error->isEmpty();
+}
+
+/**
+ * @brief optimize the operations of one step
+ * - match operations are dropped, load() has checked them already
+ * - version requests are merged into an earlier one, if only pure
+ *   operations are between them and it expects the same or any SoC ID
+ * - writes to adjacent or overlapping ranges are merged into one write,
+ *   if nothing but URB markers is between them and both are FEL or FES writes
+ * @param ops list of operations as written
+ * @return list of operations to run
+ */
+QList<plan_op_t> flashplan::optimize(const QList<plan_op_t>& ops)
+{
+        QList<plan_op_t> out;
+
+        // the device answers a repeated version request the same
+        int version = -1;
+        foreach(const plan_op_t& op, ops) {
+                if (op.op == OP_MATCH)
+                        continue;
+                if (op.op == OP_VERSION && version >= 0 &&
+                    (!op.value || !out[version].value || op.value == out[version].value)) {
+                        plan_op_t& first = out[version];
+                        first.value = qMax(first.value, op.value);
+                        first.capture = first.capture || op.capture;
+                        continue;
+                }
+                if (op.op == OP_VERSION)
+                        version = out.size();
+                else if (!is_pure(op))
+                        version = -1;
+                out += op;
+        }
+
+        for (int i = 0; i < out.size(); i++) {
+                if (out[i].op != OP_WRITE)
+                        continue;
+                int j = i + 1;
+                while (j < out.size() && out[j].op == OP_URB)
+                        j++;
+                if (j >= out.size() || out[j].op != OP_WRITE || out[j].scratch != out[i].scratch ||
+                    out[j].fes != out[i].fes)
+                        continue;
+
+                plan_op_t& first = out[i];
+                const plan_op_t& next = out[j];
+                quint64 first_start = first.addr;
+                quint64 first_end = first_start + first.data.size();
+                quint64 next_start = next.addr;
+                quint64 next_end = next_start + next.data.size();
+                if (next_start > first_end || first_start > next_end)
+                        continue;
+
+                // the later write wins where the ranges overlap
+                quint64 start = qMin(first_start, next_start);
+                QByteArray merged(static_cast<int>(qMax(first_end, next_end) - start), '\0');
+                memcpy(merged.data() + (first_start - start), first.data.constData(), first.data.size());
+                memcpy(merged.data() + (next_start - start), next.data.constData(), next.data.size());
+                first.addr = static_cast<quint32>(start);
+                first.data = merged;
+                first.length = merged.size();
+                out.removeAt(j);
+                i--;
+        }
+        return out;
+}
+
+/**
+ * @brief describe what the device can observe of a list of operations
+ * Writes and sends are applied to a model of the device memory. Every
+ * read, execute, delay and poll is recorded together with the memory
+ * contents it can see, and so is every request without an address. Version
+ * requests are pure: the SoC IDs checked between two operations that change
+ * the device are recorded once, however often they were requested, so
+ * moving a check across such an operation changes the effects, repeating
+ * it does not. Two lists of operations with equal effects are
+ * interchangeable.
+ * @param ops list of operations
+ * @return list of records, one per observation
+ */
+QList<QByteArray> flashplan::effects(const QList<plan_op_t>& ops)
+{
+        QList<QByteArray> records;
+        QMap<quint64, char> memory;
+        QList<quint32> ids;
+        bool capture = false;
+
+        foreach(const plan_op_t& op, ops) {
+                if (op.op == OP_URB)
+                        continue;
+                if (!ids.isEmpty() && !is_pure(op)) {
+                        records += version_record(ids, capture);
+                        ids.clear();
+                        capture = false;
+                }
+                switch (op.op) {
+                case OP_WRITE:
+                case OP_SEND:
+                        for (int i = 0; i < op.data.size(); i++)
+                                memory.insert(address_key(op, i), op.data.at(i));
+                        break;
+                case OP_PARAMS:
+                        records += QString("params %1 %2 %3 %4").arg(op.param1, 0, 16).arg(op.param2, 0, 16)
+                                   .arg(op.param3, 0, 16).arg(op.param4, 0, 16).toLatin1();
+                        break;
+                case OP_0204:
+                        records += QString("0204 %1").arg(op.length).toLatin1();
+                        break;
+                case OP_PAD_READ:
+                        records += QString("pad_read %1 %2 ").arg(op.length).arg(op.at).toLatin1() + op.expect.toHex();
+                        break;
+                case OP_PAD_WRITE:
+                        records += "pad_write " + op.data.toHex();
+                        break;
+                case OP_VERSION:
+                        // a check for any ID is implied by one for a certain ID
+                        if (op.value)
+                                ids.removeAll(0);
+                        if (!ids.contains(op.value) && (op.value || ids.isEmpty())) {
+                                ids += op.value;
+                                qSort(ids);
+                        }
+                        capture = capture || op.capture;
+                        break;
+                case OP_READ:
+                        {
+                                QByteArray rec = QString("%1 %2 %3 ").arg(op.fes ? "fes_read" : "read")
+                                                 .arg(address_key(op), 0, 16).arg(op.length).toLatin1();
+                                for (quint32 i = 0; i < op.length; i++) {
+                                        QMap<quint64, char>::const_iterator it = memory.constFind(address_key(op, i));
+                                        rec += it == memory.constEnd() ? QByteArray("?") : QByteArray(1, it.value()).toHex();
+                                }
+                                records += rec + ' ' + QByteArray::number(op.at) + ' ' + op.expect.toHex();
+                        }
+                        break;
+                case OP_EXEC:
+                        records += QString("%1 %2 %3 %4 ").arg(op.fes ? "fes_exec" : "exec")
+                                   .arg(address_key(op), 0, 16).arg(op.param1).arg(op.param2).toLatin1()
+                                   + memory_digest(memory);
+                        break;
+                case OP_DELAY:
+                        records += QString("delay %1").arg(op.value).toLatin1();
+                        break;
+                case OP_POLL:
+                        records += QString("poll %1").arg(op.value).toLatin1();
+                        break;
+                }
+        }
+        if (!ids.isEmpty())
+                records += version_record(ids, capture);
+        records += "memory " + memory_digest(memory);
+        return records;
+}
+
+/**
+ * @brief run the operations of a step
+ * Nothing blocks: an operation on the device is started and run()
+ * returns RUN_WAIT; it is to be called again once usb_FEL emitted
+ * Completed(bool), and continues with the result. Delays and the pauses
+ * between completion polls stop the step with RUN_AGAIN and the time to
+ * wait. The next call for the same step continues where it stopped.
+ * @param step name of the step
+ * @param msec pointer to an int receiving the time to wait for RUN_AGAIN
+ * @return RUN_DONE, RUN_AGAIN, RUN_WAIT or RUN_FAILED
+ */
+int flashplan::run(const QString& step, int* msec)
+{
+        QHash<QString, QList<plan_op_t> >::const_iterator it = m_steps.constFind(step);
+        if (it == m_steps.constEnd()) {
+                emit Error(tr("Flash plan %1 has no step %2.").arg(m_name).arg(step));
+                return RUN_FAILED;
+        }
+        if (m_run_step != step) {
+                m_run_step = step;
+                m_run_pos = 0;
+                m_polling = false;
+                m_waiting = false;
+        }
+
+        const QList<plan_op_t>& ops = it.value();
+        bool success = true;
+        if (m_waiting) {
+                const plan_op_t& op = ops.at(m_run_pos);
+                m_waiting = false;
+                if (op.op == OP_POLL) {
+                        const int rc = m_usb->aw_fel2_wait_result(m_usb->lastResult(), msec);
+                        if (rc == usb_FEL::AW_WAIT_PENDING)
+                                return RUN_AGAIN;
+                        m_polling = false;
+                        success = rc == usb_FEL::AW_WAIT_DONE;
+                } else {
+                        success = m_usb->lastResult() && end_op(op);
+                }
+                if (success)
+                        m_run_pos++;
+        }
+
+        while (success && m_run_pos < ops.size()) {
+                const plan_op_t& op = ops.at(m_run_pos);
+                if (op.op == OP_DELAY) {
+                        m_run_pos++;
+                        if (op.value > 0) {
+                                *msec = static_cast<int>(op.value);
+                                return RUN_AGAIN;
+                        }
+                        continue;
+                }
+                switch (start_op(op)) {
+                case START_WAIT:
+                        m_waiting = true;
+                        return RUN_WAIT;
+                case START_DONE:
+                        m_run_pos++;
+                        break;
+                default:
+                        success = false;
+                        break;
+                }
+        }
+        const bool done = m_run_pos == ops.size();
+        reset();
+        return done ? RUN_DONE : RUN_FAILED;
+}
+
+/**
+ * @brief forget a step that stopped with RUN_AGAIN
+ */
+void flashplan::reset()
+{
+        m_run_step.clear();
+        m_run_pos = 0;
+        m_polling = false;
+        m_waiting = false;
+}
+
+/**
+ * @brief compare data to the expected data of an operation
+ * @param op operation with the expected data
+ * @param data data to check
+ * @return true if data has the expected data at op.at
+ */
+bool flashplan::check(const plan_op_t& op, const QByteArray& data)
+{
+        for (int i = 0; i < op.expect.size(); i++) {
+                const int pos = static_cast<int>(op.at) + i;
+                if (pos < data.size() && data.at(pos) == op.expect.at(i))
+                        continue;
+                emit Error(tr("%1 (offset %2: 0x%3 instead of 0x%4)")
+                           .arg(op.error.isEmpty() ? tr("Unexpected data") : op.error)
+                           .arg(pos)
+                           .arg(pos < data.size() ? static_cast<uchar>(data.at(pos)) : 0, 2, 16, QChar('0'))
+                           .arg(static_cast<uchar>(op.expect.at(i)), 2, 16, QChar('0')));
+                return false;
+        }
+        return true;
+}
+
+quint32 flashplan::address(const plan_op_t& op) const
+{
+        return op.scratch ? m_scratchpad + op.addr : op.addr;
+}
+
+/**
+ * @brief start one operation
+ * Operations on the device are started with usb_FEL::start(); their
+ * buffers are the plan's own and stay valid until they complete.
+ * @param op operation to start
+ * @return START_WAIT if it is in flight, START_DONE if it ran on the
+ * host, START_FAILED on error
+ */
+int flashplan::start_op(const plan_op_t& op)
+{
+        aw_op_t usb = aw_op_t();
+        usb.addr = address(op);
+        usb.specs = usb_FEL::AW_FEL_2_DRAM;
+
+        switch (op.op) {
+        case OP_URB:
+                emit URB(op.value);
+                return START_DONE;
+
+        case OP_MATCH:
+                return check(op, op.data) ? START_DONE : START_FAILED;
+
+        case OP_VERSION:
+                memset(&m_reply, 0, sizeof(m_reply));
+                usb.type = usb_FEL::AW_OP_VERSION;
+                usb.rdata = &m_reply;
+                break;
+
+        case OP_READ:
+        case OP_PAD_READ:
+                m_buf.fill('\0', op.length);
+                usb.type = op.op == OP_PAD_READ ? usb_FEL::AW_OP_PAD_READ
+                                                : op.fes ? usb_FEL::AW_OP_FES_READ : usb_FEL::AW_OP_FEL_READ;
+                usb.length = op.length;
+                usb.rdata = m_buf.data();
+                break;
+
+        case OP_WRITE:
+        case OP_PAD_WRITE:
+                usb.type = op.op == OP_PAD_WRITE ? usb_FEL::AW_OP_PAD_WRITE
+                                                 : op.fes ? usb_FEL::AW_OP_FES_WRITE : usb_FEL::AW_OP_FEL_WRITE;
+                usb.length = op.data.size();
+                usb.wdata = op.data.constData();
+                break;
+
+        case OP_SEND:
+                if (!m_usb->startSend(address(op), op.fes ? usb_FEL::AW_FEL_2_DRAM : 0, op.fes, op.data,
+                                      payloads::path(op.name), op.chunk, op.min))
+                        return START_FAILED;
+                return START_WAIT;
+
+        case OP_EXEC:
+                usb.type = op.fes ? usb_FEL::AW_OP_FES_EXEC : usb_FEL::AW_OP_FEL_EXEC;
+                usb.param1 = op.param1;
+                usb.param2 = op.param2;
+                break;
+
+        case OP_PARAMS:
+                usb.type = usb_FEL::AW_OP_FES_PARAMS;
+                usb.param1 = op.param1;
+                usb.param2 = op.param2;
+                usb.param3 = op.param3;
+                usb.param4 = op.param4;
+                break;
+
+        case OP_0204:
+                usb.type = usb_FEL::AW_OP_FES_0204;
+                usb.addr = op.length;
+                break;
+
+        case OP_POLL:
+                if (!m_polling) {
+                        m_usb->aw_fel2_wait_begin(op.value);
+                        m_polling = true;
+                }
+                usb.type = usb_FEL::AW_OP_POLL;
+                break;
+
+        default:
+                return START_FAILED;
+        }
+        return m_usb->start(usb) ? START_WAIT : START_FAILED;
+}
+
+/**
+ * @brief check the result of an operation that completed successfully
+ * @param op operation that completed
+ * @return true on success
+ */
+bool flashplan::end_op(const plan_op_t& op)
+{
+        switch (op.op) {
+        case OP_VERSION:
+                {
+                        const quint32 id = usb_FEL::soc_id(m_reply);
+                        qDebug("%s: version=0x%04x", __func__, id);
+                        if (op.value && id != op.value) {
+                                emit Error(tr("Expected ID 0x%1, got 0x%2")
+                                           .arg(op.value, 4, 16, QChar('0'))
+                                           .arg(id, 4, 16, QChar('0')));
+                                return false;
+                        }
+                        if (op.capture) {
+                                m_version = m_reply;
+                                m_scratchpad = m_reply.scratchpad;
+                        }
+                        return id != 0;
+                }
+
+        case OP_READ:
+        case OP_PAD_READ:
+                if (op.capture)
+                        m_captured = m_buf;
+                return check(op, m_buf);
+        }
+        return true;
+}
@@ -0,0 +1,127 @@
+#ifndef FLASHPLAN_H
+#define FLASHPLAN_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QString>
+#include <QStringList>
+#include <QList>
+#include <QHash>
+#include <QJsonObject>
+#include <QJsonValue>
+#include "usbfel.h"
+
+/**
+ * @brief one operation of a flash plan
+ */
+typedef struct {
+        int             op;             //!< operation (flashplan::op_e)
+        bool            fes;            //!< FES2 request instead of a FEL1 one
+        quint32         addr;           //!< FEL address, or offset to the scratchpad
+        bool            scratch;        //!< addr is relative to the scratchpad
+        quint32         length;         //!< number of bytes to read
+        quint32         value;          //!< URB number, expected SoC ID, delay msec or poll site
+        bool            capture;        //!< version: keep the reply and its scratchpad address; read: keep the data
+        quint32         param1;         //!< exec and params parameter 1
+        quint32         param2;         //!< exec and params parameter 2
+        quint32         param3;         //!< params parameter 3
+        quint32         param4;         //!< params parameter 4
+        quint32         at;             //!< offset of the expected data in the data read
+        quint32         chunk;          //!< send: maximum size of a single write
+        quint32         min;            //!< send: minimum number of bytes
+        QString         name;           //!< send: name of the payload
+        QByteArray      data;           //!< data to write or send
+        QByteArray      expect;         //!< expected data of a read or match
+        QString         error;          //!< message if an expectation fails
+}       plan_op_t;
+
+/**
+ * @brief declarative description of a flash sequence
+ * A plan is a JSON document in the resources listing, per flasher step,
+ * the operations to run on usb_FEL. All payloads and log data a plan refers
+ * to are resolved when it is loaded, so running a step only talks to the
+ * device. The planner optimizes each step and verifies that the optimized
+ * step has the same device visible effect as the one it was written as.
+ * Operations are started with usb_FEL::start(); run() returns while one
+ * is in flight and continues after usb_FEL::Completed(bool).
+ */
+class flashplan : public QObject
+{
+        Q_OBJECT
+public:
+        enum op_e {
+                OP_URB,                 //!< report the URB number of the original capture
+                OP_VERSION,             //!< FEL version request
+                OP_READ,                //!< FEL or FES read, optionally compared to expected data
+                OP_WRITE,               //!< FEL or FES write
+                OP_SEND,                //!< FEL or FES write of a payload in chunks
+                OP_EXEC,                //!< FEL or FES execute
+                OP_DELAY,               //!< wait before the next request
+                OP_POLL,                //!< FEL2 completion polling
+                OP_MATCH,               //!< host side comparison of two data sources
+                OP_PARAMS,              //!< four parameters for the last FES execute
+                OP_0204,                //!< FES 0204 request announcing a pad read
+                OP_PAD_READ,            //!< read without a request, optionally compared to expected data
+                OP_PAD_WRITE            //!< write without a request
+        };
+
+        enum run_e {
+                RUN_DONE,               //!< all operations of the step ran
+                RUN_AGAIN,              //!< call run() again after a delay
+                RUN_WAIT,               //!< call run() again after usb_FEL::Completed(bool)
+                RUN_FAILED              //!< an operation failed
+        };
+
+        flashplan(usb_FEL* usb, QObject* parent = 0);
+        ~flashplan();
+
+        static QString path(const QString& name);
+        static QStringList paths();
+        bool load(const QStringList& filenames = paths(), bool optimize = true);
+        bool isLoaded() const;
+        bool contains(const QString& step) const;
+        QStringList steps() const;
+        QList<plan_op_t> ops(const QString& step) const;
+        int run(const QString& step, int* msec);
+        void reset();
+        aw_fel_version_t version() const;
+        quint32 scratchpad() const;
+        QByteArray captured() const;
+
+        static QList<plan_op_t> optimize(const QList<plan_op_t>& ops);
+        static QList<QByteArray> effects(const QList<plan_op_t>& ops);
+
+signals:
+        void URB(int urb);
+        void Status(QString message);
+        void Error(QString message);
+
+private:
+        enum {
+                START_FAILED,           //!< the operation failed or could not be started
+                START_DONE,             //!< the operation ran on the host
+                START_WAIT              //!< the operation is in flight
+        };
+        usb_FEL* m_usb;
+        QString m_name;
+        QStringList m_order;
+        QHash<QString, QList<plan_op_t> > m_steps;
+        aw_fel_version_t m_version;
+        quint32 m_scratchpad;
+        QString m_run_step;             //!< step that stopped with RUN_AGAIN or RUN_WAIT
+        int m_run_pos;                  //!< index of the operation to continue with
+        bool m_polling;                 //!< a completion wait of m_run_step is running
+        bool m_waiting;                 //!< the operation at m_run_pos is in flight
+        aw_fel_version_t m_reply;       //!< reply to the version request in flight
+        QByteArray m_buf;               //!< data of the read in flight
+        QByteArray m_captured;          //!< data of the last read with capture
+        bool load_plan(const QString& filename, bool optimize, int* written, int* planned);
+        bool parse_op(const QJsonObject& obj, plan_op_t& op, QString* error);
+        QByteArray data_spec(const QJsonValue& spec, quint32 length, bool pad, QString* error);
+        bool check(const plan_op_t& op, const QByteArray& data);
+        int start_op(const plan_op_t& op);
+        bool end_op(const plan_op_t& op);
+        quint32 address(const plan_op_t& op) const;
+};
+
+#endif // FLASHPLAN_H
@@ -0,0 +1,242 @@
+/*
+ * Copyright (C) Jürgen Buchmüller <pullmoll@t-online.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <qmath.h>
+#include "flashprogress.h"
+
+#define MBPS_TAU_SECS   2.0     //!< time constant of the smoothed throughput
+
+flashprogress::flashprogress() :
+        m_done(0),
+        m_total(0),
+        m_bytes(0),
+        m_urb(0),
+        m_clock(),
+        m_mutex(),
+        m_expected(),
+        m_expected_bytes(),
+        m_step_bytes(),
+        m_step(-1),
+        m_step_start(0),
+        m_step_bytes0(0),
+        m_ran_expected(0),
+        m_ran_actual(0),
+        m_sample_step(-1),
+        m_sample_fraction(0),
+        m_sample_usecs(-1),
+        m_sample_bytes(0),
+        m_mbps_avg(-1)
+{
+        m_clock.start();
+}
+
+/**
+ * @brief start a new transfer
+ * @param total number of bytes to transfer
+ */
+void flashprogress::begin(qint64 total)
+{
+        m_done.store(0);
+        m_total.store(total);
+}
+
+/**
+ * @brief account for transferred bytes
+ * @param bytes number of bytes transferred since the last call
+ */
+void flashprogress::advance(qint64 bytes)
+{
+        m_done.fetchAndAddRelaxed(bytes);
+        m_bytes.fetchAndAddRelaxed(bytes);
+}
+
+/**
+ * @brief set the progress of something that is not a transfer, e.g. a wait
+ * @param percentage value from 0 to 100
+ */
+void flashprogress::setPercentage(qreal percentage)
+{
+        m_total.store(10000);
+        m_done.store(static_cast<qint64>(percentage * 100));
+}
+
+void flashprogress::setURB(int urb)
+{
+        m_urb.store(urb);
+}
+
+/**
+ * @brief return the progress of the current transfer
+ * @return value from 0 to 100
+ */
+qreal flashprogress::percentage() const
+{
+        qint64 total = m_total.load();
+        qint64 done = m_done.load();
+        if (total <= 0)
+                return 0;
+        return qBound<qreal>(0, 100.0 * done / total, 100);
+}
+
+int flashprogress::urb() const
+{
+        return m_urb.load();
+}
+
+/**
+ * @brief start a session
+ * @param expected_usecs expected duration of every step
+ * @param expected_bytes expected bytes of every step, 0 if unknown
+ */
+void flashprogress::beginSession(const QVector<qint64>& expected_usecs, const QVector<qint64>& expected_bytes)
+{
+        QMutexLocker lock(&m_mutex);
+        m_expected = expected_usecs;
+        m_expected_bytes = expected_bytes;
+        m_expected_bytes.resize(m_expected.size());
+        m_step_bytes.fill(-1, m_expected.size());
+        m_step = -1;
+        m_step_start = 0;
+        m_ran_expected = 0;
+        m_ran_actual = 0;
+}
+
+/**
+ * @brief note the start of a step
+ * Steps before it that did not run (skipped or jumped over) count as done.
+ * @param step index of the step
+ */
+void flashprogress::stepStarted(int step)
+{
+        m_total.store(0);
+        QMutexLocker lock(&m_mutex);
+        m_step = step;
+        m_step_start = m_clock.nsecsElapsed() / 1000;
+        m_step_bytes0 = m_bytes.load();
+}
+
+/**
+ * @brief note the end of a step
+ * @param step index of the step
+ * @param usecs time the step took
+ */
+void flashprogress::stepFinished(int step, qint64 usecs)
+{
+        QMutexLocker lock(&m_mutex);
+        if (step < 0 || step >= m_expected.size())
+                return;
+        m_ran_expected += m_expected.at(step);
+        m_ran_actual += usecs;
+        m_step_bytes[step] = m_bytes.load() - m_step_bytes0;
+}
+
+/**
+ * @brief end a session; sample() no longer reports overall progress
+ */
+void flashprogress::endSession()
+{
+        QMutexLocker lock(&m_mutex);
+        m_expected.clear();
+        m_step = -1;
+}
+
+/**
+ * @brief return the bytes a finished step transferred
+ * @param step index of the step
+ * @return number of bytes, -1 if the step did not finish in this session
+ */
+qint64 flashprogress::stepBytes(int step) const
+{
+        QMutexLocker lock(&m_mutex);
+        if (step < 0 || step >= m_step_bytes.size())
+                return -1;
+        return m_step_bytes.at(step);
+}
+
+/**
+ * @brief take a sample of the progress
+ * Call this from one thread only, e.g. a display timer; it keeps the
+ * state to compute the throughput between samples.
+ * @return progress_sample_t with the current values
+ */
+progress_sample_t flashprogress::sample()
+{
+        progress_sample_t s;
+        qint64 now = m_clock.nsecsElapsed() / 1000;
+        qint64 bytes = m_bytes.load();
+
+        s.percentage = percentage();
+        s.urb = urb();
+        s.mbps = 0;
+        if (m_sample_usecs >= 0 && now > m_sample_usecs) {
+                qreal dt = (now - m_sample_usecs) / 1e6;
+                s.mbps = (bytes - m_sample_bytes) / dt / 1e6;
+                if (m_mbps_avg < 0)
+                        m_mbps_avg = s.mbps;
+                else
+                        m_mbps_avg += (1.0 - qExp(-dt / MBPS_TAU_SECS)) * (s.mbps - m_mbps_avg);
+        }
+        m_sample_usecs = now;
+        m_sample_bytes = bytes;
+        s.mbps_avg = qMax<qreal>(0, m_mbps_avg);
+
+        QMutexLocker lock(&m_mutex);
+        s.step = m_step;
+        s.step_bytes = 0;
+        s.step_total = 0;
+        s.overall = -1;
+        s.eta_msecs = -1;
+        if (m_step < 0 || m_step >= m_expected.size())
+                return s;
+        s.step_bytes = bytes - m_step_bytes0;
+        s.step_total = m_expected_bytes.at(m_step);
+
+        // how fast this board and host are compared to the expectation
+        qreal factor = 1.0;
+        if (m_ran_expected > 0)
+                factor = qBound<qreal>(0.25, static_cast<qreal>(m_ran_actual) / m_ran_expected, 4.0);
+
+        qint64 total = 0;
+        qint64 before = 0;
+        for (int i = 0; i < m_expected.size(); i++) {
+                total += m_expected.at(i);
+                if (i < m_step)
+                        before += m_expected.at(i);
+        }
+        qint64 current = m_expected.at(m_step);
+
+        // the step's bytes tell how far it is, else its current transfer,
+        // else its time; the fraction never goes back while the step runs
+        if (m_sample_step != m_step) {
+                m_sample_step = m_step;
+                m_sample_fraction = 0;
+        }
+        qreal fraction;
+        if (s.step_total > 0)
+                fraction = qMin<qreal>(1.0, static_cast<qreal>(s.step_bytes) / s.step_total);
+        else if (m_total.load() > 0)
+                fraction = s.percentage / 100.0;
+        else if (current > 0)
+                fraction = qMin<qreal>(0.95, (now - m_step_start) / (current * factor));
+        else
+                fraction = 0;
+        m_sample_fraction = qMax(m_sample_fraction, fraction);
+
+        if (total > 0)
+                s.overall = 100.0 * (before + m_sample_fraction * current) / total;
+        s.eta_msecs = static_cast<qint64>(((1.0 - m_sample_fraction) * current + (total - before - current)) * factor / 1000);
+        return s;
+}
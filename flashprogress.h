@@ -0,0 +1,82 @@
+#ifndef FLASHPROGRESS_H
+#define FLASHPROGRESS_H
+
+#include <QAtomicInt>
+#include <QAtomicInteger>
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QVector>
+
+/**
+ * @brief a sample of the progress of a flash session
+ */
+typedef struct {
+        qreal           percentage;     //!< progress of the current transfer (0 … 100)
+        qreal           overall;        //!< progress of the whole session (0 … 100), -1 if unknown
+        qreal           mbps;           //!< throughput since the previous sample in MB/s
+        qreal           mbps_avg;       //!< smoothed throughput in MB/s
+        qint64          eta_msecs;      //!< estimated time to the end of the session, -1 if unknown
+        int             step;           //!< index of the current step, -1 if idle
+        qint64          step_bytes;     //!< bytes transferred in the current step
+        qint64          step_total;     //!< expected bytes of the current step, 0 if unknown
+        int             urb;            //!< last URB shown
+}       progress_sample_t;
+
+/**
+ * @brief progress of a flash session, shared between threads
+ * The transfer side only stores into atomic counters and a user interface
+ * samples them at its own frame rate, so displaying progress costs the
+ * transfer nothing, no matter how many chunks it sends.
+ * For the session as a whole every step has an expected duration and
+ * byte total; the overall progress and the ETA are based on these, scaled
+ * by how fast the steps finished so far ran compared to their expectation.
+ * A step with a byte total is as far as its share of it, so a step that
+ * sends several files does not start over with each of them.
+ */
+class flashprogress
+{
+public:
+        flashprogress();
+
+        void begin(qint64 total);
+        void advance(qint64 bytes);
+        void setPercentage(qreal percentage);
+        void setURB(int urb);
+
+        qreal percentage() const;
+        int urb() const;
+
+        void beginSession(const QVector<qint64>& expected_usecs, const QVector<qint64>& expected_bytes);
+        void stepStarted(int step);
+        void stepFinished(int step, qint64 usecs);
+        void endSession();
+        qint64 stepBytes(int step) const;
+
+        progress_sample_t sample();
+
+private:
+        QAtomicInteger<qint64> m_done;
+        QAtomicInteger<qint64> m_total;
+        QAtomicInteger<qint64> m_bytes;
+        QAtomicInt m_urb;
+        QElapsedTimer m_clock;
+
+        mutable QMutex m_mutex;         //!< protects the session state below
+        QVector<qint64> m_expected;     //!< expected usecs per step
+        QVector<qint64> m_expected_bytes; //!< expected bytes per step, 0 if unknown
+        QVector<qint64> m_step_bytes;   //!< bytes of the finished steps, -1 if not run
+        int m_step;                     //!< current step, -1 if idle
+        qint64 m_step_start;            //!< m_clock usecs when the current step started
+        qint64 m_step_bytes0;           //!< m_bytes when the current step started
+        qint64 m_ran_expected;          //!< expected usecs of the steps that ran
+        qint64 m_ran_actual;            //!< actual usecs of the steps that ran
+
+        // sampler state, only touched by sample()
+        int m_sample_step;
+        qreal m_sample_fraction;
+        qint64 m_sample_usecs;
+        qint64 m_sample_bytes;
+        qreal m_mbps_avg;
+};
+
+#endif // FLASHPROGRESS_H
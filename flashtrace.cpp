@@ -0,0 +1,305 @@
+/*
+ * Copyright (C) Jürgen Buchmüller <pullmoll@t-online.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <QCoreApplication>
+#include <QThread>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QtAlgorithms>
+#include "flashtrace.h"
+
+#define TRACE_LIMIT     (1 << 20)       //!< default maximum number of events kept
+
+flashtrace::flashtrace() :
+        m_enabled(0),
+        m_clock(),
+        m_origin(0),
+        m_mutex(),
+        m_events(),
+        m_threads(),
+        m_named(),
+        m_tracks(),
+        m_limit(TRACE_LIMIT),
+        m_dropped(0)
+{
+        m_clock.start();
+}
+
+/**
+ * @brief enable or disable recording
+ * @param on true to record events
+ */
+void flashtrace::setEnabled(bool on)
+{
+        m_enabled.store(on ? 1 : 0);
+}
+
+bool flashtrace::isEnabled() const
+{
+        return m_enabled.load() != 0;
+}
+
+/**
+ * @brief set the maximum number of events kept
+ * Events beyond the limit are counted, but not recorded.
+ * @param events maximum number of events
+ */
+void flashtrace::setLimit(int events)
+{
+        QMutexLocker lock(&m_mutex);
+        m_limit = events;
+}
+
+/**
+ * @brief forget all events and restart the time at zero
+ */
+void flashtrace::clear()
+{
+        QMutexLocker lock(&m_mutex);
+        m_events.clear();
+        m_threads.clear();
+        m_named.clear();
+        m_tracks.clear();
+        m_dropped = 0;
+        m_origin.store(m_clock.nsecsElapsed() / 1000);
+}
+
+int flashtrace::count() const
+{
+        QMutexLocker lock(&m_mutex);
+        return m_events.size();
+}
+
+/**
+ * @brief return the current time of the trace
+ * @return usecs since the trace was cleared
+ */
+qint64 flashtrace::now() const
+{
+        return m_clock.nsecsElapsed() / 1000 - m_origin.load();
+}
+
+/**
+ * @brief return the track number for the calling thread or a named track
+ * Call with m_mutex locked.
+ * @param track name of a track, or 0 for the calling thread
+ * @return track number
+ */
+int flashtrace::tid(const char* track)
+{
+        if (track) {
+                const QString name = QLatin1String(track);
+                QHash<QString, int>::const_iterator it = m_named.constFind(name);
+                if (it != m_named.constEnd())
+                        return it.value();
+                m_tracks += name;
+                m_named.insert(name, m_tracks.size());
+                return m_tracks.size();
+        }
+
+        const quintptr id = reinterpret_cast<quintptr>(QThread::currentThreadId());
+        QHash<quintptr, int>::const_iterator it = m_threads.constFind(id);
+        if (it != m_threads.constEnd())
+                return it.value();
+
+        QThread* thread = QThread::currentThread();
+        QString name = thread->objectName();
+        if (name.isEmpty()) {
+                if (QCoreApplication::instance() && thread == QCoreApplication::instance()->thread())
+                        name = QLatin1String("main");
+                else
+                        name = QString("thread %1").arg(m_threads.size() + 1);
+        }
+        m_tracks += name;
+        m_threads.insert(id, m_tracks.size());
+        return m_tracks.size();
+}
+
+/**
+ * @brief record a span
+ * @param category category of the span
+ * @param name name of the span
+ * @param ts start time as returned by now()
+ * @param dur duration in usecs
+ * @param args details of the span
+ * @param track name of a track to show the span on, or 0 for the calling thread
+ */
+void flashtrace::complete(const char* category, const QString& name, qint64 ts, qint64 dur,
+                          const QJsonObject& args, const char* track)
+{
+        if (!isEnabled())
+                return;
+        QMutexLocker lock(&m_mutex);
+        if (m_events.size() >= m_limit) {
+                m_dropped++;
+                return;
+        }
+        trace_event_t ev;
+        ev.phase = 'X';
+        ev.category = category;
+        ev.name = name;
+        ev.ts = ts;
+        ev.dur = dur;
+        ev.tid = tid(track);
+        ev.args = args;
+        m_events += ev;
+}
+
+/**
+ * @brief record an instant, e.g. the URB number of the original capture
+ * @param category category of the instant
+ * @param name name of the instant
+ * @param args details of the instant
+ */
+void flashtrace::instant(const char* category, const QString& name, const QJsonObject& args)
+{
+        if (!isEnabled())
+                return;
+        qint64 ts = now();
+        QMutexLocker lock(&m_mutex);
+        if (m_events.size() >= m_limit) {
+                m_dropped++;
+                return;
+        }
+        trace_event_t ev;
+        ev.phase = 'i';
+        ev.category = category;
+        ev.name = name;
+        ev.ts = ts;
+        ev.dur = 0;
+        ev.tid = tid(0);
+        ev.args = args;
+        m_events += ev;
+}
+
+/**
+ * @brief order events by start time, enclosing spans before the ones they enclose
+ */
+static bool event_before(const trace_event_t& a, const trace_event_t& b)
+{
+        if (a.ts != b.ts)
+                return a.ts < b.ts;
+        return a.dur > b.dur;
+}
+
+/**
+ * @brief return the trace in the Chrome trace event format
+ * @return QByteArray with the JSON document
+ */
+QByteArray flashtrace::toJson() const
+{
+        QMutexLocker lock(&m_mutex);
+        QVector<trace_event_t> events = m_events;
+        QStringList tracks = m_tracks;
+        int dropped = m_dropped;
+        lock.unlock();
+
+        // spans are recorded when they end; viewers nest them best in start order
+        qStableSort(events.begin(), events.end(), event_before);
+
+        QJsonArray list;
+        QJsonObject process;
+        process.insert(QLatin1String("name"), QCoreApplication::applicationName());
+        QJsonObject meta;
+        meta.insert(QLatin1String("ph"), QLatin1String("M"));
+        meta.insert(QLatin1String("name"), QLatin1String("process_name"));
+        meta.insert(QLatin1String("pid"), 1);
+        meta.insert(QLatin1String("args"), process);
+        list.append(meta);
+        for (int i = 0; i < tracks.size(); i++) {
+                QJsonObject thread;
+                thread.insert(QLatin1String("name"), tracks.at(i));
+                meta.insert(QLatin1String("name"), QLatin1String("thread_name"));
+                meta.insert(QLatin1String("tid"), i + 1);
+                meta.insert(QLatin1String("args"), thread);
+                list.append(meta);
+        }
+
+        foreach(const trace_event_t& ev, events) {
+                QJsonObject obj;
+                obj.insert(QLatin1String("ph"), QString(QLatin1Char(ev.phase)));
+                obj.insert(QLatin1String("cat"), QLatin1String(ev.category));
+                obj.insert(QLatin1String("name"), ev.name);
+                obj.insert(QLatin1String("pid"), 1);
+                obj.insert(QLatin1String("tid"), ev.tid);
+                obj.insert(QLatin1String("ts"), static_cast<double>(ev.ts));
+                if (ev.phase == 'X')
+                        obj.insert(QLatin1String("dur"), static_cast<double>(ev.dur));
+                else
+                        obj.insert(QLatin1String("s"), QLatin1String("t"));
+                if (!ev.args.isEmpty())
+                        obj.insert(QLatin1String("args"), ev.args);
+                list.append(obj);
+        }
+
+        QJsonObject other;
+        other.insert(QLatin1String("version"), QCoreApplication::applicationVersion());
+        other.insert(QLatin1String("dropped"), dropped);
+        QJsonObject doc;
+        doc.insert(QLatin1String("traceEvents"), list);
+        doc.insert(QLatin1String("displayTimeUnit"), QLatin1String("ms"));
+        doc.insert(QLatin1String("otherData"), other);
+        return QJsonDocument(doc).toJson(QJsonDocument::Compact);
+}
+
+/**
+ * @brief write the trace to a file
+ * @param filename name of the file
+ * @return true on success
+ */
+bool flashtrace::save(const QString& filename) const
+{
+        QFile file(filename);
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+                return false;
+        const QByteArray json = toJson();
+        bool success = file.write(json) == json.size();
+        file.close();
+        return success;
+}
+
+/**
+ * @brief start a span if the trace records
+ * @param trace pointer to the trace, or 0
+ * @param category category of the span
+ * @param name name of the span; it must outlive the span (e.g. a literal)
+ */
+trace_span::trace_span(flashtrace* trace, const char* category, const char* name) :
+        m_trace(trace && trace->isEnabled() ? trace : 0),
+        m_category(category),
+        m_name(name),
+        m_ts(m_trace ? m_trace->now() : 0),
+        m_args()
+{
+}
+
+trace_span::~trace_span()
+{
+        if (m_trace)
+                m_trace->complete(m_category, QLatin1String(m_name), m_ts, m_trace->now() - m_ts, m_args);
+}
+
+/**
+ * @brief add a detail to the span
+ * @param key name of the detail
+ * @param value value of the detail
+ */
+void trace_span::arg(const char* key, const QJsonValue& value)
+{
+        if (m_trace)
+                m_args.insert(QLatin1String(key), value);
+}
@@ -0,0 +1,89 @@
+#ifndef FLASHTRACE_H
+#define FLASHTRACE_H
+
+#include <QString>
+#include <QStringList>
+#include <QByteArray>
+#include <QVector>
+#include <QHash>
+#include <QMutex>
+#include <QElapsedTimer>
+#include <QAtomicInt>
+#include <QAtomicInteger>
+#include <QJsonObject>
+#include <QJsonValue>
+
+/**
+ * @brief one span or instant of a trace
+ */
+typedef struct {
+        char            phase;          //!< 'X' for a span, 'i' for an instant
+        const char*     category;       //!< "stage", "step", "fel", "usb", "wait", "host", "urb"
+        QString         name;           //!< name shown in the timeline
+        qint64          ts;             //!< start in usecs since the trace was cleared
+        qint64          dur;            //!< duration in usecs (spans only)
+        int             tid;            //!< track the event is shown on
+        QJsonObject     args;           //!< details shown for the event
+}       trace_event_t;
+
+/**
+ * @brief timeline of a flash session
+ * Records stages, steps, FEL commands, bulk transfers and waits as spans
+ * with microsecond timestamps and exports them in the Chrome trace event
+ * format, which chrome://tracing and Perfetto open. Spans nest by time on
+ * the thread that recorded them. Recording may happen from any thread;
+ * when the trace is disabled, a span costs a single test.
+ */
+class flashtrace
+{
+public:
+        flashtrace();
+
+        void setEnabled(bool on);
+        bool isEnabled() const;
+        void setLimit(int events);
+        void clear();
+        int count() const;
+        qint64 now() const;
+
+        void complete(const char* category, const QString& name, qint64 ts, qint64 dur,
+                      const QJsonObject& args = QJsonObject(), const char* track = 0);
+        void instant(const char* category, const QString& name, const QJsonObject& args = QJsonObject());
+
+        QByteArray toJson() const;
+        bool save(const QString& filename) const;
+
+private:
+        QAtomicInt m_enabled;
+        QElapsedTimer m_clock;
+        QAtomicInteger<qint64> m_origin; //!< m_clock usecs of the last clear()
+        mutable QMutex m_mutex;         //!< protects the members below
+        QVector<trace_event_t> m_events;
+        QHash<quintptr, int> m_threads; //!< track number per thread
+        QHash<QString, int> m_named;    //!< track number per named track
+        QStringList m_tracks;           //!< name per track number
+        int m_limit;
+        int m_dropped;
+        int tid(const char* track);
+};
+
+/**
+ * @brief span recorded from its construction to the end of the scope
+ */
+class trace_span
+{
+public:
+        trace_span(flashtrace* trace, const char* category, const char* name);
+        ~trace_span();
+
+        void arg(const char* key, const QJsonValue& value);
+
+private:
+        flashtrace* m_trace;
+        const char* m_category;
+        const char* m_name;
+        qint64 m_ts;
+        QJsonObject m_args;
+};
+
+#endif // FLASHTRACE_H
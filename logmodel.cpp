@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) Jürgen Buchmüller <pullmoll@t-online.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <QDateTime>
+#include <QColor>
+#include <QFile>
+#include <QTextStream>
+#include "logmodel.h"
+
+logmodel::logmodel(int capacity, QObject* parent) :
+        QAbstractListModel(parent),
+        m_ring(qMax(1, capacity)),
+        m_first(0),
+        m_count(0)
+{
+}
+
+int logmodel::rowCount(const QModelIndex& parent) const
+{
+        if (parent.isValid())
+                return 0;
+        return m_count;
+}
+
+const log_entry_t& logmodel::entry(int row) const
+{
+        return m_ring.at((m_first + row) % m_ring.size());
+}
+
+QVariant logmodel::data(const QModelIndex& index, int role) const
+{
+        if (!index.isValid() || index.row() >= m_count)
+                return QVariant();
+
+        const log_entry_t& e = entry(index.row());
+        switch (role) {
+        case Qt::DisplayRole:
+                return QString("%1  %2")
+                        .arg(QDateTime::fromMSecsSinceEpoch(e.msecs).toString(QLatin1String("hh:mm:ss.zzz")))
+                        .arg(e.text);
+        case Qt::ToolTipRole:
+                return e.text;
+        case Qt::ForegroundRole:
+                return e.severity == Error ? QColor(0xff, 0x40, 0x40) : QColor(0x00, 0xa0, 0x20);
+        }
+        return QVariant();
+}
+
+/**
+ * @brief append lines to the log
+ * The oldest lines are dropped if the log would exceed its capacity.
+ * Appending a batch emits one removal and one insertion, so the view
+ * updates once per batch.
+ * @param entries list of lines to append
+ */
+void logmodel::append(const QList<log_entry_t>& entries)
+{
+        const int capacity = m_ring.size();
+        // lines beyond the capacity would be dropped right away
+        int skip = qMax(0, entries.size() - capacity);
+        int count = entries.size() - skip;
+        if (count <= 0)
+                return;
+
+        int overflow = qMax(0, m_count + count - capacity);
+        if (overflow > 0) {
+                beginRemoveRows(QModelIndex(), 0, overflow - 1);
+                m_first = (m_first + overflow) % capacity;
+                m_count -= overflow;
+                endRemoveRows();
+        }
+
+        beginInsertRows(QModelIndex(), m_count, m_count + count - 1);
+        for (int i = 0; i < count; i++)
+                m_ring[(m_first + m_count + i) % capacity] = entries.at(skip + i);
+        m_count += count;
+        endInsertRows();
+}
+
+void logmodel::clear()
+{
+        beginResetModel();
+        m_ring = QVector<log_entry_t>(m_ring.size());
+        m_first = 0;
+        m_count = 0;
+        endResetModel();
+}
+
+/**
+ * @brief write the log to a text file
+ * @param filename name of the file to write
+ * @return true on success
+ */
+bool logmodel::save(const QString& filename) const
+{
+        QFile file(filename);
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Text))
+                return false;
+
+        QTextStream str(&file);
+        str.setCodec("UTF-8");
+        for (int row = 0; row < m_count; row++) {
+                const log_entry_t& e = entry(row);
+                str << QDateTime::fromMSecsSinceEpoch(e.msecs).toString(QLatin1String("yyyy-MM-dd hh:mm:ss.zzz"))
+                    << (e.severity == Error ? " ERROR  " : " STATUS ")
+                    << e.text << '\n';
+        }
+        str.flush();
+        return file.error() == QFile::NoError;
+}
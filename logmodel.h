@@ -0,0 +1,50 @@
+#ifndef LOGMODEL_H
+#define LOGMODEL_H
+
+#include <QAbstractListModel>
+#include <QVector>
+#include <QList>
+#include <QString>
+
+/**
+ * @brief one line of the session log
+ */
+typedef struct {
+        qint64          msecs;          //!< time in msecs since the epoch
+        int             severity;       //!< logmodel::severity_e
+        QString         text;           //!< text of the line
+}       log_entry_t;
+
+/**
+ * @brief session log with a fixed number of lines
+ * The lines are kept in a ring buffer; once it is full, every appended
+ * line replaces the oldest one. Appending is O(1) per line and memory
+ * does not grow with the length of the session. Views only ask for the
+ * rows they show.
+ */
+class logmodel : public QAbstractListModel
+{
+        Q_OBJECT
+public:
+        enum severity_e {
+                Status,
+                Error
+        };
+
+        explicit logmodel(int capacity = 10000, QObject* parent = 0);
+
+        int rowCount(const QModelIndex& parent = QModelIndex()) const;
+        QVariant data(const QModelIndex& index, int role = Qt::DisplayRole) const;
+
+        void append(const QList<log_entry_t>& entries);
+        void clear();
+        bool save(const QString& filename) const;
+
+private:
+        QVector<log_entry_t> m_ring;
+        int m_first;
+        int m_count;
+        const log_entry_t& entry(int row) const;
+};
+
+#endif // LOGMODEL_H
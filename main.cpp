@@ -15,7 +15,10 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "cubieflasher.h"
+#include "payloads.h"
 #include <QApplication>
+#include <QCommandLineParser>
+#include <QMessageBox>
 
 int main(int argc, char *argv[])
 {
@@ -26,6 +29,24 @@ int main(int argc, char *argv[])
         a.setOrganizationName(QLatin1String("pullmoll"));
         a.setOrganizationDomain(QLatin1String("mame.myds.me"));
 
+        QCommandLineParser parser;
+        parser.setApplicationDescription(QLatin1String("Flash the NAND of a Cubietruck over USB FEL."));
+        parser.addHelpOption();
+        parser.addVersionOption();
+        QCommandLineOption opt_bundle(QLatin1String("bundle"),
+                                      QLatin1String("Take the payloads from the flash bundle <file> instead of the built-in ones."),
+                                      QLatin1String("file"));
+        parser.addOption(opt_bundle);
+        parser.process(a);
+
+        if (parser.isSet(opt_bundle)) {
+                QString error;
+                if (!payloads::setBundle(parser.value(opt_bundle), &error)) {
+                        QMessageBox::critical(0, a.applicationName(), error);
+                        return 1;
+                }
+        }
+
         CubieFlasher w;
         w.show();
 
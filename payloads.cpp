@@ -0,0 +1,347 @@
+/*
+ * Copyright (C) Jürgen Buchmüller <pullmoll@t-online.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <QDir>
+#include <QFile>
+#include <QHash>
+#include <QMutex>
+#include <QBuffer>
+#include <QRegExp>
+#include "payloads.h"
+#include "flashbundle.h"
+
+static QMutex g_mutex;
+static flashbundle* g_bundle = 0;
+static QHash<QString, QByteArray> g_files;
+static QHash<QString, QByteArray> g_hexlogs;
+
+/**
+ * @brief return a resource path name for a payload name
+ * @param name name of the payload
+ * @return QString with the filename
+ */
+QString payloads::path(const QString& name)
+{
+        if (g_bundle && g_bundle->contains(name))
+                return QString("bundle:%1").arg(name);
+        return QString(":/cubietruck/data/%1").arg(name);
+}
+
+/**
+ * @brief return the names of all available payloads
+ * @return QStringList with the names
+ */
+QStringList payloads::names()
+{
+        QStringList names = QDir(QLatin1String(":/cubietruck/data")).entryList(QDir::Files);
+        if (g_bundle) {
+                foreach(const QString& name, g_bundle->names())
+                        if (!names.contains(name))
+                                names += name;
+                names.sort();
+        }
+        return names;
+}
+
+/**
+ * @brief open a payload by the path returned from path()
+ * Payloads of a bundle are read from the mapping through a QBuffer,
+ * everything else is opened as a file.
+ * @param path path name of the payload
+ * @return pointer to a QIODevice open for reading, to be deleted by the caller
+ */
+QIODevice* payloads::open(const QString& path)
+{
+        if (path.startsWith(QLatin1String("bundle:"))) {
+                QBuffer* buffer = new QBuffer;
+                buffer->setData(get(path.mid(7)));
+                // a damaged payload is left closed
+                if (!buffer->data().isEmpty())
+                        buffer->open(QIODevice::ReadOnly);
+                return buffer;
+        }
+        QFile* file = new QFile(path);
+        file->open(QIODevice::ReadOnly);
+        return file;
+}
+
+/**
+ * @brief return a payload of the bundle, checking its digest
+ * Called without g_mutex held, so hashing a large payload does not hold
+ * up the other threads; the caller caches the result.
+ * @param bundle the bundle, which is never closed once set
+ * @param name name of the payload
+ * @param error optional pointer to a QString receiving an error message
+ * @return QByteArray referring to the mapped data; empty on error
+ */
+static QByteArray bundled(const flashbundle* bundle, const QString& name, QString* error)
+{
+        if (!bundle->verify(name)) {
+                if (error)
+                        *error = payloads::tr("Payload %1 in bundle %2 is damaged.").arg(name).arg(bundle->fileName());
+                return QByteArray();
+        }
+        return bundle->data(name);
+}
+
+/**
+ * @brief return the contents of a payload
+ * @param name name of the payload
+ * @param error optional pointer to a QString receiving an error message
+ * @return QByteArray with the data; empty on error
+ */
+QByteArray payloads::get(const QString& name, QString* error)
+{
+        const flashbundle* bundle = 0;
+        {
+                QMutexLocker lock(&g_mutex);
+                QHash<QString, QByteArray>::const_iterator it = g_files.constFind(name);
+                if (it != g_files.constEnd())
+                        return it.value();
+                if (g_bundle && g_bundle->contains(name))
+                        bundle = g_bundle;
+        }
+
+        if (bundle) {
+                QByteArray data = bundled(bundle, name, error);
+                if (!data.isEmpty()) {
+                        QMutexLocker lock(&g_mutex);
+                        g_files.insert(name, data);
+                }
+                return data;
+        }
+
+        QFile in(path(name));
+        if (!in.open(QIODevice::ReadOnly)) {
+                if (error)
+                        *error = tr("Failed to open input file: %1").arg(in.fileName());
+                return QByteArray();
+        }
+        QByteArray data = in.readAll();
+        in.close();
+        QMutexLocker lock(&g_mutex);
+        g_files.insert(name, data);
+        return data;
+}
+
+/**
+ * @brief return a payload of the bundle without checking its digest
+ * For callers that hash the payload anyway and can check the digest in
+ * the same pass; they hand an intact payload to verified().
+ * @param name name of the payload
+ * @param sha256 optional pointer to a QByteArray receiving the digest stored in the bundle
+ * @return QByteArray referring to the mapped data; empty if not bundled
+ */
+QByteArray payloads::mapped(const QString& name, QByteArray* sha256)
+{
+        const flashbundle* bundle = 0;
+        {
+                QMutexLocker lock(&g_mutex);
+                if (g_bundle && g_bundle->contains(name))
+                        bundle = g_bundle;
+        }
+        if (!bundle)
+                return QByteArray();
+        if (sha256)
+                *sha256 = bundle->digest(name);
+        return bundle->data(name);
+}
+
+/**
+ * @brief cache a bundled payload whose digest the caller has checked
+ * @param name name of the payload
+ * @param data data as returned by mapped()
+ */
+void payloads::verified(const QString& name, const QByteArray& data)
+{
+        QMutexLocker lock(&g_mutex);
+        g_files.insert(name, data);
+}
+
+/**
+ * @brief convert a hex dump with "offset:" prefixes to binary
+ */
+static QByteArray decode_hexlog(const QByteArray& text)
+{
+        QByteArray dest;
+        foreach(const QByteArray& line, text.split('\n')) {
+                QString hex = QString::fromLatin1(line);
+                hex = hex.remove(QRegExp(QLatin1String("^.*:")));
+                hex = hex.remove(QChar(' '));
+                dest.append(QByteArray::fromHex(hex.toLatin1()));
+        }
+        return dest;
+}
+
+/**
+ * @brief return the binary contents of a trace log payload
+ * Trace logs are hex dumps with "offset:" prefixes as copied
+ * from the original USB capture.
+ * @param name name of the payload
+ * @param error optional pointer to a QString receiving an error message
+ * @return QByteArray with the data; empty on error
+ */
+QByteArray payloads::hexlog(const QString& name, QString* error)
+{
+        const flashbundle* bundle = 0;
+        {
+                QMutexLocker lock(&g_mutex);
+                QHash<QString, QByteArray>::const_iterator it = g_hexlogs.constFind(name);
+                if (it != g_hexlogs.constEnd())
+                        return it.value();
+                // bundles keep the logs decoded
+                if (g_bundle && (g_bundle->flags(name) & FLASHBUNDLE_HEXLOG))
+                        bundle = g_bundle;
+        }
+        if (bundle) {
+                QByteArray data = bundled(bundle, name, error);
+                if (!data.isEmpty()) {
+                        QMutexLocker lock(&g_mutex);
+                        g_hexlogs.insert(name, data);
+                }
+                return data;
+        }
+
+        QByteArray text = get(name, error);
+        if (text.isEmpty())
+                return QByteArray();
+
+        QByteArray dest = decode_hexlog(text);
+        QMutexLocker lock(&g_mutex);
+        g_hexlogs.insert(name, dest);
+        return dest;
+}
+
+/**
+ * @brief load all payloads into the cache
+ */
+void payloads::preload()
+{
+        foreach(const QString& name, names()) {
+                if (name.startsWith(QLatin1String("pt")))
+                        hexlog(name);
+                else
+                        get(name);
+        }
+}
+
+/**
+ * @brief drop all cached payloads
+ */
+void payloads::clear()
+{
+        QMutexLocker lock(&g_mutex);
+        g_files.clear();
+        g_hexlogs.clear();
+}
+
+/**
+ * @brief use the payloads of a flash bundle instead of the resources
+ * Payloads missing from the bundle still come from the resources.
+ * The bundle stays mapped until the process exits, since payloads
+ * handed out earlier refer to it.
+ * @param filename name of the bundle
+ * @param error optional pointer to a QString receiving an error message
+ * @return true on success
+ */
+bool payloads::setBundle(const QString& filename, QString* error)
+{
+        flashbundle* bundle = new flashbundle;
+        if (!bundle->open(filename)) {
+                if (error)
+                        *error = bundle->errorString();
+                delete bundle;
+                return false;
+        }
+        QMutexLocker lock(&g_mutex);
+        g_bundle = bundle;
+        g_files.clear();
+        g_hexlogs.clear();
+        return true;
+}
+
+/**
+ * @brief return the file name of the bundle in use, or an empty string
+ */
+QString payloads::bundle()
+{
+        return g_bundle ? g_bundle->fileName() : QString();
+}
+
+/**
+ * @brief return the address a payload is loaded to
+ * A bundle may move a payload, e.g. for firmware linked elsewhere;
+ * payloads without an address in the bundle stay where the caller
+ * would load them.
+ * @param name name of the payload
+ * @param fallback address used if the bundle gives none
+ * @return the address from the bundle, or fallback
+ */
+quint32 payloads::address(const QString& name, quint32 fallback)
+{
+        QMutexLocker lock(&g_mutex);
+        const quint32 addr = g_bundle ? g_bundle->address(name) : 0;
+        return addr ? addr : fallback;
+}
+
+/**
+ * @brief write all payloads to a flash bundle
+ * Files in dir replace or add payloads of the same name, so firmware
+ * can be swapped without a rebuild. Hex logs (pt*) are stored decoded.
+ * @param filename name of the bundle to write
+ * @param dir directory with replacement payloads, or empty for none
+ * @param addresses load address per payload name
+ * @param error optional pointer to a QString receiving an error message
+ * @return true on success
+ */
+bool payloads::buildBundle(const QString& filename, const QString& dir,
+                           const QHash<QString, quint32>& addresses, QString* error)
+{
+        QStringList all = names();
+        QStringList files;
+        if (!dir.isEmpty()) {
+                files = QDir(dir).entryList(QDir::Files);
+                foreach(const QString& name, files)
+                        if (!all.contains(name))
+                                all += name;
+                all.sort();
+        }
+
+        QList<flashbundle_item_t> items;
+        foreach(const QString& name, all) {
+                flashbundle_item_t item;
+                item.name = name;
+                item.address = addresses.value(name, 0);
+                item.flags = name.startsWith(QLatin1String("pt")) ? FLASHBUNDLE_HEXLOG : 0;
+                if (files.contains(name)) {
+                        QFile in(QDir(dir).filePath(name));
+                        if (!in.open(QIODevice::ReadOnly)) {
+                                if (error)
+                                        *error = tr("Failed to open input file: %1").arg(in.fileName());
+                                return false;
+                        }
+                        item.data = in.readAll();
+                        if (item.flags & FLASHBUNDLE_HEXLOG)
+                                item.data = decode_hexlog(item.data);
+                } else {
+                        item.data = (item.flags & FLASHBUNDLE_HEXLOG) ? hexlog(name, error) : get(name, error);
+                        if (item.data.isEmpty())
+                                return false;
+                }
+                items += item;
+        }
+        return flashbundle::write(filename, items, error);
+}
@@ -0,0 +1,39 @@
+#ifndef PAYLOADS_H
+#define PAYLOADS_H
+
+#include <QCoreApplication>
+#include <QByteArray>
+#include <QString>
+#include <QStringList>
+#include <QHash>
+#include <QIODevice>
+
+/**
+ * @brief process wide cache of the stage payloads
+ * Payloads are loaded from the resources once and then handed out as
+ * implicitly shared QByteArrays, so repeated flash sessions (and other
+ * threads) do not read or decompress them again.
+ * A flash bundle set with setBundle() takes precedence over the resources:
+ * its payloads are handed out straight from the mapped file.
+ */
+class payloads
+{
+        Q_DECLARE_TR_FUNCTIONS(payloads)
+public:
+        static QString path(const QString& name);
+        static QStringList names();
+        static QByteArray get(const QString& name, QString* error = 0);
+        static QByteArray hexlog(const QString& name, QString* error = 0);
+        static void preload();
+        static void clear();
+        static QIODevice* open(const QString& path);
+        static QByteArray mapped(const QString& name, QByteArray* sha256 = 0);
+        static void verified(const QString& name, const QByteArray& data);
+        static bool setBundle(const QString& filename, QString* error = 0);
+        static QString bundle();
+        static quint32 address(const QString& name, quint32 fallback);
+        static bool buildBundle(const QString& filename, const QString& dir,
+                                const QHash<QString, quint32>& addresses, QString* error = 0);
+};
+
+#endif // PAYLOADS_H
@@ -0,0 +1,209 @@
+/*
+ * Copyright (C) Jürgen Buchmüller <pullmoll@t-online.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <QPainter>
+#include <QPolygonF>
+#include <QFormLayout>
+#include <QVBoxLayout>
+#include <qmath.h>
+#include "perfpanel.h"
+
+#define GRAPH_POINTS    240     //!< points shown in the graph
+#define GRAPH_MSECS     250     //!< time per point, so the graph shows one minute
+
+throughputgraph::throughputgraph(int points, QWidget* parent) :
+        QWidget(parent),
+        m_ring(qMax(2, points)),
+        m_first(0),
+        m_count(0)
+{
+        setMinimumHeight(80);
+        setAutoFillBackground(true);
+        setBackgroundRole(QPalette::Base);
+}
+
+QSize throughputgraph::sizeHint() const
+{
+        return QSize(m_ring.size(), 120);
+}
+
+/**
+ * @brief add a point, dropping the oldest one if the graph is full
+ * @param mbps throughput in MB/s
+ */
+void throughputgraph::add(qreal mbps)
+{
+        if (m_count < m_ring.size()) {
+                m_ring[(m_first + m_count) % m_ring.size()] = mbps;
+                m_count++;
+        } else {
+                m_ring[m_first] = mbps;
+                m_first = (m_first + 1) % m_ring.size();
+        }
+        update();
+}
+
+void throughputgraph::clear()
+{
+        m_first = 0;
+        m_count = 0;
+        update();
+}
+
+qreal throughputgraph::value(int i) const
+{
+        return m_ring.at((m_first + i) % m_ring.size());
+}
+
+void throughputgraph::paintEvent(QPaintEvent* e)
+{
+        Q_UNUSED(e);
+        QPainter p(this);
+        const QRectF area = QRectF(rect()).adjusted(4, 4, -4, -16);
+
+        // scale to the next power of two above the peak, at least 1 MB/s
+        qreal peak = 0;
+        for (int i = 0; i < m_count; i++)
+                peak = qMax(peak, value(i));
+        qreal scale = 1.0;
+        while (scale < peak)
+                scale *= 2;
+
+        p.setPen(palette().color(QPalette::Mid));
+        p.drawLine(area.bottomLeft(), area.bottomRight());
+        p.drawLine(QPointF(area.left(), area.top()), QPointF(area.right(), area.top()));
+        p.setPen(palette().color(QPalette::Text));
+        p.drawText(QRectF(area.left(), area.bottom() + 2, area.width(), 14),
+                   Qt::AlignLeft | Qt::AlignVCenter, tr("%1 MB/s").arg(scale));
+        p.drawText(QRectF(area.left(), area.bottom() + 2, area.width(), 14),
+                   Qt::AlignRight | Qt::AlignVCenter, tr("%1 s").arg(GRAPH_POINTS * GRAPH_MSECS / 1000));
+        if (m_count < 2)
+                return;
+
+        QPolygonF line;
+        const qreal dx = area.width() / (m_ring.size() - 1);
+        const qreal x0 = area.right() - (m_count - 1) * dx;
+        for (int i = 0; i < m_count; i++)
+                line << QPointF(x0 + i * dx, area.bottom() - area.height() * value(i) / scale);
+        p.setRenderHint(QPainter::Antialiasing);
+        p.setPen(QPen(QColor(0x00, 0xa0, 0x20), 1.5));
+        p.drawPolyline(line);
+}
+
+perfpanel::perfpanel(QWidget* parent) :
+        QDockWidget(tr("Performance"), parent),
+        m_graph(0),
+        m_mbps(0),
+        m_step(0),
+        m_inflight(0),
+        m_polls(0),
+        m_wait(0),
+        m_transfer(0),
+        m_clock(),
+        m_sum(0),
+        m_samples(0)
+{
+        setObjectName(QLatin1String("performanceDock"));
+
+        QWidget* w = new QWidget;
+        QVBoxLayout* layout = new QVBoxLayout(w);
+        m_graph = new throughputgraph(GRAPH_POINTS);
+        layout->addWidget(m_graph, 1);
+
+        QFormLayout* form = new QFormLayout;
+        m_mbps = new QLabel;
+        form->addRow(tr("Throughput:"), m_mbps);
+        m_step = new QLabel;
+        form->addRow(tr("Step:"), m_step);
+        m_inflight = new QLabel;
+        form->addRow(tr("Transfers in flight:"), m_inflight);
+        m_polls = new QLabel;
+        m_polls->setToolTip(tr("Polls of the running wait for the device (0203 until ok)"));
+        form->addRow(tr("Device polls:"), m_polls);
+        m_wait = new QLabel;
+        m_wait->setToolTip(tr("Time the device was busy while the host waited between polls"));
+        form->addRow(tr("Device wait:"), m_wait);
+        m_transfer = new QLabel;
+        m_transfer->setToolTip(tr("Time spent in USB requests, payload transfers and responses"));
+        form->addRow(tr("USB transfer:"), m_transfer);
+        layout->addLayout(form);
+
+        setWidget(w);
+        clear();
+}
+
+/**
+ * @brief set a label's text only if it changed, to avoid needless relayouts
+ */
+void perfpanel::setText(QLabel* label, const QString& text)
+{
+        if (label->text() != text)
+                label->setText(text);
+}
+
+/**
+ * @brief forget the graph and reset the labels
+ */
+void perfpanel::clear()
+{
+        m_graph->clear();
+        m_sum = 0;
+        m_samples = 0;
+        m_clock.start();
+        setText(m_mbps, tr("-"));
+        setText(m_step, tr("idle"));
+        setText(m_inflight, QLatin1String("0"));
+        setText(m_polls, tr("-"));
+        setText(m_wait, QLatin1String("0.0 s"));
+        setText(m_transfer, QLatin1String("0.0 s"));
+}
+
+/**
+ * @brief show a sample of the session
+ * Call at the display frame rate; the graph gets a point with the mean
+ * of the samples every GRAPH_MSECS.
+ * @param sample progress sample of the frame
+ * @param stats USB operation statistics
+ * @param step name of the current step, or empty if idle
+ */
+void perfpanel::refresh(const progress_sample_t& sample, const felstats& stats, const QString& step)
+{
+        m_sum += sample.mbps;
+        m_samples++;
+        if (m_clock.elapsed() >= GRAPH_MSECS) {
+                m_graph->add(m_sum / m_samples);
+                m_sum = 0;
+                m_samples = 0;
+                m_clock.start();
+                setText(m_mbps, tr("%1 MB/s (avg %2)")
+                        .arg(sample.mbps, 0, 'f', 2)
+                        .arg(sample.mbps_avg, 0, 'f', 2));
+        }
+
+        setText(m_step, step.isEmpty() ? tr("idle") : step);
+        setText(m_inflight, QString::number(stats.inFlight()));
+        int polls = stats.waitPolls();
+        setText(m_polls, polls < 0 ? tr("-") : QString::number(polls));
+
+        const quint64 transfer = stats.totalUsecs(felstats::OP_AWUC) +
+                        stats.totalUsecs(felstats::OP_SEND) +
+                        stats.totalUsecs(felstats::OP_RECV) +
+                        stats.totalUsecs(felstats::OP_AWUS);
+        const quint64 wait = stats.totalUsecs(felstats::OP_WAIT);
+        const quint64 poll = stats.totalUsecs(felstats::OP_POLL);
+        setText(m_wait, tr("%1 s").arg((wait > poll ? wait - poll : 0) / 1e6, 0, 'f', 1));
+        setText(m_transfer, tr("%1 s").arg(transfer / 1e6, 0, 'f', 1));
+}
@@ -0,0 +1,66 @@
+#ifndef PERFPANEL_H
+#define PERFPANEL_H
+
+#include <QDockWidget>
+#include <QWidget>
+#include <QLabel>
+#include <QVector>
+#include <QPaintEvent>
+#include <QElapsedTimer>
+#include "flashprogress.h"
+#include "felstats.h"
+
+/**
+ * @brief rolling graph of the throughput
+ * Keeps a fixed number of points in a ring; adding one is O(1).
+ */
+class throughputgraph : public QWidget
+{
+        Q_OBJECT
+public:
+        throughputgraph(int points, QWidget* parent = 0);
+
+        void add(qreal mbps);
+        void clear();
+        QSize sizeHint() const;
+
+protected:
+        void paintEvent(QPaintEvent* e);
+
+private:
+        QVector<qreal> m_ring;
+        int m_first;
+        int m_count;
+        qreal value(int i) const;
+};
+
+/**
+ * @brief dockable panel with the USB activity of a session
+ * Fed by refresh() from the window's frame timer with samples of the
+ * progress aggregator and the operation statistics; both only read
+ * atomic counters, so the panel never slows the flash down.
+ */
+class perfpanel : public QDockWidget
+{
+        Q_OBJECT
+public:
+        perfpanel(QWidget* parent = 0);
+
+        void refresh(const progress_sample_t& sample, const felstats& stats, const QString& step);
+        void clear();
+
+private:
+        throughputgraph* m_graph;
+        QLabel* m_mbps;
+        QLabel* m_step;
+        QLabel* m_inflight;
+        QLabel* m_polls;
+        QLabel* m_wait;
+        QLabel* m_transfer;
+        QElapsedTimer m_clock;  //!< time since the last graph point
+        qreal m_sum;            //!< MB/s summed since the last graph point
+        int m_samples;          //!< samples summed since the last graph point
+        void setText(QLabel* label, const QString& text);
+};
+
+#endif // PERFPANEL_H
@@ -0,0 +1,19 @@
+#-------------------------------------------------
+#
+# Counts the heap allocations of FEL commands replayed through usb_FEL
+#
+#-------------------------------------------------
+
+QT       = core testlib
+CONFIG  += console testcase
+CONFIG  -= app_bundle
+
+TARGET = tst_allocs
+TEMPLATE = app
+
+include(../../flashcore.pri)
+
+# the per-transfer tracing is compiled out, as in release builds
+DEFINES += QT_NO_DEBUG_OUTPUT
+
+SOURCES += tst_allocs.cpp
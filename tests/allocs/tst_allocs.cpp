@@ -0,0 +1,269 @@
+/*
+ * Copyright (C) Jürgen Buchmüller <pullmoll@t-online.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <QtTest>
+#include <QTemporaryFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include "usbcapture.h"
+#include "usbfel.h"
+
+#if defined(__GLIBC__)
+/*
+ * Counting allocator: malloc, calloc and realloc are interposed and
+ * forward to glibc. operator new and the Qt containers end up in malloc,
+ * so every heap allocation of the counting thread is seen.
+ */
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t nmemb, size_t size);
+extern "C" void* __libc_realloc(void* ptr, size_t size);
+
+static thread_local bool g_counting = false;
+static thread_local int g_allocs = 0;
+
+extern "C" void* malloc(size_t size)
+{
+        if (g_counting)
+                g_allocs++;
+        return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t nmemb, size_t size)
+{
+        if (g_counting)
+                g_allocs++;
+        return __libc_calloc(nmemb, size);
+}
+
+extern "C" void* realloc(void* ptr, size_t size)
+{
+        if (g_counting)
+                g_allocs++;
+        return __libc_realloc(ptr, size);
+}
+#endif
+
+/**
+ * @brief FEL commands whose exchanges are replayed
+ */
+enum {
+        CMD_VERSION,
+        CMD_READ,
+        CMD_WRITE,
+        CMD_WRITE_COMBINED,
+        CMD_EXECUTE,
+        CMD_WAIT_POLL
+};
+
+#define CMD_ADDR        0x7e00  //!< SRAM address of the reads, writes and execute
+#define CMD_SIZE        64      //!< bytes read and written
+
+class tst_allocs : public QObject
+{
+        Q_OBJECT
+private slots:
+        void command_data();
+        void command();
+
+private:
+        QJsonArray m_transfers;
+        void transfer(int ep, const QByteArray& data);
+        void awuc(quint16 request, quint32 length);
+        void request(quint32 code, quint32 address, quint32 length);
+        void read(const QByteArray& data);
+        void write(const QByteArray& data);
+        void status();
+        void exchange(int cmd);
+        bool run(usb_FEL& fel, int cmd);
+};
+
+void tst_allocs::transfer(int ep, const QByteArray& data)
+{
+        QJsonObject t;
+        t.insert(QLatin1String("frame"), m_transfers.size() + 1);
+        t.insert(QLatin1String("ep"), ep);
+        t.insert(QLatin1String("length"), data.size());
+        t.insert(QLatin1String("data"), QString::fromLatin1(data.toHex()));
+        m_transfers.append(t);
+}
+
+void tst_allocs::awuc(quint16 request, quint32 length)
+{
+        QByteArray awuc(32, '\0');
+        uchar* d = reinterpret_cast<uchar *>(awuc.data());
+        memcpy(d, "AWUC", 4);
+        qToLittleEndian<quint32>(length, d + 8);
+        qToLittleEndian<quint16>(request, d + 16);
+        qToLittleEndian<quint16>(static_cast<quint16>(length >> 16), d + 18);
+        qToLittleEndian<quint16>(static_cast<quint16>(length >> 16), d + 20);
+        transfer(usb_FEL::AW_USB_FEL_BULK_EP_OUT, awuc);
+}
+
+void tst_allocs::request(quint32 code, quint32 address, quint32 length)
+{
+        QByteArray req(16, '\0');
+        uchar* d = reinterpret_cast<uchar *>(req.data());
+        qToLittleEndian<quint32>(code, d);
+        qToLittleEndian<quint32>(address, d + 4);
+        qToLittleEndian<quint32>(length, d + 8);
+        write(req);
+}
+
+void tst_allocs::read(const QByteArray& data)
+{
+        awuc(usb_FEL::AW_USB_READ, data.size());
+        transfer(usb_FEL::AW_USB_FEL_BULK_EP_IN, data);
+        transfer(usb_FEL::AW_USB_FEL_BULK_EP_IN, QByteArray("AWUS\0\0\0\0\0\0\0\0\0", 13));
+}
+
+void tst_allocs::write(const QByteArray& data)
+{
+        awuc(usb_FEL::AW_USB_WRITE, data.size());
+        transfer(usb_FEL::AW_USB_FEL_BULK_EP_OUT, data);
+        transfer(usb_FEL::AW_USB_FEL_BULK_EP_IN, QByteArray("AWUS\0\0\0\0\0\0\0\0\0", 13));
+}
+
+void tst_allocs::status()
+{
+        read(QByteArray("\xff\xff\0\0\0\0\0\0", 8));
+}
+
+/**
+ * @brief append the transfers of one successful command to the fixture
+ */
+void tst_allocs::exchange(int cmd)
+{
+        switch (cmd) {
+        case CMD_VERSION:
+                request(usb_FEL::AW_FEL_VERSION, 0, 0);
+                read(QByteArray("AWUSBFEX\x00\x23\x16\x00\x01\x00\x00\x00\x01\x00\x44\x08"
+                                "\x00\x7e\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00", 32));
+                status();
+                break;
+        case CMD_READ:
+                request(usb_FEL::AW_FEL_1_READ, CMD_ADDR, CMD_SIZE);
+                read(QByteArray(CMD_SIZE, '\x5a'));
+                status();
+                break;
+        case CMD_WRITE:
+        case CMD_WRITE_COMBINED:
+                request(usb_FEL::AW_FEL_1_WRITE, CMD_ADDR, CMD_SIZE);
+                write(QByteArray(CMD_SIZE, '\xa5'));
+                status();
+                break;
+        case CMD_EXECUTE:
+                request(usb_FEL::AW_FEL_1_EXEC, CMD_ADDR, 0);
+                status();
+                break;
+        case CMD_WAIT_POLL:
+                request(usb_FEL::AW_FEL_2_0203, 0, 0);
+                read(QByteArray("\x00\x01", 2) + QByteArray(30, '\0'));
+                status();
+                break;
+        }
+}
+
+/**
+ * @brief run one command against the replayed board
+ * @return true if it succeeded
+ */
+bool tst_allocs::run(usb_FEL& fel, int cmd)
+{
+        uchar buf[CMD_SIZE];
+        int msec = 0;
+        switch (cmd) {
+        case CMD_VERSION:
+                return fel.aw_fel_get_version() != 0;
+        case CMD_READ:
+                return fel.aw_fel_read(CMD_ADDR, buf, sizeof(buf));
+        case CMD_WRITE:
+                memset(buf, 0xa5, sizeof(buf));
+                return fel.aw_fel_write(CMD_ADDR, buf, sizeof(buf));
+        case CMD_WRITE_COMBINED:
+                // two halves, held back and sent as one write by the flush
+                memset(buf, 0xa5, sizeof(buf));
+                fel.setWriteCombining(true);
+                return fel.aw_fel_write(CMD_ADDR + CMD_SIZE / 2, buf, CMD_SIZE / 2) &&
+                       fel.aw_fel_write(CMD_ADDR, buf, CMD_SIZE / 2) &&
+                       fel.flush_writes();
+        case CMD_EXECUTE:
+                return fel.aw_fel_execute(CMD_ADDR);
+        case CMD_WAIT_POLL:
+                fel.aw_fel2_wait_begin(1);
+                return fel.aw_fel2_wait_poll(&msec) == usb_FEL::AW_WAIT_DONE;
+        }
+        return false;
+}
+
+void tst_allocs::command_data()
+{
+        QTest::addColumn<int>("cmd");
+        QTest::newRow("version") << static_cast<int>(CMD_VERSION);
+        QTest::newRow("read") << static_cast<int>(CMD_READ);
+        QTest::newRow("write") << static_cast<int>(CMD_WRITE);
+        QTest::newRow("write_combined") << static_cast<int>(CMD_WRITE_COMBINED);
+        QTest::newRow("execute") << static_cast<int>(CMD_EXECUTE);
+        QTest::newRow("wait_poll") << static_cast<int>(CMD_WAIT_POLL);
+}
+
+/**
+ * @brief a FEL command on the success path allocates nothing
+ * The command is run once to warm up (e.g. the poll statistics of a call
+ * site are created on its first wait), and counted the second time.
+ * The transfers go to the replay backend, so this covers the request
+ * codec and write combining of usb_FEL, not what libusb allocates for
+ * a transfer, and it runs with tracing off.
+ */
+void tst_allocs::command()
+{
+#if defined(__GLIBC__)
+        QFETCH(int, cmd);
+        m_transfers = QJsonArray();
+        exchange(cmd);
+        exchange(cmd);
+        QJsonObject root;
+        root.insert(QLatin1String("version"), 1);
+        root.insert(QLatin1String("transfers"), m_transfers);
+        QTemporaryFile file;
+        QVERIFY(file.open());
+        file.write(QJsonDocument(root).toJson());
+        file.close();
+
+        usbcapture capture;
+        QVERIFY2(capture.load(file.fileName()), qPrintable(capture.errorString()));
+        usb_FEL fel;
+        fel.setReplay(&capture);
+        QVERIFY(fel.usb_open());
+        QVERIFY2(run(fel, cmd), qPrintable(capture.errorString()));
+
+        g_allocs = 0;
+        g_counting = true;
+        const bool success = run(fel, cmd);
+        g_counting = false;
+        QVERIFY2(success, qPrintable(capture.errorString()));
+        QCOMPARE(g_allocs, 0);
+        QCOMPARE(capture.position(), capture.transfers().size());
+#else
+        QSKIP("The counting allocator needs glibc.");
+#endif
+}
+
+QTEST_GUILESS_MAIN(tst_allocs)
+
+#include "tst_allocs.moc"
@@ -0,0 +1,20 @@
+#-------------------------------------------------
+#
+# Replays the fixture fel_version.json through usb_FEL and
+# imports it from the captures it was made from; replays
+# plans/stage1.json against the stage 1 fixture stage1.json
+#
+#-------------------------------------------------
+
+QT       = core testlib
+CONFIG  += console testcase
+CONFIG  -= app_bundle
+
+TARGET = tst_replay
+TEMPLATE = app
+
+include(../../flashcore.pri)
+
+DEFINES += FIXTURE_DIR=\\\"$$PWD\\\"
+
+SOURCES += tst_replay.cpp
@@ -0,0 +1,228 @@
+/*
+ * Copyright (C) Jürgen Buchmüller <pullmoll@t-online.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <QtTest>
+#include <QSignalSpy>
+#include <QFile>
+#include <QTemporaryFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include "usbcapture.h"
+#include "usbfel.h"
+#include "flashplan.h"
+
+#define FIXTURE         FIXTURE_DIR "/fel_version.json"
+#define STAGE1          FIXTURE_DIR "/stage1.json"
+#define VERSION_DATA    4       //!< index of the 32 byte version data in the fixture
+
+class tst_replay : public QObject
+{
+        Q_OBJECT
+private slots:
+        void version();
+        void short_in_fails();
+        void short_in_loose();
+        void wrong_out_fails();
+        void import_data();
+        void import();
+        void stage1_data();
+        void stage1();
+
+private:
+        bool truncated(QTemporaryFile& file, int index, int bytes);
+};
+
+/**
+ * @brief write a copy of the fixture with the data of one transfer cut short
+ * @param file temporary file receiving the copy
+ * @param index index of the transfer
+ * @param bytes number of data bytes to keep
+ * @return true on success
+ */
+bool tst_replay::truncated(QTemporaryFile& file, int index, int bytes)
+{
+        QFile in(QLatin1String(FIXTURE));
+        if (!in.open(QIODevice::ReadOnly))
+                return false;
+        QJsonObject root = QJsonDocument::fromJson(in.readAll()).object();
+        QJsonArray transfers = root.value(QLatin1String("transfers")).toArray();
+        QJsonObject t = transfers.at(index).toObject();
+        t.insert(QLatin1String("data"), t.value(QLatin1String("data")).toString().left(2 * bytes));
+        transfers.replace(index, t);
+        root.insert(QLatin1String("transfers"), transfers);
+        if (!file.open())
+                return false;
+        file.write(QJsonDocument(root).toJson());
+        file.close();
+        return true;
+}
+
+void tst_replay::version()
+{
+        usbcapture capture;
+        QVERIFY2(capture.load(QLatin1String(FIXTURE)), qPrintable(capture.errorString()));
+        usb_FEL fel;
+        fel.setReplay(&capture);
+        QVERIFY(fel.usb_open());
+        aw_fel_version_t ver;
+        QCOMPARE(fel.aw_fel_get_version(&ver), static_cast<quint32>(SUNXI_SOC_ID_A10));
+        QCOMPARE(QByteArray(ver.signature, 8), QByteArray("AWUSBFEX"));
+        QCOMPARE(ver.scratchpad, static_cast<quint32>(0x7e00));
+        QCOMPARE(capture.position(), capture.transfers().size());
+}
+
+void tst_replay::short_in_fails()
+{
+        QTemporaryFile file;
+        QVERIFY(truncated(file, VERSION_DATA, 16));
+        usbcapture capture;
+        QVERIFY(capture.load(file.fileName()));
+        usb_FEL fel;
+        fel.setReplay(&capture);
+        QVERIFY(fel.usb_open());
+        QCOMPARE(fel.aw_fel_get_version(), static_cast<quint32>(0));
+        QCOMPARE(capture.position(), VERSION_DATA);
+        QVERIFY(capture.errorString().contains(QLatin1String("only 16 of 32 bytes")));
+}
+
+void tst_replay::short_in_loose()
+{
+        QTemporaryFile file;
+        QVERIFY(truncated(file, VERSION_DATA, 16));
+        usbcapture capture;
+        QVERIFY(capture.load(file.fileName()));
+        capture.setLoose(true);
+        usb_FEL fel;
+        fel.setReplay(&capture);
+        QVERIFY(fel.usb_open());
+        aw_fel_version_t ver;
+        QCOMPARE(fel.aw_fel_get_version(&ver), static_cast<quint32>(SUNXI_SOC_ID_A10));
+        // the uncaptured half reads as zeros
+        QCOMPARE(ver.scratchpad, static_cast<quint32>(0));
+        QCOMPARE(capture.position(), capture.transfers().size());
+}
+
+void tst_replay::wrong_out_fails()
+{
+        usbcapture capture;
+        QVERIFY(capture.load(QLatin1String(FIXTURE)));
+        usb_FEL fel;
+        fel.setReplay(&capture);
+        QVERIFY(fel.usb_open());
+        // the fixture expects a version request, not a read
+        QVERIFY(!fel.aw_fel_read(0x7e00, 0, 0));
+        QCOMPARE(capture.position(), 1);
+        QVERIFY(capture.errorString().contains(QLatin1String("differs from the capture")));
+}
+
+/**
+ * @brief the captures fel_version.json was imported from
+ * All three hold the same session: a control transfer, the FEL version
+ * request of device 1:005, a bulk device 1:003 sending between its
+ * transfers, a read that was cancelled and submitted again with the
+ * same URB, and a read still pending when the capture stopped.
+ */
+void tst_replay::import_data()
+{
+        QTest::addColumn<QString>("capture");
+        QTest::newRow("usbmon text") << QString::fromLatin1("fel_version.txt");
+        QTest::newRow("pcap little endian") << QString::fromLatin1("fel_version_le.pcap");
+        QTest::newRow("pcap big endian") << QString::fromLatin1("fel_version_be.pcap");
+}
+
+void tst_replay::import()
+{
+        QFETCH(QString, capture);
+        usbcapture fixture;
+        QVERIFY2(fixture.load(QLatin1String(FIXTURE)), qPrintable(fixture.errorString()));
+        usbcapture imported;
+        QVERIFY2(imported.import(QLatin1String(FIXTURE_DIR "/") + capture), qPrintable(imported.errorString()));
+
+        // only the completed bulk transfers of the device that sent AWUC are kept
+        const QList<usb_transfer_t>& expected = fixture.transfers();
+        const QList<usb_transfer_t>& transfers = imported.transfers();
+        QCOMPARE(transfers.size(), expected.size());
+        for (int i = 0; i < transfers.size(); i++) {
+                const usb_transfer_t& t = transfers.at(i);
+                const usb_transfer_t& e = expected.at(i);
+                QCOMPARE(t.frame, e.frame);
+                QCOMPARE(t.ep, e.ep);
+                QCOMPARE(t.length, e.length);
+                QCOMPARE(t.usecs, e.usecs);
+                QCOMPARE(t.latency, e.latency);
+                QCOMPARE(t.data, e.data);
+                QCOMPARE(t.fel, e.fel);
+        }
+
+        // the cancelled read was submitted at frame 13, the data arrived for frame 15
+        QCOMPARE(transfers.at(VERSION_DATA).frame, 15);
+        QCOMPARE(transfers.at(VERSION_DATA).fel, QString::fromLatin1("data in 32"));
+        QCOMPARE(transfers.at(1).fel, QString::fromLatin1("version 0x00000000 0"));
+}
+
+/**
+ * @brief the plan of stage 1 as written and optimized
+ * stage1.json holds the transfers of stage 1 as flasher.cpp sent them
+ * before the plan replaced it, with the replies of an A20. The plan as
+ * written has to send exactly these. The optimized plan sends fewer
+ * version requests and merges the writes of install_fes_1_1, so it is
+ * replayed in the equivalent mode of usbcapture.
+ */
+void tst_replay::stage1_data()
+{
+        QTest::addColumn<bool>("optimize");
+        QTest::newRow("as written") << false;
+        QTest::newRow("optimized") << true;
+}
+
+void tst_replay::stage1()
+{
+        QFETCH(bool, optimize);
+        usbcapture capture;
+        QVERIFY2(capture.load(QLatin1String(STAGE1)), qPrintable(capture.errorString()));
+        capture.setEquivalent(optimize);
+        usb_FEL fel;
+        fel.setReplay(&capture);
+        QVERIFY(fel.usb_open());
+        flashplan plan(&fel);
+        QVERIFY(plan.load(QStringList() << flashplan::path(QLatin1String("stage1")), optimize));
+
+        int versions = 0;
+        foreach(const plan_op_t& op, plan.ops(QLatin1String("stage_1_prep")))
+                versions += op.op == flashplan::OP_VERSION;
+        QCOMPARE(versions, optimize ? 2 : 4);
+
+        QSignalSpy completed(&fel, SIGNAL(Completed(bool)));
+        foreach(const QString& step, plan.steps()) {
+                int msec = 0;
+                int rc;
+                while ((rc = plan.run(step, &msec)) != flashplan::RUN_DONE) {
+                        QVERIFY2(rc != flashplan::RUN_FAILED,
+                                 qPrintable(QString("%1: %2").arg(step).arg(capture.errorString())));
+                        // delays are not waited for, the replay is not paced
+                        if (rc == flashplan::RUN_WAIT)
+                                QVERIFY(completed.wait(1000));
+                }
+        }
+        // the reply to the first version request is kept, merged or not
+        QCOMPARE(usb_FEL::soc_id(plan.version()), static_cast<quint32>(SUNXI_SOC_ID_A20));
+        QCOMPARE(capture.position(), capture.transfers().size());
+}
+
+QTEST_GUILESS_MAIN(tst_replay)
+
+#include "tst_replay.moc"
@@ -0,0 +1,9 @@
+#-------------------------------------------------
+#
+# Tests of the flashing core; run with qmake && make check
+#
+#-------------------------------------------------
+
+TEMPLATE = subdirs
+SUBDIRS = replay \
+    allocs
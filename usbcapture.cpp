@@ -0,0 +1,908 @@
+/*
+ * Copyright (C) Jürgen Buchmüller <pullmoll@t-online.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+#include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QSet>
+#include <QMap>
+#include <QBitArray>
+#include <QThread>
+#include <QtEndian>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QCryptographicHash>
+#include "usbcapture.h"
+#include "usbfel.h"
+
+#define LINKTYPE_USB_LINUX              189     //!< pcap link type with a 48 byte usbmon header
+#define LINKTYPE_USB_LINUX_MMAPPED      220     //!< pcap link type with a 64 byte usbmon header
+#define USBMON_BULK                     3       //!< usbmon transfer type of bulk transfers
+
+/**
+ * @brief a submission waiting for its completion
+ */
+typedef struct {
+        int             frame;          //!< number of the submission in the capture
+        int             ep;             //!< endpoint including the direction bit
+        int             device;         //!< bus number << 8 | device number
+        qint64          usecs;          //!< time of the submission
+        QByteArray      data;           //!< OUT data
+}       usb_submit_t;
+
+/**
+ * @brief pairs submissions with completions and keeps the FEL transfers
+ */
+typedef struct {
+        QHash<QByteArray, usb_submit_t> pending;        //!< submissions by URB id
+        QSet<int>       devices;                        //!< devices that sent an AWUC request
+        QList<usb_transfer_t>* transfers;
+}       usb_collect_t;
+
+typedef struct {
+        quint32         code;           //!< FEL or FES request
+        const char*     name;           //!< name in decoded transfers and profiles
+}       fel_request_name_t;
+
+static const fel_request_name_t fel_requests[] = {
+        {usb_FEL::AW_FEL_VERSION,       "version"},
+        {usb_FEL::AW_FEL_1_WRITE,       "fel_write"},
+        {usb_FEL::AW_FEL_1_EXEC,        "fel_exec"},
+        {usb_FEL::AW_FEL_1_READ,        "fel_read"},
+        {usb_FEL::AW_FEL_2_RDWR,        "fes_rdwr"},
+        {usb_FEL::AW_FEL_2_EXEC,        "fes_exec"},
+        {usb_FEL::AW_FEL_2_0203,        "fes_0203"},
+        {usb_FEL::AW_FEL_2_0204,        "fes_0204"},
+        {usb_FEL::AW_FEL_2_0205,        "fes_0205"},
+        {0, 0}
+};
+
+/**
+ * @brief what the session transfers next in the equivalent mode
+ */
+enum {
+        EQ_REQUEST,                     //!< the 16 bytes of a request
+        EQ_OUT,                         //!< the data of a write
+        EQ_IN,                          //!< the data of a read or version request
+        EQ_STATUS                       //!< the FEL status
+};
+
+static bool is_write(quint32 request, quint32 specs)
+{
+        return request == usb_FEL::AW_FEL_1_WRITE ||
+                (request == usb_FEL::AW_FEL_2_RDWR && (specs & usb_FEL::AW_FEL_2_WR));
+}
+
+static bool is_read(quint32 request, quint32 specs)
+{
+        return request == usb_FEL::AW_FEL_VERSION || request == usb_FEL::AW_FEL_1_READ ||
+                (request == usb_FEL::AW_FEL_2_RDWR && (specs & usb_FEL::AW_FEL_2_RD));
+}
+
+/**
+ * @brief return true if the device answers a request with a FEL status
+ */
+static bool has_status(quint32 request)
+{
+        return request != usb_FEL::AW_FEL_2_EXEC &&
+                request != usb_FEL::AW_FEL_2_0203 &&
+                request != usb_FEL::AW_FEL_2_0204;
+}
+
+static void submit(usb_collect_t& c, const QByteArray& id, const usb_submit_t& s)
+{
+        c.pending.insert(id, s);
+}
+
+static void complete(usb_collect_t& c, const QByteArray& id, qint64 usecs, int status, int length, const QByteArray& data)
+{
+        if (!c.pending.contains(id))
+                return;
+        usb_submit_t s = c.pending.take(id);
+        if (status != 0)
+                return;
+        const bool out = !(s.ep & 0x80);
+        if (out && s.data.startsWith("AWUC"))
+                c.devices.insert(s.device);
+        if (!c.devices.contains(s.device))
+                return;
+
+        usb_transfer_t t;
+        t.frame = s.frame;
+        t.ep = s.ep;
+        t.length = length;
+        t.usecs = s.usecs;
+        t.latency = usecs - s.usecs;
+        t.data = out ? s.data.left(length) : data.left(length);
+        c.transfers->append(t);
+}
+
+usbcapture::usbcapture() :
+        m_transfers(),
+        m_source(),
+        m_error(),
+        m_paced(false),
+        m_loose(false),
+        m_pos(0),
+        m_equivalent(false),
+        m_exchanges(),
+        m_exchange(0),
+        m_state(EQ_REQUEST),
+        m_request()
+{
+}
+
+QString usbcapture::errorString() const
+{
+        return m_error;
+}
+
+const QList<usb_transfer_t>& usbcapture::transfers() const
+{
+        return m_transfers;
+}
+
+/**
+ * @brief import a usbmon capture
+ * The format is detected from the contents: pcap files (Wireshark, tcpdump)
+ * with the USB_LINUX or USB_LINUX_MMAPPED link types, or usbmon text.
+ * pcapng is not read; save such captures as pcap.
+ * @param filename name of the capture file
+ * @return true on success
+ */
+bool usbcapture::import(const QString& filename)
+{
+        m_transfers.clear();
+        m_error.clear();
+        m_pos = 0;
+        QFile file(filename);
+        if (!file.open(QIODevice::ReadOnly)) {
+                m_error = tr("Failed to open capture: %1").arg(filename);
+                return false;
+        }
+        const QByteArray contents = file.readAll();
+        file.close();
+        m_source = QFileInfo(filename).fileName();
+
+        bool success;
+        const quint32 magic = contents.size() >= 4 ? qFromLittleEndian<quint32>(reinterpret_cast<const uchar *>(contents.constData())) : 0;
+        if (magic == 0x0a0d0d0a) {
+                m_error = tr("%1 is a pcapng file; save the capture in pcap format.").arg(filename);
+                return false;
+        } else if (magic == 0xa1b2c3d4 || magic == 0xd4c3b2a1 || magic == 0xa1b23c4d || magic == 0x4d3cb2a1) {
+                success = import_pcap(contents);
+        } else {
+                success = import_text(contents);
+        }
+        if (!success)
+                return false;
+        if (m_transfers.isEmpty()) {
+                m_error = tr("No FEL transfers found in %1.").arg(filename);
+                return false;
+        }
+
+        const qint64 t0 = m_transfers.first().usecs;
+        for (int i = 0; i < m_transfers.size(); i++)
+                m_transfers[i].usecs -= t0;
+        decode();
+        return true;
+}
+
+/**
+ * @brief import the text format of /sys/kernel/debug/usb/usbmon/<bus>u
+ * Every line is an event: URB tag, timestamp, S(ubmission) or C(ompletion),
+ * address "Bo:bus:device:endpoint", status, length and the data words.
+ * The line number is the frame number.
+ */
+bool usbcapture::import_text(const QByteArray& text)
+{
+        usb_collect_t c;
+        c.transfers = &m_transfers;
+        const QList<QByteArray> lines = text.split('\n');
+        qint64 wrap = 0;
+        qint64 last = -1;
+        for (int i = 0; i < lines.size(); i++) {
+                const QList<QByteArray> f = lines.at(i).simplified().split(' ');
+                if (f.size() < 6)
+                        continue;
+                const QByteArray& type = f.at(2);
+                const QByteArray& address = f.at(3);
+                if (address.size() < 2 || address.at(0) != 'B')
+                        continue;
+                if (type != "S" && type != "C")
+                        continue;
+
+                // the timestamp is a 32 bit count of microseconds
+                bool ok = false;
+                qint64 usecs = f.at(1).toLongLong(&ok);
+                if (!ok)
+                        continue;
+                if (usecs + wrap < last)
+                        wrap += Q_INT64_C(1) << 32;
+                usecs += wrap;
+                last = usecs;
+
+                const QList<QByteArray> a = address.mid(3).split(':');
+                if (a.size() < 2)
+                        continue;
+                const int bus = a.size() > 2 ? a.at(0).toInt() : 0;
+                const int device = a.at(a.size() - 2).toInt();
+                const int ep = a.at(a.size() - 1).toInt() | (address.at(1) == 'i' ? 0x80 : 0);
+                const int length = f.at(5).toInt();
+                QByteArray data;
+                if (f.size() > 7 && f.at(6) == "=") {
+                        for (int w = 7; w < f.size(); w++)
+                                data += QByteArray::fromHex(f.at(w));
+                }
+
+                if (type == "S") {
+                        usb_submit_t s;
+                        s.frame = i + 1;
+                        s.ep = ep;
+                        s.device = (bus << 8) | device;
+                        s.usecs = usecs;
+                        s.data = data;
+                        submit(c, f.at(0), s);
+                } else {
+                        complete(c, f.at(0), usecs, f.at(4).toInt(), length, data);
+                }
+        }
+        return true;
+}
+
+static quint16 get16(const uchar* p, bool be)
+{
+        return be ? qFromBigEndian<quint16>(p) : qFromLittleEndian<quint16>(p);
+}
+
+static quint32 get32(const uchar* p, bool be)
+{
+        return be ? qFromBigEndian<quint32>(p) : qFromLittleEndian<quint32>(p);
+}
+
+/**
+ * @brief import a pcap file of the Linux usbmon interface
+ * The usbmon headers are in the byte order of the capturing host, which
+ * is assumed to be that of the pcap file. The packet number is the frame number.
+ */
+bool usbcapture::import_pcap(const QByteArray& pcap)
+{
+        const uchar* p = reinterpret_cast<const uchar *>(pcap.constData());
+        const qint64 size = pcap.size();
+        if (size < 24) {
+                m_error = tr("The pcap file is truncated.");
+                return false;
+        }
+        const quint32 magic = qFromLittleEndian<quint32>(p);
+        const bool be = magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1;
+        const bool nsecs = magic == 0xa1b23c4d || magic == 0x4d3cb2a1;
+        const quint32 linktype = get32(p + 20, be);
+        int header;
+        switch (linktype) {
+        case LINKTYPE_USB_LINUX:
+                header = 48;
+                break;
+        case LINKTYPE_USB_LINUX_MMAPPED:
+                header = 64;
+                break;
+        default:
+                m_error = tr("The pcap file has link type %1, not a Linux usbmon capture.").arg(linktype);
+                return false;
+        }
+
+        usb_collect_t c;
+        c.transfers = &m_transfers;
+        int frame = 0;
+        for (qint64 pos = 24; pos + 16 <= size; ) {
+                const qint64 secs = get32(p + pos, be);
+                const qint64 fraction = get32(p + pos + 4, be);
+                const qint64 caplen = get32(p + pos + 8, be);
+                pos += 16;
+                if (pos + caplen > size)
+                        break;
+                const uchar* pkt = p + pos;
+                pos += caplen;
+                frame++;
+                if (caplen < header)
+                        continue;
+
+                const char event = static_cast<char>(pkt[8]);
+                if (pkt[9] != USBMON_BULK || (event != 'S' && event != 'C'))
+                        continue;
+                const qint64 usecs = secs * 1000000 + (nsecs ? fraction / 1000 : fraction);
+                const int ep = pkt[10];
+                const int device = (get16(pkt + 12, be) << 8) | pkt[11];
+                const int status = static_cast<qint32>(get32(pkt + 28, be));
+                const int length = static_cast<int>(get32(pkt + 32, be));
+                const QByteArray id(reinterpret_cast<const char *>(pkt), 8);
+                const QByteArray data(reinterpret_cast<const char *>(pkt + header), caplen - header);
+
+                if (event == 'S') {
+                        usb_submit_t s;
+                        s.frame = frame;
+                        s.ep = ep;
+                        s.device = device;
+                        s.usecs = usecs;
+                        s.data = data;
+                        submit(c, id, s);
+                } else {
+                        complete(c, id, usecs, status, length, data);
+                }
+        }
+        return true;
+}
+
+static const char* request_name(quint32 code)
+{
+        for (int i = 0; fel_requests[i].name; i++)
+                if (fel_requests[i].code == code)
+                        return fel_requests[i].name;
+        return 0;
+}
+
+/**
+ * @brief decode the AWUC requests, AWUS responses and FEL requests
+ * Every FEL exchange is an AWUC request, a payload and an AWUS response.
+ * A 16 byte payload with a known request code is a FEL request unless it
+ * is the data of a preceding write request.
+ */
+void usbcapture::decode()
+{
+        bool payload = false;
+        bool write_data = false;
+        for (int i = 0; i < m_transfers.size(); i++) {
+                usb_transfer_t& t = m_transfers[i];
+                const uchar* d = reinterpret_cast<const uchar *>(t.data.constData());
+                const bool out = !(t.ep & 0x80);
+
+                if (out && t.length == 32 && t.data.size() >= 32 && t.data.startsWith("AWUC")) {
+                        const quint16 request = qFromLittleEndian<quint16>(d + 16);
+                        t.fel = QString("AWUC %1 %2")
+                                        .arg(request == usb_FEL::AW_USB_WRITE ? "write" : "read")
+                                        .arg(qFromLittleEndian<quint32>(d + 8));
+                        payload = true;
+                } else if (!out && t.length == 13 && t.data.size() >= 13 && t.data.startsWith("AWUS")) {
+                        t.fel = QString("AWUS 0x%1").arg(qFromLittleEndian<quint32>(d + 8), 8, 16, QChar('0'));
+                } else if (payload && out && t.length == 16 && t.data.size() >= 16 && !write_data &&
+                           request_name(qFromLittleEndian<quint32>(d))) {
+                        const quint32 code = qFromLittleEndian<quint32>(d);
+                        const quint32 specs = qFromLittleEndian<quint32>(d + 12);
+                        t.fel = QString("%1 0x%2 %3")
+                                        .arg(QLatin1String(request_name(code)))
+                                        .arg(qFromLittleEndian<quint32>(d + 4), 8, 16, QChar('0'))
+                                        .arg(qFromLittleEndian<quint32>(d + 8));
+                        write_data = code == usb_FEL::AW_FEL_1_WRITE ||
+                                        (code == usb_FEL::AW_FEL_2_RDWR && (specs & usb_FEL::AW_FEL_2_WR));
+                        payload = false;
+                } else if (payload) {
+                        if (!out && t.length == 8 && t.data.startsWith("\xff\xff"))
+                                t.fel = QLatin1String("status ok");
+                        else
+                                t.fel = QString("data %1 %2").arg(out ? "out" : "in").arg(t.length);
+                        if (out)
+                                write_data = false;
+                        payload = false;
+                }
+        }
+}
+
+/**
+ * @brief save the transfers as a replay fixture
+ * IN data is kept as captured, OUT data up to USBCAPTURE_MAX_DATA bytes
+ * plus the SHA-256 of longer data that was captured completely.
+ * @param filename name of the JSON file
+ * @return true on success
+ */
+bool usbcapture::save(const QString& filename) const
+{
+        QJsonArray transfers;
+        foreach(const usb_transfer_t& t, m_transfers) {
+                QJsonObject obj;
+                obj.insert(QLatin1String("frame"), t.frame);
+                obj.insert(QLatin1String("ep"), t.ep);
+                obj.insert(QLatin1String("length"), t.length);
+                obj.insert(QLatin1String("usecs"), static_cast<double>(t.usecs));
+                obj.insert(QLatin1String("latency"), static_cast<double>(t.latency));
+                QByteArray data = t.data;
+                QByteArray sha256 = t.sha256;
+                if (!(t.ep & 0x80) && data.size() > USBCAPTURE_MAX_DATA) {
+                        if (data.size() == t.length)
+                                sha256 = QCryptographicHash::hash(data, QCryptographicHash::Sha256);
+                        data.truncate(USBCAPTURE_MAX_DATA);
+                }
+                obj.insert(QLatin1String("data"), QString::fromLatin1(data.toHex()));
+                if (!sha256.isEmpty())
+                        obj.insert(QLatin1String("sha256"), QString::fromLatin1(sha256.toHex()));
+                if (!t.fel.isEmpty())
+                        obj.insert(QLatin1String("fel"), t.fel);
+                transfers.append(obj);
+        }
+        QJsonObject obj;
+        obj.insert(QLatin1String("version"), 1);
+        obj.insert(QLatin1String("source"), m_source);
+        obj.insert(QLatin1String("transfers"), transfers);
+
+        QFile file(filename);
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+                return false;
+        const QByteArray json = QJsonDocument(obj).toJson(QJsonDocument::Compact);
+        bool success = file.write(json) == json.size();
+        file.close();
+        return success;
+}
+
+/**
+ * @brief load a replay fixture written by save()
+ * @param filename name of the JSON file
+ * @return true on success
+ */
+bool usbcapture::load(const QString& filename)
+{
+        m_transfers.clear();
+        m_error.clear();
+        m_pos = 0;
+        QFile file(filename);
+        if (!file.open(QIODevice::ReadOnly)) {
+                m_error = tr("Failed to open fixture: %1").arg(filename);
+                return false;
+        }
+        QJsonParseError error;
+        QJsonDocument doc = QJsonDocument::fromJson(file.readAll(), &error);
+        file.close();
+        if (!doc.isObject()) {
+                m_error = tr("Fixture %1: %2 at offset %3.").arg(filename).arg(error.errorString()).arg(error.offset);
+                return false;
+        }
+
+        const QJsonObject root = doc.object();
+        m_source = root.value(QLatin1String("source")).toString();
+        foreach(const QJsonValue& value, root.value(QLatin1String("transfers")).toArray()) {
+                const QJsonObject obj = value.toObject();
+                usb_transfer_t t;
+                t.frame = obj.value(QLatin1String("frame")).toInt();
+                t.ep = obj.value(QLatin1String("ep")).toInt();
+                t.length = obj.value(QLatin1String("length")).toInt();
+                t.usecs = static_cast<qint64>(obj.value(QLatin1String("usecs")).toDouble());
+                t.latency = static_cast<qint64>(obj.value(QLatin1String("latency")).toDouble());
+                t.data = QByteArray::fromHex(obj.value(QLatin1String("data")).toString().toLatin1());
+                t.sha256 = QByteArray::fromHex(obj.value(QLatin1String("sha256")).toString().toLatin1());
+                t.fel = obj.value(QLatin1String("fel")).toString();
+                m_transfers += t;
+        }
+        return true;
+}
+
+/**
+ * @brief return the timing profile of the transfers
+ * Totals of the session, the time spent in transfers (submission to
+ * completion) and between them on the host, and per FEL request type the
+ * time from its AWUC to the next request. "requests" lists the frame and
+ * time of every request, for comparison with the showURB() checkpoints.
+ * @return QJsonObject with the profile
+ */
+QJsonObject usbcapture::profile() const
+{
+        qint64 bytes_out = 0;
+        qint64 bytes_in = 0;
+        qint64 usb_usecs = 0;
+        qint64 host_usecs = 0;
+        qint64 end = 0;
+        QMap<QString, QList<qint64> > commands;
+        QJsonArray requests;
+        QString name;
+        qint64 start = -1;
+
+        for (int i = 0; i < m_transfers.size(); i++) {
+                const usb_transfer_t& t = m_transfers.at(i);
+                if (t.ep & 0x80)
+                        bytes_in += t.length;
+                else
+                        bytes_out += t.length;
+                usb_usecs += t.latency;
+                if (i > 0)
+                        host_usecs += qMax<qint64>(0, t.usecs - end);
+                end = qMax(end, t.usecs + t.latency);
+
+                const QString request = t.fel.section(QLatin1Char(' '), 0, 0);
+                bool is_request = false;
+                for (int r = 0; fel_requests[r].name; r++)
+                        is_request |= request == QLatin1String(fel_requests[r].name);
+                if (!is_request || i == 0)
+                        continue;
+
+                // the request starts with the AWUC before its payload
+                const usb_transfer_t& awuc = m_transfers.at(i - 1);
+                if (start >= 0)
+                        commands[name] += awuc.usecs - start;
+                name = request;
+                start = awuc.usecs;
+                QJsonArray pair;
+                pair.append(awuc.frame);
+                pair.append(static_cast<double>(awuc.usecs));
+                requests.append(pair);
+        }
+        if (start >= 0)
+                commands[name] += end - start;
+
+        QJsonObject cmds;
+        for (QMap<QString, QList<qint64> >::const_iterator it = commands.constBegin(); it != commands.constEnd(); ++it) {
+                qint64 total = 0;
+                qint64 max = 0;
+                foreach(qint64 usecs, it.value()) {
+                        total += usecs;
+                        max = qMax(max, usecs);
+                }
+                QJsonObject obj;
+                obj.insert(QLatin1String("count"), it.value().size());
+                obj.insert(QLatin1String("total_usecs"), static_cast<double>(total));
+                obj.insert(QLatin1String("max_usecs"), static_cast<double>(max));
+                cmds.insert(it.key(), obj);
+        }
+
+        QJsonObject obj;
+        obj.insert(QLatin1String("source"), m_source);
+        obj.insert(QLatin1String("transfers"), m_transfers.size());
+        obj.insert(QLatin1String("duration_usecs"), static_cast<double>(end));
+        obj.insert(QLatin1String("bytes_out"), static_cast<double>(bytes_out));
+        obj.insert(QLatin1String("bytes_in"), static_cast<double>(bytes_in));
+        obj.insert(QLatin1String("usb_usecs"), static_cast<double>(usb_usecs));
+        obj.insert(QLatin1String("host_usecs"), static_cast<double>(host_usecs));
+        obj.insert(QLatin1String("commands"), cmds);
+        obj.insert(QLatin1String("requests"), requests);
+        return obj;
+}
+
+/**
+ * @brief wait the captured device latency before completing each transfer
+ * With pacing a replayed session takes about as long as the captured one
+ * would with our host side, so the two can be compared.
+ */
+void usbcapture::setPaced(bool paced)
+{
+        m_paced = paced;
+}
+
+/**
+ * @brief accept transfers that were not captured completely
+ * A strict replay fails a transfer whose data the capture does not hold
+ * in full (usbmon text keeps 32 bytes, pcap files may have a snap length),
+ * since its outcome would be made up. In loose mode OUT data is only
+ * compared as far as it was captured and IN data beyond the capture reads
+ * as zeros, which is good enough to follow the control flow of a session
+ * but says nothing about the data it transfers.
+ */
+void usbcapture::setLoose(bool loose)
+{
+        m_loose = loose;
+}
+
+/**
+ * @brief compare requests instead of transfers
+ * The session has to send the requests of the capture in their order,
+ * with the same data, but it may leave out version and read requests,
+ * which the device answers without changing, and it may write adjacent
+ * or overlapping ranges the capture wrote one after the other at once.
+ * Reads are answered with the data of the captured request they match.
+ * That is what the planner of flashplan changes, so an optimized plan
+ * can be replayed against a capture of the plan as it was written.
+ * Requests without a request block (pad reads and writes, FES params)
+ * are not supported.
+ * @param equivalent true to enable the equivalent mode
+ */
+void usbcapture::setEquivalent(bool equivalent)
+{
+        m_equivalent = equivalent;
+        if (equivalent)
+                exchanges();
+        rewind();
+}
+
+/**
+ * @brief start replaying from the first transfer
+ */
+void usbcapture::rewind()
+{
+        m_pos = 0;
+        m_exchange = 0;
+        m_state = EQ_REQUEST;
+        m_error.clear();
+}
+
+/**
+ * @brief collect the requests of the capture for the equivalent mode
+ * Follows the AWUC containers like decode(): the request block comes
+ * after an AWUC, its data after the next one, then the FEL status.
+ */
+void usbcapture::exchanges()
+{
+        m_exchanges.clear();
+        bool payload = false;
+        bool data = false;
+        for (int i = 0; i < m_transfers.size(); i++) {
+                const usb_transfer_t& t = m_transfers.at(i);
+                const uchar* d = reinterpret_cast<const uchar *>(t.data.constData());
+                const bool out = !(t.ep & 0x80);
+
+                if (out && t.length == 32 && t.data.startsWith("AWUC")) {
+                        payload = true;
+                } else if (!out && t.length == 13 && t.data.startsWith("AWUS")) {
+                        // AWUS containers carry nothing of the request
+                } else if (payload && out && t.length == 16 && t.data.size() >= 16 && !data &&
+                           request_name(qFromLittleEndian<quint32>(d))) {
+                        if (!m_exchanges.isEmpty())
+                                m_exchanges.last().end = i - 1;
+                        usb_exchange_t ex;
+                        ex.request = qFromLittleEndian<quint32>(d);
+                        ex.addr = qFromLittleEndian<quint32>(d + 4);
+                        ex.length = qFromLittleEndian<quint32>(d + 8);
+                        ex.specs = qFromLittleEndian<quint32>(d + 12);
+                        ex.first = i - 1;
+                        ex.end = m_transfers.size();
+                        m_exchanges += ex;
+                        data = is_write(ex.request, ex.specs) || is_read(ex.request, ex.specs);
+                        payload = false;
+                } else if (payload) {
+                        if (data && !m_exchanges.isEmpty()) {
+                                usb_exchange_t& ex = m_exchanges.last();
+                                if (out) {
+                                        ex.out = t.data;
+                                        ex.sha256 = t.sha256;
+                                } else {
+                                        ex.in = t.data;
+                                }
+                        }
+                        data = false;
+                        payload = false;
+                }
+        }
+}
+
+/**
+ * @brief return the number of transfers replayed so far
+ */
+int usbcapture::position() const
+{
+        return m_pos;
+}
+
+/**
+ * @brief replay the next transfer in place of libusb_bulk_transfer()
+ * The endpoint and length must match the capture and OUT data must match
+ * it; IN transfers get the captured data. A transfer whose data was not
+ * captured completely (and, for OUT data, has no digest) fails unless
+ * setLoose() is on.
+ * @param ep endpoint including the direction bit
+ * @param data pointer to the data to send or the buffer to receive into
+ * @param length number of bytes
+ * @param actual receives the number of bytes transferred
+ * @return 0 on success or a LIBUSB_ERROR code; errorString() tells why
+ */
+int usbcapture::transfer(int ep, unsigned char* data, int length, int* actual)
+{
+        *actual = 0;
+        if (m_equivalent) {
+                const int rc = equivalent(ep, data, length);
+                if (rc == 0)
+                        *actual = length;
+                return rc;
+        }
+        if (m_pos >= m_transfers.size()) {
+                m_error = tr("Replay: transfer %1 is past the end of the capture.").arg(m_pos + 1);
+                return LIBUSB_ERROR_NO_DEVICE;
+        }
+        const usb_transfer_t& t = m_transfers.at(m_pos);
+        if (t.ep != ep || t.length != length) {
+                m_error = tr("Replay: frame %1 (%2) has %3 bytes on endpoint %4, got %5 bytes on endpoint %6.")
+                                .arg(t.frame).arg(t.fel)
+                                .arg(t.length).arg(t.ep, 2, 16, QChar('0'))
+                                .arg(length).arg(ep, 2, 16, QChar('0'));
+                return LIBUSB_ERROR_IO;
+        }
+
+        const bool complete = t.data.size() >= length || (!(ep & 0x80) && !t.sha256.isEmpty());
+        if (!complete && !m_loose) {
+                m_error = tr("Replay: frame %1 (%2): only %3 of %4 bytes were captured.")
+                                .arg(t.frame).arg(t.fel).arg(t.data.size()).arg(length);
+                return LIBUSB_ERROR_IO;
+        }
+
+        if (!(ep & 0x80)) {
+                const int compare = qMin(t.data.size(), length);
+                bool match = !memcmp(data, t.data.constData(), compare);
+                if (match && !t.sha256.isEmpty()) {
+                        const QByteArray sent(reinterpret_cast<const char *>(data), length);
+                        match = QCryptographicHash::hash(sent, QCryptographicHash::Sha256) == t.sha256;
+                }
+                if (!match) {
+                        m_error = tr("Replay: frame %1 (%2): the data sent differs from the capture.")
+                                        .arg(t.frame).arg(t.fel);
+                        return LIBUSB_ERROR_IO;
+                }
+        } else {
+                const int copy = qMin(t.data.size(), length);
+                memcpy(data, t.data.constData(), copy);
+                memset(data + copy, 0, length - copy);
+        }
+
+        if (m_paced && t.latency > 0)
+                QThread::usleep(static_cast<unsigned long>(t.latency));
+        *actual = length;
+        m_pos++;
+        return 0;
+}
+
+/**
+ * @brief replay a transfer in the equivalent mode of setEquivalent()
+ * AWUC containers are accepted as sent, AWUS containers and FEL status
+ * reads are answered as the device does on success; request blocks and
+ * their data are matched with the requests of the capture.
+ * @param ep endpoint including the direction bit
+ * @param data pointer to the data to send or the buffer to receive into
+ * @param length number of bytes
+ * @return 0 on success or a LIBUSB_ERROR code; errorString() tells why
+ */
+int usbcapture::equivalent(int ep, unsigned char* data, int length)
+{
+        const bool out = !(ep & 0x80);
+        if (out && length == 32 && !memcmp(data, "AWUC", 4))
+                return 0;
+        if (!out && length == 13) {
+                memset(data, 0, length);
+                memcpy(data, "AWUS", 4);
+                return 0;
+        }
+
+        switch (m_state) {
+        case EQ_REQUEST:
+                if (!out || length != 16) {
+                        m_error = tr("Replay: expected a request, got %1 bytes on endpoint %2.")
+                                        .arg(length).arg(ep, 2, 16, QChar('0'));
+                        return LIBUSB_ERROR_IO;
+                }
+                m_request = usb_exchange_t();
+                m_request.request = qFromLittleEndian<quint32>(data);
+                m_request.addr = qFromLittleEndian<quint32>(data + 4);
+                m_request.length = qFromLittleEndian<quint32>(data + 8);
+                m_request.specs = qFromLittleEndian<quint32>(data + 12);
+                if (!match_request())
+                        return LIBUSB_ERROR_IO;
+                if (is_write(m_request.request, m_request.specs))
+                        m_state = EQ_OUT;
+                else if (is_read(m_request.request, m_request.specs))
+                        m_state = EQ_IN;
+                else if (has_status(m_request.request))
+                        m_state = EQ_STATUS;
+                return 0;
+
+        case EQ_OUT:
+                if (!out || !match_write(data, length))
+                        break;
+                m_state = EQ_STATUS;
+                return 0;
+
+        case EQ_IN:
+                if (out)
+                        break;
+                memset(data, 0, length);
+                memcpy(data, m_request.in.constData(), qMin(length, m_request.in.size()));
+                m_state = EQ_STATUS;
+                return 0;
+
+        case EQ_STATUS:
+                if (out || length != 8)
+                        break;
+                memset(data, 0, length);
+                data[0] = data[1] = 0xff;
+                m_state = EQ_REQUEST;
+                return 0;
+        }
+        if (m_error.isEmpty())
+                m_error = tr("Replay: %1 bytes on endpoint %2 do not follow the request %3 at 0x%4.")
+                                .arg(length).arg(ep, 2, 16, QChar('0'))
+                                .arg(QLatin1String(request_name(m_request.request)))
+                                .arg(m_request.addr, 8, 16, QChar('0'));
+        return LIBUSB_ERROR_IO;
+}
+
+/**
+ * @brief find the captured request the session's request stands for
+ * Version and read requests of the capture that the session left out are
+ * passed over. A write only has to start at the same address; its data
+ * decides in match_write().
+ * @return true if a request matches
+ */
+bool usbcapture::match_request()
+{
+        const usb_exchange_t& req = m_request;
+        const bool write = is_write(req.request, req.specs);
+        for (int i = m_exchange; i < m_exchanges.size(); i++) {
+                const usb_exchange_t& ex = m_exchanges.at(i);
+                if (write && ex.request == req.request && ex.specs == req.specs && ex.addr == req.addr) {
+                        m_exchange = i;
+                        return true;
+                }
+                if (!write && ex.request == req.request && ex.addr == req.addr &&
+                    ex.length == req.length && ex.specs == req.specs) {
+                        m_request.in = ex.in;
+                        m_exchange = i + 1;
+                        m_pos = ex.end;
+                        return true;
+                }
+                if (!is_read(ex.request, ex.specs))
+                        break;
+        }
+        const int frame = m_exchange < m_exchanges.size() ? m_transfers.at(m_exchanges.at(m_exchange).first).frame : -1;
+        m_error = tr("Replay: %1 0x%2 %3 does not match the capture at frame %4.")
+                        .arg(QLatin1String(request_name(req.request)))
+                        .arg(req.addr, 8, 16, QChar('0'))
+                        .arg(req.length)
+                        .arg(frame);
+        return false;
+}
+
+/**
+ * @brief compare the data of a write with the writes of the capture
+ * The captured writes that fall into the range are applied in order,
+ * the later one winning where they overlap, and have to cover it.
+ * @param data data the session sends
+ * @param length number of bytes
+ * @return true if the data is what the capture wrote
+ */
+bool usbcapture::match_write(const unsigned char* data, int length)
+{
+        const usb_exchange_t& req = m_request;
+        const QByteArray sent(reinterpret_cast<const char *>(data), length);
+        const usb_exchange_t& first = m_exchanges.at(m_exchange);
+
+        // a write the capture holds only as a digest can only match as a whole
+        if (first.out.size() < static_cast<int>(first.length)) {
+                if (first.length != static_cast<quint32>(length) || first.sha256.isEmpty() ||
+                    QCryptographicHash::hash(sent, QCryptographicHash::Sha256) != first.sha256) {
+                        m_error = tr("Replay: frame %1 (%2): the data sent differs from the capture.")
+                                        .arg(m_transfers.at(first.first).frame).arg(m_transfers.at(first.first + 1).fel);
+                        return false;
+                }
+                m_exchange++;
+                m_pos = first.end;
+                return true;
+        }
+
+        QByteArray expect(length, '\0');
+        QBitArray covered(length);
+        while (m_exchange < m_exchanges.size()) {
+                const usb_exchange_t& ex = m_exchanges.at(m_exchange);
+                if (ex.request != req.request || ex.specs != req.specs || ex.addr < req.addr ||
+                    static_cast<quint64>(ex.addr) + ex.length > static_cast<quint64>(req.addr) + length ||
+                    ex.out.size() < static_cast<int>(ex.length))
+                        break;
+                const int offset = static_cast<int>(ex.addr - req.addr);
+                memcpy(expect.data() + offset, ex.out.constData(), ex.length);
+                covered.fill(true, offset, offset + static_cast<int>(ex.length));
+                m_exchange++;
+                m_pos = ex.end;
+                if (covered.count(true) == length)
+                        break;
+        }
+        if (covered.count(true) != length || sent != expect) {
+                m_error = tr("Replay: %1 0x%2 %3: the data sent differs from the capture.")
+                                .arg(QLatin1String(request_name(req.request)))
+                                .arg(req.addr, 8, 16, QChar('0'))
+                                .arg(length);
+                return false;
+        }
+        return true;
+}
@@ -0,0 +1,98 @@
+#ifndef USBCAPTURE_H
+#define USBCAPTURE_H
+
+#include <QCoreApplication>
+#include <QString>
+#include <QByteArray>
+#include <QList>
+#include <QJsonObject>
+
+#define USBCAPTURE_MAX_DATA     4096    //!< bytes of OUT data kept in a fixture; longer ones get a digest
+
+/**
+ * @brief one completed bulk transfer of a capture
+ */
+typedef struct {
+        int             frame;          //!< number of the submission in the capture, as used by showURB()
+        int             ep;             //!< endpoint including the direction bit
+        int             length;         //!< number of bytes transferred
+        qint64          usecs;          //!< submission time since the first transfer
+        qint64          latency;        //!< time from submission to completion
+        QByteArray      data;           //!< captured data, may be shorter than length
+        QByteArray      sha256;         //!< digest of OUT data longer than USBCAPTURE_MAX_DATA
+        QString         fel;            //!< decoded AWUC/AWUS/FEL meaning
+}       usb_transfer_t;
+
+/**
+ * @brief one FEL or FES request of a capture with its data
+ */
+typedef struct {
+        quint32         request;        //!< FEL or FES request code
+        quint32         addr;           //!< address of the request
+        quint32         length;         //!< length or first parameter of the request
+        quint32         specs;          //!< AW_FEL_2_xxx flags or second parameter
+        QByteArray      out;            //!< data written, may be shorter than length
+        QByteArray      sha256;         //!< digest of out data that was not kept
+        QByteArray      in;             //!< data read
+        int             first;          //!< index of the AWUC of the request
+        int             end;            //!< index after its last transfer
+}       usb_exchange_t;
+
+/**
+ * @brief USB FEL traffic of a session, imported from a capture or a fixture
+ * Linux usbmon captures, as text from /sys/kernel/debug/usb/usbmon or as
+ * pcap files written by Wireshark or tcpdump, are reduced to the bulk
+ * transfers of FEL devices (any device that sends an AWUC request, so the
+ * re-enumerated board of stage 2 is included) and decoded. The result is
+ * saved as a JSON replay fixture and a timing profile.
+ * A loaded fixture can stand in for the board: usb_FEL hands its bulk
+ * transfers to transfer(), which checks what is sent against the capture
+ * and answers reads with the captured data, optionally with the captured
+ * device latencies. Transfers that were not captured completely fail,
+ * unless the loose mode of setLoose() is on. In the equivalent mode of
+ * setEquivalent() the requests are compared instead of the transfers, so
+ * an optimized plan can be replayed against a capture of the plan as it
+ * was written.
+ */
+class usbcapture
+{
+        Q_DECLARE_TR_FUNCTIONS(usbcapture)
+public:
+        usbcapture();
+
+        bool import(const QString& filename);
+        bool load(const QString& filename);
+        bool save(const QString& filename) const;
+        QJsonObject profile() const;
+        QString errorString() const;
+        const QList<usb_transfer_t>& transfers() const;
+
+        void setPaced(bool paced);
+        void setLoose(bool loose);
+        void setEquivalent(bool equivalent);
+        void rewind();
+        int position() const;
+        int transfer(int ep, unsigned char* data, int length, int* actual);
+
+private:
+        QList<usb_transfer_t> m_transfers;
+        QString m_source;
+        QString m_error;
+        bool m_paced;
+        bool m_loose;
+        int m_pos;
+        bool m_equivalent;
+        QList<usb_exchange_t> m_exchanges;      //!< requests of the capture, for the equivalent mode
+        int m_exchange;                         //!< next request of the capture to match
+        int m_state;                            //!< what the session transfers next in the equivalent mode
+        usb_exchange_t m_request;               //!< request of the session in progress
+        bool import_text(const QByteArray& text);
+        bool import_pcap(const QByteArray& pcap);
+        void decode();
+        void exchanges();
+        int equivalent(int ep, unsigned char* data, int length);
+        bool match_request();
+        bool match_write(const unsigned char* data, int length);
+};
+
+#endif // USBCAPTURE_H
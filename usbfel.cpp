@@ -18,7 +18,10 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "usbfel.h"
+#include "usbcapture.h"
 #include <errno.h>
+#include <QElapsedTimer>
+#include <QThread>
 
 /* Needs _BSD_SOURCE for htole and letoh  */
 //#define _BSD_SOURCE
@@ -27,6 +30,13 @@
 #define HOST_TO_LE(x) qToLittleEndian(x)
 #define LE_TO_HOST(x) qFromLittleEndian(x)
 
+#define AW_FES_CRC_ADDR 0x40023c00      //!< FES keeps the CRC of the NAND data written here
+#define AW_DRAIN_MSEC   100             //!< time to wait for an outstanding AWUS after an error
+#define AW_LEGS_MAX     9               //!< most transfers of a command: request, data and status
+#define AW_REQUEST_LEGS 2               //!< transfers of the AWUC and the request itself
+#define AW_OP_DRAIN     -1              //!< command reading an outstanding AWUS after an error
+#define AW_EVENT_USECS  100000          //!< longest time the event thread waits for libusb
+
 typedef struct aw_fel_request_s {
         quint32		request;
         quint32		address;
@@ -41,6 +51,189 @@ typedef struct aw_fel_generic_s {
         quint32         param4;
 }       aw_fel_generic_t;
 
+/* USB request container preceding every transfer (32 bytes) */
+typedef struct aw_usb_request_s {
+        char            signature[8];   /* "AWUC" */
+        quint64         length;         /* transfer length */
+        quint16         request;        /* AW_USB_READ or AW_USB_WRITE */
+        quint16         length_hi[2];   /* length >> 16, twice */
+        quint8          pad[10];
+}       aw_usb_request_t;
+
+/* USB response container following every transfer (13 bytes) */
+typedef struct aw_usb_response_s {
+        char            signature[8];   /* "AWUS" */
+        quint8          status[4];      /* little endian status word */
+        quint8          pad;
+}       aw_usb_response_t;
+
+/* FEL status read after a FEL request (8 bytes) */
+typedef struct aw_fel_status_s {
+        quint8          mark[2];        /* ff ff on success */
+        quint8          pad[6];
+}       aw_fel_status_t;
+
+/* The layouts are sent and received as they are, so their sizes are fixed */
+Q_STATIC_ASSERT(sizeof(aw_usb_request_t) == 32);
+Q_STATIC_ASSERT(sizeof(aw_usb_response_t) == 13);
+Q_STATIC_ASSERT(sizeof(aw_fel_status_t) == 8);
+Q_STATIC_ASSERT(sizeof(aw_fel_request_t) == 16);
+Q_STATIC_ASSERT(sizeof(aw_fel_generic_t) == 16);
+Q_STATIC_ASSERT(sizeof(aw_fel_version_t) == 32);
+
+static const aw_fel_status_t status_ok = {{0xff, 0xff}, {0, 0, 0, 0, 0, 0}};
+
+/* kinds of the transfers a command is made of */
+enum {
+        LEG_OUT,                        /* bulk send */
+        LEG_IN,                         /* bulk receive */
+        LEG_AWUS,                       /* receive and check an AWUS */
+        LEG_STATUS,                     /* receive and check a FEL status */
+        LEG_DRAIN                       /* receive an AWUS if one is pending */
+};
+
+/* one bulk transfer of a command */
+typedef struct aw_leg_s {
+        int             kind;           /* LEG_xxx */
+        uchar*          buf;            /* data to send or receive */
+        quint32         length;         /* number of bytes */
+        int             stat;           /* felstats::OP_xxx it is recorded as, -1 for none */
+        int             timeout;        /* msec */
+        qint64          start;          /* nsecs since the start of the command */
+        qint64          usecs;          /* time to complete */
+        qint64          ts;             /* trace timestamp */
+}       aw_leg_t;
+
+/**
+ * @brief a FEL command as the bulk transfers it is made of
+ * The USB and FEL containers are part of it, so a command is set up
+ * without allocating memory. The transfers run one after the other,
+ * each started from the completion of the one before.
+ */
+struct usb_FEL::aw_cmd_s {
+        aw_op_t                 op;             //!< operation the command carries out
+        aw_leg_t                legs[AW_LEGS_MAX];
+        int                     count;          //!< number of legs
+        int                     pos;            //!< index of the leg in flight
+        quint32                 done;           //!< bytes of the leg transferred so far
+        int                     rc;             //!< libusb error of the leg that failed
+        int                     failed;         //!< index of the leg that failed, -1 if none
+        int                     nawuc;          //!< AWUC containers used
+        int                     nawus;          //!< AWUS containers used
+        QElapsedTimer           timer;          //!< runs from the start of the command
+        qint64                  ts;             //!< trace timestamp of the start
+        aw_usb_request_t        awuc[3];
+        aw_usb_response_t       awus[3];
+        aw_fel_request_t        req;
+        aw_fel_generic_t        params;
+        aw_fel_status_t         status;
+        aw_fel_version_t        version;
+        uchar                   reply[32];      //!< reply to a completion poll
+};
+
+/* names of the commands in the trace, per AW_OP_xxx */
+static const char* const op_names[] = {
+        "aw_fel_get_version",
+        "aw_fel_read",
+        "aw_fel_write",
+        "aw_fel_execute",
+        "aw_fel2_read",
+        "aw_fel2_write",
+        "aw_fel2_exec",
+        "aw_fel2_0203",
+        "aw_fel2_0204",
+        "aw_fel2_0205",
+        "aw_fel2_send_4uints",
+        "aw_pad_read",
+        "aw_pad_write",
+        "aw_fel2_wait_poll",
+        "flush_writes",
+        "send_chunks"
+};
+
+/**
+ * @brief thread handling the libusb events of all usb_FEL instances
+ * Every transfer is submitted asynchronously and completes here; the
+ * completion starts the next transfer of the command or hands the
+ * command back to the thread of its usb_FEL. One thread serves any
+ * number of boards.
+ */
+class usb_event_thread : public QThread
+{
+public:
+        usb_event_thread(libusb_context* ctx) :
+                QThread(),
+                m_ctx(ctx),
+                m_stop(0)
+        {
+                setObjectName(QLatin1String("libusb events"));
+        }
+
+        void stop()
+        {
+                m_stop.storeRelease(1);
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+                libusb_interrupt_event_handler(m_ctx);
+#endif
+                wait();
+        }
+
+protected:
+        void run()
+        {
+                while (!m_stop.loadAcquire()) {
+                        struct timeval tv = {0, AW_EVENT_USECS};
+                        libusb_handle_events_timeout_completed(m_ctx, &tv, 0);
+                }
+        }
+
+private:
+        libusb_context* m_ctx;
+        QAtomicInt m_stop;
+};
+
+static QMutex g_ctx_mutex;
+static libusb_context* g_ctx = 0;
+static int g_ctx_refs = 0;
+static usb_event_thread* g_events = 0;
+
+/**
+ * @brief return the libusb context shared by all usb_FEL instances
+ * The context is created on first use and kept alive until the last
+ * reference is dropped, so any number of boards are driven by one
+ * libusb event handling context, and one thread handling its events,
+ * instead of one per device.
+ * @return pointer to the shared libusb_context
+ */
+libusb_context* usb_FEL::context_ref()
+{
+        QMutexLocker lock(&g_ctx_mutex);
+        if (0 == g_ctx_refs++) {
+                int rc = libusb_init(&g_ctx);
+                Q_ASSERT(rc == 0);
+                Q_UNUSED(rc);
+                g_events = new usb_event_thread(g_ctx);
+                g_events->start();
+        }
+        return g_ctx;
+}
+
+/**
+ * @brief drop a reference to the shared libusb context
+ */
+void usb_FEL::context_unref()
+{
+        QMutexLocker lock(&g_ctx_mutex);
+        Q_ASSERT(g_ctx_refs > 0);
+        if (0 == --g_ctx_refs) {
+                g_events->stop();
+                delete g_events;
+                g_events = 0;
+                libusb_exit(g_ctx);
+                g_ctx = 0;
+        }
+}
+
 usb_FEL::usb_FEL(quint16 major, quint16 minor, int timeout, QObject *parent) :
         QObject(parent),
         m_rc(0),
@@ -48,15 +241,75 @@ usb_FEL::usb_FEL(quint16 major, quint16 minor, int timeout, QObject *parent) :
         m_usb(0),
         m_detached_iface(false),
         m_timeout(timeout),
+        m_control_timeout(2000),
+        m_bulk_timeout(1000),
+        m_bytes_per_msec(200),
+        m_retries(2),
+        m_retry_count(0),
+        m_quiet(0),
+        m_deferred_error(),
+        m_error_offset(0),
         m_major(major),
-        m_minor(minor)
+        m_minor(minor),
+        m_port_path(),
+        m_speed(LIBUSB_SPEED_UNKNOWN),
+        m_wc_enable(false),
+        m_wc_limit(4096),
+        m_wc_offset(0),
+        m_wc_data(),
+        m_wc_len(0),
+        m_progress(0),
+        m_trace(0),
+        m_stats(),
+        m_replay(0),
+        m_replay_open(false),
+        m_poll(),
+        m_poll_stats(),
+        m_wait_site(0),
+        m_wait_polls(0),
+        m_wait_delay(0),
+        m_wait_ts(0),
+        m_wait_timer(),
+        m_buffers(),
+        m_free_buffers(),
+        m_cmd(0),
+        m_xfer(0),
+        m_cmd_done(),
+        m_abort(0),
+        m_cmd_active(false),
+        m_cmd_serial(0),
+        m_op(),
+        m_retry_op(),
+        m_op_busy(false),
+        m_op_async(false),
+        m_op_result(false),
+        m_flushing(false),
+        m_retrying(false),
+        m_attempts(0),
+        m_send()
 {
+        m_ctx = context_ref();
+        m_cmd = new aw_cmd_s();
+        m_xfer = libusb_alloc_transfer(0);
+        m_send.pool = 0;
+        m_send.in = 0;
+        m_poll.initial_msec = 1;
+        m_poll.max_msec = 100;
+        m_poll.factor = 2.0;
+        m_poll.deadline_msec = 300000;
 }
 
 usb_FEL::~usb_FEL()
 {
-        if (m_usb)
+        if (is_open())
                 usb_close();
+        buffer_free_all();
+        libusb_free_transfer(m_xfer);
+        m_xfer = 0;
+        delete m_cmd;
+        m_cmd = 0;
+        context_unref();
+        m_ctx = 0;
 }
 
 void usb_FEL::setDevice(quint16 major, quint32 minor)
@@ -66,38 +319,105 @@ void usb_FEL::setDevice(quint16 major, quint32 minor)
         m_minor = minor;
 }
 
-bool usb_FEL::find_device()
+/**
+ * @brief select the device by its USB port path (e.g. "1-1.2")
+ * The board re-enumerates with a new address after stage 1, but it stays
+ * on the same port, so the port path identifies a board across the whole
+ * session. An empty path selects the first matching device.
+ * @param path bus number and port numbers separated by '-' and '.'
+ */
+void usb_FEL::setPortPath(const QString& path)
 {
-        bool success = false;
-        libusb_context* ctx = 0;
+        usb_close();
+        m_port_path = path;
+}
 
-        m_rc = libusb_init(&ctx);
-        Q_ASSERT(m_rc == 0);
+QString usb_FEL::portPath() const
+{
+        return m_port_path;
+}
+
+/**
+ * @brief return the port path of a libusb device
+ * @param device pointer to the libusb_device
+ * @return QString with the path in the form "bus-port.port..."
+ */
+QString usb_FEL::port_path(libusb_device* device)
+{
+        quint8 ports[8];
+        int nports = libusb_get_port_numbers(device, ports, sizeof(ports));
+        QString path = QString::number(libusb_get_bus_number(device));
+        for (int i = 0; i < nports; i++)
+                path += QString("%1%2").arg(i ? QChar('.') : QChar('-')).arg(static_cast<int>(ports[i]));
+        return path;
+}
+
+bool usb_FEL::match_device(libusb_device* device)
+{
+        libusb_device_descriptor desc;
+        if (0 != libusb_get_device_descriptor(device, &desc))
+                return false;
+        if (desc.idVendor != m_major || desc.idProduct != m_minor)
+                return false;
+        return m_port_path.isEmpty() || m_port_path == port_path(device);
+}
+
+/**
+ * @brief list the port paths of all attached FEL devices
+ * @return QStringList with the port paths
+ */
+QStringList usb_FEL::port_paths()
+{
+        QStringList paths;
         libusb_device** list = 0;
-        ssize_t ndevices = libusb_get_device_list(ctx, &list);
+        ssize_t ndevices = libusb_get_device_list(m_ctx, &list);
         for (ssize_t i = 0; i < ndevices; i++) {
-                libusb_device* device = list[i];
                 libusb_device_descriptor desc;
-                int rc = libusb_get_device_descriptor(device, &desc);
-                if (0 == rc) {
-                        if (desc.idVendor == m_major && desc.idProduct == m_minor)
-                                success = true;
-                }
+                if (0 != libusb_get_device_descriptor(list[i], &desc))
+                        continue;
+                if (desc.idVendor == m_major && desc.idProduct == m_minor)
+                        paths += port_path(list[i]);
         }
         libusb_free_device_list(list, 1);
-        libusb_exit(ctx);
+        return paths;
+}
+
+bool usb_FEL::find_device()
+{
+        if (m_replay)
+                return true;
+        bool success = false;
+        libusb_device** list = 0;
+        ssize_t ndevices = libusb_get_device_list(m_ctx, &list);
+        for (ssize_t i = 0; i < ndevices && !success; i++)
+                success = match_device(list[i]);
+        libusb_free_device_list(list, 1);
         return success;
 }
 
 bool usb_FEL::usb_open()
 {
-        m_rc = libusb_init(&m_ctx);
-        Q_ASSERT(m_rc == 0);
+        if (m_replay) {
+                // the capture stands in for the board; it re-enumerates at the same speed
+                m_replay_open = true;
+                m_retry_count = 0;
+                m_wc_len = 0;
+                m_speed = LIBUSB_SPEED_HIGH;
+                return true;
+        }
+
+        libusb_device** list = 0;
+        ssize_t ndevices = libusb_get_device_list(m_ctx, &list);
+        int rc = LIBUSB_ERROR_NO_DEVICE;
+        for (ssize_t i = 0; i < ndevices && !m_usb; i++) {
+                if (match_device(list[i]))
+                        rc = libusb_open(list[i], &m_usb);
+        }
+        libusb_free_device_list(list, 1);
 
-        m_usb = libusb_open_device_with_vid_pid(m_ctx, m_major , m_minor);
         if (!m_usb) {
-                switch (errno) {
-                case EACCES:
+                switch (rc) {
+                case LIBUSB_ERROR_ACCESS:
                         emit Error(tr("You don't have permission to access Allwinner USB FEL device."));
                         emit Status(tr("Root privileges are required to run this tool."));
                         break;
@@ -120,17 +440,39 @@ bool usb_FEL::usb_open()
         }
 #endif
         Q_ASSERT(m_rc == 0);
+        m_retry_count = 0;
+        m_wc_len = 0;
+
+        // a bad cable or hub makes the board enumerate at full speed,
+        // which makes a flash take some 40 times longer
+        m_speed = libusb_get_device_speed(libusb_get_device(m_usb));
+        if (degraded()) {
+                emit Status(tr("Warning: the board is connected at %1 only; check the cable and hub.")
+                            .arg(speed_name(m_speed)));
+        } else {
+                qDebug("%s: connected at %s", __func__, qPrintable(speed_name(m_speed)));
+        }
         return m_usb != 0;
 }
 
 bool usb_FEL::usb_close()
 {
+        if (m_op_busy)
+                abort_op();
+        if (m_replay_open) {
+                flush_writes();
+                buffer_free_all();
+                m_replay_open = false;
+                return true;
+        }
         if (!m_usb) {
                 qDebug("%s: not opened", __func__);
                 return false;
         }
 
-        libusb_close(m_usb);
+        flush_writes();
+        buffer_free_all();
+        libusb_release_interface(m_usb, 0);
 
 #if defined(Q_OS_UNIX)
         if (m_detached_iface) {
@@ -138,129 +480,489 @@ bool usb_FEL::usb_close()
                 m_detached_iface = false;
         }
 #endif
+        libusb_close(m_usb);
         m_usb = 0;
 
-        libusb_exit(m_ctx);
-        m_ctx = 0;
-
         return m_usb == 0;
 }
 
 
-bool usb_FEL::usb_bulk_send(int ep, const void *buff, size_t length)
+/**
+ * @brief return the speed the device was opened at
+ * @return one of the libusb_speed values
+ */
+int usb_FEL::speed() const
 {
-        uchar* data = (uchar *)(buff);
-        int rc = 0;
-        qDebug("%s: ep=%02x buff=%p length=%u", __func__, ep, buff, static_cast<unsigned>(length));
-        while (length > 0) {
-                int sent = 0;
-                rc = libusb_bulk_transfer(m_usb, ep, data, length, &sent, m_timeout);
-                if (0 != rc) {
-                        emit Error(tr("libusb usb_bulk_send error (%1)").arg(rc));
-                        break;
-                }
-                length -= sent;
-                data += sent;
-        }
-        bool success = 0 == rc;
-        qDebug("%s: %s", __func__, success ? "SUCCESS" : "FAILED");
-        return success;
+        return m_speed;
 }
 
-bool usb_FEL::usb_bulk_recv(int ep, void *buff, size_t length)
+/**
+ * @brief return true if the device is known to be slower than high speed
+ */
+bool usb_FEL::degraded() const
 {
-        quint8 *data = reinterpret_cast<quint8 *>(buff);
-        int rc = 0;
-        qDebug("%s: ep=%02x buff=%p length=%u", __func__, ep, buff, static_cast<unsigned>(length));
-        while (length > 0) {
-                int recv = 0;
-                rc = libusb_bulk_transfer(m_usb, ep, data, length, &recv, m_timeout);
-                if (0 != rc) {
-                        emit Error(tr("libusb usb_bulk_recv error (%1)").arg(rc));
-                        break;
-                }
-                length -= recv;
-                data += recv;
+        return m_speed != LIBUSB_SPEED_UNKNOWN && m_speed < LIBUSB_SPEED_HIGH;
+}
+
+/**
+ * @brief return a readable name of a libusb_speed value
+ */
+QString usb_FEL::speed_name(int speed)
+{
+        switch (speed) {
+        case LIBUSB_SPEED_LOW:
+                return tr("low speed (1.5 Mbit/s)");
+        case LIBUSB_SPEED_FULL:
+                return tr("full speed (12 Mbit/s)");
+        case LIBUSB_SPEED_HIGH:
+                return tr("high speed (480 Mbit/s)");
+        case LIBUSB_SPEED_SUPER:
+                return tr("super speed (5 Gbit/s)");
         }
-        bool success = 0 == rc;
-        qDebug("%s: %s", __func__, success ? "SUCCESS" : "FAILED");
-        return success;
+        return tr("unknown speed");
 }
 
-bool usb_FEL::aw_send_usb_request(quint16 type, qint64 size)
-{
-        uchar buf[32];
-        memset(buf, 0, sizeof(buf));
-        buf[ 0] = 'A';
-        buf[ 1] = 'W';
-        buf[ 2] = 'U';
-        buf[ 3] = 'C';
-        buf[ 8] = static_cast<uchar>(size >>  0);
-        buf[ 9] = static_cast<uchar>(size >>  8);
-        buf[10] = static_cast<uchar>(size >> 16);
-        buf[11] = static_cast<uchar>(size >> 24);
-        buf[12] = static_cast<uchar>(size >> 32);
-        buf[13] = static_cast<uchar>(size >> 40);
-        buf[14] = static_cast<uchar>(size >> 48);
-        buf[15] = static_cast<uchar>(size >> 56);
-        buf[16] = static_cast<uchar>(type >>  0);
-        buf[17] = static_cast<uchar>(type >>  8);
-        buf[18] = static_cast<uchar>(size >> 16);
-        buf[19] = static_cast<uchar>(size >> 24);
-        buf[20] = static_cast<uchar>(size >> 16);
-        buf[21] = static_cast<uchar>(size >> 24);
-        bool success     = usb_bulk_send(AW_USB_FEL_BULK_EP_OUT, buf, sizeof(buf));
-        qDebug("%s: %s", __func__, success ? "SUCCESS" : "FAILED");
-        return success;
+/**
+ * @brief return the timeout for a bulk transfer
+ * Requests and status replies are small and answered at once, so they get
+ * a short budget. Payload transfers get a base budget plus time for the
+ * data at a worst case rate. Neither exceeds the overall timeout.
+ * @param length number of bytes to transfer
+ * @return timeout in milliseconds
+ */
+int usb_FEL::timeout_for(size_t length) const
+{
+        if (length <= 64)
+                return qMin(m_timeout, m_control_timeout);
+        qint64 msec = m_bulk_timeout + static_cast<qint64>(length) / qMax(1, m_bytes_per_msec);
+        return static_cast<int>(qMin(static_cast<qint64>(m_timeout), msec));
+}
+
+/**
+ * @brief set the timeout budgets
+ * @param control_msec timeout for requests and status replies
+ * @param bulk_msec base timeout for payload transfers
+ * @param bytes_per_msec worst case rate added to the payload base timeout
+ */
+void usb_FEL::setTimeouts(int control_msec, int bulk_msec, int bytes_per_msec)
+{
+        m_control_timeout = control_msec;
+        m_bulk_timeout = bulk_msec;
+        m_bytes_per_msec = bytes_per_msec;
+}
+
+void usb_FEL::setRetries(int retries)
+{
+        m_retries = retries;
+}
+
+/**
+ * @brief return the device offset of the last write that failed for good
+ */
+quint32 usb_FEL::lastErrorOffset() const
+{
+        return m_error_offset;
+}
+
+/**
+ * @brief return the number of retried writes since the device was opened
+ */
+int usb_FEL::retryCount() const
+{
+        return m_retry_count;
+}
+
+/**
+ * @brief enable or disable combining of small FEL writes
+ * Writes of up to max_bytes are held back and merged with adjacent or
+ * overlapping writes that follow. The combined range is sent as one FEL
+ * write before the next request of any other kind, so the device sees
+ * the same memory contents at every point it can observe them.
+ * Errors of a held back write are reported by the request that flushes it.
+ * The buffer for the combined range is allocated here, so combining
+ * writes does not allocate memory.
+ * @param on true to enable write combining
+ * @param max_bytes maximum size of a write, and of the combined range
+ */
+void usb_FEL::setWriteCombining(bool on, quint32 max_bytes)
+{
+        flush_writes();
+        m_wc_enable = on;
+        m_wc_limit = max_bytes;
+        if (on)
+                m_wc_data.resize(static_cast<int>(max_bytes));
+        else
+                m_wc_data.clear();
+}
+
+/**
+ * @brief set the progress aggregator that transfers account their bytes to
+ * @param progress pointer to a flashprogress, or 0
+ */
+void usb_FEL::setProgress(flashprogress* progress)
+{
+        m_progress = progress;
+}
+
+/**
+ * @brief set the trace that FEL commands, transfers and waits are recorded to
+ * @param trace pointer to a flashtrace, or 0
+ */
+void usb_FEL::setTrace(flashtrace* trace)
+{
+        m_trace = trace;
+}
+
+flashtrace* usb_FEL::trace() const
+{
+        return m_trace;
+}
+
+/**
+ * @brief serve the bulk transfers from a capture instead of a board
+ * Opening always succeeds and every transfer is checked against and
+ * answered from the capture, from its first transfer on.
+ * @param replay pointer to a usbcapture, or 0 for the real device
+ */
+void usb_FEL::setReplay(usbcapture* replay)
+{
+        usb_close();
+        m_replay = replay;
+        if (m_replay)
+                m_replay->rewind();
+}
+
+/**
+ * @brief return the statistics of the USB and FEL operations
+ * They are always recorded and may be read from any thread.
+ */
+const felstats& usb_FEL::stats() const
+{
+        return m_stats;
+}
+
+void usb_FEL::resetStats()
+{
+        m_stats.reset();
+}
+
+bool usb_FEL::writeCombining() const
+{
+        return m_wc_enable;
+}
+
+/**
+ * @brief send the held back writes, if any
+ * @return true on success, false if the combined write failed
+ */
+bool usb_FEL::flush_writes()
+{
+        if (!m_wc_len)
+                return true;
+        aw_op_t op = aw_op_t();
+        op.type = AW_OP_FLUSH;
+        return run(op);
 }
 
-bool usb_FEL::aw_read_usb_response()
+void usb_FEL::clear_halt()
 {
-        quint32 status;
-        uchar buf[13];
-        memset(buf, 0, sizeof(buf));
+        if (!m_usb)
+                return;
+        libusb_clear_halt(m_usb, AW_USB_FEL_BULK_EP_OUT);
+        libusb_clear_halt(m_usb, AW_USB_FEL_BULK_EP_IN);
+}
 
-        bool success = usb_bulk_recv(AW_USB_FEL_BULK_EP_IN, buf, sizeof(buf));
-        qDebug("%s: %s", __func__, success ? "SUCCESS" : "FAILED");
-        if (success) {
-                success &=
-                        buf[0] == 'A' &&
-                        buf[1] == 'W' &&
-                        buf[2] == 'U' &&
-                        buf[3] == 'S';
-                status =
-                        static_cast<quint32>(buf[ 8] <<  0) |
-                        static_cast<quint32>(buf[ 9] <<  8) |
-                        static_cast<quint32>(buf[10] << 16) |
-                        static_cast<quint32>(buf[11] << 24);
+/**
+ * @brief report an error, or keep it while an operation may still be retried
+ * @param message error message
+ */
+void usb_FEL::error(const QString& message)
+{
+        if (m_quiet > 0) {
+                m_deferred_error = message;
+                return;
         }
-        qDebug("%s: response %.8s status=0x%08x %s", __func__, buf, status, success ? "SUCCESS" : "FAILED");
-        return success;
+        emit Error(message);
 }
 
-bool usb_FEL::aw_usb_write(const void *data, size_t len)
+/**
+ * @brief start an operation and return immediately
+ * Its transfers are submitted to libusb and complete in the event
+ * thread; Completed(bool) is emitted in the thread of this object when
+ * the operation is done. Buffers of the operation must stay valid until
+ * then. Only one operation runs at a time.
+ * @param op operation to start
+ * @return true if the operation was started
+ */
+bool usb_FEL::start(const aw_op_t& op)
 {
-        qDebug("%s: data=%p len=%u", __func__, data, static_cast<unsigned>(len));
-        if (!aw_send_usb_request(AW_USB_WRITE, len))
+        if (m_op_busy) {
+                emit Error(tr("USB FEL device is busy."));
                 return false;
-        if (!usb_bulk_send(AW_USB_FEL_BULK_EP_OUT, data, len))
-                return false;
-        return aw_read_usb_response();
+        }
+        m_op = op;
+        return launch(true);
 }
 
-bool usb_FEL::aw_usb_read(void *data, size_t len)
+/**
+ * @brief run an operation and wait for it to complete
+ * The thread waits for the event thread instead of handling libusb
+ * events itself. This is what the aw_xxx functions use.
+ * @param op operation to run
+ * @return true on success
+ */
+bool usb_FEL::run(const aw_op_t& op)
 {
-        qDebug("%s: data=%p len=%u", __func__, data, static_cast<unsigned>(len));
-        if (!aw_send_usb_request(AW_USB_READ, len))
-                return false;
-        if (!usb_bulk_send(AW_USB_FEL_BULK_EP_IN, data, len))
+        if (m_op_busy) {
+                emit Error(tr("USB FEL device is busy."));
                 return false;
-        return aw_read_usb_response();
+        }
+        m_op = op;
+        return launch(false);
+}
+
+/**
+ * @brief return the result of the operation that completed last
+ */
+bool usb_FEL::lastResult() const
+{
+        return m_op_result;
+}
+
+/**
+ * @brief return the SoC ID of a decoded FEL version reply
+ */
+quint32 usb_FEL::soc_id(const aw_fel_version_t& ver)
+{
+        return (ver.soc_id >> 8) & 0xFFFF;
+}
+
+bool usb_FEL::launch(bool async)
+{
+        m_op_async = async;
+        m_op_busy = true;
+        const bool done = begin_op();
+        if (!async)
+                return wait_op(done);
+        if (done)
+                QMetaObject::invokeMethod(this, "op_done", Qt::QueuedConnection);
+        return true;
+}
+
+/**
+ * @brief wait for the commands of a synchronous operation
+ * @param done true if the operation completed without a command
+ * @return result of the operation
+ */
+bool usb_FEL::wait_op(bool done)
+{
+        while (!done) {
+                m_cmd_done.acquire();
+                done = command_end();
+        }
+        return m_op_result;
+}
+
+/**
+ * @brief abandon the operation in progress
+ * The transfer in flight is cancelled and its completion waited for,
+ * so its buffers may be freed afterwards.
+ */
+void usb_FEL::abort_op()
+{
+        if (m_cmd_active) {
+                m_abort.storeRelease(1);
+                if (!m_replay)
+                        libusb_cancel_transfer(m_xfer);
+                m_cmd_done.acquire();
+                m_abort.storeRelease(0);
+                m_cmd_active = false;
+        }
+        buffer_put(m_send.pool);
+        m_send.pool = 0;
+        m_send.in = 0;
+        m_send.data = QByteArray();
+        if (m_retrying) {
+                m_retrying = false;
+                m_quiet--;
+        }
+        m_flushing = false;
+        m_op_busy = false;
+}
+
+/**
+ * @brief begin or continue the operation in m_op
+ * Small FEL writes are held back if write combining is on. Held back
+ * writes are sent as one FEL write before any other request.
+ * @return true if the operation completed, false if a command is in flight
+ */
+bool usb_FEL::begin_op()
+{
+        if (m_op.type == AW_OP_FEL_WRITE && m_wc_enable && m_op.length <= m_wc_limit &&
+            hold_write(m_op.addr, m_op.wdata, m_op.length))
+                return end_op(true);
+
+        if (m_wc_len) {
+                // empty the buffer first; the operation continues once it is sent
+                aw_op_t flush = aw_op_t();
+                flush.type = AW_OP_FEL_WRITE;
+                flush.addr = m_wc_offset;
+                flush.length = m_wc_len;
+                flush.wdata = m_wc_data.constData();
+                m_wc_len = 0;
+                m_flushing = true;
+                qDebug("%s: flush offset=0x%08x len=%u", __func__, flush.addr, flush.length);
+                return start_command(flush);
+        }
+
+        switch (m_op.type) {
+        case AW_OP_FLUSH:
+                return end_op(true);
+        case AW_OP_SEND:
+                return send_chunk();
+        }
+        return start_command(m_op);
+}
+
+/**
+ * @brief end the operation in m_op
+ * @param success result of the operation
+ * @return true
+ */
+bool usb_FEL::end_op(bool success)
+{
+        m_op_result = success;
+        m_op_busy = false;
+        return true;
+}
+
+void usb_FEL::op_done()
+{
+        emit Completed(m_op_result);
+}
+
+/**
+ * @brief hold back a FEL write, merged with the held back range
+ * @return true if the write is held back, false if the held back range
+ * has to be sent first
+ */
+bool usb_FEL::hold_write(quint32 offset, const void *buf, size_t len)
+{
+        char* held = m_wc_data.data();
+        if (m_wc_len) {
+                quint64 start = m_wc_offset;
+                quint64 end = start + m_wc_len;
+                quint64 new_start = offset;
+                quint64 new_end = new_start + len;
+                bool touches = new_start <= end && start <= new_end;
+                if (!touches || qMax(end, new_end) - qMin(start, new_start) > m_wc_limit)
+                        return false;
+                // the new range covers any gap, and it overwrites what it overlaps
+                if (new_start < start) {
+                        memmove(held + (start - new_start), held, m_wc_len);
+                        m_wc_offset = offset;
+                }
+                m_wc_len = static_cast<quint32>(qMax(end, new_end) - m_wc_offset);
+                memcpy(held + (offset - m_wc_offset), buf, len);
+                qDebug("%s: combined offset=0x%08x len=%u", __func__, offset, static_cast<unsigned>(len));
+                return true;
+        }
+        m_wc_offset = offset;
+        m_wc_len = static_cast<quint32>(len);
+        memcpy(held, buf, len);
+        return true;
+}
+
+/**
+ * @brief set up the transfers of a command and submit the first one
+ * @param op operation the command carries out
+ * @return false; the command ends in command_end()
+ */
+bool usb_FEL::start_command(const aw_op_t& op)
+{
+        if (op.retry && !m_retrying) {
+                // errors of failed attempts are reported only if the last one fails, too
+                m_retrying = true;
+                m_attempts = 1;
+                m_quiet++;
+                m_deferred_error.clear();
+        }
+        build_command(op);
+        m_cmd_serial++;
+        m_cmd_active = true;
+        m_cmd->ts = m_trace ? m_trace->now() : 0;
+        m_cmd->timer.start();
+        submit_leg();
+        return false;
+}
+
+void usb_FEL::add_leg(int kind, void* buf, quint32 length, int stat, int timeout)
+{
+        Q_ASSERT(m_cmd->count < AW_LEGS_MAX);
+        aw_leg_t& leg = m_cmd->legs[m_cmd->count++];
+        leg.kind = kind;
+        leg.buf = reinterpret_cast<uchar *>(buf);
+        leg.length = length;
+        leg.stat = stat;
+        leg.timeout = timeout;
+        leg.start = 0;
+        leg.usecs = 0;
+        leg.ts = 0;
+}
+
+/**
+ * @brief add an AWUC, the data (if any) and the AWUS of a write
+ */
+void usb_FEL::add_write(const void* buf, quint32 length, int stat)
+{
+        aw_usb_request_t& req = m_cmd->awuc[m_cmd->nawuc++];
+        memset(&req, 0, sizeof(req));
+        memcpy(req.signature, "AWUC", 4);
+        req.length       = HOST_TO_LE(static_cast<quint64>(length));
+        req.request      = HOST_TO_LE(static_cast<quint16>(AW_USB_WRITE));
+        req.length_hi[0] = HOST_TO_LE(static_cast<quint16>(length >> 16));
+        req.length_hi[1] = req.length_hi[0];
+        add_leg(LEG_OUT, &req, sizeof(req), felstats::OP_AWUC, timeout_for(sizeof(req)));
+        if (length)
+                add_leg(LEG_OUT, const_cast<void *>(buf), length, stat, timeout_for(length));
+        aw_usb_response_t& rsp = m_cmd->awus[m_cmd->nawus++];
+        memset(&rsp, 0, sizeof(rsp));
+        add_leg(LEG_AWUS, &rsp, sizeof(rsp), felstats::OP_AWUS, timeout_for(sizeof(rsp)));
+}
+
+/**
+ * @brief add an AWUC, the data (if any) and the AWUS of a read
+ * @param kind LEG_IN, or LEG_STATUS to check the data as a FEL status
+ */
+void usb_FEL::add_read(void* buf, quint32 length, int stat, int kind)
+{
+        aw_usb_request_t& req = m_cmd->awuc[m_cmd->nawuc++];
+        memset(&req, 0, sizeof(req));
+        memcpy(req.signature, "AWUC", 4);
+        req.length       = HOST_TO_LE(static_cast<quint64>(length));
+        req.request      = HOST_TO_LE(static_cast<quint16>(AW_USB_READ));
+        req.length_hi[0] = HOST_TO_LE(static_cast<quint16>(length >> 16));
+        req.length_hi[1] = req.length_hi[0];
+        add_leg(LEG_OUT, &req, sizeof(req), felstats::OP_AWUC, timeout_for(sizeof(req)));
+        if (length)
+                add_leg(kind, buf, length, stat, timeout_for(length));
+        aw_usb_response_t& rsp = m_cmd->awus[m_cmd->nawus++];
+        memset(&rsp, 0, sizeof(rsp));
+        add_leg(LEG_AWUS, &rsp, sizeof(rsp), felstats::OP_AWUS, timeout_for(sizeof(rsp)));
+}
+
+/**
+ * @brief add the read of the FEL status that ends most commands
+ */
+void usb_FEL::add_status()
+{
+        memset(&m_cmd->status, 0, sizeof(m_cmd->status));
+        add_read(&m_cmd->status, sizeof(m_cmd->status), felstats::OP_STATUS, LEG_STATUS);
 }
 
-bool usb_FEL::aw_send_fel_request(int type, quint32 addr, quint32 length, quint32 pad)
+void usb_FEL::add_request(int type, quint32 addr, quint32 length, quint32 pad)
 {
-        aw_fel_request_t req;
+        aw_fel_request_t& req = m_cmd->req;
         memset (&req, 0, sizeof (req));
         req.request = HOST_TO_LE(type);
         req.address = HOST_TO_LE(addr);
@@ -271,318 +973,1041 @@ bool usb_FEL::aw_send_fel_request(int type, quint32 addr, quint32 length, quint3
         qDebug("%s:     address  : %08x", __func__, req.address);
         qDebug("%s:     length   : %08x", __func__, req.length);
         qDebug("%s:     pad      : %08x", __func__, req.pad);
-        bool success = aw_usb_write (&req, sizeof(req));
-        qDebug("%s: %s", __func__, success ? "SUCCESS" : "FAILED");
-        return success;
+        add_write(&req, sizeof(req), felstats::OP_SEND);
 }
 
-bool usb_FEL::aw_send_fel_4uints( quint32 param1, quint32 param2, quint32 param3, quint32 param4)
+/**
+ * @brief set up the transfers of a command
+ * Requests are sent as an AWUC, the 16 bytes of the request and an
+ * AWUS; data is read or written the same way, and most commands end
+ * with the read of a FEL status. Data of length 0 is not transferred.
+ * @param op operation the command carries out
+ */
+void usb_FEL::build_command(const aw_op_t& op)
 {
-        aw_fel_generic_t req;
-        memset (&req, 0, sizeof (req));
-        req.param1 = HOST_TO_LE(param1);
-        req.param2 = HOST_TO_LE(param2);
-        req.param3 = HOST_TO_LE(param3);
-        req.param4 = HOST_TO_LE(param4);
-        qDebug("%s: aw_fel_request", __func__);
-        qDebug("%s:     param1   : %08x", __func__, req.param1);
-        qDebug("%s:     param2   : %08x", __func__, req.param2);
-        qDebug("%s:     param3   : %08x", __func__, req.param3);
-        qDebug("%s:     param4   : %08x", __func__, req.param4);
-        bool success = aw_usb_write (&req, sizeof(req));
-        qDebug("%s: %s", __func__, success ? "SUCCESS" : "FAILED");
-        return success;
+        aw_cmd_s* cmd = m_cmd;
+        cmd->op = op;
+        cmd->count = 0;
+        cmd->pos = 0;
+        cmd->done = 0;
+        cmd->rc = LIBUSB_SUCCESS;
+        cmd->failed = -1;
+        cmd->nawuc = 0;
+        cmd->nawus = 0;
+
+        switch (op.type) {
+        case AW_OP_VERSION:
+                memset(&cmd->version, 0, sizeof(cmd->version));
+                add_request(AW_FEL_VERSION, 0, 0, 0);
+                add_read(&cmd->version, sizeof(cmd->version), felstats::OP_RECV, LEG_IN);
+                add_status();
+                break;
+        case AW_OP_FEL_READ:
+                add_request(AW_FEL_1_READ, op.addr, op.length, 0);
+                add_read(op.rdata, op.length, felstats::OP_RECV, LEG_IN);
+                add_status();
+                break;
+        case AW_OP_FEL_WRITE:
+                add_request(AW_FEL_1_WRITE, op.addr, op.length, 0);
+                add_write(op.wdata, op.length, felstats::OP_SEND);
+                add_status();
+                break;
+        case AW_OP_FEL_EXEC:
+                add_request(AW_FEL_1_EXEC, op.addr, op.param1, op.param2);
+                add_status();
+                break;
+        case AW_OP_FES_READ:
+                add_request(AW_FEL_2_RDWR, op.addr, op.length, (op.specs & ~AW_FEL_2_IO) | AW_FEL_2_RD);
+                add_read(op.rdata, op.length, felstats::OP_RECV, LEG_IN);
+                add_status();
+                break;
+        case AW_OP_FES_WRITE:
+                add_request(AW_FEL_2_RDWR, op.addr, op.length, (op.specs & ~AW_FEL_2_IO) | AW_FEL_2_WR);
+                add_write(op.wdata, op.length, felstats::OP_SEND);
+                add_status();
+                break;
+        case AW_OP_FES_EXEC:
+                add_request(AW_FEL_2_EXEC, op.addr, op.param1, op.param2);
+                break;
+        case AW_OP_FES_0203:
+                add_request(AW_FEL_2_0203, op.addr, op.param1, op.param2);
+                break;
+        case AW_OP_FES_0204:
+                add_request(AW_FEL_2_0204, op.addr, op.param1, op.param2);
+                break;
+        case AW_OP_FES_0205:
+                add_request(AW_FEL_2_0205, op.param1, op.param2, op.param3);
+                add_status();
+                break;
+        case AW_OP_FES_PARAMS:
+                memset(&cmd->params, 0, sizeof(cmd->params));
+                cmd->params.param1 = HOST_TO_LE(op.param1);
+                cmd->params.param2 = HOST_TO_LE(op.param2);
+                cmd->params.param3 = HOST_TO_LE(op.param3);
+                cmd->params.param4 = HOST_TO_LE(op.param4);
+                add_write(&cmd->params, sizeof(cmd->params), felstats::OP_SEND);
+                add_status();
+                break;
+        case AW_OP_PAD_READ:
+                add_read(op.rdata, op.length, felstats::OP_RECV, LEG_IN);
+                add_status();
+                break;
+        case AW_OP_PAD_WRITE:
+                add_write(op.wdata, op.length, felstats::OP_SEND);
+                add_status();
+                break;
+        case AW_OP_POLL:
+                memset(cmd->reply, 0, sizeof(cmd->reply));
+                add_request(AW_FEL_2_0203, 0, 0, 0);
+                add_read(cmd->reply, sizeof(cmd->reply), felstats::OP_RECV, LEG_IN);
+                add_status();
+                break;
+        case AW_OP_DRAIN:
+                add_leg(LEG_DRAIN, &cmd->awus[0], sizeof(cmd->awus[0]), -1, AW_DRAIN_MSEC);
+                break;
+        }
 }
 
-bool usb_FEL::aw_read_fel_status()
+/**
+ * @brief submit the leg in flight, or the rest of it
+ * Replays are answered from the capture right away.
+ */
+void usb_FEL::submit_leg()
 {
-        static const QByteArray status_ok("\xff\xff\x00\x00\x00\x00\x00\x00", 8);
-        QByteArray buf;
-
-        buf.fill('\0', 8);
-        if (!aw_usb_read(buf.data(), buf.size()))
-                return false;
+        aw_cmd_s* cmd = m_cmd;
+        aw_leg_t& leg = cmd->legs[cmd->pos];
+        if (0 == cmd->done) {
+                leg.start = cmd->timer.nsecsElapsed();
+                leg.ts = m_trace ? m_trace->now() : 0;
+        }
+        const int ep = leg.kind == LEG_OUT ? AW_USB_FEL_BULK_EP_OUT : AW_USB_FEL_BULK_EP_IN;
+        uchar* data = leg.buf + cmd->done;
+        const int length = static_cast<int>(leg.length - cmd->done);
+        qDebug("%s: ep=%02x buff=%p length=%d", __func__, ep, data, length);
+        m_stats.beginTransfer();
+        if (m_replay) {
+                int actual = 0;
+                const int rc = m_replay->transfer(ep, data, length, &actual);
+                leg_done(rc, actual);
+                return;
+        }
+        libusb_fill_bulk_transfer(m_xfer, m_usb, static_cast<unsigned char>(ep), data, length,
+                                  &usb_FEL::transfer_cb, this, static_cast<unsigned int>(leg.timeout));
+        const int rc = libusb_submit_transfer(m_xfer);
+        if (rc != LIBUSB_SUCCESS)
+                leg_done(rc, 0);
+}
 
-        if (buf != status_ok) {
-                emit Error(tr("ERROR: aw_read_fel_status"));
+/**
+ * @brief completion of a transfer, called in the event thread
+ */
+void LIBUSB_CALL usb_FEL::transfer_cb(libusb_transfer* xfer)
+{
+        usb_FEL* fel = static_cast<usb_FEL *>(xfer->user_data);
+        int rc;
+        switch (xfer->status) {
+        case LIBUSB_TRANSFER_COMPLETED:
+                rc = LIBUSB_SUCCESS;
+                break;
+        case LIBUSB_TRANSFER_TIMED_OUT:
+                rc = LIBUSB_ERROR_TIMEOUT;
+                break;
+        case LIBUSB_TRANSFER_STALL:
+                rc = LIBUSB_ERROR_PIPE;
+                break;
+        case LIBUSB_TRANSFER_NO_DEVICE:
+                rc = LIBUSB_ERROR_NO_DEVICE;
+                break;
+        case LIBUSB_TRANSFER_OVERFLOW:
+                rc = LIBUSB_ERROR_OVERFLOW;
+                break;
+        case LIBUSB_TRANSFER_CANCELLED:
+                rc = LIBUSB_ERROR_INTERRUPTED;
+                break;
+        default:
+                rc = LIBUSB_ERROR_IO;
+                break;
         }
-        return buf == status_ok;
+        fel->leg_done(rc, xfer->actual_length);
 }
 
-quint32 usb_FEL::aw_fel_get_version(aw_fel_version_t *pver)
+/**
+ * @brief account a completed transfer and submit the next one
+ * Runs in the event thread, or inline for a replay. When the command is
+ * done or a transfer failed, the command is handed back to the thread
+ * of this object: command_done() is queued for an asynchronous
+ * operation, and m_cmd_done released last, since the object may be
+ * gone as soon as a synchronous caller or usb_close() got it.
+ * @param rc libusb error code
+ * @param actual number of bytes transferred
+ */
+void usb_FEL::leg_done(int rc, int actual)
 {
-        aw_fel_version_t ver;
-        if (!aw_send_fel_request(AW_FEL_VERSION, 0, 0))
-                return 0;
-        if (!aw_usb_read(&ver, sizeof(ver)))
-                return 0;
-        if (!aw_read_fel_status())
-                return 0;
+        aw_cmd_s* cmd = m_cmd;
+        aw_leg_t& leg = cmd->legs[cmd->pos];
+        m_stats.endTransfer();
+        if (m_abort.loadAcquire())
+                rc = LIBUSB_ERROR_INTERRUPTED;
+        if (LIBUSB_SUCCESS == rc) {
+                cmd->done += static_cast<quint32>(qMax(0, actual));
+                if (cmd->done < leg.length && actual > 0) {
+                        // short transfer; the rest follows
+                        submit_leg();
+                        return;
+                }
+                if (cmd->done < leg.length && leg.kind != LEG_DRAIN)
+                        rc = LIBUSB_ERROR_IO;
+        }
+        leg.usecs = (cmd->timer.nsecsElapsed() - leg.start) / 1000;
 
-        ver.soc_id     = LE_TO_HOST(ver.soc_id);
-        ver.unknown_0a = LE_TO_HOST(ver.unknown_0a);
-        ver.protocol   = LE_TO_HOST(ver.protocol);
-        ver.scratchpad = LE_TO_HOST(ver.scratchpad);
-        ver.pad[0]     = LE_TO_HOST(ver.pad[0]);
-        ver.pad[1]     = LE_TO_HOST(ver.pad[1]);
-
-        const char *soc_name = "unknown";
-        switch ((ver.soc_id >> 8) & 0xFFFF) {
-        case SUNXI_SOC_ID_FLASHMODE:
-                soc_name = "A?? flash mode";
+        bool success = LIBUSB_SUCCESS == rc;
+        switch (leg.kind) {
+        case LEG_AWUS:
+                success = success && !memcmp(leg.buf, "AWUS", 4);
                 break;
-        case SUNXI_SOC_ID_A10:
-                soc_name = "A10";
+        case LEG_STATUS:
+                success = success && !memcmp(leg.buf, &status_ok, sizeof(status_ok));
                 break;
-        case SUNXI_SOC_ID_A13:
-                soc_name = "A13";
+        case LEG_DRAIN:
+                // whatever came, nothing is pending any more
+                qDebug("%s: drain rc=%d got=%u", __func__, rc, cmd->done);
+                success = true;
                 break;
-        case SUNXI_SOC_ID_A31:
-                soc_name = "A31";
+        }
+
+        if (success && cmd->pos + 1 < cmd->count) {
+                cmd->pos++;
+                cmd->done = 0;
+                submit_leg();
+                return;
+        }
+        if (!success) {
+                cmd->rc = rc;
+                cmd->failed = cmd->pos;
+        }
+        if (m_op_async)
+                QMetaObject::invokeMethod(this, "command_done", Qt::QueuedConnection, Q_ARG(int, m_cmd_serial));
+        m_cmd_done.release();
+}
+
+/**
+ * @brief continue an asynchronous operation after a command
+ * @param serial number of the command that ended
+ */
+void usb_FEL::command_done(int serial)
+{
+        // the completion of a command abandoned by usb_close() may still be queued
+        if (!m_cmd_active || serial != m_cmd_serial)
+                return;
+        m_cmd_done.acquire();
+        if (command_end())
+                op_done();
+}
+
+/**
+ * @brief continue the operation after the command in flight ended
+ * @return true if the operation completed, false if a command is in flight
+ */
+bool usb_FEL::command_end()
+{
+        m_cmd_active = false;
+        const bool success = finish_command();
+        const aw_op_t& op = m_cmd->op;
+
+        if (m_flushing) {
+                m_flushing = false;
+                if (!success) {
+                        m_error_offset = op.addr;
+                        emit Error(tr("Combined write of %1 bytes at 0x%2 failed.")
+                                   .arg(op.length).arg(op.addr, 8, 16, QChar('0')));
+                        return m_op.type == AW_OP_SEND ? send_end(false) : end_op(false);
+                }
+                return begin_op();
+        }
+        if (op.type == AW_OP_DRAIN)
+                return start_command(m_retry_op);
+        if (!success && retry_command())
+                return false;
+        if (op.retry)
+                retry_end(success);
+        if (m_op.type == AW_OP_SEND)
+                return send_chunk_done(success);
+        return end_op(success);
+}
+
+/**
+ * @brief record and report the command that ended
+ * Statistics, trace and messages are done here, in the thread of this
+ * object, not in the event thread.
+ * @return true if the command succeeded
+ */
+bool usb_FEL::finish_command()
+{
+        aw_cmd_s* cmd = m_cmd;
+        const aw_op_t& op = cmd->op;
+        const bool success = cmd->failed < 0;
+        const bool tracing = m_trace && m_trace->isEnabled();
+        const qint64 usecs = cmd->timer.nsecsElapsed() / 1000;
+
+        for (int i = 0; i <= cmd->pos && i < cmd->count; i++) {
+                const aw_leg_t& leg = cmd->legs[i];
+                if (leg.stat >= 0)
+                        m_stats.record(leg.stat, leg.usecs, leg.length, i != cmd->failed);
+                if (tracing) {
+                        QJsonObject args;
+                        args.insert(QLatin1String("ep"), leg.kind == LEG_OUT ? AW_USB_FEL_BULK_EP_OUT : AW_USB_FEL_BULK_EP_IN);
+                        args.insert(QLatin1String("length"), static_cast<double>(leg.length));
+                        m_trace->complete("usb", QLatin1String(leg.kind == LEG_OUT ? "bulk_send" : "bulk_recv"),
+                                          leg.ts, leg.usecs, args);
+                }
+        }
+
+        if (!success) {
+                const aw_leg_t& leg = cmd->legs[cmd->failed];
+                if (cmd->rc != LIBUSB_SUCCESS) {
+                        if (LIBUSB_ERROR_TIMEOUT == cmd->rc)
+                                m_stats.recordTimeout();
+                        if (m_replay)
+                                error(m_replay->errorString());
+                        if (leg.kind == LEG_OUT)
+                                error(tr("libusb usb_bulk_send error (%1)").arg(cmd->rc));
+                        else
+                                error(tr("libusb usb_bulk_recv error (%1)").arg(cmd->rc));
+                } else if (leg.kind == LEG_STATUS) {
+                        error(tr("ERROR: aw_read_fel_status"));
+                }
+        }
+
+        switch (op.type) {
+        case AW_OP_VERSION:
+                if (success) {
+                        aw_fel_version_t& ver = cmd->version;
+                        ver.soc_id     = LE_TO_HOST(ver.soc_id);
+                        ver.unknown_0a = LE_TO_HOST(ver.unknown_0a);
+                        ver.protocol   = LE_TO_HOST(ver.protocol);
+                        ver.scratchpad = LE_TO_HOST(ver.scratchpad);
+                        ver.pad[0]     = LE_TO_HOST(ver.pad[0]);
+                        ver.pad[1]     = LE_TO_HOST(ver.pad[1]);
+                        if (op.rdata)
+                                memcpy(op.rdata, &ver, sizeof(ver));
+                        qDebug("signature    : '%.8s'", ver.signature);
+                        qDebug("soc_id       : %08x", ver.soc_id);
+                        qDebug("unknown_0a   : %08x", ver.unknown_0a);
+                        qDebug("protocol     : %04x", ver.protocol);
+                        qDebug("unknown_12   : %04x", ver.unknown_12);
+                        qDebug("unknown_13   : %04x", ver.unknown_13);
+                        qDebug("scratchpad   : %08x", ver.scratchpad);
+                        qDebug("pad[0]       : %08x", ver.pad[0]);
+                        qDebug("pad[1]       : %08x", ver.pad[1]);
+                }
                 break;
-        case SUNXI_SOC_ID_A20:
-                soc_name = "A20";
+        case AW_OP_FES_READ:
+        case AW_OP_FES_WRITE:
+                m_stats.record(felstats::OP_FES_RDWR, usecs, op.length, success);
                 break;
-        case SUNXI_SOC_ID_A23:
-                soc_name = "A23";
+        case AW_OP_POLL:
+                m_stats.record(felstats::OP_POLL, usecs, sizeof(cmd->reply), success);
                 break;
         }
 
-        if (pver)
-                memcpy(pver, &ver, sizeof(*pver));
+        if (tracing) {
+                QJsonObject args;
+                args.insert(QLatin1String("offset"), static_cast<double>(op.addr));
+                args.insert(QLatin1String("len"), static_cast<double>(op.length));
+                const char* name = op.type >= 0 ? op_names[op.type] : "drain_response";
+                m_trace->complete("fel", QLatin1String(name), cmd->ts, m_trace->now() - cmd->ts, args);
+        }
+        qDebug("%s: %s %s", __func__, op.type >= 0 ? op_names[op.type] : "drain_response",
+               success ? "SUCCESS" : "FAILED");
+        return success;
+}
+
+/**
+ * @brief repeat a FES write after a transfer error, if it may be
+ * Every retry first resyncs with the device: a halt on the endpoints is
+ * cleared and a pending AWUS discarded, then the write is repeated. The
+ * device acts on a request as soon as it has its 16 bytes, so a write
+ * whose AWUC or request failed is always repeated. Once the request went
+ * out the device may have acted on it, so only DRAM writes are repeated:
+ * NAND writes, and writes to the CRC, update the CRC that FES keeps of
+ * the NAND data, so they fail at once.
+ * @return true if the write is repeated
+ */
+bool usb_FEL::retry_command()
+{
+        const aw_op_t& op = m_cmd->op;
+        if (!op.retry || m_replay || m_attempts > m_retries)
+                return false;
+        const bool repeatable = !(op.specs & AW_FEL_2_NAND) && op.addr != AW_FES_CRC_ADDR;
+        if (m_cmd->failed >= AW_REQUEST_LEGS && !repeatable)
+                return false;
 
-        qDebug("signature    : '%.8s'", ver.signature);
-        qDebug("soc_id       : %08x (%s)", ver.soc_id, soc_name);
-        qDebug("unknown_0a   : %08x", ver.unknown_0a);
-        qDebug("protocol     : %04x", ver.protocol);
-        qDebug("unknown_12   : %04x", ver.unknown_12);
-        qDebug("unknown_13   : %04x", ver.unknown_13);
-        qDebug("scratchpad   : %08x", ver.scratchpad);
-        qDebug("pad[0]       : %08x", ver.pad[0]);
-        qDebug("pad[1]       : %08x", ver.pad[1]);
+        m_retry_count++;
+        m_stats.recordRetry();
+        emit Status(tr("Retrying write of %1 bytes at 0x%2 (%3 of %4).")
+                    .arg(op.length)
+                    .arg(op.addr, 8, 16, QChar('0'))
+                    .arg(m_attempts)
+                    .arg(m_retries));
+        m_attempts++;
+        m_retry_op = op;
+        clear_halt();
+        aw_op_t drain = aw_op_t();
+        drain.type = AW_OP_DRAIN;
+        start_command(drain);
+        return true;
+}
+
+/**
+ * @brief end the attempts of a FES write
+ * @param success true if the last attempt succeeded
+ */
+void usb_FEL::retry_end(bool success)
+{
+        m_retrying = false;
+        m_quiet--;
+        if (success)
+                return;
+        const aw_op_t& op = m_cmd->op;
+        m_error_offset = op.addr;
+        if (!m_deferred_error.isEmpty())
+                emit Error(m_deferred_error);
+        emit Error(tr("Write of %1 bytes at 0x%2 failed after %3 attempt(s).")
+                   .arg(op.length)
+                   .arg(op.addr, 8, 16, QChar('0'))
+                   .arg(m_attempts));
+}
 
-        return ((ver.soc_id >> 8) & 0xFFFF);
+quint32 usb_FEL::aw_fel_get_version(aw_fel_version_t *pver)
+{
+        aw_fel_version_t ver;
+        aw_op_t op = aw_op_t();
+        op.type = AW_OP_VERSION;
+        op.rdata = &ver;
+        if (!run(op))
+                return 0;
+        if (pver)
+                memcpy(pver, &ver, sizeof(*pver));
+        return soc_id(ver);
 }
 
 
 bool usb_FEL::aw_fel_read(quint32 offset, void *buf, size_t len)
 {
-        if (!aw_send_fel_request(AW_FEL_1_READ, offset, len))
-                return false;
-        if (!aw_usb_read(buf, len))
-                return false;
-        return aw_read_fel_status();
+        aw_op_t op = aw_op_t();
+        op.type = AW_OP_FEL_READ;
+        op.addr = offset;
+        op.length = static_cast<quint32>(len);
+        op.rdata = buf;
+        return run(op);
 }
 
 
 bool usb_FEL::aw_fel_write(quint32 offset, const void *buf, size_t len)
 {
-        if (!aw_send_fel_request(AW_FEL_1_WRITE, offset, len))
-                return false;
-        if (!aw_usb_write(buf, len))
-                return false;
-        return aw_read_fel_status();
+        aw_op_t op = aw_op_t();
+        op.type = AW_OP_FEL_WRITE;
+        op.addr = offset;
+        op.length = static_cast<quint32>(len);
+        op.wdata = buf;
+        return run(op);
 }
 
 
 bool usb_FEL::aw_fel_execute(quint32 offset, quint32 param1, quint32 param2)
 {
-        if (!aw_send_fel_request(AW_FEL_1_EXEC, offset, param1, param2))
-                return false;
-        return aw_read_fel_status();
+        aw_op_t op = aw_op_t();
+        op.type = AW_OP_FEL_EXEC;
+        op.addr = offset;
+        op.param1 = param1;
+        op.param2 = param2;
+        return run(op);
 }
 
 
 bool usb_FEL::aw_fel_send_file(quint32 offset, const QString& filename, quint32 chunk_size, quint32 min_bytes)
 {
         QFile fin(filename);
-        quint32	file_size;
-        quint32	total_written;
-
         if (!fin.open(QIODevice::ReadOnly)) {
                 emit Error(tr("Failed to open file to send: %1").arg(filename));
                 return false;
         }
-        file_size = fin.size();
+        bool success = send_chunks(offset, 0, false, &fin, QByteArray(), filename, chunk_size, min_bytes);
+        fin.close();
+        return success;
+}
+
+
+bool usb_FEL::aw_fel_send_buffer(quint32 offset, const QByteArray& data, const QString& name, quint32 chunk_size, quint32 min_bytes)
+{
+        return send_chunks(offset, 0, false, 0, data, name, chunk_size, min_bytes);
+}
+
+
+/**
+ * @brief start sending a payload in memory and return immediately
+ * Completed(bool) is emitted when all chunks are sent.
+ * @param offset address to write to
+ * @param specs AW_FEL_2_xxx flags for FES writes
+ * @param fes true to use FES writes
+ * @param data payload
+ * @param name name of the payload for messages
+ * @param chunk_size maximum size of a single write
+ * @param min_bytes minimum number of bytes
+ * @return true if the send was started
+ */
+bool usb_FEL::startSend(quint32 offset, quint32 specs, bool fes, const QByteArray& data, const QString& name,
+                        quint32 chunk_size, quint32 min_bytes)
+{
+        if (!begin_send(offset, specs, fes, 0, data, name, chunk_size, min_bytes))
+                return false;
+        return launch(true);
+}
+
+
+/**
+ * @brief send a payload in chunks with FEL or, if fes is true, FES writes
+ * @return true on success
+ */
+bool usb_FEL::send_chunks(quint32 offset, quint32 specs, bool fes, QIODevice* in, const QByteArray& data,
+                          const QString& name, quint32 chunk_size, quint32 min_bytes)
+{
+        if (!begin_send(offset, specs, fes, in, data, name, chunk_size, min_bytes))
+                return false;
+        return launch(false);
+}
+
+
+/**
+ * @brief set up the send of a payload in chunks
+ * Every chunk goes out of a pooled transfer buffer, which is device
+ * memory where libusb supports it, so usbfs does not copy it again into
+ * a kernel buffer. Files are read straight into it; payloads in memory
+ * are copied, which costs less than the copy into the kernel it saves.
+ * @param offset address to write to
+ * @param specs AW_FEL_2_xxx flags for FES writes
+ * @param fes true to use FES writes
+ * @param in device to read the payload from, or 0 to send data
+ * @param data payload in memory (if in is 0)
+ * @param name name of the payload for messages
+ * @param chunk_size maximum size of a single write
+ * @param min_bytes minimum number of bytes
+ * @return true if the send can start
+ */
+bool usb_FEL::begin_send(quint32 offset, quint32 specs, bool fes, QIODevice* in, const QByteArray& data,
+                         const QString& name, quint32 chunk_size, quint32 min_bytes)
+{
+        if (m_op_busy) {
+                emit Error(tr("USB FEL device is busy."));
+                return false;
+        }
+        aw_send_t& s = m_send;
+        s.in = in;
+        s.data = data;
+        s.name = name;
+        s.offset = offset;
+        s.specs = specs;
+        s.fes = fes;
+        s.chunk_size = chunk_size;
+        s.size = in ? static_cast<quint32>(in->size()) : static_cast<quint32>(data.size());
+        s.min_bytes = qMax(min_bytes, s.size);
+        s.written = 0;
+        s.chunk = 0;
+        s.percent = 0;
+        s.ts = m_trace ? m_trace->now() : 0;
 
         QLocale l = QLocale::system();
         emit Status(tr("Sending %1 (%2 bytes)...")
-                    .arg(filename)
-                    .arg(l.toString(file_size)));
+                    .arg(name)
+                    .arg(l.toString(s.size)));
+        if (m_progress)
+                m_progress->begin(s.size);
+        emit Progress(0);
+        s.pool = buffer_get(chunk_size);
+        m_op = aw_op_t();
+        m_op.type = AW_OP_SEND;
+        return true;
+}
 
-        if (min_bytes < file_size)
-                min_bytes = file_size;
 
-        total_written = 0;
-        emit Progress(0);
-        while (min_bytes > 0) {
-                quint32 read_size = min_bytes < chunk_size ? min_bytes : chunk_size;
-                QByteArray buf = fin.read(read_size);
-                quint32 bytes_read = buf.size();
-                min_bytes -= bytes_read;
-                qDebug("%s: offset=0x%08x bytes_read=%u min_bytes=%u chunk_size=%u", __func__,
-                       offset, bytes_read, min_bytes, chunk_size);
-                while (min_bytes > 0 && bytes_read < chunk_size) {
-                        buf.append('\0');
-                        min_bytes--;
-                }
-                total_written += bytes_read;
-                emit Progress(100.0 * total_written / file_size);
-                if (!aw_fel_write(offset, buf.constData(), bytes_read)) {
-                        emit Error(tr("Abort file send at offset %1 of %2.")
-                                   .arg(fin.pos()).arg(fin.size()));
-                        return false;
-                }
-                offset += bytes_read;
+/**
+ * @brief start the write of the next chunk
+ * @return true if the send completed, false if a write is in flight
+ */
+bool usb_FEL::send_chunk()
+{
+        aw_send_t& s = m_send;
+        if (0 == s.min_bytes)
+                return send_end(true);
+
+        const quint32 read_size = qMin(s.min_bytes, s.chunk_size);
+        quint32 bytes_read;
+        if (s.in) {
+                trace_span read(m_trace, "host", "read");
+                qint64 got = s.in->read(reinterpret_cast<char *>(s.pool), read_size);
+                bytes_read = got > 0 ? static_cast<quint32>(got) : 0;
+        } else {
+                bytes_read = qMin(read_size, s.size - s.written);
+                memcpy(s.pool, s.data.constData() + s.written, bytes_read);
         }
+        s.min_bytes -= bytes_read;
+        // a short chunk ends the payload; padding up to min_bytes is not sent
+        if (bytes_read < s.chunk_size)
+                s.min_bytes = 0;
+        qDebug("%s: offset=0x%08x bytes_read=%u min_bytes=%u chunk_size=%u", __func__,
+               s.offset, bytes_read, s.min_bytes, s.chunk_size);
+        if (0 == bytes_read)
+                return send_end(true);
+
+        s.chunk = bytes_read;
+        aw_op_t op = aw_op_t();
+        op.type = s.fes ? AW_OP_FES_WRITE : AW_OP_FEL_WRITE;
+        op.addr = s.offset;
+        op.length = bytes_read;
+        op.specs = s.specs;
+        op.wdata = s.pool;
+        op.retry = s.fes;
+        return start_command(op);
+}
 
-        fin.close();
-        emit Status(tr("Successfully sent %1.").arg(filename));
-        return true;
+
+/**
+ * @brief account the chunk written and go on with the next one
+ * @param success true if the chunk was written
+ * @return true if the send completed, false if a write is in flight
+ */
+bool usb_FEL::send_chunk_done(bool success)
+{
+        aw_send_t& s = m_send;
+        if (!success) {
+                m_error_offset = s.offset;
+                emit Error(tr("Abort file send of %1 at offset %2 of %3.")
+                           .arg(s.name).arg(s.written).arg(s.size));
+                return send_end(false);
+        }
+        s.written += s.chunk;
+        if (m_progress)
+                m_progress->advance(s.chunk);
+        // the signal is for simple clients, it is limited to whole percents
+        if (100 * static_cast<qint64>(s.written) / s.size != s.percent) {
+                s.percent = 100 * static_cast<qint64>(s.written) / s.size;
+                emit Progress(s.percent);
+        }
+        s.offset += s.chunk;
+        return send_chunk();
+}
+
+
+bool usb_FEL::send_end(bool success)
+{
+        aw_send_t& s = m_send;
+        buffer_put(s.pool);
+        s.pool = 0;
+        if (m_trace && m_trace->isEnabled()) {
+                QJsonObject args;
+                args.insert(QLatin1String("name"), s.name);
+                args.insert(QLatin1String("offset"), static_cast<double>(s.offset - s.written));
+                args.insert(QLatin1String("size"), static_cast<double>(s.size));
+                m_trace->complete("send", QLatin1String("send_chunks"), s.ts, m_trace->now() - s.ts, args);
+        }
+        if (success)
+                emit Status(tr("Successfully sent %1.").arg(s.name));
+        s.in = 0;
+        s.data = QByteArray();
+        return end_op(success);
+}
+
+
+/**
+ * @brief get a transfer buffer from the pool
+ * Buffers are allocated with libusb_dev_mem_alloc() where the platform
+ * supports it (usbfs maps them, so the kernel does not copy the data into
+ * its own URB buffers) and page aligned from the heap otherwise. They stay
+ * in the pool until the device is closed.
+ * @param size minimum size of the buffer
+ * @return pointer to the buffer
+ */
+uchar* usb_FEL::buffer_get(size_t size)
+{
+        for (int i = 0; i < m_free_buffers.size(); i++) {
+                uchar* buf = m_free_buffers.at(i);
+                if (m_buffers.value(buf).size < size)
+                        continue;
+                m_free_buffers.removeAt(i);
+                return buf;
+        }
+
+        aw_buffer_t info;
+        info.size = size;
+        info.devmem = false;
+        uchar* buf = 0;
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+        if (m_usb) {
+                buf = libusb_dev_mem_alloc(m_usb, size);
+                info.devmem = buf != 0;
+        }
+#endif
+        if (!buf)
+                buf = reinterpret_cast<uchar *>(qMallocAligned(size, 4096));
+        qDebug("%s: new %s buffer %p size=%u", __func__,
+               info.devmem ? "device" : "heap", buf, static_cast<unsigned>(size));
+        m_buffers.insert(buf, info);
+        return buf;
+}
+
+
+/**
+ * @brief return a transfer buffer to the pool
+ * @param buf pointer to the buffer (may be 0)
+ */
+void usb_FEL::buffer_put(uchar* buf)
+{
+        if (buf)
+                m_free_buffers.append(buf);
+}
+
+
+/**
+ * @brief free all pooled transfer buffers
+ * Device memory belongs to the device handle, so this is done before
+ * the handle is closed. All buffers must have been returned.
+ */
+void usb_FEL::buffer_free_all()
+{
+        Q_ASSERT(m_free_buffers.size() == m_buffers.size());
+        QHash<uchar*, aw_buffer_t>::const_iterator it;
+        for (it = m_buffers.constBegin(); it != m_buffers.constEnd(); ++it) {
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+                if (it.value().devmem) {
+                        libusb_dev_mem_free(m_usb, it.key(), it.value().size);
+                        continue;
+                }
+#endif
+                qFreeAligned(it.key());
+        }
+        m_buffers.clear();
+        m_free_buffers.clear();
 }
 
 bool usb_FEL::aw_pad_read(void *buf, size_t len)
 {
-        if (!aw_usb_read(buf, len))
-                return false;
-        return aw_read_fel_status();
+        aw_op_t op = aw_op_t();
+        op.type = AW_OP_PAD_READ;
+        op.length = static_cast<quint32>(len);
+        op.rdata = buf;
+        return run(op);
 }
 
 
 bool usb_FEL::aw_pad_write(const void *buf, size_t len)
 {
-        if (!aw_usb_write(buf, len))
-                return false;
-        return aw_read_fel_status();
+        aw_op_t op = aw_op_t();
+        op.type = AW_OP_PAD_WRITE;
+        op.length = static_cast<quint32>(len);
+        op.wdata = buf;
+        return run(op);
 }
 
 
 bool usb_FEL::aw_fel2_read(quint32 offset, void *buf, size_t len, quint32 specs)
 {
-        specs &= ~AW_FEL_2_IO;
-        specs |=  AW_FEL_2_RD;
-        if (!aw_send_fel_request(AW_FEL_2_RDWR, offset, len, specs))
-                return false;
-        if (!aw_usb_read(buf, len))
-                return false;
-        return aw_read_fel_status();
+        aw_op_t op = aw_op_t();
+        op.type = AW_OP_FES_READ;
+        op.addr = offset;
+        op.length = static_cast<quint32>(len);
+        op.specs = specs;
+        op.rdata = buf;
+        return run(op);
 }
 
 
 bool usb_FEL::aw_fel2_write(quint32 offset, const void *buf, size_t len, quint32 specs)
 {
-        specs &= ~AW_FEL_2_IO;
-        specs |=  AW_FEL_2_WR;
-        if (!aw_send_fel_request(AW_FEL_2_RDWR, offset, len, specs))
-                return false;
-        if (!aw_usb_write(buf, len))
-                return false;
-        return aw_read_fel_status();
+        aw_op_t op = aw_op_t();
+        op.type = AW_OP_FES_WRITE;
+        op.addr = offset;
+        op.length = static_cast<quint32>(len);
+        op.specs = specs;
+        op.wdata = buf;
+        return run(op);
+}
+
+
+/**
+ * @brief write a chunk in FES mode, retrying after a transfer error
+ * See retry_command() for which writes are repeated. Errors of failed
+ * attempts are reported only if the last one fails too.
+ * @param offset DRAM address or NAND sector
+ * @param buf pointer to the data
+ * @param len number of bytes
+ * @param specs AW_FEL_2_xxx flags
+ * @return true on success
+ */
+bool usb_FEL::aw_fel2_write_retry(quint32 offset, const void *buf, size_t len, quint32 specs)
+{
+        aw_op_t op = aw_op_t();
+        op.type = AW_OP_FES_WRITE;
+        op.addr = offset;
+        op.length = static_cast<quint32>(len);
+        op.specs = specs;
+        op.wdata = buf;
+        op.retry = true;
+        return run(op);
 }
 
 
 bool usb_FEL::aw_fel2_send_file(quint32 offset, quint32 specs, const QString& filename, quint32 chunk_size, quint32 min_bytes)
 {
         QFile fin(filename);
-        quint32	file_size;
-        quint32	total_written;
-
         if (!fin.open(QIODevice::ReadOnly)) {
                 emit Error(tr("Failed to open file to send: %1").arg(filename));
                 return false;
         }
-        file_size = fin.size();
-
-        QLocale l = QLocale::system();
-        emit Status(tr("Sending %1 (%2 bytes)...")
-                    .arg(filename)
-                    .arg(l.toString(file_size)));
-
-        if (min_bytes < file_size)
-                min_bytes = file_size;
+        bool success = send_chunks(offset, specs, true, &fin, QByteArray(), filename, chunk_size, min_bytes);
+        fin.close();
+        return success;
+}
 
-        total_written = 0;
-        emit Progress(0);
-        while (min_bytes > 0) {
-                quint32 read_size = min_bytes < chunk_size ? min_bytes : chunk_size;
-                QByteArray buf = fin.read(read_size);
-                quint32 bytes_read = buf.size();
-                min_bytes -= bytes_read;
-                qDebug("%s: offset=0x%08x bytes_read=%u min_bytes=%u chunk_size=%u", __func__,
-                       offset, bytes_read, min_bytes, chunk_size);
-                while (min_bytes > 0 && bytes_read < chunk_size) {
-                        buf.append('\0');
-                        min_bytes--;
-                }
-                total_written += bytes_read;
-                emit Progress(100.0 * total_written / file_size);
-                if (!aw_fel2_write(offset, buf.constData(), bytes_read, specs)) {
-                        emit Error(tr("Abort file send at offset %1 of %2.")
-                                   .arg(fin.pos()).arg(fin.size()));
-                        return false;
-                }
-                offset += bytes_read;
-        }
 
-        fin.close();
-        emit Status(tr("Successfully sent %1.").arg(filename));
-        return true;
+bool usb_FEL::aw_fel2_send_buffer(quint32 offset, quint32 specs, const QByteArray& data, const QString& name, quint32 chunk_size, quint32 min_bytes)
+{
+        return send_chunks(offset, specs, true, 0, data, name, chunk_size, min_bytes);
 }
 
 
 bool usb_FEL::aw_fel2_exec(quint32 offset, quint32 param1, quint32 param2)
 {
-        return aw_send_fel_request(AW_FEL_2_EXEC, offset, param1, param2);
-//	return aw_read_fel_status();
+        aw_op_t op = aw_op_t();
+        op.type = AW_OP_FES_EXEC;
+        op.addr = offset;
+        op.param1 = param1;
+        op.param2 = param2;
+        return run(op);
 }
 
 
 bool usb_FEL::aw_fel2_send_4uints(quint32 param1, quint32 param2, quint32 param3, quint32 param4)
 {
-        aw_send_fel_4uints (param1, param2, param3, param4);
-        return aw_read_fel_status();
+        aw_op_t op = aw_op_t();
+        op.type = AW_OP_FES_PARAMS;
+        op.param1 = param1;
+        op.param2 = param2;
+        op.param3 = param3;
+        op.param4 = param4;
+        return run(op);
 }
 
 
 bool usb_FEL::aw_fel2_0203(quint32 offset, quint32 param1, quint32 param2)
 {
-        return aw_send_fel_request(AW_FEL_2_0203, offset, param1, param2);
-//	return aw_read_fel_status();
+        aw_op_t op = aw_op_t();
+        op.type = AW_OP_FES_0203;
+        op.addr = offset;
+        op.param1 = param1;
+        op.param2 = param2;
+        return run(op);
+}
+
+
+/**
+ * @brief start waiting for a device side operation (FED_NAND, UPDATE_BOOT)
+ * The wait does not block: the caller polls with aw_fel2_wait_poll() and
+ * returns to its event loop for the delay it gets back between polls.
+ * @param site call site, e.g. the URB number of the original capture
+ */
+void usb_FEL::aw_fel2_wait_begin(int site)
+{
+        m_wait_site = site;
+        m_wait_polls = 0;
+        m_wait_delay = m_poll.initial_msec;
+        m_wait_ts = m_trace ? m_trace->now() : 0;
+        m_wait_timer.start();
+        m_stats.setWaitPolls(0);
 }
 
 
-bool usb_FEL::aw_fel2_0203_until_ok()
+/**
+ * @brief poll once for the operation started with aw_fel2_wait_begin()
+ * Sends a 0203 request and checks for the reply 00 01. The delay before
+ * the next poll grows exponentially up to a maximum, so a long running
+ * operation is not disturbed by a storm of requests, while a short one is
+ * still noticed quickly. Poll count and time to complete are recorded
+ * per call site.
+ * @param msec pointer to an int receiving the delay before the next poll
+ * @return AW_WAIT_DONE, AW_WAIT_PENDING, or AW_WAIT_FAILED on error or
+ * when the deadline passed
+ */
+int usb_FEL::aw_fel2_wait_poll(int* msec)
 {
-        static const QByteArray reply("\x00\x01", 2);
-        QByteArray buf;
+        aw_op_t op = aw_op_t();
+        op.type = AW_OP_POLL;
+        return aw_fel2_wait_result(run(op), msec);
+}
 
-        buf.fill('\0', 64);
-        buf[0] = '\xff';
-        emit Status(tr("...waiting"));
-        while (buf.left(2) != reply) {
-                if (!aw_fel2_0203())
-                        return false;
-                if (!aw_pad_read(buf.data(), 32))
-                        return false;
+
+/**
+ * @brief evaluate a completion poll
+ * The poll is run with run() or, to not block, with start() and an
+ * AW_OP_POLL operation; this is called with its result.
+ * @param success result of the poll
+ * @param msec pointer to an int receiving the delay before the next poll
+ * @return AW_WAIT_DONE, AW_WAIT_PENDING, or AW_WAIT_FAILED
+ */
+int usb_FEL::aw_fel2_wait_result(bool success, int* msec)
+{
+        static const uchar reply[2] = {0x00, 0x01};
+        if (!success) {
+                end_wait(false);
+                return AW_WAIT_FAILED;
+        }
+        m_wait_polls++;
+        m_stats.setWaitPolls(static_cast<int>(m_wait_polls));
+        if (!memcmp(m_cmd->reply, reply, sizeof(reply))) {
+                end_wait(true);
+                return AW_WAIT_DONE;
+        }
+        if (m_poll.deadline_msec > 0 && m_wait_timer.elapsed() >= m_poll.deadline_msec) {
+                end_wait(false);
+                m_stats.recordTimeout();
+                emit Error(tr("Device did not complete within %1 ms (%2 polls).")
+                           .arg(m_poll.deadline_msec).arg(m_wait_polls));
+                return AW_WAIT_FAILED;
         }
+        *msec = m_wait_delay;
+        m_wait_delay = qMin(m_poll.max_msec, qMax(m_wait_delay + 1, static_cast<int>(m_wait_delay * m_poll.factor)));
+        return AW_WAIT_PENDING;
+}
 
-        emit Status(tr("Done."));
-        return true;
+
+/**
+ * @brief record the end of a wait
+ * @param success true if the device completed
+ */
+void usb_FEL::end_wait(bool success)
+{
+        const qint64 usecs = m_wait_timer.nsecsElapsed() / 1000;
+        m_stats.setWaitPolls(-1);
+        m_stats.record(felstats::OP_WAIT, usecs, 0, success);
+        if (m_trace && m_trace->isEnabled()) {
+                QJsonObject args;
+                args.insert(QLatin1String("site"), m_wait_site);
+                args.insert(QLatin1String("polls"), static_cast<int>(m_wait_polls));
+                m_trace->complete("wait", QLatin1String("wait_complete"), m_wait_ts, m_trace->now() - m_wait_ts, args);
+        }
+        if (!success)
+                return;
+        aw_poll_stats_t& stats = m_poll_stats[m_wait_site];
+        stats.calls++;
+        stats.polls += m_wait_polls;
+        stats.last_polls = m_wait_polls;
+        stats.last_usecs = usecs;
+        stats.total_usecs += usecs;
+        stats.max_usecs = qMax(stats.max_usecs, usecs);
+        qDebug("%s: site %d completed after %lld us, %u polls", __func__,
+               m_wait_site, static_cast<long long>(usecs), m_wait_polls);
+}
+
+
+void usb_FEL::setPollParams(const aw_poll_params_t& params)
+{
+        m_poll = params;
+}
+
+
+aw_poll_params_t usb_FEL::pollParams() const
+{
+        return m_poll;
+}
+
+
+QMap<int, aw_poll_stats_t> usb_FEL::pollStats() const
+{
+        return m_poll_stats;
 }
 
 
 bool usb_FEL::aw_fel2_0204(quint32 length, quint32 param1, quint32 param2)
 {
-        return aw_send_fel_request (AW_FEL_2_0204, length, param1, param2);
-//	return aw_read_fel_status();
+        aw_op_t op = aw_op_t();
+        op.type = AW_OP_FES_0204;
+        op.addr = length;
+        op.param1 = param1;
+        op.param2 = param2;
+        return run(op);
 }
 
 
 bool usb_FEL::aw_fel2_0205(quint32 param1, quint32 param2, quint32 param3)
 {
-        if (!aw_send_fel_request(AW_FEL_2_0205, param1, param2, param3))
-                return false;
-        return aw_read_fel_status();
+        aw_op_t op = aw_op_t();
+        op.type = AW_OP_FES_0205;
+        op.param1 = param1;
+        op.param2 = param2;
+        op.param3 = param3;
+        return run(op);
+}
+
+/**
+ * @brief measure the write and read bandwidth at several transfer sizes
+ * Writes a pattern to device memory and reads it back, repeated until
+ * about bytes were transferred per size and direction. In FEL mode the
+ * memory is SRAM (FEL1 requests), in flash mode DRAM (FES2 requests);
+ * the caller picks a range that is overwritten later anyway.
+ * @param fes true to use FES2 requests, false for FEL1
+ * @param offset address of the memory to use
+ * @param sizes list of transfer sizes
+ * @param bytes number of bytes to transfer per size and direction
+ * @return list of aw_bandwidth_t, empty if a transfer failed
+ */
+QList<aw_bandwidth_t> usb_FEL::probe_bandwidth(bool fes, quint32 offset, const QList<quint32>& sizes, quint32 bytes)
+{
+        QList<aw_bandwidth_t> results;
+        if (!flush_writes())
+                return results;
+        trace_span span(m_trace, "host", "probe_bandwidth");
+        // FEL1 writes are measured as they are sent, not held back
+        const bool wc_enable = m_wc_enable;
+        m_wc_enable = false;
+        bool ok = true;
+
+        foreach(quint32 size, sizes) {
+                QByteArray pattern(static_cast<int>(size), '\0');
+                for (quint32 i = 0; i < size; i++)
+                        pattern[i] = static_cast<char>((i * 7 + size) & 0xff);
+                QByteArray back(static_cast<int>(size), '\0');
+
+                aw_bandwidth_t bw;
+                bw.fes = fes;
+                bw.size = size;
+                bw.count = qMax<quint32>(1, bytes / size);
+
+                QElapsedTimer timer;
+                timer.start();
+                for (quint32 i = 0; ok && i < bw.count; i++)
+                        ok = fes ? aw_fel2_write(offset, pattern.constData(), size, AW_FEL_2_DRAM)
+                                 : aw_fel_write(offset, pattern.constData(), size);
+                qint64 write_nsecs = qMax<qint64>(1, timer.nsecsElapsed());
+
+                timer.start();
+                for (quint32 i = 0; ok && i < bw.count; i++)
+                        ok = fes ? aw_fel2_read(offset, back.data(), size, AW_FEL_2_DRAM)
+                                 : aw_fel_read(offset, back.data(), size);
+                qint64 read_nsecs = qMax<qint64>(1, timer.nsecsElapsed());
+                if (!ok)
+                        break;
+
+                const qreal total = static_cast<qreal>(size) * bw.count;
+                bw.write_mbps = total * 1000.0 / write_nsecs;
+                bw.read_mbps = total * 1000.0 / read_nsecs;
+                bw.verified = back == pattern;
+                qDebug("%s: %s size=%u write=%.2f MB/s read=%.2f MB/s %s", __func__, fes ? "FES2" : "FEL1",
+                       size, bw.write_mbps, bw.read_mbps, bw.verified ? "verified" : "MISMATCH");
+                results += bw;
+        }
+        m_wc_enable = wc_enable;
+        if (!ok)
+                results.clear();
+        return results;
 }
 
 qint64 usb_FEL::save_file(const QString& filename, void *data, size_t size)
@@ -3,9 +3,22 @@
 
 #include <QObject>
 #include <QFile>
+#include <QStringList>
 #include <QLocale>
 #include <QtEndian>
+#include <QMutex>
+#include <QMap>
+#include <QHash>
+#include <QList>
+#include <QElapsedTimer>
+#include <QSemaphore>
+#include <QAtomicInt>
 #include <libusb.h>
+#include "flashprogress.h"
+#include "flashtrace.h"
+#include "felstats.h"
+
+class usbcapture;
 
 
 #define SUNXI_FEL_DEVICE_MAJOR  0x1f3a
@@ -29,6 +42,58 @@ typedef struct aw_fel_version_s {
 }       aw_fel_version_t;
 
 
+/**
+ * @brief parameters of the completion polling in aw_fel2_wait_poll()
+ */
+typedef struct aw_poll_params_s {
+        int             initial_msec;   /* delay after the first unsuccessful poll */
+        int             max_msec;       /* upper limit for the delay between polls */
+        qreal           factor;         /* delay growth per poll */
+        int             deadline_msec;  /* give up after this time (0 = never) */
+}       aw_poll_params_t;
+
+/**
+ * @brief completion polling statistics of one call site
+ */
+typedef struct aw_poll_stats_s {
+        quint32         calls;          /* number of completed waits */
+        quint32         polls;          /* polls summed over all waits */
+        quint32         last_polls;     /* polls of the last wait */
+        qint64          last_usecs;     /* time to complete of the last wait */
+        qint64          total_usecs;    /* time to complete summed over all waits */
+        qint64          max_usecs;      /* longest time to complete */
+}       aw_poll_stats_t;
+
+/**
+ * @brief one FEL or FES command for usb_FEL::start() and usb_FEL::run()
+ */
+typedef struct aw_op_s {
+        int             type;           /* usb_FEL::AW_OP_xxx */
+        quint32         addr;           /* address, NAND sector, or the length of a 0204 request */
+        quint32         length;         /* bytes to read or write */
+        quint32         specs;          /* AW_FEL_2_xxx flags of FES reads and writes */
+        quint32         param1;         /* parameters of exec, 0203, 0205 and params */
+        quint32         param2;
+        quint32         param3;
+        quint32         param4;
+        const void*     wdata;          /* data to write */
+        void*           rdata;          /* buffer to read into; an aw_fel_version_t for AW_OP_VERSION (may be 0) */
+        bool            retry;          /* FES write: retried after a transfer error, see aw_fel2_write_retry() */
+}       aw_op_t;
+
+/**
+ * @brief measured bandwidth of one transfer size
+ */
+typedef struct aw_bandwidth_s {
+        bool            fes;            /* FES2 DRAM (true) or FEL1 SRAM (false) */
+        quint32         size;           /* bytes per transfer */
+        quint32         count;          /* transfers per direction */
+        qreal           write_mbps;     /* host to device in MB/s */
+        qreal           read_mbps;      /* device to host in MB/s */
+        bool            verified;       /* the data read back matched */
+}       aw_bandwidth_t;
+
+
 class usb_FEL : public QObject
 {
         Q_OBJECT
@@ -65,44 +130,109 @@ public:
                 AW_FEL_2_LAST   = (1 << 15)
         }       AW_FEL_2_CMD;
 
+        typedef enum {
+                AW_OP_VERSION,          //!< FEL version request, the reply is decoded into rdata
+                AW_OP_FEL_READ,         //!< FEL1 read
+                AW_OP_FEL_WRITE,        //!< FEL1 write, held back if write combining is on
+                AW_OP_FEL_EXEC,         //!< FEL1 execute
+                AW_OP_FES_READ,         //!< FES2 read
+                AW_OP_FES_WRITE,        //!< FES2 write
+                AW_OP_FES_EXEC,         //!< FES2 execute (no status)
+                AW_OP_FES_0203,         //!< FES2 0203 request (no status)
+                AW_OP_FES_0204,         //!< FES2 0204 request for addr bytes (no status)
+                AW_OP_FES_0205,         //!< FES2 0205 request
+                AW_OP_FES_PARAMS,       //!< four parameters for the last FES2 execute
+                AW_OP_PAD_READ,         //!< read without a request
+                AW_OP_PAD_WRITE,        //!< write without a request
+                AW_OP_POLL,             //!< one completion poll, evaluated by aw_fel2_wait_result()
+                AW_OP_FLUSH,            //!< send the held back writes
+                AW_OP_SEND              //!< a payload in chunks, see startSend()
+        }       AW_OP;
+
+        typedef enum {
+                AW_WAIT_DONE,           //!< the device completed
+                AW_WAIT_PENDING,        //!< poll again after the returned delay
+                AW_WAIT_FAILED          //!< transfer error or deadline passed
+        }       AW_WAIT_RESULT;
+
+        static libusb_context* context_ref();
+        static void context_unref();
+
         void setDevice(quint16 major, quint32 minor);
+        void setPortPath(const QString& path);
+        QString portPath() const;
+        QStringList port_paths();
         bool find_device();
         bool usb_open();
         bool usb_close();
+        bool is_open() const { return m_usb != 0 || m_replay_open; }
+        int speed() const;
+        bool degraded() const;
+        static QString speed_name(int speed);
+
+        bool start(const aw_op_t& op);
+        bool startSend(quint32 offset, quint32 specs, bool fes, const QByteArray& data, const QString& name,
+                       quint32 chunk_size = 65536, quint32 min_bytes = 0);
+        bool run(const aw_op_t& op);
+        bool lastResult() const;
+        static quint32 soc_id(const aw_fel_version_t& ver);
 
-        bool aw_send_usb_request(quint16 type, qint64 size);
-        bool aw_read_usb_response();
-        bool aw_usb_write(const void *data, size_t len);
-        bool aw_usb_read(void *data, size_t len);
         quint32 aw_fel_get_version(aw_fel_version_t* pver = 0);
         bool aw_fel_read(quint32 offset, void *buf, size_t len);
         bool aw_fel_write(quint32 offset, const void *buf, size_t len);
         bool aw_fel_execute(quint32 offset, quint32 param1 = 0, quint32 param2 = 0);
         bool aw_fel_send_file(quint32 offset, const QString &filename, quint32 chunk_size = 65536, quint32 min_bytes = 0);
-        bool aw_send_fel_request(int type, quint32 addr, quint32 length, quint32 pad = 0);
-        bool aw_send_fel_4uints(quint32 param1, quint32 param2, quint32 param3, quint32 param4);
-        bool aw_read_fel_status();
+        bool aw_fel_send_buffer(quint32 offset, const QByteArray &data, const QString &name, quint32 chunk_size = 65536, quint32 min_bytes = 0);
         bool aw_pad_read(void *buf, size_t len);
         bool aw_pad_write(const void *buf, size_t len);
         bool aw_fel2_read(quint32 offset, void *buf, size_t len, quint32 specs);
         bool aw_fel2_write(quint32 offset, const void *buf, size_t len, quint32 specs);
         bool aw_fel2_send_file(quint32 offset, quint32 specs, const QString &filename, quint32 chunk_size = 65536, quint32 min_bytes = 0);
+        bool aw_fel2_send_buffer(quint32 offset, quint32 specs, const QByteArray &data, const QString &name, quint32 chunk_size = 65536, quint32 min_bytes = 0);
         bool aw_fel2_exec(quint32 offset = 0, quint32 param1 = 0, quint32 param2 = 0);
         bool aw_fel2_send_4uints(quint32 param1, quint32 param2, quint32 param3, quint32 param4);
         bool aw_fel2_0203(quint32 offset = 0, quint32 param1 = 0, quint32 param2 = 0);
-        bool aw_fel2_0203_until_ok();
+        void aw_fel2_wait_begin(int site = 0);
+        int aw_fel2_wait_poll(int* msec);
+        int aw_fel2_wait_result(bool success, int* msec);
+        bool aw_fel2_write_retry(quint32 offset, const void *buf, size_t len, quint32 specs);
+        void setTimeouts(int control_msec, int bulk_msec, int bytes_per_msec);
+        void setRetries(int retries);
+        quint32 lastErrorOffset() const;
+        int retryCount() const;
+        void setWriteCombining(bool on, quint32 max_bytes = 4096);
+        bool writeCombining() const;
+        bool flush_writes();
+        void setProgress(flashprogress* progress);
+        void setTrace(flashtrace* trace);
+        void setReplay(usbcapture* replay);
+        flashtrace* trace() const;
+        const felstats& stats() const;
+        void resetStats();
+        void setPollParams(const aw_poll_params_t& params);
+        aw_poll_params_t pollParams() const;
+        QMap<int, aw_poll_stats_t> pollStats() const;
         bool aw_fel2_0204(quint32 length = 0, quint32 param1 = 0, quint32 param2 = 0);
         bool aw_fel2_0205(quint32 param1 = 0, quint32 param2 = 0, quint32 param3 = 0);
+        QList<aw_bandwidth_t> probe_bandwidth(bool fes, quint32 offset, const QList<quint32>& sizes, quint32 bytes);
 
         void aw_fel_hexdump(quint32 offset, size_t size);
         bool aw_fel_dump(quint32 offset, size_t size);
         bool aw_fel_fill(quint32 offset, size_t size, unsigned char value);
 
+        uchar* buffer_get(size_t size);
+        void buffer_put(uchar* buf);
+
         static QString hexdump(const void *data, quint32 offset, size_t size);
 signals:
         void Progress(qreal percentage);
         void Error(QString message);
         void Status(QString message);
+        void Completed(bool success);
+
+private slots:
+        void command_done(int serial);
+        void op_done();
 
 private:
         int m_rc;
@@ -110,10 +240,107 @@ private:
         libusb_device_handle* m_usb;
         bool m_detached_iface;
         int m_timeout;
+        int m_control_timeout;
+        int m_bulk_timeout;
+        int m_bytes_per_msec;
+        int m_retries;
+        int m_retry_count;
+        int m_quiet;
+        QString m_deferred_error;
+        quint32 m_error_offset;
         quint16 m_major;
         quint16 m_minor;
-        bool usb_bulk_send(int ep, const void *buff, size_t length);
-        bool usb_bulk_recv(int ep, void *buff, size_t length);
+        QString m_port_path;
+        int m_speed;
+        bool m_wc_enable;
+        quint32 m_wc_limit;
+        quint32 m_wc_offset;
+        QByteArray m_wc_data;                   //!< held back writes, m_wc_limit bytes allocated once
+        quint32 m_wc_len;                       //!< number of bytes held back in m_wc_data
+        flashprogress* m_progress;
+        flashtrace* m_trace;
+        felstats m_stats;
+        usbcapture* m_replay;
+        bool m_replay_open;
+        aw_poll_params_t m_poll;
+        QMap<int, aw_poll_stats_t> m_poll_stats;
+        int m_wait_site;
+        quint32 m_wait_polls;
+        int m_wait_delay;
+        qint64 m_wait_ts;
+        QElapsedTimer m_wait_timer;
+        typedef struct {
+                size_t          size;           //!< size of the buffer
+                bool            devmem;         //!< allocated with libusb_dev_mem_alloc()
+        }       aw_buffer_t;
+        QHash<uchar*, aw_buffer_t> m_buffers;
+        QList<uchar*> m_free_buffers;
+        typedef struct {
+                QIODevice*      in;             //!< device the payload is read from, or 0
+                QByteArray      data;           //!< payload in memory (if in is 0)
+                QString         name;           //!< name of the payload for messages
+                quint32         offset;         //!< address of the next chunk
+                quint32         specs;          //!< AW_FEL_2_xxx flags of FES writes
+                bool            fes;            //!< FES writes instead of FEL writes
+                quint32         chunk_size;     //!< maximum size of a single write
+                quint32         min_bytes;      //!< bytes still to send at least
+                quint32         size;           //!< size of the payload
+                quint32         written;        //!< bytes sent so far
+                quint32         chunk;          //!< bytes of the chunk in flight
+                int             percent;        //!< last percentage signalled
+                uchar*          pool;           //!< pooled transfer buffer of the chunks
+                qint64          ts;             //!< trace timestamp of the start
+        }       aw_send_t;
+        struct aw_cmd_s;
+        struct aw_cmd_s* m_cmd;                 //!< legs of the command in flight, allocated once
+        libusb_transfer* m_xfer;                //!< transfer of the leg in flight, allocated once
+        QSemaphore m_cmd_done;                  //!< released by the leg that ends a command
+        QAtomicInt m_abort;                     //!< set by usb_close() to stop the command in flight
+        bool m_cmd_active;                      //!< a command was started and not yet ended
+        int m_cmd_serial;                       //!< number of the command, to spot stale completions
+        aw_op_t m_op;                           //!< operation of start(), run() or a send
+        aw_op_t m_retry_op;                     //!< FES write to repeat after the drain
+        bool m_op_busy;                         //!< an operation is in progress
+        bool m_op_async;                        //!< it ends with Completed(bool)
+        bool m_op_result;                       //!< result of the last operation
+        bool m_flushing;                        //!< the command sends the held back writes
+        bool m_retrying;                        //!< errors of the FES write are deferred
+        int m_attempts;                         //!< attempts of the FES write so far
+        aw_send_t m_send;                       //!< state of the payload send in progress
+        void buffer_free_all();
+        bool hold_write(quint32 offset, const void *buf, size_t len);
+        bool launch(bool async);
+        void abort_op();
+        bool wait_op(bool done);
+        bool begin_op();
+        bool end_op(bool success);
+        bool start_command(const aw_op_t& op);
+        void build_command(const aw_op_t& op);
+        void add_leg(int kind, void* buf, quint32 length, int stat, int timeout);
+        void add_write(const void* buf, quint32 length, int stat);
+        void add_read(void* buf, quint32 length, int stat, int kind);
+        void add_status();
+        void add_request(int type, quint32 addr, quint32 length, quint32 pad);
+        void submit_leg();
+        void leg_done(int rc, int actual);
+        static void LIBUSB_CALL transfer_cb(libusb_transfer* xfer);
+        bool command_end();
+        bool finish_command();
+        bool retry_command();
+        void retry_end(bool success);
+        bool begin_send(quint32 offset, quint32 specs, bool fes, QIODevice* in, const QByteArray& data,
+                        const QString& name, quint32 chunk_size, quint32 min_bytes);
+        bool send_chunk();
+        bool send_chunk_done(bool success);
+        bool send_end(bool success);
+        bool send_chunks(quint32 offset, quint32 specs, bool fes, QIODevice* in, const QByteArray& data,
+                         const QString& name, quint32 chunk_size, quint32 min_bytes);
+        void end_wait(bool success);
+        int timeout_for(size_t length) const;
+        void clear_halt();
+        void error(const QString& message);
+        static QString port_path(libusb_device* device);
+        bool match_device(libusb_device* device);
         qint64 save_file(const QString &filename, void *data, size_t size);
         QByteArray load_file(const QString &filename, size_t *psize);
 };